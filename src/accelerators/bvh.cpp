@@ -33,11 +33,33 @@
 
 // accelerators/bvh.cpp*
 #include "accelerators/bvh.h"
+#include "checkpoint.h"
 #include "interaction.h"
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include <stdio.h>
+#include <string.h>
 #include <algorithm>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Wide BVH nodes are tested against rays 8 children at a time with AVX, 4
+// at a time with SSE, and one at a time otherwise
+#if defined(__AVX__)
+#define PBRT_BVH_AVX
+#include <immintrin.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PBRT_BVH_SSE
+#include <xmmintrin.h>
+#endif
 
 namespace pbrt {
 
@@ -45,6 +67,7 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Trees read from cache", cacheReads);
 
 // BVHAccel Local Declarations
 struct BVHPrimitiveInfo {
@@ -103,6 +126,212 @@ struct LinearBVHNode {
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// WideBVHNode stores the bounds of up to _N_ children as arrays of each
+// coordinate, so that a ray is tested against all of them at once. Unused
+// children have empty bounds, which no ray hits.
+template <int N>
+struct WideBVHNode {
+    WideBVHNode() {
+        for (int c = 0; c < N; ++c) {
+            for (int a = 0; a < 3; ++a) {
+                bounds[0][a][c] = std::numeric_limits<float>::infinity();
+                bounds[1][a][c] = -std::numeric_limits<float>::infinity();
+            }
+            child[c] = -1;
+            nPrimitives[c] = 0;
+        }
+    }
+    float bounds[2][3][N];  // [min/max][axis][child]
+    int32_t child[N];       // offset of node or of leaf's primitives
+    uint16_t nPrimitives[N];  // 0 -> interior node
+    // Children in the order the binary tree would be traversed in, 4 bits
+    // each, for each octant of ray directions
+    uint32_t order[8];
+    uint8_t pad[N == 4 ? 8 : 16];  // ensure 32 byte aligned total size
+};
+
+// The ray's origin and inverse direction as floats, for the slab tests of
+// wide BVH nodes
+struct WideBVHRay {
+    WideBVHRay(const Ray &ray, const Vector3f &invDir, const int dirIsNeg[3]) {
+        for (int a = 0; a < 3; ++a) {
+            o[a] = ray.o[a];
+            this->invDir[a] = invDir[a];
+            this->dirIsNeg[a] = dirIsNeg[a];
+        }
+    }
+    float o[3], invDir[3];
+    int dirIsNeg[3];
+};
+
+// Returns the mask of the children of _node_ that the ray hits before
+// _tMax_, and their entry distances in _tNear_; the slab tests are those of
+// Bounds3::IntersectP()
+template <int N>
+inline int IntersectChildren(const WideBVHNode<N> &node, const WideBVHRay &r,
+                             float tMax, float tNear[N]) {
+    const float farScale = 1 + 2 * gamma(3);
+#ifdef PBRT_BVH_AVX
+    if (N == 8) {
+        __m256 t0[3], t1[3];
+        for (int a = 0; a < 3; ++a) {
+            __m256 o = _mm256_set1_ps(r.o[a]);
+            __m256 invDir = _mm256_set1_ps(r.invDir[a]);
+            __m256 near = _mm256_loadu_ps(node.bounds[r.dirIsNeg[a]][a]);
+            __m256 far = _mm256_loadu_ps(node.bounds[1 - r.dirIsNeg[a]][a]);
+            t0[a] = _mm256_mul_ps(_mm256_sub_ps(near, o), invDir);
+            t1[a] = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(far, o), invDir),
+                                  _mm256_set1_ps(farScale));
+        }
+        __m256 tMin = _mm256_max_ps(t0[2], _mm256_max_ps(t0[1], t0[0]));
+        __m256 tFar = _mm256_min_ps(t1[2], _mm256_min_ps(t1[1], t1[0]));
+        __m256 hit = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(tMin, tFar, _CMP_LE_OQ),
+                          _mm256_cmp_ps(tMin, _mm256_set1_ps(tMax),
+                                        _CMP_LT_OQ)),
+            _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GT_OQ));
+        _mm256_storeu_ps(tNear, tMin);
+        return _mm256_movemask_ps(hit);
+    }
+#endif
+#ifdef PBRT_BVH_SSE
+    int mask = 0;
+    for (int g = 0; g < N; g += 4) {
+        __m128 t0[3], t1[3];
+        for (int a = 0; a < 3; ++a) {
+            __m128 o = _mm_set1_ps(r.o[a]);
+            __m128 invDir = _mm_set1_ps(r.invDir[a]);
+            __m128 near = _mm_loadu_ps(&node.bounds[r.dirIsNeg[a]][a][g]);
+            __m128 far = _mm_loadu_ps(&node.bounds[1 - r.dirIsNeg[a]][a][g]);
+            t0[a] = _mm_mul_ps(_mm_sub_ps(near, o), invDir);
+            t1[a] = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far, o), invDir),
+                               _mm_set1_ps(farScale));
+        }
+        __m128 tMin = _mm_max_ps(t0[2], _mm_max_ps(t0[1], t0[0]));
+        __m128 tFar = _mm_min_ps(t1[2], _mm_min_ps(t1[1], t1[0]));
+        __m128 hit = _mm_and_ps(
+            _mm_and_ps(_mm_cmple_ps(tMin, tFar),
+                       _mm_cmplt_ps(tMin, _mm_set1_ps(tMax))),
+            _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+        _mm_storeu_ps(tNear + g, tMin);
+        mask |= _mm_movemask_ps(hit) << g;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int c = 0; c < N; ++c) {
+        float tMin = 0, tFar = 0;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (node.bounds[r.dirIsNeg[a]][a][c] - r.o[a]) * r.invDir[a];
+            float t1 = (node.bounds[1 - r.dirIsNeg[a]][a][c] - r.o[a]) *
+                       r.invDir[a] * farScale;
+            tMin = a == 0 ? t0 : std::max(t0, tMin);
+            tFar = a == 0 ? t1 : std::min(t1, tFar);
+        }
+        tNear[c] = tMin;
+        if (tMin <= tFar && tMin < tMax && tFar > 0) mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
+
+// QuantizedBVHNode is an interior node that stores the bounds of its two
+// children as _T_ integers, rounded outwards on a grid over the bounds of
+// the node itself, which are decoded from its parent. Along each axis the
+// grid starts at the node's minimum and has a spacing of 2^_exponent_, so
+// that decoding is exact up to a single rounding. Leaves are not nodes of
+// their own: their primitives are referenced by their parents.
+template <typename T>
+struct QuantizedBVHNode {
+    int32_t child[2] = {-1, -1};  // offset of node or of leaf's primitives
+    T bounds[2][2][3] = {};       // [child][min/max][axis]
+    uint16_t nPrimitives[2] = {0, 0};  // 0 -> interior node
+    uint8_t axis = 0;
+    int8_t exponent[3] = {0, 0, 0};
+};
+
+// Powers of two 2^e for the quantized bounds' grid exponents _e_
+static const struct GridSpacings {
+    GridSpacings() {
+        for (int e = -128; e < 128; ++e)
+            spacing[e + 128] = std::ldexp(Float(1), e);
+    }
+    Float spacing[256];
+} gridSpacings;
+
+inline Float GridSpacing(int exponent) {
+    return gridSpacings.spacing[exponent + 128];
+}
+
+// Returns the exponent of the finest grid from _lo_ that reaches _hi_
+// within the range of _T_. It is no finer than the spacing of floats
+// around _lo_ and _hi_, so that the grid's coordinates decode to different
+// values.
+template <typename T>
+static int8_t GridExponent(Float lo, Float hi) {
+    const int qMax = std::numeric_limits<T>::max();
+    int exp;
+    std::frexp(std::max(std::abs(lo), std::abs(hi)), &exp);
+    int e = std::max(exp - std::numeric_limits<Float>::digits, -128);
+    if (hi > lo) {
+        std::frexp((hi - lo) / qMax, &exp);
+        e = std::max(exp - 1, e);
+    }
+    while (e < 127 && lo + qMax * GridSpacing(e) < hi) ++e;
+    CHECK_GE(lo + qMax * GridSpacing(e), hi);
+    return e;
+}
+
+// The largest grid coordinate at or below _v_ and the smallest one at or
+// above it
+template <typename T>
+static T QuantizeDown(Float v, Float origin, Float spacing) {
+    const int qMax = std::numeric_limits<T>::max();
+    int q = Clamp(std::floor((v - origin) / spacing), Float(0), Float(qMax));
+    while (q > 0 && origin + q * spacing > v) --q;
+    while (q < qMax && origin + (q + 1) * spacing <= v) ++q;
+    return q;
+}
+
+template <typename T>
+static T QuantizeUp(Float v, Float origin, Float spacing) {
+    const int qMax = std::numeric_limits<T>::max();
+    int q = Clamp(std::ceil((v - origin) / spacing), Float(0), Float(qMax));
+    while (q < qMax && origin + q * spacing < v) ++q;
+    while (q > 0 && origin + (q - 1) * spacing >= v) --q;
+    return q;
+}
+
+// Bounds of child _c_ of _node_, whose own bounds are _bounds_
+template <typename T>
+inline Bounds3f DecodeChildBounds(const QuantizedBVHNode<T> &node, int c,
+                                  const Bounds3f &bounds) {
+    Bounds3f b;
+    for (int a = 0; a < 3; ++a) {
+        Float spacing = GridSpacing(node.exponent[a]);
+        b.pMin[a] = bounds.pMin[a] + node.bounds[c][0][a] * spacing;
+        b.pMax[a] = bounds.pMin[a] + node.bounds[c][1][a] * spacing;
+    }
+    return b;
+}
+
+// Bounds3::IntersectP() that also returns the ray's entry distance
+inline bool IntersectBounds(const Bounds3f &b, const Ray &ray,
+                            const Vector3f &invDir, const int dirIsNeg[3],
+                            Float *tNear) {
+    Float tMin = -Infinity, tMax = Infinity;
+    for (int a = 0; a < 3; ++a) {
+        Float t0 = (b[dirIsNeg[a]][a] - ray.o[a]) * invDir[a];
+        Float t1 = (b[1 - dirIsNeg[a]][a] - ray.o[a]) * invDir[a];
+        t1 *= 1 + 2 * gamma(3);
+        if (tMin > t1 || t0 > tMax) return false;
+        tMin = std::max(t0, tMin);
+        tMax = std::min(t1, tMax);
+    }
+    *tNear = tMin;
+    return tMin < ray.tMax && tMax > 0;
+}
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -179,11 +408,167 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     if (nPasses & 1) std::swap(*v, tempVector);
 }
 
+// BVH cache files start with this header, followed by the original index
+// of each of the tree's primitives and, at _nodesOffset_, the tree's nodes
+// in the layout that the build parameters select
+struct BVHCacheHeader {
+    char magic[8];
+    uint64_t key;
+    int64_t nPrimitives, nReferences, nNodes, nodesOffset;
+    Bounds3f worldBound;
+    int32_t floatSize, pad;
+};
+
+static const char bvhCacheMagic[8] = "pbrtbvh";
+// Changes to the node layouts or to the builds must change this, so that
+// trees from earlier versions are not read
+static PBRT_CONSTEXPR int32_t bvhCacheVersion = 3;
+
+static size_t BVHNodeSize(int width, int quantizeBits) {
+    if (width == 4) return sizeof(WideBVHNode<4>);
+    if (width == 8) return sizeof(WideBVHNode<8>);
+    if (quantizeBits == 8) return sizeof(QuantizedBVHNode<uint8_t>);
+    if (quantizeBits == 16) return sizeof(QuantizedBVHNode<uint16_t>);
+    return sizeof(LinearBVHNode);
+}
+
+// Key of the tree built over primitives with the bounds in _primitiveInfo_
+// with the given parameters. The builds other than SBVH only look at the
+// bounds, which cover the meshes' vertices and transforms.
+static uint64_t BVHCacheKey(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                            int maxPrimsInNode,
+                            BVHAccel::SplitMethod splitMethod, int width,
+                            int quantizeBits) {
+    int32_t params[] = {bvhCacheVersion,
+                        (int32_t)sizeof(Float),
+                        (int32_t)BVHNodeSize(width, quantizeBits),
+                        maxPrimsInNode,
+                        (int32_t)splitMethod,
+                        width,
+                        quantizeBits,
+                        (int32_t)primitiveInfo.size()};
+    uint64_t hash = HashBytes(params, sizeof(params));
+    for (const BVHPrimitiveInfo &pi : primitiveInfo)
+        hash = HashBytes(&pi.bounds, sizeof(pi.bounds), hash);
+    return hash;
+}
+
+// Reads the file _filename_ into memory, mapping it if possible; nodes read
+// from it are tested against rays where they are. Cache files are therefore
+// only ever replaced by new ones, never written over.
+static void *ReadCacheData(const std::string &filename, size_t *size) {
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    struct stat stat;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &stat) == 0 && stat.st_size > 0) {
+        *size = stat.st_size;
+        data = mmap(0, *size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return data == MAP_FAILED ? nullptr : data;
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    uint8_t *data = nullptr;
+    long length = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (length > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        *size = length;
+        data = AllocAligned<uint8_t>(*size);
+        if (fread(data, 1, *size, f) != *size) {
+            FreeAligned(data);
+            data = nullptr;
+        }
+    }
+    fclose(f);
+    return data;
+#endif
+}
+
+// Checks a child of node _parent_ of a cached tree: a leaf's primitives are
+// among the _nReferences_ there are, and interior nodes come after their
+// parents, as they are flattened depth first, and are no deeper than the
+// traversal stacks allow, which _depth_ records
+static bool ValidCachedChild(int parent, int32_t child, int nPrimitives,
+                             int64_t nNodes, int64_t nReferences,
+                             std::vector<int> &depth) {
+    if (nPrimitives > 0)
+        return child >= 0 && child + (int64_t)nPrimitives <= nReferences;
+    if (child <= parent || child >= nNodes) return false;
+    depth[child] = depth[parent] + 1;
+    return depth[child] < 64;
+}
+
+static bool ValidCachedNodes(const LinearBVHNode *nodes, int64_t nNodes,
+                             int64_t nReferences) {
+    std::vector<int> depth(nNodes, 0);
+    for (int i = 0; i < nNodes; ++i) {
+        const LinearBVHNode &node = nodes[i];
+        bool ok = node.nPrimitives > 0
+                      ? ValidCachedChild(i, node.primitivesOffset,
+                                         node.nPrimitives, nNodes,
+                                         nReferences, depth)
+                      : node.axis < 3 &&
+                            ValidCachedChild(i, i + 1, 0, nNodes, nReferences,
+                                             depth) &&
+                            ValidCachedChild(i, node.secondChildOffset, 0,
+                                             nNodes, nReferences, depth);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+template <int N>
+static bool ValidCachedNodes(const WideBVHNode<N> *nodes, int64_t nNodes,
+                             int64_t nReferences) {
+    std::vector<int> depth(nNodes, 0);
+    for (int i = 0; i < nNodes; ++i) {
+        const WideBVHNode<N> &node = nodes[i];
+        for (int c = 0; c < N; ++c)
+            if (node.child[c] >= 0 &&
+                !ValidCachedChild(i, node.child[c], node.nPrimitives[c],
+                                  nNodes, nReferences, depth))
+                return false;
+        for (int octant = 0; octant < 8; ++octant)
+            for (int k = 0; k < N; ++k)
+                if (((node.order[octant] >> (4 * k)) & 0xf) >= N)
+                    return false;
+    }
+    return true;
+}
+
+template <typename T>
+static bool ValidCachedNodes(const QuantizedBVHNode<T> *nodes, int64_t nNodes,
+                             int64_t nReferences) {
+    std::vector<int> depth(nNodes, 0);
+    for (int i = 0; i < nNodes; ++i) {
+        const QuantizedBVHNode<T> &node = nodes[i];
+        if (node.axis >= 3) return false;
+        for (int c = 0; c < 2; ++c)
+            if (node.child[c] >= 0 &&
+                !ValidCachedChild(i, node.child[c], node.nPrimitives[c],
+                                  nNodes, nReferences, depth))
+                return false;
+    }
+    return true;
+}
+
+static void ReleaseCacheData(void *data, size_t size) {
+#ifdef PBRT_HAVE_MMAP
+    munmap(data, size);
+#else
+    FreeAligned(data);
+#endif
+}
+
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   int quantizeBits, Float duplicationBudget)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      width(width),
       primitives(std::move(p)) {
     ProfilePhase _(Prof::AccelConstruction);
     if (primitives.empty()) return;
@@ -194,84 +579,170 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
     for (size_t i = 0; i < primitives.size(); ++i)
         primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 
-    // Build BVH tree for primitives using _primitiveInfo_
-    MemoryArena arena(1024 * 1024);
+    // Read the tree from the cache if it was saved for the same primitive
+    // bounds and build parameters. Spatial splits also depend on the shapes
+    // of the primitives, which the key does not cover, so SBVH trees are
+    // always built.
+    uint64_t cacheKey = 0;
+    if (!PbrtOptions.accelCacheDir.empty() &&
+        splitMethod != SplitMethod::SBVH) {
+        cacheKey = BVHCacheKey(primitiveInfo, this->maxPrimsInNode,
+                               splitMethod, width, quantizeBits);
+        cacheFilename = StringPrintf("%s/bvh-%016llx.cache",
+                                     PbrtOptions.accelCacheDir.c_str(),
+                                     (unsigned long long)cacheKey);
+        if (readCache(cacheKey, quantizeBits)) return;
+    }
+
+    // Build BVH tree for primitives using _primitiveInfo_, with a
+    // _MemoryArena_ for each thread that may take part
+    std::vector<MemoryArena> arenas(MaxThreadIndex());
     int totalNodes = 0;
     std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
-        root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
-        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
+        root = HLBVHBuild(arenas[0], primitiveInfo, &totalNodes, orderedPrims);
+    else if (splitMethod == SplitMethod::SBVH) {
+        Bounds3f bounds;
+        for (const BVHPrimitiveInfo &pi : primitiveInfo)
+            bounds = Union(bounds, pi.bounds);
+        int64_t refBudget = duplicationBudget * primitives.size();
+        root = spatialSplitBuild(arenas[0], primitiveInfo,
+                                 bounds.SurfaceArea(), &refBudget,
+                                 &totalNodes, orderedPrims);
+    } else {
+        orderedPrims.resize(primitives.size());
+        root = recursiveBuild(arenas.data(), primitiveInfo, 0,
+                              primitives.size(), &totalNodes, orderedPrims);
+    }
+    // The cache records the tree's primitives by their original indices
+    std::vector<int32_t> cacheOrder;
+    int64_t nPrimitives = primitives.size();
+    if (!cacheFilename.empty()) {
+        std::unordered_map<const Primitive *, int32_t> index;
+        for (size_t i = 0; i < primitives.size(); ++i)
+            index[primitives[i].get()] = i;
+        for (const std::shared_ptr<Primitive> &prim : orderedPrims)
+            cacheOrder.push_back(index[prim.get()]);
+    }
     primitives.swap(orderedPrims);
     primitiveInfo.resize(0);
+    size_t arenaBytes = 0;
+    for (const MemoryArena &arena : arenas) arenaBytes += arena.TotalAllocated();
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
-                              "primitives (%.2f MB), arena allocated %.2f MB",
+                              "primitives (%.2f MB), arenas allocated %.2f MB",
                               totalNodes, (int)primitives.size(),
                               float(totalNodes * sizeof(LinearBVHNode)) /
                               (1024.f * 1024.f),
-                              float(arena.TotalAllocated()) /
-                              (1024.f * 1024.f));
+                              float(arenaBytes) / (1024.f * 1024.f));
 
-    // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
+    // Compute representation of depth-first traversal of BVH tree, collapse
+    // it into a tree of _width_ children per node or quantize its bounds
+    worldBound = root->bounds;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]);
+    if (width == 4)
+        nodes4 = flattenWideBVHTree<4>(root);
+    else if (width == 8)
+        nodes8 = flattenWideBVHTree<8>(root);
+    else if (quantizeBits == 8)
+        nodesQ8 = flattenQuantizedBVHTree<uint8_t>(root);
+    else if (quantizeBits == 16)
+        nodesQ16 = flattenQuantizedBVHTree<uint16_t>(root);
+    else {
+        treeBytes += totalNodes * sizeof(LinearBVHNode);
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        int offset = 0;
+        flattenBVHTree(root, &offset);
+        CHECK_EQ(totalNodes, offset);
+        nNodes = totalNodes;
+    }
+    if (!cacheFilename.empty()) writeCache(cacheKey, nPrimitives, cacheOrder);
 }
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
-}
+Bounds3f BVHAccel::WorldBound() const { return worldBound; }
 
 struct BucketInfo {
     int count = 0;
     Bounds3f bounds;
 };
 
+// The SAH build runs the two subtrees of nodes with at least
+// _parallelTaskPrimitives_ primitives as parallel tasks, and bins the
+// primitives of nodes with at least _parallelBinPrimitives_ in parallel, in
+// chunks of _binChunkSize_.
+static PBRT_CONSTEXPR int parallelTaskPrimitives = 4096;
+static PBRT_CONSTEXPR int parallelBinPrimitives = 65536;
+static PBRT_CONSTEXPR int binChunkSize = 16384;
+
+// Computes _T_ values for [_start_, _end_) with _func(begin, end, T *)_,
+// for chunks of _binChunkSize_ primitives in parallel if there are enough
+// of them, and combines the chunks' values with _reduce(T *, const T &)_
+template <typename T, typename Func, typename Reduce>
+static void BinPrimitives(int start, int end, T *result, Func func,
+                          Reduce reduce) {
+    if (end - start < parallelBinPrimitives || !ParallelRunning()) {
+        func(start, end, result);
+        return;
+    }
+    int nChunks = (end - start + binChunkSize - 1) / binChunkSize;
+    std::vector<T> chunks(nChunks, *result);
+    ParallelFor([&](int64_t c) {
+        int begin = start + c * binChunkSize;
+        func(begin, std::min(begin + binChunkSize, end), &chunks[c]);
+    }, nChunks);
+    for (const T &chunk : chunks) reduce(result, chunk);
+}
+
 BVHBuildNode *BVHAccel::recursiveBuild(
-    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
-    int end, int *totalNodes,
+    MemoryArena *arenas, std::vector<BVHPrimitiveInfo> &primitiveInfo,
+    int start, int end, int *totalNodes,
     std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
     CHECK_NE(start, end);
-    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    BVHBuildNode *node = arenas[ThreadIndex].Alloc<BVHBuildNode>();
     (*totalNodes)++;
-    // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+    // Compute bounds of all primitives in BVH node and of their centroids
     int nPrimitives = end - start;
-    if (nPrimitives == 1) {
-        // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+    struct NodeBounds {
+        Bounds3f bounds, centroidBounds;
+    } nodeBounds;
+    BinPrimitives(start, end, &nodeBounds,
+                  [&](int begin, int end, NodeBounds *nb) {
+                      for (int i = begin; i < end; ++i) {
+                          nb->bounds = Union(nb->bounds, primitiveInfo[i].bounds);
+                          nb->centroidBounds = Union(nb->centroidBounds,
+                                                     primitiveInfo[i].centroid);
+                      }
+                  },
+                  [](NodeBounds *nb, const NodeBounds &chunk) {
+                      nb->bounds = Union(nb->bounds, chunk.bounds);
+                      nb->centroidBounds =
+                          Union(nb->centroidBounds, chunk.centroidBounds);
+                  });
+    const Bounds3f &bounds = nodeBounds.bounds;
+    const Bounds3f &centroidBounds = nodeBounds.centroidBounds;
+
+    // Primitives of leaves end up where they are in _primitiveInfo_, which
+    // is the order in which a depth-first build would emit them
+    auto makeLeaf = [&]() {
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = primitives[primNum];
         }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
+    };
+    if (nPrimitives == 1) {
+        // Create leaf _BVHBuildNode_
+        return makeLeaf();
     } else {
-        // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        // Choose split dimension _dim_
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
-            for (int i = start; i < end; ++i) {
-                int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-            return node;
+            return makeLeaf();
         } else {
             // Partition primitives based on _splitMethod_
             switch (splitMethod) {
@@ -318,20 +789,34 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 } else {
                     // Allocate _BucketInfo_ for SAH partition buckets
                     PBRT_CONSTEXPR int nBuckets = 12;
-                    BucketInfo buckets[nBuckets];
+                    struct Buckets {
+                        BucketInfo b[nBuckets];
+                    } nodeBuckets;
+                    BucketInfo *buckets = nodeBuckets.b;
 
                     // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                    BinPrimitives(
+                        start, end, &nodeBuckets,
+                        [&](int begin, int end, Buckets *bs) {
+                            for (int i = begin; i < end; ++i) {
+                                int b = nBuckets *
+                                        centroidBounds.Offset(
+                                            primitiveInfo[i].centroid)[dim];
+                                if (b == nBuckets) b = nBuckets - 1;
+                                CHECK_GE(b, 0);
+                                CHECK_LT(b, nBuckets);
+                                bs->b[b].count++;
+                                bs->b[b].bounds = Union(
+                                    bs->b[b].bounds, primitiveInfo[i].bounds);
+                            }
+                        },
+                        [](Buckets *bs, const Buckets &chunk) {
+                            for (int b = 0; b < nBuckets; ++b) {
+                                bs->b[b].count += chunk.b[b].count;
+                                bs->b[b].bounds =
+                                    Union(bs->b[b].bounds, chunk.b[b].bounds);
+                            }
+                        });
 
                     // Compute costs for splitting after each bucket
                     Float cost[nBuckets - 1];
@@ -379,25 +864,278 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
-                        for (int i = start; i < end; ++i) {
-                            int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
-                        }
-                        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-                        return node;
+                        return makeLeaf();
                     }
                 }
                 break;
             }
             }
-            node->InitInterior(dim,
-                               recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
-                               recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+
+            // Build the children, as parallel tasks for large nodes; each
+            // thread allocates nodes from its own arena
+            BVHBuildNode *children[2];
+            int childNodes[2] = {0, 0};
+            auto buildChild = [&](int64_t c) {
+                children[c] = recursiveBuild(
+                    arenas, primitiveInfo, c == 0 ? start : mid,
+                    c == 0 ? mid : end, &childNodes[c], orderedPrims);
+            };
+            if (nPrimitives >= parallelTaskPrimitives && ParallelRunning())
+                ParallelFor(buildChild, 2);
+            else {
+                buildChild(0);
+                buildChild(1);
+            }
+            *totalNodes += childNodes[0] + childNodes[1];
+            node->InitInterior(dim, children[0], children[1]);
+        }
+    }
+    return node;
+}
+
+// The spatial split build considers splitting the references to primitives
+// at the planes between _nSpatialBins_ slabs along each axis of a node, if
+// the children of the best object split overlap by more than
+// _spatialSplitOverlap_ of the surface area of the root
+static PBRT_CONSTEXPR int nSpatialBins = 16;
+static PBRT_CONSTEXPR Float spatialSplitOverlap = 1e-5f;
+
+static bool Empty(const Bounds3f &b) {
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+BVHBuildNode *BVHAccel::spatialSplitBuild(
+    MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs, Float rootArea,
+    int64_t *refBudget, int *totalNodes,
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    CHECK(!refs.empty());
+    BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    // Compute bounds of the references in the node and of their centroids
+    int nRefs = refs.size();
+    Bounds3f bounds, centroidBounds;
+    for (const BVHPrimitiveInfo &ref : refs) {
+        bounds = Union(bounds, ref.bounds);
+        centroidBounds = Union(centroidBounds, ref.centroid);
+    }
+    auto makeLeaf = [&]() {
+        int firstPrimOffset = orderedPrims.size();
+        for (const BVHPrimitiveInfo &ref : refs)
+            orderedPrims.push_back(primitives[ref.primitiveNumber]);
+        node->InitLeaf(firstPrimOffset, nRefs, bounds);
+        return node;
+    };
+    if (nRefs == 1) return makeLeaf();
+    // Costs are those of the SAH build, scaled by the node's surface area
+    Float area = bounds.SurfaceArea();
+
+    // Find the best object split, as the SAH build does
+    PBRT_CONSTEXPR int nBuckets = 12;
+    int objectDim = centroidBounds.MaximumExtent();
+    auto centroidBucket = [&](const BVHPrimitiveInfo &ref) {
+        int b = nBuckets * centroidBounds.Offset(ref.centroid)[objectDim];
+        return std::min(b, nBuckets - 1);
+    };
+    Float objectCost = Infinity;
+    int objectSplitBucket = -1;
+    Bounds3f objectBounds[2];
+    if (centroidBounds.pMax[objectDim] > centroidBounds.pMin[objectDim]) {
+        BucketInfo buckets[nBuckets];
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int b = centroidBucket(ref);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, ref.bounds);
+        }
+        BucketInfo above[nBuckets];
+        above[nBuckets - 1] = buckets[nBuckets - 1];
+        for (int i = nBuckets - 2; i > 0; --i) {
+            above[i].count = above[i + 1].count + buckets[i].count;
+            above[i].bounds = Union(above[i + 1].bounds, buckets[i].bounds);
+        }
+        BucketInfo below;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            below.count += buckets[i].count;
+            below.bounds = Union(below.bounds, buckets[i].bounds);
+            if (below.count == 0 || above[i + 1].count == 0) continue;
+            Float cost = area + below.count * below.bounds.SurfaceArea() +
+                         above[i + 1].count * above[i + 1].bounds.SurfaceArea();
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectSplitBucket = i;
+                objectBounds[0] = below.bounds;
+                objectBounds[1] = above[i + 1].bounds;
+            }
+        }
+    }
+
+    // Find the best spatial split if the object split's children overlap
+    // and the budget for references allows
+    Float spatialCost = Infinity;
+    int spatialDim = -1, spatialSplitBin = -1;
+    Bounds3f overlap = pbrt::Intersect(objectBounds[0], objectBounds[1]);
+    auto spatialBin = [&](int dim, Float v) {
+        int b = nSpatialBins * (v - bounds.pMin[dim]) /
+                (bounds.pMax[dim] - bounds.pMin[dim]);
+        return Clamp(b, 0, nSpatialBins - 1);
+    };
+    auto binPlane = [&](int dim, int i) {
+        if (i == nSpatialBins) return bounds.pMax[dim];
+        return bounds.pMin[dim] +
+               (bounds.pMax[dim] - bounds.pMin[dim]) * i / nSpatialBins;
+    };
+    if (*refBudget > 0 &&
+        (objectSplitBucket == -1 ||
+         (!Empty(overlap) &&
+          overlap.SurfaceArea() > spatialSplitOverlap * rootArea))) {
+        for (int dim = 0; dim < 3; ++dim) {
+            if (bounds.pMax[dim] == bounds.pMin[dim]) continue;
+            // Add the parts of the references' bounds in each slab to its
+            // bin; references are counted where they enter and exit. Only
+            // the references that are split get clipped exactly.
+            struct SpatialBin {
+                Bounds3f bounds;
+                int entries = 0, exits = 0;
+            } bins[nSpatialBins];
+            for (const BVHPrimitiveInfo &ref : refs) {
+                int b0 = spatialBin(dim, ref.bounds.pMin[dim]);
+                int b1 = spatialBin(dim, ref.bounds.pMax[dim]);
+                bins[b0].entries++;
+                bins[b1].exits++;
+                if (b0 == b1) {
+                    bins[b0].bounds = Union(bins[b0].bounds, ref.bounds);
+                    continue;
+                }
+                for (int b = b0; b <= b1; ++b) {
+                    Bounds3f slab = ref.bounds;
+                    slab.pMin[dim] = std::max(slab.pMin[dim], binPlane(dim, b));
+                    slab.pMax[dim] =
+                        std::min(slab.pMax[dim], binPlane(dim, b + 1));
+                    if (!Empty(slab))
+                        bins[b].bounds = Union(bins[b].bounds, slab);
+                }
+            }
+
+            // Compute costs for splitting after each bin
+            Bounds3f above[nSpatialBins];
+            int exitsAbove[nSpatialBins];
+            above[nSpatialBins - 1] = bins[nSpatialBins - 1].bounds;
+            exitsAbove[nSpatialBins - 1] = bins[nSpatialBins - 1].exits;
+            for (int i = nSpatialBins - 2; i > 0; --i) {
+                above[i] = Union(above[i + 1], bins[i].bounds);
+                exitsAbove[i] = exitsAbove[i + 1] + bins[i].exits;
+            }
+            Bounds3f below;
+            int entriesBelow = 0;
+            for (int i = 0; i < nSpatialBins - 1; ++i) {
+                below = Union(below, bins[i].bounds);
+                entriesBelow += bins[i].entries;
+                int nBelow = entriesBelow, nAbove = exitsAbove[i + 1];
+                // Both children must have fewer references than the node
+                if (nBelow == 0 || nAbove == 0 || nBelow == nRefs ||
+                    nAbove == nRefs || nBelow + nAbove - nRefs > *refBudget)
+                    continue;
+                Float cost = area + nBelow * below.SurfaceArea() +
+                             nAbove * above[i + 1].SurfaceArea();
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialDim = dim;
+                    spatialSplitBin = i;
+                }
+            }
         }
     }
+
+    // Create leaf or split references with the cheaper split
+    Float minCost = std::min(objectCost, spatialCost);
+    if (minCost == Infinity ||
+        (nRefs <= maxPrimsInNode && nRefs * area <= minCost))
+        return makeLeaf();
+    std::vector<BVHPrimitiveInfo> childRefs[2];
+    int dim;
+    if (objectCost > spatialCost) {
+        // Put references on the side of the plane they are on, and clip the
+        // ones that straddle it, unless moving them to one side is cheaper
+        dim = spatialDim;
+        Float plane = binPlane(dim, spatialSplitBin + 1);
+        std::vector<BVHPrimitiveInfo> straddling;
+        Bounds3f childBounds[2];
+        for (const BVHPrimitiveInfo &ref : refs) {
+            int side = -1;
+            if (spatialBin(dim, ref.bounds.pMax[dim]) <= spatialSplitBin)
+                side = 0;
+            else if (spatialBin(dim, ref.bounds.pMin[dim]) > spatialSplitBin)
+                side = 1;
+            if (side == -1)
+                straddling.push_back(ref);
+            else {
+                childRefs[side].push_back(ref);
+                childBounds[side] = Union(childBounds[side], ref.bounds);
+            }
+        }
+        int nChild[2] = {int(childRefs[0].size() + straddling.size()),
+                         int(childRefs[1].size() + straddling.size())};
+        for (const BVHPrimitiveInfo &ref : straddling) {
+            const Primitive &prim = *primitives[ref.primitiveNumber];
+            Bounds3f clipped[2] = {ref.bounds, ref.bounds};
+            clipped[0].pMax[dim] = std::min(clipped[0].pMax[dim], plane);
+            clipped[1].pMin[dim] = std::max(clipped[1].pMin[dim], plane);
+            for (int c = 0; c < 2; ++c)
+                clipped[c] = prim.ClippedWorldBound(clipped[c]);
+            // A reference that clips to nothing on one side goes to the
+            // other one, unclipped
+            int side = -1;
+            if (Empty(clipped[0]) || Empty(clipped[1]))
+                side = Empty(clipped[0]) ? 1 : 0;
+            else {
+                Bounds3f split[2] = {Union(childBounds[0], clipped[0]),
+                                     Union(childBounds[1], clipped[1])};
+                Float splitCost = split[0].SurfaceArea() * nChild[0] +
+                                  split[1].SurfaceArea() * nChild[1];
+                Float moveCost[2];
+                for (int c = 0; c < 2; ++c)
+                    moveCost[c] =
+                        Union(childBounds[c], ref.bounds).SurfaceArea() *
+                            nChild[c] +
+                        split[1 - c].SurfaceArea() * (nChild[1 - c] - 1);
+                if (moveCost[0] < splitCost || moveCost[1] < splitCost)
+                    side = moveCost[0] < moveCost[1] ? 0 : 1;
+            }
+            if (side == -1) {
+                for (int c = 0; c < 2; ++c) {
+                    childRefs[c].push_back(
+                        BVHPrimitiveInfo(ref.primitiveNumber, clipped[c]));
+                    childBounds[c] = Union(childBounds[c], clipped[c]);
+                }
+                --*refBudget;
+            } else {
+                childRefs[side].push_back(ref);
+                childBounds[side] = Union(childBounds[side], ref.bounds);
+                --nChild[1 - side];
+            }
+        }
+        // If all references ended up on one side, none were duplicated;
+        // fall back to the object split
+        if (childRefs[0].empty() || childRefs[1].empty()) {
+            if (objectSplitBucket == -1) return makeLeaf();
+            childRefs[0].clear();
+            childRefs[1].clear();
+        }
+    }
+    if (childRefs[0].empty()) {
+        dim = objectDim;
+        for (const BVHPrimitiveInfo &ref : refs)
+            childRefs[centroidBucket(ref) > objectSplitBucket].push_back(ref);
+    }
+    CHECK(!childRefs[0].empty() && !childRefs[1].empty());
+
+    // Build the children depth first, so that the leaves' primitives are
+    // emitted in order, freeing the node's references first
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+    BVHBuildNode *children[2];
+    for (int c = 0; c < 2; ++c)
+        children[c] = spatialSplitBuild(arena, childRefs[c], rootArea,
+                                        refBudget, totalNodes, orderedPrims);
+    node->InitInterior(dim, children[0], children[1]);
     return node;
 }
 
@@ -657,9 +1395,463 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+// Appends the children of _node_ that were collapsed into _children_ to
+// _order_, 4 bits each, in the order that the binary tree traversal visits
+// them for rays in direction _octant_
+static void CollapsedChildOrder(const BVHBuildNode *node, int octant,
+                                const BVHBuildNode *const *children,
+                                int nChildren, uint32_t *order, int *n) {
+    for (int c = 0; c < nChildren; ++c)
+        if (children[c] == node) {
+            *order |= c << (4 * (*n)++);
+            return;
+        }
+    // Visit the second child first for rays going down the split axis
+    int first = (octant >> node->splitAxis) & 1;
+    CollapsedChildOrder(node->children[first], octant, children, nChildren,
+                        order, n);
+    CollapsedChildOrder(node->children[1 - first], octant, children,
+                        nChildren, order, n);
+}
+
+// Bounds of wide nodes are floats, rounded outward if _Float_ is double
+static float RoundDown(Float v) {
+    float f = v;
+    return f > v ? NextFloatDown(f) : f;
+}
+
+static float RoundUp(Float v) {
+    float f = v;
+    return f < v ? NextFloatUp(f) : f;
+}
+
+template <int N>
+int BVHAccel::collapseBVHTree(const BVHBuildNode *node,
+                              std::vector<WideBVHNode<N>> &wideNodes) {
+    // Gather up to _N_ children for the wide node, opening the interior
+    // node of largest surface area until there are _N_ or only leaves
+    const BVHBuildNode *children[N];
+    int nChildren = 0;
+    if (node->nPrimitives > 0)
+        children[nChildren++] = node;
+    else {
+        children[nChildren++] = node->children[0];
+        children[nChildren++] = node->children[1];
+    }
+    while (nChildren < N) {
+        int open = -1;
+        Float maxArea = -1;
+        for (int c = 0; c < nChildren; ++c)
+            if (children[c]->nPrimitives == 0 &&
+                children[c]->bounds.SurfaceArea() > maxArea) {
+                open = c;
+                maxArea = children[c]->bounds.SurfaceArea();
+            }
+        if (open == -1) break;
+        const BVHBuildNode *opened = children[open];
+        children[open] = opened->children[0];
+        children[nChildren++] = opened->children[1];
+    }
+
+    // Create the wide node and its visiting orders; the unused children go
+    // last
+    int myOffset = wideNodes.size();
+    wideNodes.push_back(WideBVHNode<N>());
+    for (int octant = 0; octant < 8; ++octant) {
+        uint32_t order = 0;
+        int n = 0;
+        CollapsedChildOrder(node, octant, children, nChildren, &order, &n);
+        for (int c = nChildren; c < N; ++c) order |= c << (4 * n++);
+        wideNodes[myOffset].order[octant] = order;
+    }
+    for (int c = 0; c < nChildren; ++c) {
+        const Bounds3f &b = children[c]->bounds;
+        int child = children[c]->nPrimitives > 0
+                        ? children[c]->firstPrimOffset
+                        : collapseBVHTree<N>(children[c], wideNodes);
+        WideBVHNode<N> &wideNode = wideNodes[myOffset];
+        for (int a = 0; a < 3; ++a) {
+            wideNode.bounds[0][a][c] = RoundDown(b.pMin[a]);
+            wideNode.bounds[1][a][c] = RoundUp(b.pMax[a]);
+        }
+        wideNode.child[c] = child;
+        CHECK_LT(children[c]->nPrimitives, 65536);
+        wideNode.nPrimitives[c] = children[c]->nPrimitives;
+    }
+    return myOffset;
+}
+
+template <int N>
+WideBVHNode<N> *BVHAccel::flattenWideBVHTree(const BVHBuildNode *root) {
+    std::vector<WideBVHNode<N>> wideNodes;
+    collapseBVHTree<N>(root, wideNodes);
+    nNodes = wideNodes.size();
+    treeBytes += nNodes * sizeof(WideBVHNode<N>);
+    WideBVHNode<N> *flat = AllocAligned<WideBVHNode<N>>(nNodes);
+    std::copy(wideNodes.begin(), wideNodes.end(), flat);
+    return flat;
+}
+
+template <typename T>
+int BVHAccel::quantizeBVHTree(const BVHBuildNode *node, const Bounds3f &bounds,
+                              std::vector<QuantizedBVHNode<T>> &qNodes) {
+    int myOffset = qNodes.size();
+    qNodes.push_back(QuantizedBVHNode<T>());
+    QuantizedBVHNode<T> qNode;
+    // A leaf at the root is the only child of a node of its own
+    const BVHBuildNode *children[2] = {node, nullptr};
+    if (node->nPrimitives == 0) {
+        children[0] = node->children[0];
+        children[1] = node->children[1];
+        qNode.axis = node->splitAxis;
+    }
+    for (int a = 0; a < 3; ++a)
+        qNode.exponent[a] = GridExponent<T>(bounds.pMin[a], bounds.pMax[a]);
+    for (int c = 0; c < 2; ++c) {
+        if (!children[c]) continue;
+        for (int a = 0; a < 3; ++a) {
+            Float spacing = GridSpacing(qNode.exponent[a]);
+            qNode.bounds[c][0][a] = QuantizeDown<T>(
+                children[c]->bounds.pMin[a], bounds.pMin[a], spacing);
+            qNode.bounds[c][1][a] = QuantizeUp<T>(
+                children[c]->bounds.pMax[a], bounds.pMin[a], spacing);
+        }
+        CHECK_LT(children[c]->nPrimitives, 65536);
+        qNode.nPrimitives[c] = children[c]->nPrimitives;
+        if (children[c]->nPrimitives > 0)
+            qNode.child[c] = children[c]->firstPrimOffset;
+        else
+            qNode.child[c] = quantizeBVHTree<T>(
+                children[c], DecodeChildBounds(qNode, c, bounds), qNodes);
+    }
+    qNodes[myOffset] = qNode;
+    return myOffset;
+}
+
+template <typename T>
+QuantizedBVHNode<T> *BVHAccel::flattenQuantizedBVHTree(
+    const BVHBuildNode *root) {
+    std::vector<QuantizedBVHNode<T>> qNodes;
+    quantizeBVHTree<T>(root, worldBound, qNodes);
+    nNodes = qNodes.size();
+    treeBytes += nNodes * sizeof(QuantizedBVHNode<T>);
+    QuantizedBVHNode<T> *flat = AllocAligned<QuantizedBVHNode<T>>(nNodes);
+    std::copy(qNodes.begin(), qNodes.end(), flat);
+    return flat;
+}
+
+BVHAccel::~BVHAccel() {
+    if (cacheData) {
+        ReleaseCacheData(cacheData, cacheSize);
+        return;
+    }
+    FreeAligned(nodes);
+    FreeAligned(nodes4);
+    FreeAligned(nodes8);
+    FreeAligned(nodesQ8);
+    FreeAligned(nodesQ16);
+}
+
+size_t BVHAccel::NodeBytes() const {
+    if (nodes4) return nNodes * sizeof(WideBVHNode<4>);
+    if (nodes8) return nNodes * sizeof(WideBVHNode<8>);
+    if (nodesQ8) return nNodes * sizeof(QuantizedBVHNode<uint8_t>);
+    if (nodesQ16) return nNodes * sizeof(QuantizedBVHNode<uint16_t>);
+    return nNodes * sizeof(LinearBVHNode);
+}
+
+bool BVHAccel::readCache(uint64_t key, int quantizeBits) {
+    size_t size = 0;
+    void *data = ReadCacheData(cacheFilename, &size);
+    if (!data) return false;
+
+    // Check that the file is complete and saved for these primitives, and
+    // that the tree only refers to primitives there are
+    const BVHCacheHeader &header = *(const BVHCacheHeader *)data;
+    const int32_t *order =
+        (const int32_t *)((const char *)data + sizeof(BVHCacheHeader));
+    size_t nodeSize = BVHNodeSize(width, quantizeBits);
+    bool ok =
+        size >= sizeof(BVHCacheHeader) &&
+        memcmp(header.magic, bvhCacheMagic, sizeof(header.magic)) == 0 &&
+        header.key == key && header.floatSize == (int32_t)sizeof(Float) &&
+        header.nPrimitives == (int64_t)primitives.size() &&
+        header.nReferences > 0 && header.nNodes > 0 &&
+        header.nodesOffset % 64 == 0 &&
+        header.nodesOffset >= (int64_t)(sizeof(BVHCacheHeader) +
+                                        header.nReferences * sizeof(int32_t)) &&
+        size >= (size_t)header.nodesOffset &&
+        (size - header.nodesOffset) / nodeSize == (size_t)header.nNodes &&
+        (size - header.nodesOffset) % nodeSize == 0;
+    for (int64_t i = 0; ok && i < header.nReferences; ++i)
+        ok = order[i] >= 0 && order[i] < header.nPrimitives;
+    // Rays are traced through the nodes where they are, so check them too
+    if (ok) {
+        const void *nodeData = (const char *)data + header.nodesOffset;
+        if (width == 4)
+            ok = ValidCachedNodes((const WideBVHNode<4> *)nodeData,
+                                  header.nNodes, header.nReferences);
+        else if (width == 8)
+            ok = ValidCachedNodes((const WideBVHNode<8> *)nodeData,
+                                  header.nNodes, header.nReferences);
+        else if (quantizeBits == 8)
+            ok = ValidCachedNodes((const QuantizedBVHNode<uint8_t> *)nodeData,
+                                  header.nNodes, header.nReferences);
+        else if (quantizeBits == 16)
+            ok = ValidCachedNodes(
+                (const QuantizedBVHNode<uint16_t> *)nodeData, header.nNodes,
+                header.nReferences);
+        else
+            ok = ValidCachedNodes((const LinearBVHNode *)nodeData,
+                                  header.nNodes, header.nReferences);
+    }
+    if (!ok) {
+        Warning("%s: BVH cache file is damaged; building the tree again",
+                cacheFilename.c_str());
+        ReleaseCacheData(data, size);
+        return false;
+    }
+
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(header.nReferences);
+    for (int64_t i = 0; i < header.nReferences; ++i)
+        orderedPrims[i] = primitives[order[i]];
+    primitives.swap(orderedPrims);
+    worldBound = header.worldBound;
+    nNodes = header.nNodes;
+    void *nodeData = (char *)data + header.nodesOffset;
+    if (width == 4)
+        nodes4 = (WideBVHNode<4> *)nodeData;
+    else if (width == 8)
+        nodes8 = (WideBVHNode<8> *)nodeData;
+    else if (quantizeBits == 8)
+        nodesQ8 = (QuantizedBVHNode<uint8_t> *)nodeData;
+    else if (quantizeBits == 16)
+        nodesQ16 = (QuantizedBVHNode<uint16_t> *)nodeData;
+    else
+        nodes = (LinearBVHNode *)nodeData;
+    cacheData = data;
+    cacheSize = size;
+    ++cacheReads;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]) +
+                 NodeBytes();
+    LOG(INFO) << StringPrintf("BVH with %d nodes for %d primitives read "
+                              "from %s", nNodes, (int)primitives.size(),
+                              cacheFilename.c_str());
+    return true;
+}
+
+void BVHAccel::writeCache(uint64_t key, int64_t nPrimitives,
+                          const std::vector<int32_t> &order) const {
+    BVHCacheHeader header{};
+    memcpy(header.magic, bvhCacheMagic, sizeof(header.magic));
+    header.key = key;
+    header.nPrimitives = nPrimitives;
+    header.nReferences = order.size();
+    header.nNodes = nNodes;
+    // Align the nodes for the SIMD loads of wide nodes
+    header.nodesOffset =
+        (sizeof(header) + order.size() * sizeof(int32_t) + 63) & ~size_t(63);
+    header.worldBound = worldBound;
+    header.floatSize = sizeof(Float);
+    const void *nodeData = nodes4 ? (const void *)nodes4
+                         : nodes8 ? (const void *)nodes8
+                         : nodesQ8 ? (const void *)nodesQ8
+                         : nodesQ16 ? (const void *)nodesQ16
+                         : (const void *)nodes;
+    char zeros[64] = {0};
+    size_t nPad = header.nodesOffset - sizeof(header) -
+                  order.size() * sizeof(int32_t);
+
+    // Write to a temporary file that replaces the cache file once it is
+    // complete, so that other renders never read a partial tree
+    std::string tmpFilename = cacheFilename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: unable to open BVH cache file for writing",
+                tmpFilename.c_str());
+        return;
+    }
+    bool ok =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(order.data(), sizeof(int32_t), order.size(), f) ==
+            order.size() &&
+        fwrite(zeros, 1, nPad, f) == nPad &&
+        fwrite(nodeData, 1, NodeBytes(), f) == NodeBytes();
+    ok = fclose(f) == 0 && ok;
+#ifdef PBRT_IS_WINDOWS
+    if (ok) remove(cacheFilename.c_str());
+#endif
+    if (!ok || rename(tmpFilename.c_str(), cacheFilename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache file", cacheFilename.c_str());
+        remove(tmpFilename.c_str());
+    }
+}
+
+// Cost of the children of wide nodes, as BVHAccel::SAHCost() defines it
+template <int N>
+static double WideSAHCost(const WideBVHNode<N> *nodes, int nNodes) {
+    double cost = 0;
+    for (int i = 0; i < nNodes; ++i)
+        for (int c = 0; c < N; ++c) {
+            if (nodes[i].child[c] < 0) continue;
+            Bounds3f b;
+            for (int a = 0; a < 3; ++a) {
+                b.pMin[a] = nodes[i].bounds[0][a][c];
+                b.pMax[a] = nodes[i].bounds[1][a][c];
+            }
+            cost += std::max<int>(nodes[i].nPrimitives[c], 1) * b.SurfaceArea();
+        }
+    return cost;
+}
+
+// Cost of the subtree under quantized node _offset_, whose bounds are
+// _bounds_
+template <typename T>
+static double QuantizedSAHCost(const QuantizedBVHNode<T> *nodes, int offset,
+                               const Bounds3f &bounds) {
+    double cost = 0;
+    for (int c = 0; c < 2; ++c) {
+        const QuantizedBVHNode<T> &node = nodes[offset];
+        if (node.child[c] < 0) continue;
+        Bounds3f b = DecodeChildBounds(node, c, bounds);
+        cost += std::max<int>(node.nPrimitives[c], 1) * b.SurfaceArea();
+        if (node.nPrimitives[c] == 0)
+            cost += QuantizedSAHCost(nodes, node.child[c], b);
+    }
+    return cost;
+}
+
+Float BVHAccel::SAHCost() const {
+    if (nNodes == 0) return 0;
+    // The costs the SAH build estimates, 1 for visiting an interior node and
+    // 1 for each primitive of a leaf, weighted by the nodes' surface areas
+    // relative to the root's. Visiting a wide node tests all its children
+    // and costs 1 as well.
+    double cost = 0;
+    if (nodes4)
+        cost = worldBound.SurfaceArea() + WideSAHCost(nodes4, nNodes);
+    else if (nodes8)
+        cost = worldBound.SurfaceArea() + WideSAHCost(nodes8, nNodes);
+    else if (nodesQ8)
+        cost = worldBound.SurfaceArea() +
+               QuantizedSAHCost(nodesQ8, 0, worldBound);
+    else if (nodesQ16)
+        cost = worldBound.SurfaceArea() +
+               QuantizedSAHCost(nodesQ16, 0, worldBound);
+    else
+        for (int i = 0; i < nNodes; ++i)
+            cost += std::max<int>(nodes[i].nPrimitives, 1) *
+                    nodes[i].bounds.SurfaceArea();
+    return cost / worldBound.SurfaceArea();
+}
+
+template <int N>
+bool BVHAccel::intersectWide(const WideBVHNode<N> *nodes, const Ray &ray,
+                             SurfaceInteraction *isect) const {
+    ProfilePhase p(isect ? Prof::AccelIntersect : Prof::AccelIntersectP);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    int octant = dirIsNeg[0] | (dirIsNeg[1] << 1) | (dirIsNeg[2] << 2);
+    WideBVHRay wideRay(ray, invDir, dirIsNeg);
+    const Float tNearScale = 1 + 2 * gamma(3);
+
+    // Follow ray through BVH nodes to find primitive intersections; the
+    // stack holds the children that the ray hit, with their entry distances
+    struct ToVisit {
+        int offset, nPrimitives;
+        float tNear;
+    };
+    ToVisit nodesToVisit[64 * (N - 1) + 1];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, 0.f};
+    while (toVisitOffset > 0) {
+        ToVisit current = nodesToVisit[--toVisitOffset];
+        // Skip nodes that start beyond the closest intersection so far
+        if (current.tNear > ray.tMax * tNearScale) continue;
+        if (current.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf BVH node
+            for (int i = 0; i < current.nPrimitives; ++i) {
+                const Primitive &prim = *primitives[current.offset + i];
+                if (!isect) {
+                    if (prim.IntersectP(ray)) return true;
+                } else if (prim.Intersect(ray, isect))
+                    hit = true;
+            }
+        } else {
+            // Put the children that the ray hits on _nodesToVisit_, the
+            // one to visit first last
+            const WideBVHNode<N> &node = nodes[current.offset];
+            float tNear[N];
+            int hitMask = IntersectChildren(node, wideRay, ray.tMax, tNear);
+            uint32_t order = node.order[octant];
+            for (int i = N - 1; i >= 0; --i) {
+                int c = (order >> (4 * i)) & 0xf;
+                if (hitMask & (1 << c))
+                    nodesToVisit[toVisitOffset++] = {
+                        node.child[c], node.nPrimitives[c], tNear[c]};
+            }
+        }
+    }
+    return hit;
+}
+
+template <typename T>
+bool BVHAccel::intersectQuantized(const QuantizedBVHNode<T> *nodes,
+                                  const Ray &ray,
+                                  SurfaceInteraction *isect) const {
+    ProfilePhase p(isect ? Prof::AccelIntersect : Prof::AccelIntersectP);
+    bool hit = false;
+    Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+    // Follow ray through BVH nodes to find primitive intersections; the
+    // stack holds the nodes and leaves that the ray hit, with their decoded
+    // bounds and entry distances
+    struct ToVisit {
+        Bounds3f bounds;
+        int offset, nPrimitives;
+        Float tNear;
+    };
+    ToVisit nodesToVisit[64 + 1];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {worldBound, 0, 0, 0};
+    while (toVisitOffset > 0) {
+        const ToVisit current = nodesToVisit[--toVisitOffset];
+        // Skip nodes that start beyond the closest intersection so far
+        if (current.tNear >= ray.tMax) continue;
+        if (current.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf BVH node
+            for (int i = 0; i < current.nPrimitives; ++i) {
+                const Primitive &prim = *primitives[current.offset + i];
+                if (!isect) {
+                    if (prim.IntersectP(ray)) return true;
+                } else if (prim.Intersect(ray, isect))
+                    hit = true;
+            }
+        } else {
+            // Put the children that the ray hits on _nodesToVisit_, the
+            // near one last
+            const QuantizedBVHNode<T> &node = nodes[current.offset];
+            int nearChild = dirIsNeg[node.axis];
+            for (int c : {1 - nearChild, nearChild}) {
+                if (node.child[c] < 0) continue;
+                Bounds3f b = DecodeChildBounds(node, c, current.bounds);
+                Float tNear;
+                if (IntersectBounds(b, ray, invDir, dirIsNeg, &tNear))
+                    nodesToVisit[toVisitOffset++] = {
+                        b, node.child[c], node.nPrimitives[c], tNear};
+            }
+        }
+    }
+    return hit;
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (nodes4) return intersectWide(nodes4, ray, isect);
+    if (nodes8) return intersectWide(nodes8, ray, isect);
+    if (nodesQ8) return intersectQuantized(nodesQ8, ray, isect);
+    if (nodesQ16) return intersectQuantized(nodesQ16, ray, isect);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
@@ -700,6 +1892,10 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    if (nodes4) return intersectWide(nodes4, ray, nullptr);
+    if (nodes8) return intersectWide(nodes8, ray, nullptr);
+    if (nodesQ8) return intersectQuantized(nodesQ8, ray, nullptr);
+    if (nodesQ16) return intersectQuantized(nodesQ16, ray, nullptr);
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
@@ -749,6 +1945,8 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
         splitMethod = BVHAccel::SplitMethod::Middle;
     else if (splitMethodName == "equal")
         splitMethod = BVHAccel::SplitMethod::EqualCounts;
+    else if (splitMethodName == "sbvh")
+        splitMethod = BVHAccel::SplitMethod::SBVH;
     else {
         Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
                 splitMethodName.c_str());
@@ -756,7 +1954,26 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    int width = ps.FindOneInt("width", 2);
+    if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported.  Using 2.", width);
+        width = 2;
+    }
+    int quantizeBits = ps.FindOneInt("quantizebits", 0);
+    if (quantizeBits != 0 && quantizeBits != 8 && quantizeBits != 16) {
+        Warning("BVH quantization to %d bits unsupported.  Using full "
+                "precision bounds.", quantizeBits);
+        quantizeBits = 0;
+    }
+    if (quantizeBits != 0 && width != 2) {
+        Warning("Quantized BVH bounds are only supported with width 2.  "
+                "Using full precision bounds.");
+        quantizeBits = 0;
+    }
+    Float duplicationBudget = ps.FindOneFloat("duplicationbudget", 0.3f);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, width, quantizeBits,
+                                      std::max(Float(0), duplicationBudget));
 }
 
 }  // namespace pbrt
@@ -50,28 +50,52 @@ struct BVHBuildNode;
 struct BVHPrimitiveInfo;
 struct MortonPrimitive;
 struct LinearBVHNode;
+template <int N>
+struct WideBVHNode;
+template <typename T>
+struct QuantizedBVHNode;
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
   public:
     // BVHAccel Public Types
-    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+    enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts, SBVH };
 
     // BVHAccel Public Methods
+    // With a _width_ of 4 or 8, the binary tree that is built is collapsed
+    // into nodes of that many children, which are tested against rays at
+    // once with SIMD instructions. Otherwise, a _quantizeBits_ of 8 or 16
+    // stores the binary tree's bounds in integers of that size, relative to
+    // the bounds of the parent nodes. The SBVH build splits primitives
+    // across nodes, adding up to _duplicationBudget_ references per
+    // primitive.
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             int quantizeBits = 0, Float duplicationBudget = 0.3f);
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Expected cost of a ray intersection, as the SAH build estimates it
+    Float SAHCost() const;
+    // Memory used by the nodes of the tree
+    size_t NodeBytes() const;
+    // The file under _PbrtOptions.accelCacheDir_ that the tree was read
+    // from or saved to, if any
+    const std::string &CacheFilename() const { return cacheFilename; }
+    bool FromCache() const { return cacheData != nullptr; }
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
-        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
+        MemoryArena *arenas, std::vector<BVHPrimitiveInfo> &primitiveInfo,
         int start, int end, int *totalNodes,
         std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+    BVHBuildNode *spatialSplitBuild(
+        MemoryArena &arena, std::vector<BVHPrimitiveInfo> &refs,
+        Float rootArea, int64_t *refBudget, int *totalNodes,
+        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         int *totalNodes,
@@ -86,12 +110,43 @@ class BVHAccel : public Aggregate {
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    template <int N>
+    WideBVHNode<N> *flattenWideBVHTree(const BVHBuildNode *root);
+    template <int N>
+    int collapseBVHTree(const BVHBuildNode *node,
+                        std::vector<WideBVHNode<N>> &wideNodes);
+    template <typename T>
+    QuantizedBVHNode<T> *flattenQuantizedBVHTree(const BVHBuildNode *root);
+    template <typename T>
+    int quantizeBVHTree(const BVHBuildNode *node, const Bounds3f &bounds,
+                        std::vector<QuantizedBVHNode<T>> &qNodes);
+    template <int N>
+    bool intersectWide(const WideBVHNode<N> *nodes, const Ray &ray,
+                       SurfaceInteraction *isect) const;
+    template <typename T>
+    bool intersectQuantized(const QuantizedBVHNode<T> *nodes, const Ray &ray,
+                            SurfaceInteraction *isect) const;
+    bool readCache(uint64_t key, int quantizeBits);
+    void writeCache(uint64_t key, int64_t nPrimitives,
+                    const std::vector<int32_t> &order) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const int width;
     std::vector<std::shared_ptr<Primitive>> primitives;
+    Bounds3f worldBound;
     LinearBVHNode *nodes = nullptr;
+    WideBVHNode<4> *nodes4 = nullptr;
+    WideBVHNode<8> *nodes8 = nullptr;
+    QuantizedBVHNode<uint8_t> *nodesQ8 = nullptr;
+    QuantizedBVHNode<uint16_t> *nodesQ16 = nullptr;
+    int nNodes = 0;
+    // The nodes of a tree read from the cache point into _cacheData_, the
+    // file mapped to memory
+    std::string cacheFilename;
+    void *cacheData = nullptr;
+    size_t cacheSize = 0;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
@@ -0,0 +1,155 @@
+#ifndef _MICROSURFACEMATH_
+#define _MICROSURFACEMATH_
+
+#include <cmath>
+#include <limits>
+
+/* Constants and special functions shared by the microsurface models. */
+
+//#define M_PI			3.14159265358979323846f	/* pi */
+#define INV_M_PI		0.31830988618379067153f /* 1/pi */
+//#define M_PI_2			1.57079632679489661923f	/* pi/2 */
+#define SQRT_M_PI		1.77245385090551602729f /* sqrt(pi) */
+#define SQRT_2			1.41421356237309504880f /* sqrt(2) */
+#define INV_SQRT_M_PI	0.56418958354775628694f /* 1/sqrt(pi) */
+#define INV_2_SQRT_M_PI	0.28209479177387814347f /* 0.5/sqrt(pi) */
+#define INV_SQRT_2_M_PI 0.3989422804014326779f /* 1/sqrt(2*pi) */
+#define INV_SQRT_2		0.7071067811865475244f /* 1/sqrt(2) */
+
+
+static inline bool IsFiniteNumber(float x) 
+{
+	return (x <= std::numeric_limits<float>::max() && x >= -std::numeric_limits<float>::max()); 
+} 
+
+
+static inline float sign(float a) {
+	return a >= 0.0f ? 1.0f : -1.0f;
+} 
+
+static inline double serf(double x)
+{
+    // constants
+    double a1 =  0.254829592;
+    double a2 = -0.284496736;
+    double a3 =  1.421413741;
+    double a4 = -1.453152027;
+    double a5 =  1.061405429;
+    double p  =  0.3275911;
+ 
+    // Save the sign of x
+    int sign = 1;
+    if (x < 0)
+        sign = -1;
+    x = fabs(x);
+ 
+    // A&S formula 7.1.26
+    double t = 1.0/(1.0 + p*x);
+    double y = 1.0 - (((((a5*t + a4)*t) + a3)*t + a2)*t + a1)*t*exp(-x*x);
+ 
+    return sign*y;
+}
+
+
+static inline float serfinv(float x)
+{
+float w, p;
+w = - logf((1.0f-x)*(1.0f+x));
+if ( w < 5.000000f ) {
+w = w - 2.500000f;
+p = 2.81022636e-08f;
+p = 3.43273939e-07f + p*w;
+p = -3.5233877e-06f + p*w;
+p = -4.39150654e-06f + p*w;
+p = 0.00021858087f + p*w;
+p = -0.00125372503f + p*w;
+p = -0.00417768164f + p*w;
+p = 0.246640727f + p*w;
+p = 1.50140941f + p*w;
+}
+else {
+w = sqrtf(w) - 3.000000f;
+p = -0.000200214257f;
+p = 0.000100950558f + p*w;
+p = 0.00134934322f + p*w;
+p = -0.00367342844f + p*w;
+p = 0.00573950773f + p*w;
+p = -0.0076224613f + p*w;
+p = 0.00943887047f + p*w;
+p = 1.00167406f + p*w;
+p = 2.83297682f + p*w;
+}
+return p*x;
+}
+
+
+
+#ifndef M_PI
+#define M_PI			3.14159265358979323846f	/* pi */
+#endif
+/* 
+ * A method to compute the sgamma() function.
+ *
+ */  
+
+static inline double  abgam (double x)
+{
+  double  gam[10],
+          temp;
+
+  gam[0] = 1./ 12.;
+  gam[1] = 1./ 30.;
+  gam[2] = 53./ 210.;
+  gam[3] = 195./ 371.;
+  gam[4] = 22999./ 22737.;
+  gam[5] = 29944523./ 19733142.;
+  gam[6] = 109535241009./ 48264275462.;
+  temp = 0.5*log (2*M_PI) - x + (x - 0.5)*log (x)
+    + gam[0]/(x + gam[1]/(x + gam[2]/(x + gam[3]/(x + gam[4] /
+	  (x + gam[5]/(x + gam[6]/x))))));
+
+  return temp;
+}
+
+static inline double  sgamma (double x)
+{
+  double  result;
+  result = exp (abgam (x + 5))/(x*(x + 1)*(x + 2)*(x + 3)*(x + 4));
+  return result;
+}
+
+static inline double  beta (double m, double n)
+{
+  return (sgamma (m)*sgamma (n)/sgamma (m + n));
+}
+
+/************* FAST FLOAT KERNELS *************/
+
+/* Float-only kernels for the walks of the specialized microsurfaces. The
+   error bounds are measured against double precision (see the
+   Microsurface.FastMath test). serfinv() is already a float polynomial, and
+   the float expf(), logf() and powf() of the C library turned out faster
+   than polynomial replacements, so the walks keep those. */
+
+// erf() without exp(): Abramowitz & Stegun 7.1.28 in single precision,
+// absolute error < 2e-6
+static inline float fastErf(const float x)
+{
+	const float ax = fabsf(x);
+	float p = 0.0000430638f;
+	p = p*ax + 0.0002765672f;
+	p = p*ax + 0.0001520143f;
+	p = p*ax + 0.0092705272f;
+	p = p*ax + 0.0422820123f;
+	p = p*ax + 0.0705230784f;
+	p = p*ax + 1.0f;
+	// p^16
+	p = p*p;
+	p = p*p;
+	p = p*p;
+	p = p*p;
+	const float y = 1.0f - 1.0f/p;
+	return (x < 0.0f) ? -y : y;
+}
+
+#endif
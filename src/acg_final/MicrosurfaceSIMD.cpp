@@ -0,0 +1,494 @@
+#include "MicrosurfaceScattering.h"
+#include "MicrosurfaceMath.h"
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+/* Batched random walks: the same algorithms as MicrosurfaceScattering.cpp,
+   written without trigonometry and with one independent walk per SIMD lane.
+   Branches become per-lane selects, and lanes whose walk has left the
+   microsurface are masked out until every lane of the batch is done. */
+
+using namespace simd;
+
+#define FLT_MAX std::numeric_limits<float>::max()
+
+
+/************* MICROSURFACE HEIGHT DISTRIBUTION *************/
+
+vfloat MicrosurfaceHeightUniform::C1(const vfloat& h) const
+{
+	return min(1.0f, max(0.0f, 0.5f*(h+1.0f)));
+}
+
+vfloat MicrosurfaceHeightUniform::invC1(const vfloat& U) const
+{
+	return max(-1.0f, min(1.0f, 2.0f*U-1.0f));
+}
+
+vfloat MicrosurfaceHeightGaussian::C1(const vfloat& h) const
+{
+	return 0.5f + 0.5f * erf(INV_SQRT_2*h);
+}
+
+vfloat MicrosurfaceHeightGaussian::invC1(const vfloat& U) const
+{
+	return SQRT_2 * erfinv(2.0f*U - 1.0f);
+}
+
+
+/************* MICROSURFACE SLOPE DISTRIBUTION *************/
+
+// alpha_i(wi) * sin(theta_i)
+static vfloat projectedRoughness(const Vector3v& wi, const float alpha_u, const float alpha_v)
+{
+	return sqrt(wi.x*wi.x*(alpha_u*alpha_u) + wi.y*wi.y*(alpha_v*alpha_v));
+}
+
+vfloat MicrosurfaceSlope::D(const Vector3v& wm, const float m_alpha_x, const float m_alpha_y) const
+{
+	// slope of wm
+	const vfloat slope_x = -wm.x/wm.z;
+	const vfloat slope_y = -wm.y/wm.z;
+
+	// value
+	const vfloat z2 = wm.z*wm.z;
+	const vfloat value = P22(slope_x, slope_y, m_alpha_x, m_alpha_y) / (z2*z2);
+	return select(wm.z > 0.0f, value, 0.0f);
+}
+
+vfloat MicrosurfaceSlope::D_wi(const Vector3v& wi, const Vector3v& wm, const float m_alpha_x, const float m_alpha_y) const
+{
+	const vfloat projectedarea = projectedArea(wi, m_alpha_x, m_alpha_y);
+	const vfloat value = max(0.0f, Dot(wi, wm)) * D(wm, m_alpha_x, m_alpha_y) / projectedarea;
+	return select((wm.z > 0.0f) & (projectedarea != 0.0f), value, 0.0f);
+}
+
+Vector3v MicrosurfaceSlope::sampleD_wi(const Vector3v& wi, const vfloat& U1, const vfloat& U2, const float m_alpha_x, const float m_alpha_y) const
+{
+	// stretch to match configuration with alpha=1.0
+	const Vector3v wi_11 = Normalize(Vector3v(m_alpha_x * wi.x, m_alpha_y * wi.y, wi.z));
+
+	// sample visible slope with alpha=1.0
+	const Vector2v slope_11 = sampleP22_11(wi_11.z, U1, U2);
+
+	// align with view direction
+	const vfloat r = sqrt(wi_11.x*wi_11.x + wi_11.y*wi_11.y);
+	const vmask vertical = (r == 0.0f);
+	const vfloat cos_phi = select(vertical, 1.0f, wi_11.x / r);
+	const vfloat sin_phi = select(vertical, 0.0f, wi_11.y / r);
+	const vfloat slope_x = (cos_phi*slope_11.x - sin_phi*slope_11.y) * m_alpha_x;
+	const vfloat slope_y = (sin_phi*slope_11.x + cos_phi*slope_11.y) * m_alpha_y;
+
+	// if numerical instability
+	const Vector3v fallback = select(wi.z > 0.0f, Vector3v(Vector3f(0.0f, 0.0f, 1.0f)), Normalize(Vector3v(wi.x, wi.y, 0.0f)));
+
+	// compute normal
+	const Vector3v wm = Normalize(Vector3v(-slope_x, -slope_y, 1.0f));
+	return select(isfinite(slope_x), wm, fallback);
+}
+
+vfloat MicrosurfaceSlopeBeckmann::P22(const vfloat& slope_x, const vfloat& slope_y, const float m_alpha_x, const float m_alpha_y) const
+{
+	return 1.0f / (M_PI * m_alpha_x * m_alpha_y) * exp(-slope_x*slope_x/(m_alpha_x*m_alpha_x) - slope_y*slope_y/(m_alpha_y*m_alpha_y));
+}
+
+vfloat MicrosurfaceSlopeBeckmann::Lambda(const Vector3v& wi, const float alpha_u, const float alpha_v) const
+{
+	// a = 1 / (tan(theta_i) * alpha_i)
+	const vfloat a = wi.z / projectedRoughness(wi, alpha_u, alpha_v);
+
+	// value
+	const vfloat value = 0.5f*(erf(a) - 1.0f) + INV_2_SQRT_M_PI / a * exp(-a*a);
+	return select(wi.z > 0.9999f, 0.0f, select(wi.z < -0.9999f, -1.0f, value));
+}
+
+vfloat MicrosurfaceSlopeBeckmann::projectedArea(const Vector3v& wi, const float alpha_u, const float alpha_v) const
+{
+	// a
+	const vfloat alphai_sin = projectedRoughness(wi, alpha_u, alpha_v);
+	const vfloat a = wi.z / alphai_sin;
+
+	// value
+	const vfloat value = 0.5f*(erf(a) + 1.0f)*wi.z + INV_2_SQRT_M_PI * alphai_sin * exp(-a*a);
+	return select(wi.z > 0.9999f, 1.0f, select(wi.z < -0.9999f, 0.0f, value));
+}
+
+Vector2v MicrosurfaceSlopeBeckmann::sampleP22_11(const vfloat& cos_theta_i, const vfloat& U1, const vfloat& U2) const
+{
+	// the visible slopes are found by an iterative search with a different
+	// number of steps per lane: solve it lane by lane
+	float cos_theta[lanes], u1[lanes], u2[lanes], x[lanes], y[lanes];
+	cos_theta_i.store(cos_theta);
+	U1.store(u1);
+	U2.store(u2);
+	for(int i = 0; i < lanes; ++i)
+	{
+		const Vector2f slope = sampleP22_11(acosf(std::max(-1.0f, std::min(1.0f, cos_theta[i]))), u1[i], u2[i]);
+		x[i] = slope.x;
+		y[i] = slope.y;
+	}
+	return Vector2v(vfloat::load(x), vfloat::load(y));
+}
+
+vfloat MicrosurfaceSlopeGGX::P22(const vfloat& slope_x, const vfloat& slope_y, const float m_alpha_x, const float m_alpha_y) const
+{
+	const vfloat tmp = 1.0f + slope_x*slope_x/(m_alpha_x*m_alpha_x) + slope_y*slope_y/(m_alpha_y*m_alpha_y);
+	return 1.0f / (M_PI * m_alpha_x * m_alpha_y) / (tmp * tmp);
+}
+
+vfloat MicrosurfaceSlopeGGX::Lambda(const Vector3v& wi, const float alpha_u, const float alpha_v) const
+{
+	// a = 1 / (tan(theta_i) * alpha_i)
+	const vfloat a = wi.z / projectedRoughness(wi, alpha_u, alpha_v);
+
+	// value
+	const vfloat value = 0.5f*(-1.0f + sign(a) * sqrt(1.0f + 1.0f/(a*a)));
+	return select(wi.z > 0.9999f, 0.0f, select(wi.z < -0.9999f, -1.0f, value));
+}
+
+vfloat MicrosurfaceSlopeGGX::projectedArea(const Vector3v& wi, const float alpha_u, const float alpha_v) const
+{
+	const vfloat alphai_sin = projectedRoughness(wi, alpha_u, alpha_v);
+
+	// value
+	const vfloat value = 0.5f * (wi.z + sqrt(wi.z*wi.z + alphai_sin*alphai_sin));
+	return select(wi.z > 0.9999f, 1.0f, select(wi.z < -0.9999f, 0.0f, value));
+}
+
+Vector2v MicrosurfaceSlopeGGX::sampleP22_11(const vfloat& cos_theta_i, const vfloat& U, const vfloat& U_2) const
+{
+	// constant
+	const vfloat sin_theta_i = sqrt(max(0.0f, 1.0f - cos_theta_i*cos_theta_i));
+	const vfloat tan_theta_i = sin_theta_i/cos_theta_i;
+
+	// normal incidence
+	const vfloat r = sqrt(U/(1.0f-U));
+	vfloat sin_phi, cos_phi;
+	sincos(6.28318530718f * U_2, sin_phi, cos_phi);
+	const Vector2v slope_normal(r * cos_phi, r * sin_phi);
+
+	// projected area
+	const vfloat projectedarea = 0.5f * (cos_theta_i + 1.0f);
+
+	const vfloat A = 2.0f*U*projectedarea/cos_theta_i - 1.0f;
+	const vfloat B = tan_theta_i;
+	const vfloat inv = 1.0f / (A*A-1.0f);
+	const vfloat tmp = select(abs(inv) <= FLT_MAX, inv, -10000000.0f);
+
+	const vfloat D = sqrt(max(0.0f, B*B*tmp*tmp - (A*A-B*B)*tmp));
+	const vfloat slope_x_1 = B*tmp - D;
+	const vfloat slope_x_2 = B*tmp + D;
+	const vfloat slope_x = select((A < 0.0f) | (slope_x_2 > 1.0f/tan_theta_i), slope_x_1, slope_x_2);
+
+	const vfloat S = select(U_2 > 0.5f, 1.0f, -1.0f);
+	const vfloat U2 = abs(2.0f*U_2 - 1.0f);
+	const vfloat z = (U2*(U2*(U2*0.27385f-0.73369f)+0.46341f)) / (U2*(U2*(U2*0.093073f+0.309420f)-1.000000f)+0.597999f);
+	const vfloat slope_y = S * z * sqrt(1.0f+slope_x*slope_x);
+
+	const vmask normal = sin_theta_i < 0.0001f;
+	const vmask degenerate = !(projectedarea >= 0.0001f);
+	return Vector2v(select(normal, slope_normal.x, select(degenerate, 0.0f, slope_x)),
+					select(normal, slope_normal.y, select(degenerate, 0.0f, slope_y)));
+}
+
+
+/************* MICROSURFACE *************/
+
+// records the walks of the lanes set in finished, see microsurfaceWalkStats()
+static void walkStats(const vmask& finished, const int scatteringOrder, const WalkOutcome outcome)
+{
+	const int bits = finished.bits();
+	for(int i = 0; i < lanes; ++i)
+		if(bits & (1 << i))
+			microsurfaceWalkStats(scatteringOrder, outcome);
+}
+
+vfloat Microsurface::G_1(const Vector3v& wi, const vfloat& h0) const
+{
+	const vfloat value = pow(m_microsurfaceheight->C1(h0), m_microsurfaceslope->Lambda(wi, m_alphau, m_alphav));
+	return select(wi.z > 0.9999f, 1.0f, select(wi.z <= 0.0f, 0.0f, value));
+}
+
+vfloat Microsurface::sampleHeight(const Vector3v& wr, const vfloat& hr, const vfloat& U) const
+{
+	const vfloat C1_hr = m_microsurfaceheight->C1(hr);
+	const vfloat Lambda = m_microsurfaceslope->Lambda(wr, m_alphau, m_alphav);
+
+	// probability of intersection
+	const vfloat G_1_ = select(wr.z > 0.0f, pow(C1_hr, Lambda), 0.0f);
+
+	vfloat h = m_microsurfaceheight->invC1(C1_hr / pow(1.0f-U, 1.0f/Lambda));
+	h = select(U > 1.0f - G_1_, FLT_MAX, h); // leave the microsurface
+	h = select(abs(wr.z) < 0.0001f, hr, h);
+	h = select(wr.z < -0.9999f, m_microsurfaceheight->invC1(U*C1_hr), h);
+	h = select(wr.z > 0.9999f, FLT_MAX, h);
+	return h;
+}
+
+float Microsurface::eval(const Vector3f& wi, const Vector3f& wo, const int nWalks, RNG& rng) const
+{
+	if(nWalks <= 0 || wo.z < 0)
+		return 0;
+	if(nWalks == 1 || !accelerated)
+	{
+		float sum = 0;
+		for(int i = 0; i < nWalks; ++i)
+			sum += eval(wi, wo, rng);
+		return sum / nWalks;
+	}
+	ProfilePhase p(Prof::MicrosurfaceBatchedWalks);
+	const float h0 = 1.0f + m_microsurfaceheight->invC1(0.999f);
+
+	float sum = 0;
+	for(int first = 0; first < nWalks; first += lanes)
+	{
+		// init, lanes past nWalks stay inactive
+		vmask active = firstLanes(nWalks - first);
+		Vector3v wr = -Vector3v(wi);
+		vfloat hr = h0;
+		vfloat lanesum = 0.0f;
+		vfloat throughput = 1.0f;
+
+		// random walks, each iteration scattering once in every active lane
+		for(int scatteringOrder = 1; any(active); ++scatteringOrder)
+		{
+			// next height
+			const vfloat U = uniform(rng, active);
+			hr = select(active, sampleHeight(wr, hr, U), hr);
+
+			// leave the microsurface?
+			walkStats(andnot(active, (hr != FLT_MAX)), scatteringOrder - 1, WalkOutcome::Left);
+			active = active & (hr != FLT_MAX);
+			if(!any(active))
+				break;
+
+			// next event estimation
+			const vfloat phasefunction = evalPhaseFunction(-wr, wo, rng, active);
+			const vfloat shadowing = G_1(Vector3v(wo), hr);
+			const vfloat I = phasefunction * shadowing;
+			lanesum += select(active & isfinite(I), throughput * I, 0.0f);
+
+			// next direction
+			wr = select(active, samplePhaseFunction(-wr, rng, active), wr);
+
+			// if NaN (should not happen, just in case)
+			const vmask failed = active & (isnan(hr) | isnan(wr.z));
+			lanesum = select(failed, 0.0f, lanesum);
+			walkStats(failed, scatteringOrder, WalkOutcome::NaN);
+			active = andnot(active, failed);
+
+			// Russian roulette
+			const vmask rouletteActive = active;
+			m_roulette.survive(scatteringOrder, throughput, rng, active);
+			walkStats(andnot(rouletteActive, active), scatteringOrder, WalkOutcome::Roulette);
+		}
+		sum += reduceAdd(lanesum);
+	}
+
+	return sum / nWalks;
+}
+
+vfloat MicrosurfaceConductor::evalPhaseFunction(const Vector3v& wi, const Vector3f& wo, RNG& rng, const vmask& active) const
+{
+	// half vector
+	const Vector3v wh = Normalize(wi+Vector3v(wo));
+
+	// value
+	const vfloat value = 0.25f * m_microsurfaceslope->D_wi(wi, wh, m_alphau, m_alphav) / Dot(wi, wh);
+	return select(wh.z < 0.0f, 0.0f, value);
+}
+
+Vector3v MicrosurfaceConductor::samplePhaseFunction(const Vector3v& wi, RNG& rng, const vmask& active) const
+{
+	const vfloat U1 = uniform(rng, active);
+	const vfloat U2 = uniform(rng, active);
+
+	const Vector3v wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+	// reflect
+	return -wi + 2.0f * wm * Dot(wi, wm);
+}
+
+Vector3v MicrosurfaceDielectric::refract(const Vector3v &wi, const Vector3v &wm, const vfloat& eta) const
+{
+	const vfloat cos_theta_i = Dot(wi, wm);
+	const vfloat cos_theta_t2 = 1.0f - (1.0f-cos_theta_i*cos_theta_i) / (eta*eta);
+	const vfloat cos_theta_t = -sqrt(max(0.0f, cos_theta_t2));
+
+	return wm * (cos_theta_i / eta + cos_theta_t) - wi / eta;
+}
+
+vfloat MicrosurfaceDielectric::Fresnel(const Vector3v& wi, const Vector3v& wm, const vfloat& eta) const
+{
+	const vfloat cos_theta_i = Dot(wi, wm);
+	const vfloat cos_theta_t2 = 1.0f - (1.0f-cos_theta_i*cos_theta_i) / (eta*eta);
+	const vfloat cos_theta_t = sqrt(max(0.0f, cos_theta_t2));
+
+	const vfloat Rs = (cos_theta_i - eta * cos_theta_t) / (cos_theta_i + eta * cos_theta_t);
+	const vfloat Rp = (eta * cos_theta_i - cos_theta_t) / (eta * cos_theta_i + cos_theta_t);
+
+	// total internal reflection
+	return select(cos_theta_t2 <= 0.0f, 1.0f, 0.5f * (Rs * Rs + Rp * Rp));
+}
+
+vfloat MicrosurfaceDielectric::evalPhaseFunction(const Vector3v& wi, const Vector3f& wo, RNG& rng, const vmask& active) const
+{
+	const vmask outside(true);
+	return evalPhaseFunction(wi, wo, outside, true) + evalPhaseFunction(wi, wo, outside, false);
+}
+
+vfloat MicrosurfaceDielectric::evalPhaseFunction(const Vector3v& wi, const Vector3f& wo_, const vmask& wi_outside, const bool wo_outside) const
+{
+	const Vector3v wo(wo_);
+	const vfloat eta = select(wi_outside, m_eta, 1.0f / m_eta);
+	// flips the inside lanes to the outside configuration
+	const vfloat side = select(wi_outside, 1.0f, -1.0f);
+
+	// reflection
+	const Vector3v wh_r = Normalize(wi+wo);
+	const vfloat reflection = 0.25f * m_microsurfaceslope->D_wi(side*wi, side*wh_r, m_alphau, m_alphav) / Dot(wi, wh_r) * Fresnel(wi, wh_r, eta);
+
+	// transmission
+	Vector3v wh_t = -Normalize(wi+wo*eta);
+	wh_t = wh_t * (side * sign(wh_t.z));
+	const vfloat denominator = Dot(wi, wh_t)+eta*Dot(wo,wh_t);
+	const vfloat transmission = eta*eta * (1.0f-Fresnel(wi, wh_t, eta)) *
+		m_microsurfaceslope->D_wi(side*wi, side*wh_t, m_alphau, m_alphav) * max(0.0f, -Dot(wo, wh_t)) /
+		(denominator*denominator);
+
+	const vmask is_reflection = wi_outside == vmask(wo_outside);
+	return select(is_reflection, reflection, select(Dot(wh_t, wi) < 0.0f, 0.0f, transmission));
+}
+
+Vector3v MicrosurfaceDielectric::samplePhaseFunction(const Vector3v& wi, RNG& rng, const vmask& active) const
+{
+	vmask outside(true);
+	return samplePhaseFunction(wi, rng, active, outside);
+}
+
+Vector3v MicrosurfaceDielectric::samplePhaseFunction(const Vector3v& wi, RNG& rng, const vmask& active, vmask& outside) const
+{
+	const vfloat U1 = uniform(rng, active);
+	const vfloat U2 = uniform(rng, active);
+
+	const vfloat eta = select(outside, m_eta, 1.0f / m_eta);
+	const vfloat side = select(outside, 1.0f, -1.0f);
+
+	const Vector3v wm = side * m_microsurfaceslope->sampleD_wi(side*wi, U1, U2, m_alphau, m_alphav);
+
+	const vfloat F = Fresnel(wi, wm, eta);
+	const vmask reflect = uniform(rng, active) < F;
+
+	const Vector3v wo_r = -wi + 2.0f * wm * Dot(wi, wm);
+	const Vector3v wo_t = Normalize(refract(wi, wm, eta));
+	outside = select(active & !reflect, !outside, outside);
+	return select(reflect, wo_r, wo_t);
+}
+
+float MicrosurfaceDielectric::eval(const Vector3f& wi, const Vector3f& wo, const int nWalks, RNG& rng) const
+{
+	if(nWalks <= 0)
+		return 0;
+	if(nWalks == 1 || !accelerated)
+	{
+		float sum = 0;
+		for(int i = 0; i < nWalks; ++i)
+			sum += eval(wi, wo, rng);
+		return sum / nWalks;
+	}
+	ProfilePhase p(Prof::MicrosurfaceBatchedWalks);
+	const float h0 = 1.0f + m_microsurfaceheight->invC1(0.999f);
+
+	float sum = 0.0f;
+	for(int first = 0; first < nWalks; first += lanes)
+	{
+		// init, lanes past nWalks stay inactive
+		vmask active = firstLanes(nWalks - first);
+		Vector3v wr = -Vector3v(wi);
+		vmask outside(wi.z > 0);
+		vfloat hr = (wi.z > 0) ? h0 : -h0;
+		vfloat lanesum = 0.0f;
+		vfloat throughput = 1.0f;
+
+		// random walks, each iteration scattering once in every active lane
+		for(int scatteringOrder = 1; any(active); ++scatteringOrder)
+		{
+			// next height
+			const vfloat U = uniform(rng, active);
+			const vfloat side = select(outside, 1.0f, -1.0f);
+			hr = select(active, side * sampleHeight(side*wr, side*hr, U), hr);
+
+			// leave the microsurface?
+			walkStats(andnot(active, (abs(hr) != FLT_MAX)), scatteringOrder - 1, WalkOutcome::Left);
+			active = active & (abs(hr) != FLT_MAX);
+			if(!any(active))
+				break;
+
+			// next event estimation
+			const vfloat phasefunction = evalPhaseFunction(-wr, wo, outside, (wo.z>0));
+			const vfloat shadowing = (wo.z>0) ? G_1(Vector3v(wo), hr) : G_1(-Vector3v(wo), -hr);
+			const vfloat I = phasefunction * shadowing;
+			lanesum += select(active & isfinite(I), throughput * I, 0.0f);
+
+			// next direction
+			wr = select(active, samplePhaseFunction(-wr, rng, active, outside), wr);
+
+			// if NaN (should not happen, just in case)
+			const vmask failed = active & (isnan(hr) | isnan(wr.z));
+			lanesum = select(failed, 0.0f, lanesum);
+			walkStats(failed, scatteringOrder, WalkOutcome::NaN);
+			active = andnot(active, failed);
+
+			// Russian roulette
+			const vmask rouletteActive = active;
+			m_roulette.survive(scatteringOrder, throughput, rng, active);
+			walkStats(andnot(rouletteActive, active), scatteringOrder, WalkOutcome::Roulette);
+		}
+		sum += reduceAdd(lanesum);
+	}
+
+	return sum / nWalks;
+}
+
+vfloat MicrosurfaceDiffuse::evalPhaseFunction(const Vector3v& wi, const Vector3f& wo, RNG& rng, const vmask& active) const
+{
+	const vfloat U1 = uniform(rng, active);
+	const vfloat U2 = uniform(rng, active);
+	const Vector3v wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+	// value
+	return 1.0f/M_PI * max(0.0f, Dot(Vector3v(wo), wm));
+}
+
+Vector3v MicrosurfaceDiffuse::samplePhaseFunction(const Vector3v& wi, RNG& rng, const vmask& active) const
+{
+	const vfloat U1 = uniform(rng, active);
+	const vfloat U2 = uniform(rng, active);
+	const vfloat U3 = uniform(rng, active);
+	const vfloat U4 = uniform(rng, active);
+
+	const Vector3v wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+	// sample diffuse reflection in the basis of [Frisvad2012]
+	const vmask pole = wm.z < -0.9999999f;
+	const vfloat a = 1.0f / (1.0f + wm.z);
+	const vfloat b = -wm.x*wm.y*a;
+	const Vector3v w1 = select(pole, Vector3v(Vector3f(0.0f, -1.0f, 0.0f)), Vector3v(1.0f - wm.x*wm.x*a, b, -wm.x));
+	const Vector3v w2 = select(pole, Vector3v(Vector3f(-1.0f, 0.0f, 0.0f)), Vector3v(b, 1.0f - wm.y*wm.y*a, -wm.y));
+
+	// concentric map
+	const vfloat r1 = 2.0f*U3 - 1.0f;
+	const vfloat r2 = 2.0f*U4 - 1.0f;
+	const vmask first = r1*r1 > r2*r2;
+	const vfloat r = select(first, r1, r2);
+	vfloat phi = select(first, (M_PI/4.0f) * (r2/r1), (M_PI/2.0f) - (r1/r2) * (M_PI/4.0f));
+	phi = select((r1 == 0.0f) & (r2 == 0.0f), 0.0f, phi);
+	vfloat sin_phi, cos_phi;
+	sincos(phi, sin_phi, cos_phi);
+	const vfloat x = r*cos_phi;
+	const vfloat y = r*sin_phi;
+	const vfloat z = sqrt(max(0.0f, 1.0f - x*x - y*y));
+	return x*w1 + y*w2 + z*wm;
+}
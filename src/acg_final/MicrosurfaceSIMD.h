@@ -0,0 +1,441 @@
+#ifndef _MICROSURFACESIMD_
+#define _MICROSURFACESIMD_
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "rng.h"
+
+#include <cstring>
+#include <limits>
+
+/* Lanes used by the batched random walks: 8 with AVX2, 4 with SSE2, and a
+   portable 4-wide fallback otherwise (or if MICROSURFACE_SIMD_SCALAR is
+   defined). */
+#if !defined(MICROSURFACE_SIMD_SCALAR) && defined(__AVX2__)
+#define MICROSURFACE_SIMD_AVX2
+#include <immintrin.h>
+#elif !defined(MICROSURFACE_SIMD_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MICROSURFACE_SIMD_SSE2
+#include <emmintrin.h>
+#elif !defined(MICROSURFACE_SIMD_SCALAR)
+#define MICROSURFACE_SIMD_SCALAR
+#endif
+
+namespace simd {
+
+
+/************* NATIVE REGISTERS *************/
+
+// masks are stored in float registers with all bits of a true lane set
+
+#if defined(MICROSURFACE_SIMD_AVX2)
+
+static const int lanes = 8;
+static const bool accelerated = true;
+typedef __m256 native;
+
+inline native n_set1(const float f) { return _mm256_set1_ps(f); }
+inline native n_load(const float* p) { return _mm256_loadu_ps(p); }
+inline void n_store(float* p, const native a) { _mm256_storeu_ps(p, a); }
+inline native n_add(const native a, const native b) { return _mm256_add_ps(a, b); }
+inline native n_sub(const native a, const native b) { return _mm256_sub_ps(a, b); }
+inline native n_mul(const native a, const native b) { return _mm256_mul_ps(a, b); }
+inline native n_div(const native a, const native b) { return _mm256_div_ps(a, b); }
+inline native n_min(const native a, const native b) { return _mm256_min_ps(a, b); }
+inline native n_max(const native a, const native b) { return _mm256_max_ps(a, b); }
+inline native n_sqrt(const native a) { return _mm256_sqrt_ps(a); }
+inline native n_lt(const native a, const native b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline native n_le(const native a, const native b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline native n_eq(const native a, const native b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline native n_neq(const native a, const native b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+inline native n_and(const native a, const native b) { return _mm256_and_ps(a, b); }
+inline native n_or(const native a, const native b) { return _mm256_or_ps(a, b); }
+inline native n_xor(const native a, const native b) { return _mm256_xor_ps(a, b); }
+inline native n_andnot(const native a, const native b) { return _mm256_andnot_ps(a, b); }
+inline int n_bits(const native a) { return _mm256_movemask_ps(a); }
+// nearest integer, |a| < 2^31
+inline native n_round(const native a) { return _mm256_cvtepi32_ps(_mm256_cvtps_epi32(a)); }
+// 2^n for integer n in [-126, 127]
+inline native n_exp2i(const native n)
+{
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+}
+// mantissa in [0.5, 1) and exponent of normal positive a
+inline native n_frexp(const native a, native& e)
+{
+	const __m256i bits = _mm256_castps_si256(a);
+	e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+	return _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+}
+
+#elif defined(MICROSURFACE_SIMD_SSE2)
+
+static const int lanes = 4;
+static const bool accelerated = true;
+typedef __m128 native;
+
+inline native n_set1(const float f) { return _mm_set1_ps(f); }
+inline native n_load(const float* p) { return _mm_loadu_ps(p); }
+inline void n_store(float* p, const native a) { _mm_storeu_ps(p, a); }
+inline native n_add(const native a, const native b) { return _mm_add_ps(a, b); }
+inline native n_sub(const native a, const native b) { return _mm_sub_ps(a, b); }
+inline native n_mul(const native a, const native b) { return _mm_mul_ps(a, b); }
+inline native n_div(const native a, const native b) { return _mm_div_ps(a, b); }
+inline native n_min(const native a, const native b) { return _mm_min_ps(a, b); }
+inline native n_max(const native a, const native b) { return _mm_max_ps(a, b); }
+inline native n_sqrt(const native a) { return _mm_sqrt_ps(a); }
+inline native n_lt(const native a, const native b) { return _mm_cmplt_ps(a, b); }
+inline native n_le(const native a, const native b) { return _mm_cmple_ps(a, b); }
+inline native n_eq(const native a, const native b) { return _mm_cmpeq_ps(a, b); }
+inline native n_neq(const native a, const native b) { return _mm_cmpneq_ps(a, b); }
+inline native n_and(const native a, const native b) { return _mm_and_ps(a, b); }
+inline native n_or(const native a, const native b) { return _mm_or_ps(a, b); }
+inline native n_xor(const native a, const native b) { return _mm_xor_ps(a, b); }
+inline native n_andnot(const native a, const native b) { return _mm_andnot_ps(a, b); }
+inline int n_bits(const native a) { return _mm_movemask_ps(a); }
+// nearest integer, |a| < 2^31
+inline native n_round(const native a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+// 2^n for integer n in [-126, 127]
+inline native n_exp2i(const native n)
+{
+	return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23));
+}
+// mantissa in [0.5, 1) and exponent of normal positive a
+inline native n_frexp(const native a, native& e)
+{
+	const __m128i bits = _mm_castps_si128(a);
+	e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+	return _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f000000)));
+}
+
+#else
+
+static const int lanes = 4;
+// the portable lanes are slower than scalar code, only for completeness
+static const bool accelerated = false;
+struct native { float v[lanes]; };
+
+#define SIMD_LANEWISE(expr) native r; for(int i = 0; i < lanes; ++i) r.v[i] = (expr); return r;
+
+inline uint32_t n_asbits(const float f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+inline float n_asfloat(const uint32_t u) { float f; memcpy(&f, &u, 4); return f; }
+inline float n_bool(const bool b) { return n_asfloat(b ? 0xffffffffu : 0u); }
+
+inline native n_set1(const float f) { SIMD_LANEWISE(f) }
+inline native n_load(const float* p) { SIMD_LANEWISE(p[i]) }
+inline void n_store(float* p, const native a) { for(int i = 0; i < lanes; ++i) p[i] = a.v[i]; }
+inline native n_add(const native a, const native b) { SIMD_LANEWISE(a.v[i] + b.v[i]) }
+inline native n_sub(const native a, const native b) { SIMD_LANEWISE(a.v[i] - b.v[i]) }
+inline native n_mul(const native a, const native b) { SIMD_LANEWISE(a.v[i] * b.v[i]) }
+inline native n_div(const native a, const native b) { SIMD_LANEWISE(a.v[i] / b.v[i]) }
+inline native n_min(const native a, const native b) { SIMD_LANEWISE(a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+inline native n_max(const native a, const native b) { SIMD_LANEWISE(a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline native n_sqrt(const native a) { SIMD_LANEWISE(sqrtf(a.v[i])) }
+inline native n_lt(const native a, const native b) { SIMD_LANEWISE(n_bool(a.v[i] < b.v[i])) }
+inline native n_le(const native a, const native b) { SIMD_LANEWISE(n_bool(a.v[i] <= b.v[i])) }
+inline native n_eq(const native a, const native b) { SIMD_LANEWISE(n_bool(a.v[i] == b.v[i])) }
+inline native n_neq(const native a, const native b) { SIMD_LANEWISE(n_bool(a.v[i] != b.v[i])) }
+inline native n_and(const native a, const native b) { SIMD_LANEWISE(n_asfloat(n_asbits(a.v[i]) & n_asbits(b.v[i]))) }
+inline native n_or(const native a, const native b) { SIMD_LANEWISE(n_asfloat(n_asbits(a.v[i]) | n_asbits(b.v[i]))) }
+inline native n_xor(const native a, const native b) { SIMD_LANEWISE(n_asfloat(n_asbits(a.v[i]) ^ n_asbits(b.v[i]))) }
+inline native n_andnot(const native a, const native b) { SIMD_LANEWISE(n_asfloat(~n_asbits(a.v[i]) & n_asbits(b.v[i]))) }
+inline int n_bits(const native a) { int bits = 0; for(int i = 0; i < lanes; ++i) bits |= (n_asbits(a.v[i]) >> 31) << i; return bits; }
+inline native n_round(const native a) { SIMD_LANEWISE(nearbyintf(a.v[i])) }
+inline native n_exp2i(const native n) { SIMD_LANEWISE(ldexpf(1.0f, (int)n.v[i])) }
+inline native n_frexp(const native a, native& e)
+{
+	native r;
+	for(int i = 0; i < lanes; ++i)
+	{
+		int exponent;
+		r.v[i] = frexpf(a.v[i], &exponent);
+		e.v[i] = (float)exponent;
+	}
+	return r;
+}
+
+#undef SIMD_LANEWISE
+
+#endif
+
+
+/************* LANES *************/
+
+/* one float per lane */
+class vfloat
+{
+public:
+	native v;
+
+	vfloat() {}
+	vfloat(const float f) : v(n_set1(f)) {}
+	explicit vfloat(const native& v) : v(v) {}
+
+	static vfloat load(const float* p) { return vfloat(n_load(p)); }
+	void store(float* p) const { n_store(p, v); }
+	float lane(const int i) const { float f[lanes]; store(f); return f[i]; }
+};
+
+/* one boolean per lane */
+class vmask
+{
+public:
+	native v;
+
+	vmask() {}
+	explicit vmask(const native& v) : v(v) {}
+	explicit vmask(const bool b) : v(n_eq(n_set1(0.0f), n_set1(b ? 0.0f : 1.0f))) {}
+
+	// bit i is set if lane i is
+	int bits() const { return n_bits(v); }
+};
+
+inline vfloat operator+(const vfloat& a, const vfloat& b) { return vfloat(n_add(a.v, b.v)); }
+inline vfloat operator-(const vfloat& a, const vfloat& b) { return vfloat(n_sub(a.v, b.v)); }
+inline vfloat operator*(const vfloat& a, const vfloat& b) { return vfloat(n_mul(a.v, b.v)); }
+inline vfloat operator/(const vfloat& a, const vfloat& b) { return vfloat(n_div(a.v, b.v)); }
+inline vfloat operator-(const vfloat& a) { return vfloat(n_xor(a.v, n_set1(-0.0f))); }
+inline vfloat& operator+=(vfloat& a, const vfloat& b) { return a = a + b; }
+inline vfloat& operator*=(vfloat& a, const vfloat& b) { return a = a * b; }
+
+inline vmask operator<(const vfloat& a, const vfloat& b) { return vmask(n_lt(a.v, b.v)); }
+inline vmask operator<=(const vfloat& a, const vfloat& b) { return vmask(n_le(a.v, b.v)); }
+inline vmask operator>(const vfloat& a, const vfloat& b) { return vmask(n_lt(b.v, a.v)); }
+inline vmask operator>=(const vfloat& a, const vfloat& b) { return vmask(n_le(b.v, a.v)); }
+inline vmask operator==(const vfloat& a, const vfloat& b) { return vmask(n_eq(a.v, b.v)); }
+inline vmask operator!=(const vfloat& a, const vfloat& b) { return vmask(n_neq(a.v, b.v)); }
+
+inline vmask operator&(const vmask& a, const vmask& b) { return vmask(n_and(a.v, b.v)); }
+inline vmask operator|(const vmask& a, const vmask& b) { return vmask(n_or(a.v, b.v)); }
+inline vmask operator!(const vmask& a) { return vmask(n_xor(a.v, vmask(true).v)); }
+inline vmask operator==(const vmask& a, const vmask& b) { return !vmask(n_xor(a.v, b.v)); }
+// a and not b
+inline vmask andnot(const vmask& a, const vmask& b) { return vmask(n_andnot(b.v, a.v)); }
+
+inline bool any(const vmask& m) { return m.bits() != 0; }
+
+// lanes [0, n) set
+inline vmask firstLanes(const int n)
+{
+	static const float index[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+	return vfloat::load(index) < vfloat((float)n);
+}
+
+// a where m is set, b elsewhere
+inline vfloat select(const vmask& m, const vfloat& a, const vfloat& b)
+{
+	return vfloat(n_or(n_and(m.v, a.v), n_andnot(m.v, b.v)));
+}
+inline vmask select(const vmask& m, const vmask& a, const vmask& b)
+{
+	return vmask(n_or(n_and(m.v, a.v), n_andnot(m.v, b.v)));
+}
+
+inline float reduceAdd(const vfloat& a)
+{
+	float f[lanes];
+	a.store(f);
+	float sum = 0.0f;
+	for(int i = 0; i < lanes; ++i)
+		sum += f[i];
+	return sum;
+}
+
+// one uniform random number per set lane of active, drawn in lane order;
+// the other lanes get 0.5 and draw nothing from rng
+inline vfloat uniform(pbrt::RNG& rng, const vmask& active)
+{
+	float u[lanes];
+	const int bits = active.bits();
+	for(int i = 0; i < lanes; ++i)
+		u[i] = (bits & (1 << i)) ? rng.UniformFloat() : 0.5f;
+	return vfloat::load(u);
+}
+
+
+/************* MATH *************/
+
+inline vfloat min(const vfloat& a, const vfloat& b) { return vfloat(n_min(a.v, b.v)); }
+inline vfloat max(const vfloat& a, const vfloat& b) { return vfloat(n_max(a.v, b.v)); }
+inline vfloat sqrt(const vfloat& a) { return vfloat(n_sqrt(a.v)); }
+inline vfloat abs(const vfloat& a) { return vfloat(n_andnot(n_set1(-0.0f), a.v)); }
+inline vfloat round(const vfloat& a) { return vfloat(n_round(a.v)); }
+inline vfloat floor(const vfloat& a) { const vfloat r = round(a); return r - select(r > a, 1.0f, 0.0f); }
+// sign(a) >= 0 ? 1 : -1, as sign() in MicrosurfaceScattering.cpp
+inline vfloat sign(const vfloat& a) { return select(a >= 0.0f, 1.0f, -1.0f); }
+// |a| with the sign of b
+inline vfloat copysign(const vfloat& a, const vfloat& b)
+{
+	const native signbit = n_set1(-0.0f);
+	return vfloat(n_or(n_andnot(signbit, a.v), n_and(signbit, b.v)));
+}
+
+inline vmask isnan(const vfloat& a) { return a != a; }
+inline vmask isfinite(const vfloat& a)
+{
+	return (a <= std::numeric_limits<float>::max()) & (a >= -std::numeric_limits<float>::max());
+}
+
+// Cephes expf, relative error ~2e-7; the input is clamped to [-87.3, 88.3]
+inline vfloat exp(const vfloat& x_)
+{
+	vfloat x = min(max(x_, -87.3f), 88.3f);
+	const vfloat n = round(x * 1.44269504088896341f);
+	x = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+	vfloat p = 1.9875691500e-4f;
+	p = p*x + 1.3981999507e-3f;
+	p = p*x + 8.3334519073e-3f;
+	p = p*x + 4.1665795894e-2f;
+	p = p*x + 1.6666665459e-1f;
+	p = p*x + 5.0000001201e-1f;
+	p = p*x*x + x + 1.0f;
+	return p * vfloat(n_exp2i(n.v));
+}
+
+// Cephes logf, absolute error ~1e-7 around 1; -inf at 0, NaN below
+inline vfloat log(const vfloat& x_)
+{
+	vfloat e;
+	vfloat x = vfloat(n_frexp(max(x_, std::numeric_limits<float>::min()).v, e.v));
+	const vmask small = x < 0.707106781186547524f;
+	e = e - select(small, 1.0f, 0.0f);
+	x = x + select(small, x, 0.0f) - 1.0f;
+
+	const vfloat z = x*x;
+	vfloat y = 7.0376836292e-2f;
+	y = y*x - 1.1514610310e-1f;
+	y = y*x + 1.1676998740e-1f;
+	y = y*x - 1.2420140846e-1f;
+	y = y*x + 1.4249322787e-1f;
+	y = y*x - 1.6668057665e-1f;
+	y = y*x + 2.0000714765e-1f;
+	y = y*x - 2.4999993993e-1f;
+	y = y*x + 3.3333331174e-1f;
+	y = y*x*z - e * 2.12194440e-4f - 0.5f * z;
+	const vfloat value = x + y + e * 0.693359375f;
+
+	return select(x_ > 0.0f, value, select(x_ == 0.0f, -std::numeric_limits<float>::infinity(), std::numeric_limits<float>::quiet_NaN()));
+}
+
+// x^y for x >= 0, with 0^y = 0 and x^0 = 1
+inline vfloat pow(const vfloat& x, const vfloat& y)
+{
+	const vfloat value = exp(y * log(x));
+	return select(y == 0.0f, 1.0f, select(x == 0.0f, 0.0f, value));
+}
+
+// Abramowitz & Stegun 7.1.26, as serf() in MicrosurfaceScattering.cpp
+inline vfloat erf(const vfloat& x)
+{
+	const vfloat ax = abs(x);
+	const vfloat t = 1.0f / (1.0f + 0.3275911f * ax);
+	vfloat p = 1.061405429f;
+	p = p*t - 1.453152027f;
+	p = p*t + 1.421413741f;
+	p = p*t - 0.284496736f;
+	p = p*t + 0.254829592f;
+	const vfloat y = 1.0f - p * t * exp(-ax*ax);
+	return copysign(y, x);
+}
+
+// Giles' single precision approximation, as serfinv() in MicrosurfaceScattering.cpp
+inline vfloat erfinv(const vfloat& x)
+{
+	const vfloat w = -log((1.0f - x) * (1.0f + x));
+
+	const vfloat w1 = w - 2.5f;
+	vfloat p1 = 2.81022636e-08f;
+	p1 = 3.43273939e-07f + p1*w1;
+	p1 = -3.5233877e-06f + p1*w1;
+	p1 = -4.39150654e-06f + p1*w1;
+	p1 = 0.00021858087f + p1*w1;
+	p1 = -0.00125372503f + p1*w1;
+	p1 = -0.00417768164f + p1*w1;
+	p1 = 0.246640727f + p1*w1;
+	p1 = 1.50140941f + p1*w1;
+
+	const vfloat w2 = sqrt(w) - 3.0f;
+	vfloat p2 = -0.000200214257f;
+	p2 = 0.000100950558f + p2*w2;
+	p2 = 0.00134934322f + p2*w2;
+	p2 = -0.00367342844f + p2*w2;
+	p2 = 0.00573950773f + p2*w2;
+	p2 = -0.0076224613f + p2*w2;
+	p2 = 0.00943887047f + p2*w2;
+	p2 = 1.00167406f + p2*w2;
+	p2 = 2.83297682f + p2*w2;
+
+	return select(w < 5.0f, p1, p2) * x;
+}
+
+// Cephes sinf/cosf after reduction to [-pi/4, pi/4], for |x| < 8192
+inline void sincos(const vfloat& x, vfloat& s, vfloat& c)
+{
+	const vfloat q = round(x * 0.636619772367581343f);
+	const vfloat r = x - q * 1.5703125f - q * 4.837512969970703125e-4f - q * 7.54978995489188216e-8f;
+	const vfloat z = r*r;
+
+	vfloat ps = -1.9515295891e-4f;
+	ps = ps*z + 8.3321608736e-3f;
+	ps = ps*z - 1.6666654611e-1f;
+	ps = ps*z*r + r;
+
+	vfloat pc = 2.443315711809948e-5f;
+	pc = pc*z - 1.388731625493765e-3f;
+	pc = pc*z + 4.166664568298827e-2f;
+	pc = pc*z*z - 0.5f*z + 1.0f;
+
+	// quadrant in {0, 1, 2, 3}
+	const vfloat quadrant = q - 4.0f * floor(q * 0.25f);
+	const vmask swap = (quadrant == 1.0f) | (quadrant == 3.0f);
+	s = select(swap, pc, ps);
+	c = select(swap, ps, pc);
+	s = select(quadrant >= 2.0f, -s, s);
+	c = select((quadrant == 1.0f) | (quadrant == 2.0f), -c, c);
+}
+
+
+/************* VECTORS *************/
+
+/* one 3D vector per lane */
+class Vector3v
+{
+public:
+	vfloat x, y, z;
+
+	Vector3v() {}
+	Vector3v(const vfloat& x, const vfloat& y, const vfloat& z) : x(x), y(y), z(z) {}
+	Vector3v(const pbrt::Vector3f& v) : x(v.x), y(v.y), z(v.z) {}
+
+	pbrt::Vector3f lane(const int i) const { return pbrt::Vector3f(x.lane(i), y.lane(i), z.lane(i)); }
+};
+
+/* one 2D vector per lane */
+class Vector2v
+{
+public:
+	vfloat x, y;
+
+	Vector2v() {}
+	Vector2v(const vfloat& x, const vfloat& y) : x(x), y(y) {}
+};
+
+inline Vector3v operator+(const Vector3v& a, const Vector3v& b) { return Vector3v(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vector3v operator-(const Vector3v& a, const Vector3v& b) { return Vector3v(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vector3v operator-(const Vector3v& a) { return Vector3v(-a.x, -a.y, -a.z); }
+inline Vector3v operator*(const Vector3v& a, const vfloat& s) { return Vector3v(a.x * s, a.y * s, a.z * s); }
+inline Vector3v operator*(const vfloat& s, const Vector3v& a) { return a * s; }
+inline Vector3v operator/(const Vector3v& a, const vfloat& s) { return a * (1.0f / s); }
+
+inline vfloat Dot(const Vector3v& a, const Vector3v& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vector3v Normalize(const Vector3v& a) { return a / sqrt(Dot(a, a)); }
+
+inline Vector3v select(const vmask& m, const Vector3v& a, const Vector3v& b)
+{
+	return Vector3v(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+}
+
+} // namespace simd
+
+#endif
@@ -1,145 +1,29 @@
 #include "MicrosurfaceScattering.h"
+#include "MicrosurfaceMath.h"
+#include "reflection.h"
 
 #include <cmath>
 #include <iostream>
 #include <algorithm>
-#include <random>
 #include <limits>
 
 using namespace std;
 
-//#define M_PI			3.14159265358979323846f	/* pi */
-#define INV_M_PI		0.31830988618379067153f /* 1/pi */
-//#define M_PI_2			1.57079632679489661923f	/* pi/2 */
-#define SQRT_M_PI		1.77245385090551602729f /* sqrt(pi) */
-#define SQRT_2			1.41421356237309504880f /* sqrt(2) */
-#define INV_SQRT_M_PI	0.56418958354775628694f /* 1/sqrt(pi) */
-#define INV_2_SQRT_M_PI	0.28209479177387814347f /* 0.5/sqrt(pi) */
-#define INV_SQRT_2_M_PI 0.3989422804014326779f /* 1/sqrt(2*pi) */
-#define INV_SQRT_2		0.7071067811865475244f /* 1/sqrt(2) */
 #define FLT_MAX numeric_limits<float>::max()
 #define FLT_MIN numeric_limits<float>::min()
 
 
-static bool IsFiniteNumber(float x) 
-{
-	return (x <= FLT_MAX && x >= -FLT_MAX); 
-} 
-
-
-static std::random_device rd;
-static std::mt19937 gen(rd());
-static std::uniform_real_distribution<> dis(0, 1);
-
-static float generateRandomNumber()
-{
-	float temp = (float)dis(gen);
-	return temp;
-}
-
-static float sign(float a) {
-	return a >= 0.0f ? 1.0f : -1.0f;
-} 
-
-static double serf(double x)
-{
-    // constants
-    double a1 =  0.254829592;
-    double a2 = -0.284496736;
-    double a3 =  1.421413741;
-    double a4 = -1.453152027;
-    double a5 =  1.061405429;
-    double p  =  0.3275911;
- 
-    // Save the sign of x
-    int sign = 1;
-    if (x < 0)
-        sign = -1;
-    x = fabs(x);
- 
-    // A&S formula 7.1.26
-    double t = 1.0/(1.0 + p*x);
-    double y = 1.0 - (((((a5*t + a4)*t) + a3)*t + a2)*t + a1)*t*exp(-x*x);
- 
-    return sign*y;
-}
-
-
-static float serfinv(float x)
-{
-float w, p;
-w = - logf((1.0f-x)*(1.0f+x));
-if ( w < 5.000000f ) {
-w = w - 2.500000f;
-p = 2.81022636e-08f;
-p = 3.43273939e-07f + p*w;
-p = -3.5233877e-06f + p*w;
-p = -4.39150654e-06f + p*w;
-p = 0.00021858087f + p*w;
-p = -0.00125372503f + p*w;
-p = -0.00417768164f + p*w;
-p = 0.246640727f + p*w;
-p = 1.50140941f + p*w;
-}
-else {
-w = sqrtf(w) - 3.000000f;
-p = -0.000200214257f;
-p = 0.000100950558f + p*w;
-p = 0.00134934322f + p*w;
-p = -0.00367342844f + p*w;
-p = 0.00573950773f + p*w;
-p = -0.0076224613f + p*w;
-p = 0.00943887047f + p*w;
-p = 1.00167406f + p*w;
-p = 2.83297682f + p*w;
-}
-return p*x;
-}
-
-
-
-#ifndef M_PI
-#define M_PI			3.14159265358979323846f	/* pi */
-#endif
-/* 
- * A method to compute the sgamma() function.
- *
- */  
-
-static double  abgam (double x)
-{
-  double  gam[10],
-          temp;
-
-  gam[0] = 1./ 12.;
-  gam[1] = 1./ 30.;
-  gam[2] = 53./ 210.;
-  gam[3] = 195./ 371.;
-  gam[4] = 22999./ 22737.;
-  gam[5] = 29944523./ 19733142.;
-  gam[6] = 109535241009./ 48264275462.;
-  temp = 0.5*log (2*M_PI) - x + (x - 0.5)*log (x)
-    + gam[0]/(x + gam[1]/(x + gam[2]/(x + gam[3]/(x + gam[4] /
-	  (x + gam[5]/(x + gam[6]/x))))));
-
-  return temp;
-}
-
-static double  sgamma (double x)
-{
-  double  result;
-  result = exp (abgam (x + 5))/(x*(x + 1)*(x + 2)*(x + 3)*(x + 4));
-  return result;
-}
+/************* MICROSURFACE HEIGHT DISTRIBUTION *************/
 
-static double  beta (double m, double n)
+const MicrosurfaceHeight* MicrosurfaceHeight::get(const bool height_uniform)
 {
-  return (sgamma (m)*sgamma (n)/sgamma (m + n));
+	static const MicrosurfaceHeightUniform uniform;
+	static const MicrosurfaceHeightGaussian gaussian;
+	if(height_uniform)
+		return &uniform;
+	return &gaussian;
 }
 
-
-/************* MICROSURFACE HEIGHT DISTRIBUTION *************/
-
 float MicrosurfaceHeightUniform::P1(const float h) const
 {
 	const float value = (h >= -1.0f && h <= 1.0f) ? 0.5f : 0.0f;
@@ -179,6 +63,15 @@ float MicrosurfaceHeightGaussian::invC1(const float U) const
 
 /************* MICROSURFACE SLOPE DISTRIBUTION *************/
 
+const MicrosurfaceSlope* MicrosurfaceSlope::get(const bool slope_beckmann)
+{
+	static const MicrosurfaceSlopeBeckmann beckmann;
+	static const MicrosurfaceSlopeGGX ggx;
+	if(slope_beckmann)
+		return &beckmann;
+	return &ggx;
+}
+
 float MicrosurfaceSlope::D(const Vector3f& wm, const float m_alpha_x, const float m_alpha_y) const {
 	if( wm.z <= 0.0f)
 		return 0.0f;
@@ -464,6 +357,35 @@ Vector2f MicrosurfaceSlopeGGX::sampleP22_11(const float theta_i, const float U,
 }
 
 
+/************* STATISTICS *************/
+
+STAT_INT_DISTRIBUTION("Microsurface/Scattering order of walks leaving", walkScatteringOrder);
+STAT_PERCENT("Microsurface/Walks leaving after one bounce", singleBounceWalks, walksLeft);
+STAT_PERCENT("Microsurface/Walks stopped by Russian roulette", rouletteWalks, walksStopped);
+STAT_PERCENT("Microsurface/Walks given up on a NaN", failedWalks, walksFinished);
+
+void microsurfaceWalkStats(const int scatteringOrder, const WalkOutcome outcome)
+{
+	++walksStopped;
+	++walksFinished;
+	switch(outcome)
+	{
+	case WalkOutcome::Left:
+		ReportValue(walkScatteringOrder, scatteringOrder);
+		++walksLeft;
+		if(scatteringOrder == 1)
+			++singleBounceWalks;
+		break;
+	case WalkOutcome::Roulette:
+		++rouletteWalks;
+		break;
+	case WalkOutcome::NaN:
+		++failedWalks;
+		break;
+	}
+}
+
+
 /************* MICROSURFACE *************/
 
 float Microsurface::G_1(const Vector3f& wi) const
@@ -498,6 +420,7 @@ float Microsurface::G_1(const Vector3f& wi, const float h0) const
 
 float Microsurface::sampleHeight(const Vector3f& wr, const float hr, const float U) const
 {
+	ProfilePhase p(Prof::MicrosurfaceHeight);
 	if(wr.z > 0.9999f)
 		return FLT_MAX;
 	if(wr.z < -0.9999f)
@@ -520,8 +443,10 @@ float Microsurface::sampleHeight(const Vector3f& wr, const float hr, const float
 	return h;
 }
 
-Vector3f Microsurface::sample(const Vector3f& wi, int& scatteringOrder) const
+Vector3f Microsurface::sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const
 {
+	weight = 1.0f;
+
 	// init
 	Vector3f wr = -wi;
 	float hr = 1.0f + m_microsurfaceheight->invC1(0.999f);
@@ -531,7 +456,7 @@ Vector3f Microsurface::sample(const Vector3f& wi, int& scatteringOrder) const
 	while(true)
 	{
 		// next height
-		float U = generateRandomNumber();
+		float U = random.UniformFloat();
 		hr = sampleHeight(wr, hr, U);
 
 		// leave the microsurface?
@@ -541,32 +466,39 @@ Vector3f Microsurface::sample(const Vector3f& wi, int& scatteringOrder) const
 			scatteringOrder++;
 
 		// next direction
-		wr = samplePhaseFunction(-wr);
+		wr = samplePhaseFunction(-wr, random);
 
-		// if NaN (should not happen, just in case)
-		if( (hr != hr) || (wr.z != wr.z) ) 
+		// if NaN (should not happen, just in case), or stopped by Russian roulette
+		if( (hr != hr) || (wr.z != wr.z) || !m_roulette.survive(scatteringOrder, weight, random.rng) )
+		{
+			microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+			weight = 0.0f;
 			return Vector3f(0,0,1);
+		}
 	}
 
+	microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
 	return wr;
 }
 
-float Microsurface::eval(const Vector3f& wi, const Vector3f& wo, const int scatteringOrder) const
+float Microsurface::eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder) const
 {
 	if(wo.z < 0)
 		return 0;
 	// init
+	MicrosurfaceRandom random(rng);
 	Vector3f wr = -wi;
 	float hr = 1.0f + m_microsurfaceheight->invC1(0.999f);
 
 	float sum = 0;
+	float throughput = 1.0f;
 	
 	// random walk
 	int current_scatteringOrder = 0;	
 	while(scatteringOrder==0 || current_scatteringOrder <= scatteringOrder)
 	{
 		// next height
-		float U = generateRandomNumber();
+		float U = rng.UniformFloat();
 		hr = sampleHeight(wr, hr, U);
 
 		// leave the microsurface?
@@ -576,30 +508,134 @@ float Microsurface::eval(const Vector3f& wi, const Vector3f& wo, const int scatt
 			current_scatteringOrder++;
 
 		// next event estimation
-		float phasefunction = evalPhaseFunction(-wr, wo);
+		float phasefunction = evalPhaseFunction(-wr, wo, rng);
 		float shadowing = G_1(wo, hr);
 		float I = phasefunction * shadowing;
 
 		if ( IsFiniteNumber(I) && (scatteringOrder==0 || current_scatteringOrder==scatteringOrder) )
-			sum += I;
+			sum += throughput * I;
 		
 		// next direction
-		wr = samplePhaseFunction(-wr);
+		wr = samplePhaseFunction(-wr, random);
 			
 		// if NaN (should not happen, just in case)
-		if( (hr != hr) || (wr.z != wr.z) ) 
+		if( (hr != hr) || (wr.z != wr.z) )
+		{
+			microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::NaN);
 			return 0.0f;
+		}
+
+		// Russian roulette
+		if( !m_roulette.survive(current_scatteringOrder, throughput, rng) )
+		{
+			microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Roulette);
+			return sum;
+		}
 	}
 
+	microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Left);
 	return sum;
 }
 
-void Microsurface::refresh_alpha(float alphau, float alphav) {
-	m_alphau = alphau;
-	m_alphav = alphav;
+Spectrum Microsurface::evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+{
+	if(wo.z < 0)
+		return Spectrum(0.0f);
+	// init
+	MicrosurfaceRandom random(rng);
+	Vector3f wr = -wi;
+	float hr = 1.0f + m_microsurfaceheight->invC1(0.999f);
+
+	Spectrum sum(0.0f);
+	Spectrum throughput(1.0f);
+
+	// random walk
+	int scatteringOrder = 0;
+	while(true)
+	{
+		// next height
+		float U = rng.UniformFloat();
+		hr = sampleHeight(wr, hr, U);
+
+		// leave the microsurface?
+		if( hr == FLT_MAX )
+			break;
+		else
+			scatteringOrder++;
+
+		// next event estimation, through the reflectance towards wo
+		float phasefunction = evalPhaseFunction(-wr, wo, rng);
+		float shadowing = G_1(wo, hr);
+		float I = phasefunction * shadowing;
+
+		if ( IsFiniteNumber(I) )
+			sum += throughput * scatteringWeight(-wr, wo) * I;
+
+		// next direction, and the reflectance along it
+		const Vector3f wnext = samplePhaseFunction(-wr, random);
+		throughput *= scatteringWeight(-wr, wnext);
+		wr = wnext;
+
+		// if NaN (should not happen, just in case)
+		if( (hr != hr) || (wr.z != wr.z) )
+		{
+			microsurfaceWalkStats(scatteringOrder, WalkOutcome::NaN);
+			return Spectrum(0.0f);
+		}
+
+		// Russian roulette
+		if( !m_roulette.survive(scatteringOrder, throughput, rng) )
+		{
+			microsurfaceWalkStats(scatteringOrder, WalkOutcome::Roulette);
+			return sum;
+		}
+	}
+
+	microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+	return sum;
 }
 
-float MicrosurfaceConductor::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const
+Vector3f Microsurface::sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const
+{
+	weight = Spectrum(1.0f);
+
+	// init
+	Vector3f wr = -wi;
+	float hr = 1.0f + m_microsurfaceheight->invC1(0.999f);
+
+	// random walk
+	scatteringOrder = 0;
+	while(true)
+	{
+		// next height
+		float U = random.UniformFloat();
+		hr = sampleHeight(wr, hr, U);
+
+		// leave the microsurface?
+		if( hr == FLT_MAX )
+			break;
+		else
+			scatteringOrder++;
+
+		// next direction, and the reflectance along it
+		const Vector3f wnext = samplePhaseFunction(-wr, random);
+		weight *= scatteringWeight(-wr, wnext);
+		wr = wnext;
+
+		// if NaN (should not happen, just in case), or stopped by Russian roulette
+		if( (hr != hr) || (wr.z != wr.z) || !m_roulette.survive(scatteringOrder, weight, random.rng) )
+		{
+			microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+			weight = Spectrum(0.0f);
+			return Vector3f(0,0,1);
+		}
+	}
+
+	microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+	return wr;
+}
+
+float MicrosurfaceConductor::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
 	// half vector 
 	const Vector3f wh = Normalize(wi+wo);
@@ -611,10 +647,11 @@ float MicrosurfaceConductor::evalPhaseFunction(const Vector3f& wi, const Vector3
 	return value;
 }
 
-Vector3f MicrosurfaceConductor::samplePhaseFunction(const Vector3f& wi) const
+Vector3f MicrosurfaceConductor::samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
 {
-	const float U1 = generateRandomNumber();
-	const float U2 = generateRandomNumber();
+	ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+	const float U1 = random.UniformFloat();
+	const float U2 = random.UniformFloat();
 
 	Vector3f wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
 
@@ -624,8 +661,19 @@ Vector3f MicrosurfaceConductor::samplePhaseFunction(const Vector3f& wi) const
 	return wo;
 }
 
-float MicrosurfaceConductor::evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const
+Spectrum MicrosurfaceConductor::scatteringWeight(const Vector3f& wi, const Vector3f& wo) const
+{
+	if(m_eta.IsBlack() && m_k.IsBlack())
+		return Spectrum(1.0f);
+
+	// the mirror reflection from wi to wo is off the half vector
+	const Vector3f wh = Normalize(wi+wo);
+	return FrConductor(std::abs(Dot(wi, wh)), Spectrum(1.0f), m_eta, m_k);
+}
+
+float MicrosurfaceConductor::evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
+	ProfilePhase p(Prof::MicrosurfaceSingleScattering);
 	// half-vector
 	const Vector3f wh = Normalize(wi+wo);
 	const float D = m_microsurfaceslope->D(wh, m_alphau, m_alphav);
@@ -667,7 +715,7 @@ float MicrosurfaceDielectric::Fresnel(const Vector3f& wi, const Vector3f& wm, co
 }
 
 // wrapper (only for the API and testing)
-float MicrosurfaceDielectric::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const
+float MicrosurfaceDielectric::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
 	return evalPhaseFunction(wi, wo, true, true) + evalPhaseFunction(wi, wo, true, false);
 }
@@ -711,16 +759,17 @@ float MicrosurfaceDielectric::evalPhaseFunction(const Vector3f& wi, const Vector
 	}
 }
 
-Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi) const
+Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
 {
 	bool wo_outside;
-	return samplePhaseFunction(wi, true, wo_outside);
+	return samplePhaseFunction(wi, random, true, wo_outside);
 }
 
-Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi, const bool wi_outside, bool& wo_outside) const
+Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random, const bool wi_outside, bool& wo_outside) const
 {
-	const float U1 = generateRandomNumber();
-	const float U2 = generateRandomNumber();
+	ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+	const float U1 = random.UniformFloat();
+	const float U2 = random.UniformFloat();
 
 	const float eta = wi_outside ? m_eta : 1.0f / m_eta;
 
@@ -729,7 +778,7 @@ Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi, const b
 
 	const float F = Fresnel(wi, wm, eta);
 
-	if( generateRandomNumber() < F )
+	if( random.UniformFloat() < F )
 	{
 		const Vector3f wo = -wi + 2.0f * wm * Dot(wi, wm); // reflect
 		return wo;
@@ -742,8 +791,9 @@ Vector3f MicrosurfaceDielectric::samplePhaseFunction(const Vector3f& wi, const b
 	}
 }
 
-float MicrosurfaceDielectric::evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const
+float MicrosurfaceDielectric::evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
+	ProfilePhase p(Prof::MicrosurfaceSingleScattering);
 	if(wi.z < 0 && wo.z < 0)
 		return 0.0f;
 	bool wi_outside = true;
@@ -793,9 +843,10 @@ float MicrosurfaceDielectric::evalSingleScattering(const Vector3f& wi, const Vec
 	}
 }
 
-float MicrosurfaceDielectric::eval(const Vector3f& wi, const Vector3f& wo, const int scatteringOrder) const
+float MicrosurfaceDielectric::eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder) const
 {
 	// init
+	MicrosurfaceRandom random(rng);
 	Vector3f wr = -wi;
 	bool outside = wi.z > 0;
 	float hr = 1.0f + m_microsurfaceheight->invC1(0.999f);
@@ -803,13 +854,14 @@ float MicrosurfaceDielectric::eval(const Vector3f& wi, const Vector3f& wo, const
 	hr = outside ? hr : -hr;
 
 	float sum = 0.0f;
+	float throughput = 1.0f;
 	
 	// random walk
 	int current_scatteringOrder = 0;	
 	while(scatteringOrder==0 || current_scatteringOrder <= scatteringOrder)
 	{
 		// next height
-		float U = generateRandomNumber();		
+		float U = rng.UniformFloat();		
 		hr = (outside) ? sampleHeight(wr, hr, U) : -sampleHeight(-wr, -hr, U);
 
 		// leave the microsurface?
@@ -824,21 +876,47 @@ float MicrosurfaceDielectric::eval(const Vector3f& wi, const Vector3f& wo, const
 		float I = phasefunction * shadowing;
 
 		if ( IsFiniteNumber(I) && (scatteringOrder==0 || current_scatteringOrder==scatteringOrder) )
-			sum += I;
+			sum += throughput * I;
 		
 		// next direction
-		wr = samplePhaseFunction(-wr, outside, outside);
+		wr = samplePhaseFunction(-wr, random, outside, outside);
 
 		// if NaN (should not happen, just in case)
-		if( (hr != hr) || (wr.z != wr.z) ) 
+		if( (hr != hr) || (wr.z != wr.z) )
+		{
+			microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::NaN);
 			return 0.0f;
+		}
+
+		// Russian roulette
+		if( !m_roulette.survive(current_scatteringOrder, throughput, rng) )
+		{
+			microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Roulette);
+			return sum;
+		}
 	}
 
+	microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Left);
 	return sum;
 }
 
-Vector3f MicrosurfaceDielectric::sample(const Vector3f& wi, int& scatteringOrder) const
+Spectrum MicrosurfaceDielectric::evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+{
+	return Spectrum(eval(wi, wo, rng));
+}
+
+Vector3f MicrosurfaceDielectric::sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const
 {
+	float grey;
+	const Vector3f wo = sample(wi, random, scatteringOrder, grey);
+	weight = Spectrum(grey);
+	return wo;
+}
+
+Vector3f MicrosurfaceDielectric::sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const
+{
+	weight = 1.0f;
+
 	// init
 	Vector3f wr = -wi;
 	bool outside = wi.z > 0;
@@ -851,7 +929,7 @@ Vector3f MicrosurfaceDielectric::sample(const Vector3f& wi, int& scatteringOrder
 	while(true)
 	{
 		// next height
-		float U = generateRandomNumber();
+		float U = random.UniformFloat();
 		hr = (outside) ? sampleHeight(wr, hr, U) : -sampleHeight(-wr, -hr, U);
 
 		// leave the microsurface?
@@ -861,21 +939,26 @@ Vector3f MicrosurfaceDielectric::sample(const Vector3f& wi, int& scatteringOrder
 			scatteringOrder++;
 
 		// next direction
-		Vector3f wr_temp = samplePhaseFunction(-wr, outside, outside);
+		Vector3f wr_temp = samplePhaseFunction(-wr, random, outside, outside);
 		wr = wr_temp;		
 
-		// if NaN (should not happen, just in case)
-		if( (hr != hr) || (wr.z != wr.z) ) 
+		// if NaN (should not happen, just in case), or stopped by Russian roulette
+		if( (hr != hr) || (wr.z != wr.z) || !m_roulette.survive(scatteringOrder, weight, random.rng) )
+		{
+			microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+			weight = 0.0f;
 			return Vector3f(0,0,1);
+		}
 	}
 
+	microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
 	return wr;
 }
 
-float MicrosurfaceDiffuse::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const
+float MicrosurfaceDiffuse::evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
-	const float U1 = generateRandomNumber();
-	const float U2 = generateRandomNumber();
+	const float U1 = rng.UniformFloat();
+	const float U2 = rng.UniformFloat();
 	Vector3f wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
 	
 	// value
@@ -899,12 +982,13 @@ float MicrosurfaceDiffuse::evalPhaseFunction(const Vector3f& wi, const Vector3f&
 }
 
 
-Vector3f MicrosurfaceDiffuse::samplePhaseFunction(const Vector3f& wi) const
+Vector3f MicrosurfaceDiffuse::samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
 {
-	const float U1 = generateRandomNumber();
-	const float U2 = generateRandomNumber();
-	const float U3 = generateRandomNumber();
-	const float U4 = generateRandomNumber();
+	ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+	const float U1 = random.UniformFloat();
+	const float U2 = random.UniformFloat();
+	const float U3 = random.UniformFloat();
+	const float U4 = random.UniformFloat();
 
 	Vector3f wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
 
@@ -938,11 +1022,12 @@ Vector3f MicrosurfaceDiffuse::samplePhaseFunction(const Vector3f& wi) const
 // stochastic evaluation  
 // Heitz and Dupuy 2015
 // Implementing a Simple Anisotropic Rough Diffuse Material with Stochastic Evaluation
-float MicrosurfaceDiffuse::evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const
+float MicrosurfaceDiffuse::evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
 {
+	ProfilePhase p(Prof::MicrosurfaceSingleScattering);
 	// sample visible microfacet
-	const float U1 = generateRandomNumber();
-	const float U2 = generateRandomNumber();
+	const float U1 = rng.UniformFloat();
+	const float U2 = rng.UniformFloat();
 	const Vector3f wm = m_microsurfaceslope->sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
 
 	// shadowing given masking
@@ -3,6 +3,10 @@
 
 #include "pbrt.h"
 #include "geometry.h"
+#include "rng.h"
+#include "spectrum.h"
+#include "stats.h"
+#include "MicrosurfaceSIMD.h"
 using namespace pbrt;
 
 
@@ -12,12 +16,19 @@ using namespace pbrt;
 class MicrosurfaceHeight
 {
 public:
+	// shared, immutable instance of the uniform or Gaussian distribution
+	static const MicrosurfaceHeight* get(const bool height_uniform);
+
 	// height PDF	
 	virtual float P1(const float h) const=0; 
 	// height CDF	
 	virtual float C1(const float h) const=0; 
 	// inverse of the height CDF
 	virtual float invC1(const float U) const=0; 
+
+	// batched versions, one height per SIMD lane
+	virtual simd::vfloat C1(const simd::vfloat& h) const=0;
+	virtual simd::vfloat invC1(const simd::vfloat& U) const=0;
 };
 
 /* Uniform height distribution in [-1, 1] */
@@ -30,6 +41,10 @@ public:
 	virtual float C1(const float h) const; 
 	// inverse of the height CDF
 	virtual float invC1(const float U) const; 
+
+	// batched versions
+	virtual simd::vfloat C1(const simd::vfloat& h) const;
+	virtual simd::vfloat invC1(const simd::vfloat& U) const;
 };
 
 /* Gaussian height distribution N(0,1) */
@@ -42,6 +57,10 @@ public:
 	virtual float C1(const float h) const; 
 	// inverse of the height CDF
 	virtual float invC1(const float U) const; 
+
+	// batched versions
+	virtual simd::vfloat C1(const simd::vfloat& h) const;
+	virtual simd::vfloat invC1(const simd::vfloat& U) const;
 };
 
 
@@ -54,6 +73,9 @@ public:
 	MicrosurfaceSlope()
 	{}
 
+	// shared, immutable instance of the Beckmann or GGX distribution
+	static const MicrosurfaceSlope* get(const bool slope_beckmann);
+
 public:
 	// roughness
 	// projected roughness in wi
@@ -67,6 +89,11 @@ public:
 	// sample the VNDF
 	Vector3f sampleD_wi(const Vector3f& wi, const float U1, const float U2, const float m_alpha_x, const float m_alpha_y) const;
 
+	// batched versions, one direction per SIMD lane
+	simd::vfloat D(const simd::Vector3v& wm, const float m_alpha_x, const float m_alpha_y) const; 
+	simd::vfloat D_wi(const simd::Vector3v& wi, const simd::Vector3v& wm, const float m_alpha_x, const float m_alpha_y) const; 
+	simd::Vector3v sampleD_wi(const simd::Vector3v& wi, const simd::vfloat& U1, const simd::vfloat& U2, const float m_alpha_x, const float m_alpha_y) const;
+
 public:
 	// distribution of slopes
 	virtual float P22(const float slope_x, const float slope_y, const float m_alpha_x, const float m_alpha_y) const=0; 
@@ -76,6 +103,12 @@ public:
 	virtual float projectedArea(const Vector3f& wi, const float alpha_u, const float alpha_v) const=0;
 	// sample the distribution of visible slopes with alpha=1.0
 	virtual Vector2f sampleP22_11(const float theta_i, const float U1, const float U2) const=0;
+
+	// batched versions; sampleP22_11 takes cos(theta_i)
+	virtual simd::vfloat P22(const simd::vfloat& slope_x, const simd::vfloat& slope_y, const float m_alpha_x, const float m_alpha_y) const=0; 
+	virtual simd::vfloat Lambda(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const=0;
+	virtual simd::vfloat projectedArea(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const=0;
+	virtual simd::Vector2v sampleP22_11(const simd::vfloat& cos_theta_i, const simd::vfloat& U1, const simd::vfloat& U2) const=0;
 };
 
 /* Beckmann slope distribution */
@@ -93,6 +126,12 @@ public:
 	virtual float projectedArea(const Vector3f& wi, const float alpha_u, const float alpha_v) const;
 	// sample the distribution of visible slopes with alpha=1.0
 	virtual Vector2f sampleP22_11(const float theta_i, const float U1, const float U2) const;
+
+	// batched versions
+	virtual simd::vfloat P22(const simd::vfloat& slope_x, const simd::vfloat& slope_y, const float m_alpha_x, const float m_alpha_y) const; 
+	virtual simd::vfloat Lambda(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const;
+	virtual simd::vfloat projectedArea(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const;
+	virtual simd::Vector2v sampleP22_11(const simd::vfloat& cos_theta_i, const simd::vfloat& U1, const simd::vfloat& U2) const;
 };
 
 /* GGX slope distribution */
@@ -110,12 +149,122 @@ public:
 	virtual float projectedArea(const Vector3f& wi, const float alpha_u, const float alpha_v) const;
 	// sample the distribution of visible slopes with alpha=1.0
 	virtual Vector2f sampleP22_11(const float theta_i, const float U1, const float U2) const;
+
+	// batched versions
+	virtual simd::vfloat P22(const simd::vfloat& slope_x, const simd::vfloat& slope_y, const float m_alpha_x, const float m_alpha_y) const; 
+	virtual simd::vfloat Lambda(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const;
+	virtual simd::vfloat projectedArea(const simd::Vector3v& wi, const float alpha_u, const float alpha_v) const;
+	virtual simd::Vector2v sampleP22_11(const simd::vfloat& cos_theta_i, const simd::vfloat& U1, const simd::vfloat& U2) const;
+};
+
+
+/************* RUSSIAN ROULETTE *************/
+
+/* Once a walk has scattered order times, it continues with probability
+   min(continuation, throughput), throughput being its largest channel, and
+   the walks that continue are divided by that probability; estimates stay
+   unbiased, walks whose throughput has faded stop early and the remaining
+   long walks are cut short. No random number is drawn when the walk
+   continues for sure, so disabled roulette leaves the walks unchanged. */
+struct MicrosurfaceRoulette
+{
+	MicrosurfaceRoulette(const int order = 0, const float continuation = 1.0f)
+		: order(order), continuation(continuation)
+	{}
+
+	// scattering order from which walks may stop; 0 disables the roulette
+	int order;
+	// largest continuation probability
+	float continuation;
+
+	// does a walk continue after its scatteringOrder-th event?
+	bool survive(const int scatteringOrder, float& throughput, RNG& rng) const
+	{
+		if(order <= 0 || scatteringOrder < order)
+			return true;
+		const float q = std::min(continuation, throughput);
+		if(q >= 1.0f)
+			return true;
+		if(rng.UniformFloat() >= q)
+			return false;
+		throughput /= q;
+		return true;
+	}
+	bool survive(const int scatteringOrder, Spectrum& throughput, RNG& rng) const
+	{
+		float q = throughput.MaxComponentValue();
+		const float scale = q;
+		if(!survive(scatteringOrder, q, rng))
+			return false;
+		if(q != scale)
+			throughput *= q / scale;
+		return true;
+	}
+	// batched version, one walk per lane; clears the lanes of active that stop
+	void survive(const int scatteringOrder, simd::vfloat& throughput, RNG& rng, simd::vmask& active) const
+	{
+		if(order <= 0 || scatteringOrder < order)
+			return;
+		const simd::vfloat q = simd::min(simd::vfloat(continuation), throughput);
+		const simd::vmask draw = active & (q < simd::vfloat(1.0f));
+		if(!simd::any(draw))
+			return;
+		const simd::vmask stop = draw & (simd::uniform(rng, draw) >= q);
+		throughput = simd::select(simd::andnot(draw, stop), throughput / q, throughput);
+		active = simd::andnot(active, stop);
+	}
+};
+
+
+/************* RANDOM NUMBERS *************/
+
+/* Random numbers of a sampled walk. The first n ones can be prescribed, e.g.
+   by the stratified or low-discrepancy sampler of the renderer, so that the
+   first bounces of the walks are well distributed; the others are drawn from
+   rng. A walk draws, for each bounce, a height and then the random numbers
+   of its phase function (Microsurface::phaseFunctionDimensions()). Russian
+   roulette draws directly from rng. */
+class MicrosurfaceRandom
+{
+public:
+	MicrosurfaceRandom(RNG& rng, const float* U = nullptr, const int n = 0)
+		: rng(rng), m_U(U), m_n(n), m_next(0)
+	{}
+
+	float UniformFloat()
+	{
+		return (m_next < m_n) ? m_U[m_next++] : rng.UniformFloat();
+	}
+
+	RNG& rng;
+
+private:
+	const float* m_U;
+	const int m_n;
+	int m_next;
 };
 
 
+/************* STATISTICS *************/
+
+/* How a walk finished: leaving the microsurface, stopped by Russian roulette
+   or given up on a NaN */
+enum class WalkOutcome { Left, Roulette, NaN };
+
+/* Records a finished walk in pbrt's statistics: how it finished and, for the
+   walks that left, their scattering order and whether they left after the
+   first bounce. Heights, phase functions and single scattering are timed by
+   the profiler under Prof::MicrosurfaceHeight, MicrosurfacePhaseSampling and
+   MicrosurfaceSingleScattering, and batched walks as a whole under
+   MicrosurfaceBatchedWalks. */
+void microsurfaceWalkStats(const int scatteringOrder, const WalkOutcome outcome);
+
+
 /************* MICROSURFACE *************/
 
 /* API */
+/* A microsurface only stores its roughness and points to shared height and
+   slope distributions, so it is cheap to create one per shading point. */
 class Microsurface 
 {
 public:
@@ -123,35 +272,59 @@ public:
 	const MicrosurfaceHeight* m_microsurfaceheight; 
 	// slope distribution
 	const MicrosurfaceSlope* m_microsurfaceslope; 
+	// termination of the walks, disabled by default
+	const MicrosurfaceRoulette m_roulette;
 
 public:
 
 	Microsurface(const bool height_uniform, // uniform or Gaussian height distribution
-				const bool slope_beckmann) : // Beckmann or GGX slope distribution  
-		m_microsurfaceheight((height_uniform) ? 
-		  static_cast<MicrosurfaceHeight*>(new MicrosurfaceHeightUniform) 
-		: static_cast<MicrosurfaceHeight*>(new MicrosurfaceHeightGaussian)),
-		m_microsurfaceslope((slope_beckmann) ? 
-		  static_cast<MicrosurfaceSlope*>(new MicrosurfaceSlopeBeckmann()) 
-		: static_cast<MicrosurfaceSlope*>(new MicrosurfaceSlopeGGX()))
+				const bool slope_beckmann, // Beckmann or GGX slope distribution
+				const float alpha_x,
+				const float alpha_y,
+				const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette()) :
+		m_microsurfaceheight(MicrosurfaceHeight::get(height_uniform)),
+		m_microsurfaceslope(MicrosurfaceSlope::get(slope_beckmann)),
+		m_roulette(roulette),
+		m_alphau(alpha_x),
+		m_alphav(alpha_y)
 	{}
-		
-	~Microsurface() 
-	{
-		delete m_microsurfaceheight; 
-		delete m_microsurfaceslope;
-	}
 
 	// evaluate BSDF with a random walk (stochastic but unbiased)
 	// scatteringOrder=0 --> contribution from all scattering events
 	// scatteringOrder=1 --> contribution from 1st bounce only
 	// scatteringOrder=2 --> contribution from 2nd bounce only, etc..
-	virtual float eval(const Vector3f& wi, const Vector3f& wo, const int scatteringOrder=0) const; 
+	// all random numbers of the walk are drawn from the caller-owned rng
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder=0) const; 
 
 	// sample BSDF with a random walk
 	// scatteringOrder is set to the number of bounces computed for this sample
-	virtual Vector3f sample(const Vector3f& wi, int& scatteringOrder) const;
-	Vector3f sample(const Vector3f& wi) const {int scatteringOrder; return sample(wi, scatteringOrder);}
+	// weight is set to the throughput of the walk, i.e. BSDF * cos / pdf
+	// (1 for these lossless microsurfaces, 0 if the walk failed)
+	// the random numbers of the walk come from random (see MicrosurfaceRandom)
+	virtual Vector3f sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const;
+	Vector3f sample(const Vector3f& wi, RNG& rng, int& scatteringOrder, float& weight) const {MicrosurfaceRandom random(rng); return sample(wi, random, scatteringOrder, weight);}
+	Vector3f sample(const Vector3f& wi, RNG& rng, int& scatteringOrder) const {float weight; return sample(wi, rng, scatteringOrder, weight);}
+	Vector3f sample(const Vector3f& wi, RNG& rng) const {int scatteringOrder; return sample(wi, rng, scatteringOrder);}
+
+	// evaluate BSDF as the average of nWalks random walks (all scattering
+	// orders), advanced together in SIMD lanes
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, const int nWalks, RNG& rng) const;
+
+	// evaluate BSDF with a random walk whose throughput carries the spectral
+	// reflectance of its scattering events (see scatteringWeight()); all
+	// channels share the walk, which draws the same random numbers as eval()
+	virtual Spectrum evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const;
+	// sample BSDF with a random walk; weight is set to its spectral throughput
+	virtual Vector3f sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const;
+	Vector3f sampleSpectrum(const Vector3f& wi, RNG& rng, int& scatteringOrder, Spectrum& weight) const {MicrosurfaceRandom random(rng); return sampleSpectrum(wi, random, scatteringOrder, weight);}
+
+	// whether walks may leave the microsurface below it
+	virtual bool transmits() const { return false; }
+
+public:
+	// roughness
+	float alpha_u() const { return m_alphau; }
+	float alpha_v() const { return m_alphav; }
 
 public:
 	// masking function
@@ -161,42 +334,69 @@ public:
 	// sample height in outgoing direction
 	float sampleHeight(const Vector3f& wo, const float h0, const float U) const;
 
+	// batched versions, one walk per SIMD lane
+	simd::vfloat G_1(const simd::Vector3v& wi, const simd::vfloat& h0) const;
+	simd::vfloat sampleHeight(const simd::Vector3v& wo, const simd::vfloat& h0, const simd::vfloat& U) const;
+
 public:
 	// evaluate local phase function 
-	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const=0;
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const=0;
 	// sample local phase function
-	virtual Vector3f samplePhaseFunction(const Vector3f& wi) const=0; 
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const=0; 
+	// number of random numbers drawn by samplePhaseFunction()
+	virtual int phaseFunctionDimensions() const { return 2; }
+
+	// batched versions; random numbers are only drawn for active lanes
+	virtual simd::vfloat evalPhaseFunction(const simd::Vector3v& wi, const Vector3f& wo, RNG& rng, const simd::vmask& active) const=0;
+	virtual simd::Vector3v samplePhaseFunction(const simd::Vector3v& wi, RNG& rng, const simd::vmask& active) const=0; 
+
+	// spectral reflectance of a scattering event from wi into wo, which the
+	// phase functions leave out; white for the lossless microsurfaces
+	virtual Spectrum scatteringWeight(const Vector3f& wi, const Vector3f& wo) const { return Spectrum(1.0f); }
 
 	// evaluate BSDF limited to single scattering 
 	// this is in average equivalent to eval(wi, wo, 1);
-	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const=0;
-
-public:
-	void refresh_alpha(float alphau, float alphav);
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const=0;
 
 protected:
-	float m_alphau, m_alphav;
+	const float m_alphau, m_alphav;
 };
 
 /* Microsurface made of conductor material */
 class MicrosurfaceConductor : public Microsurface
 {
+public:
+	// complex index of refraction; zero for a perfect mirror
+	const Spectrum m_eta, m_k;
 public:
 	MicrosurfaceConductor(const bool height_uniform, // uniform or Gaussian
-				 const bool slope_beckmann // Beckmann or GGX
-)
-		: Microsurface(height_uniform, slope_beckmann)
+				 const bool slope_beckmann, // Beckmann or GGX
+				 const float alpha_x,
+				 const float alpha_y,
+				 const Spectrum& eta = Spectrum(0.0f),
+				 const Spectrum& k = Spectrum(0.0f),
+				 const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: Microsurface(height_uniform, slope_beckmann, alpha_x, alpha_y, roulette),
+		m_eta(eta),
+		m_k(k)
 	{}
 
 public:
 	// evaluate local phase function 
-	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const;
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const;
 	// sample local phase function
-	virtual Vector3f samplePhaseFunction(const Vector3f& wi) const; 
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const; 
+
+	// batched versions
+	virtual simd::vfloat evalPhaseFunction(const simd::Vector3v& wi, const Vector3f& wo, RNG& rng, const simd::vmask& active) const;
+	virtual simd::Vector3v samplePhaseFunction(const simd::Vector3v& wi, RNG& rng, const simd::vmask& active) const; 
+
+	// Fresnel reflectance of the microfacet between wi and wo
+	virtual Spectrum scatteringWeight(const Vector3f& wi, const Vector3f& wo) const;
 
 	// evaluate BSDF limited to single scattering 
 	// this is in average equivalent to eval(wi, wo, 1);
-	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const; 
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const; 
 };
 
 /* Microsurface made of conductor material */
@@ -207,8 +407,11 @@ public:
 public:
 	MicrosurfaceDielectric(const bool height_uniform, // uniform or Gaussian
 				 const bool slope_beckmann, // Beckmann or GGX
-				 const float eta = 1.5f)
-		: Microsurface(height_uniform, slope_beckmann),
+				 const float alpha_x,
+				 const float alpha_y,
+				 const float eta = 1.5f,
+				 const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: Microsurface(height_uniform, slope_beckmann, alpha_x, alpha_y, roulette),
 		m_eta(eta)
 	{}
 
@@ -216,48 +419,83 @@ public:
 	// scatteringOrder=0 --> contribution from all scattering events
 	// scatteringOrder=1 --> contribution from 1st bounce only
 	// scatteringOrder=2 --> contribution from 2nd bounce only, etc..
-	virtual float eval(const Vector3f& wi, const Vector3f& wo, const int scatteringOrder=0) const; 
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder=0) const; 
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, const int nWalks, RNG& rng) const;
 
 	// sample final BSDF with a random walk
 	// scatteringOrder is set to the number of bounces computed for this sample
-	virtual Vector3f sample(const Vector3f& wi, int& scatteringOrder) const;
+	using Microsurface::sample;
+	virtual Vector3f sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const;
+
+	// the walk itself depends on the Fresnel terms, so a dielectric is grey
+	virtual Spectrum evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const;
+	using Microsurface::sampleSpectrum;
+	virtual Vector3f sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const;
+
+	virtual bool transmits() const { return true; }
 
 public:
 	// evaluate local phase function 
-	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const;
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const;
 	float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, const bool wi_outside, const bool wo_outside) const;
 	// sample local phase function
-	virtual Vector3f samplePhaseFunction(const Vector3f& wi) const; 
-	Vector3f samplePhaseFunction(const Vector3f& wi, const bool wi_outside, bool& wo_outside) const; 
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const; 
+	Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random, const bool wi_outside, bool& wo_outside) const; 
+	// VNDF, then the choice between reflection and refraction
+	virtual int phaseFunctionDimensions() const { return 3; }
+
+	// batched versions; outside is updated in active lanes
+	virtual simd::vfloat evalPhaseFunction(const simd::Vector3v& wi, const Vector3f& wo, RNG& rng, const simd::vmask& active) const;
+	simd::vfloat evalPhaseFunction(const simd::Vector3v& wi, const Vector3f& wo, const simd::vmask& wi_outside, const bool wo_outside) const;
+	virtual simd::Vector3v samplePhaseFunction(const simd::Vector3v& wi, RNG& rng, const simd::vmask& active) const; 
+	simd::Vector3v samplePhaseFunction(const simd::Vector3v& wi, RNG& rng, const simd::vmask& active, simd::vmask& outside) const; 
 
 	// evaluate BSDF limited to single scattering 
 	// this is in average equivalent to eval(wi, wo, 1);
-	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const; 
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const; 
 
 protected:
 	float Fresnel(const Vector3f& wi, const Vector3f& wm, const float eta) const;
 	Vector3f refract(const Vector3f &wi, const Vector3f &wm, const float eta) const;
+	simd::vfloat Fresnel(const simd::Vector3v& wi, const simd::Vector3v& wm, const simd::vfloat& eta) const;
+	simd::Vector3v refract(const simd::Vector3v &wi, const simd::Vector3v &wm, const simd::vfloat& eta) const;
 };
 
 /* Microsurface made of conductor material */
 class MicrosurfaceDiffuse : public Microsurface
 {
+public:
+	// albedo of the Lambertian microfacets
+	const Spectrum m_albedo;
 public:
 	MicrosurfaceDiffuse(const bool height_uniform, // uniform or Gaussian
-				 const bool slope_beckmann // Beckmann or GGX
-)
-		: Microsurface(height_uniform, slope_beckmann)
+				 const bool slope_beckmann, // Beckmann or GGX
+				 const float alpha_x,
+				 const float alpha_y,
+				 const Spectrum& albedo = Spectrum(1.0f),
+				 const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: Microsurface(height_uniform, slope_beckmann, alpha_x, alpha_y, roulette),
+		m_albedo(albedo)
 	{}
 
 public:
 	// evaluate local phase function 
-	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo) const;
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const;
 	// sample local phase function
-	virtual Vector3f samplePhaseFunction(const Vector3f& wi) const; 
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const; 
+	// VNDF, then the cosine lobe of the microfacet
+	virtual int phaseFunctionDimensions() const { return 4; }
+
+	// batched versions
+	virtual simd::vfloat evalPhaseFunction(const simd::Vector3v& wi, const Vector3f& wo, RNG& rng, const simd::vmask& active) const;
+	virtual simd::Vector3v samplePhaseFunction(const simd::Vector3v& wi, RNG& rng, const simd::vmask& active) const; 
+
+	// albedo of the microfacets
+	virtual Spectrum scatteringWeight(const Vector3f& wi, const Vector3f& wo) const { return m_albedo; }
 
 	// evaluate BSDF limited to single scattering 
 	// this is in average equivalent to eval(wi, wo, 1);
-	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo) const; 
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const; 
 };
 
 
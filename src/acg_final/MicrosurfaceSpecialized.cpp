@@ -0,0 +1,142 @@
+#include "MicrosurfaceSpecialized.h"
+
+#include <cmath>
+
+
+/************* BECKMANN VISIBLE SLOPES *************/
+
+const BeckmannVisibleSlopeTable& BeckmannVisibleSlopeTable::get()
+{
+	static const BeckmannVisibleSlopeTable table;
+	return table;
+}
+
+BeckmannVisibleSlopeTable::BeckmannVisibleSlopeTable()
+	: m_data(nCos * nU)
+{
+	for(int i = 0; i < nCos; ++i)
+	{
+		const double w = std::sqrt(1.0 - cosMin()) * i / (nCos-1);
+		const double cos_theta_i = 1.0 - w*w;
+		const double sin_theta_i = std::sqrt(std::max(0.0, 1.0 - cos_theta_i*cos_theta_i));
+		for(int j = 0; j < nU; ++j)
+		{
+			const double r = 1.0 - (double)j / (nU-1);
+			const double U = 1.0 - r*r;
+			float& v = m_data[i*nU + j];
+
+			// normal incidence: erf(slope_x) is uniform
+			if(sin_theta_i == 0.0 || U == 0.0 || U == 1.0)
+			{
+				v = (float)U;
+				continue;
+			}
+
+			// bisection on the CDF of sampleP22_11(), in double precision
+			const double slope_i = cos_theta_i / sin_theta_i;
+			const double projectedarea = 0.5*(std::erf(slope_i) + 1.0)*cos_theta_i + INV_2_SQRT_M_PI * sin_theta_i * std::exp(-slope_i*slope_i);
+			double lo = std::min(-12.0, slope_i - 12.0), hi = slope_i;
+			for(int k = 0; k < 64; ++k)
+			{
+				const double slope = 0.5 * (lo + hi);
+				const double CDF = (INV_2_SQRT_M_PI*sin_theta_i*std::exp(-slope*slope) + cos_theta_i*(0.5+0.5*std::erf(slope))) / projectedarea;
+				if(CDF < U)
+					lo = slope;
+				else
+					hi = slope;
+			}
+			v = (float)((std::erf(0.5 * (lo + hi)) + 1.0) / (std::erf(slope_i) + 1.0));
+		}
+	}
+}
+
+
+/************* SELECTION *************/
+
+template<class Height, class Slope>
+static Microsurface* allocateConductor(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette)
+{
+	typedef MicrosurfaceSpecialized<Height, Slope, MicrosurfaceConductor> Specialized;
+	return ARENA_ALLOC(arena, Specialized)(alpha_x, alpha_y, optics.conductor_eta, optics.conductor_k, roulette);
+}
+
+template<class Height, class Slope>
+static Microsurface* allocateDielectric(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette)
+{
+	typedef MicrosurfaceSpecialized<Height, Slope, MicrosurfaceDielectric> Specialized;
+	return ARENA_ALLOC(arena, Specialized)(alpha_x, alpha_y, optics.eta, roulette);
+}
+
+template<class Height, class Slope>
+static Microsurface* allocateDiffuse(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette)
+{
+	typedef MicrosurfaceSpecialized<Height, Slope, MicrosurfaceDiffuse> Specialized;
+	return ARENA_ALLOC(arena, Specialized)(alpha_x, alpha_y, optics.albedo, roulette);
+}
+
+// reference classes, with virtual height and slope distributions
+template<bool height_uniform, bool slope_beckmann>
+static Microsurface* allocateReference(MemoryArena& arena, const MicrosurfaceMaterial material, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette)
+{
+	switch(material)
+	{
+	case MICROSURFACE_CONDUCTOR:
+		return ARENA_ALLOC(arena, MicrosurfaceConductor)(height_uniform, slope_beckmann, alpha_x, alpha_y, optics.conductor_eta, optics.conductor_k, roulette);
+	case MICROSURFACE_DIELECTRIC:
+		return ARENA_ALLOC(arena, MicrosurfaceDielectric)(height_uniform, slope_beckmann, alpha_x, alpha_y, optics.eta, roulette);
+	default:
+		return ARENA_ALLOC(arena, MicrosurfaceDiffuse)(height_uniform, slope_beckmann, alpha_x, alpha_y, optics.albedo, roulette);
+	}
+}
+
+template<MicrosurfaceMaterial material, bool height_uniform, bool slope_beckmann>
+static Microsurface* allocateReference(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette)
+{
+	return allocateReference<height_uniform, slope_beckmann>(arena, material, alpha_x, alpha_y, optics, roulette);
+}
+
+template<MicrosurfaceMaterial material>
+static MicrosurfaceAllocator::Function referenceAllocator(const bool height_uniform, const bool slope_beckmann)
+{
+	if(height_uniform)
+		return slope_beckmann ? allocateReference<material, true, true> : allocateReference<material, true, false>;
+	return slope_beckmann ? allocateReference<material, false, true> : allocateReference<material, false, false>;
+}
+
+template<class Height, class Slope>
+static MicrosurfaceAllocator::Function specializedAllocator(const MicrosurfaceMaterial material)
+{
+	switch(material)
+	{
+	case MICROSURFACE_CONDUCTOR:  return allocateConductor<Height, Slope>;
+	case MICROSURFACE_DIELECTRIC: return allocateDielectric<Height, Slope>;
+	default:                      return allocateDiffuse<Height, Slope>;
+	}
+}
+
+template<class Height>
+static MicrosurfaceAllocator::Function specializedAllocator(const MicrosurfaceMaterial material, const bool slope_beckmann, const bool beckmann_table)
+{
+	if(!slope_beckmann)
+		return specializedAllocator<Height, SlopeGGX>(material);
+	if(beckmann_table)
+		return specializedAllocator<Height, SlopeBeckmann>(material);
+	return specializedAllocator<Height, SlopeBeckmannIterative>(material);
+}
+
+MicrosurfaceAllocator microsurfaceAllocator(const MicrosurfaceMaterial material, const bool height_uniform, const bool slope_beckmann, const bool specialized, const bool beckmann_table, const MicrosurfaceRoulette& roulette)
+{
+	if(!specialized)
+	{
+		switch(material)
+		{
+		case MICROSURFACE_CONDUCTOR:  return MicrosurfaceAllocator(referenceAllocator<MICROSURFACE_CONDUCTOR>(height_uniform, slope_beckmann), roulette);
+		case MICROSURFACE_DIELECTRIC: return MicrosurfaceAllocator(referenceAllocator<MICROSURFACE_DIELECTRIC>(height_uniform, slope_beckmann), roulette);
+		default:                      return MicrosurfaceAllocator(referenceAllocator<MICROSURFACE_DIFFUSE>(height_uniform, slope_beckmann), roulette);
+		}
+	}
+
+	if(height_uniform)
+		return MicrosurfaceAllocator(specializedAllocator<HeightUniform>(material, slope_beckmann, beckmann_table), roulette);
+	return MicrosurfaceAllocator(specializedAllocator<HeightGaussian>(material, slope_beckmann, beckmann_table), roulette);
+}
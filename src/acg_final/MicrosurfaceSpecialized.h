@@ -0,0 +1,1141 @@
+#ifndef _MICROSURFACESPECIALIZED_
+#define _MICROSURFACESPECIALIZED_
+
+#include "MicrosurfaceScattering.h"
+#include "MicrosurfaceMath.h"
+#include "memory.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+/* Microsurfaces whose height distribution, slope distribution and material
+   are template parameters: their random walks make no virtual call and can
+   be inlined entirely. They derive from the classes of
+   MicrosurfaceScattering.h, which remain the reference implementation, and
+   draw random numbers in the same order.
+
+   The distributions work on the components of the directions instead of
+   their angles, in single precision with fastErf(): results differ from the
+   reference within the bounds of MicrosurfaceMath.h. */
+
+
+/************* COMPILE-TIME HEIGHT DISTRIBUTIONS *************/
+
+/* Uniform height distribution in [-1, 1] */
+struct HeightUniform
+{
+	static const bool uniform = true;
+
+	// height CDF
+	static float C1(const float h)
+	{
+		return std::min(1.0f, std::max(0.0f, 0.5f*(h+1.0f)));
+	}
+	// inverse of the height CDF
+	static float invC1(const float U)
+	{
+		return std::max(-1.0f, std::min(1.0f, 2.0f*U-1.0f));
+	}
+};
+
+/* Gaussian height distribution N(0,1) */
+struct HeightGaussian
+{
+	static const bool uniform = false;
+
+	// height CDF
+	static float C1(const float h)
+	{
+		return 0.5f + 0.5f * fastErf(INV_SQRT_2*h);
+	}
+	// inverse of the height CDF
+	static float invC1(const float U)
+	{
+		return SQRT_2 * serfinv(2.0f*U - 1.0f);
+	}
+};
+
+
+/************* COMPILE-TIME SLOPE DISTRIBUTIONS *************/
+
+/* Inverse CDF of the visible Beckmann slopes along x with alpha=1.0, built
+   once on first use. It is tabulated as (erf(slope_x)+1) / (erf(cot(theta_i))+1),
+   which stays in [0, 1], over sqrt(1-U) and sqrt(1-cos(theta_i)): unlike U
+   and cos(theta_i), these keep it smooth where slope_x reaches cot(theta_i)
+   and at normal incidence. */
+class BeckmannVisibleSlopeTable
+{
+public:
+	static const int nCos = 128;
+	static const int nU = 256;
+	// below, the projected area vanishes and the solver is used instead
+	static float cosMin() { return -0.9f; }
+
+	static const BeckmannVisibleSlopeTable& get();
+
+	// slope_x for U in [0, 1) and cos_theta_i >= cosMin()
+	float sampleSlopeX(const float cos_theta_i, const float sin_theta_i, const float U) const
+	{
+		const float x = std::min((float)(nCos-1), sqrtf(1.0f - cos_theta_i) / sqrtf(1.0f - cosMin()) * (nCos-1));
+		const float y = (1.0f - sqrtf(1.0f - U)) * (nU-1);
+		const int i = std::min(nCos-2, (int)x);
+		const int j = std::min(nU-2, (int)y);
+		const float tx = x - i;
+		const float ty = y - j;
+
+		const float* row0 = &m_data[i*nU + j];
+		const float* row1 = row0 + nU;
+		const float v = (1.0f-tx) * ((1.0f-ty)*row0[0] + ty*row0[1]) + tx * ((1.0f-ty)*row1[0] + ty*row1[1]);
+
+		const float erf_max = fastErf(cos_theta_i/sin_theta_i);
+		return serfinv(std::max(-0.9999f, v*(erf_max+1.0f) - 1.0f));
+	}
+
+private:
+	BeckmannVisibleSlopeTable();
+	std::vector<float> m_data;
+};
+
+// projected roughness in wi times sin(theta_i); 1/tan(theta_i)/alpha_i is
+// then wi.z over this
+inline float projectedRoughnessSin(const Vector3f& wi, const float alpha_x, const float alpha_y)
+{
+	return sqrtf( wi.x*wi.x*alpha_x*alpha_x + wi.y*wi.y*alpha_y*alpha_y );
+}
+
+/* Beckmann slope distribution */
+struct SlopeBeckmann
+{
+	static const bool beckmann = true;
+
+	// distribution of slopes
+	static float P22(const float slope_x, const float slope_y, const float alpha_x, const float alpha_y)
+	{
+		return 1.0f / (M_PI * alpha_x * alpha_y) * expf(-slope_x*slope_x/(alpha_x*alpha_x) - slope_y*slope_y/(alpha_y*alpha_y) );
+	}
+
+	// Smith's Lambda function
+	static float Lambda(const Vector3f& wi, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 0.0f;
+		if(wi.z < -0.9999f)
+			return -1.0f;
+
+		const float a = wi.z/projectedRoughnessSin(wi, alpha_u, alpha_v);
+		return 0.5f*(fastErf(a) - 1.0f) + INV_2_SQRT_M_PI / a * expf(-a*a);
+	}
+
+	// projected area towards incident direction
+	static float projectedArea(const Vector3f& wi, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 1.0f;
+		if(wi.z < -0.9999f)
+			return 0.0f;
+
+		const float alphai_sin = projectedRoughnessSin(wi, alpha_u, alpha_v);
+		const float a = wi.z/alphai_sin;
+		return 0.5f*(fastErf(a) + 1.0f)*wi.z + INV_2_SQRT_M_PI * alphai_sin * expf(-a*a);
+	}
+
+	// sample the distribution of visible slopes with alpha=1.0, inverting
+	// the tabulated CDF
+	static Vector2f sampleP22_11(const float cos_theta_i, const float sin_theta_i, const float U, const float U_2)
+	{
+		if((sin_theta_i < 0.0001f && cos_theta_i > 0.0f) || cos_theta_i < BeckmannVisibleSlopeTable::cosMin())
+			return solveP22_11(cos_theta_i, sin_theta_i, U, U_2);
+
+		const float slope_x = BeckmannVisibleSlopeTable::get().sampleSlopeX(cos_theta_i, sin_theta_i, U);
+		return Vector2f(slope_x, serfinv(2.0f*U_2-1.0f));
+	}
+
+	// sample the distribution of visible slopes with alpha=1.0, solving for
+	// the CDF with Newton iterations
+	static Vector2f solveP22_11(const float cos_theta_i, const float sin_theta_i, const float U, const float U_2)
+	{
+		Vector2f slope;
+
+		if(sin_theta_i < 0.0001f && cos_theta_i > 0.0f)
+		{
+			const float r = sqrtf(-logf(U));
+			const float phi = 6.28318530718f * U_2;
+			slope.x = r * cosf(phi);
+			slope.y = r * sinf(phi);
+			return slope;
+		}
+
+		// slope associated to theta_i
+		const float slope_i = cos_theta_i/sin_theta_i;
+
+		// projected area
+		const float a = cos_theta_i/sin_theta_i;
+		const float projectedarea = 0.5f*(fastErf(a) + 1.0f)*cos_theta_i + INV_2_SQRT_M_PI * sin_theta_i * expf(-a*a);
+		if(projectedarea < 0.0001f || projectedarea!=projectedarea)
+			return Vector2f(0,0);
+		// VNDF normalization factor
+		const float c = 1.0f / projectedarea;
+
+		// search
+		float serf_min = -0.9999f;
+		float serf_max = std::max(serf_min, fastErf(slope_i));
+		float serf_current = 0.5f * (serf_min+serf_max);
+
+		while(serf_max-serf_min > 0.00001f)
+		{
+			if (!(serf_current >= serf_min && serf_current <= serf_max))
+				serf_current = 0.5f * (serf_min + serf_max);
+
+			// evaluate slope
+			const float slope = serfinv(serf_current);
+
+			// CDF
+			const float CDF = (slope>=slope_i) ? 1.0f : c * (INV_2_SQRT_M_PI*sin_theta_i*expf(-slope*slope) + cos_theta_i*(0.5f+0.5f*fastErf(slope)));
+			const float diff = CDF - U;
+
+			// test estimate
+			if( fabsf(diff) < 0.00001f )
+				break;
+
+			// update bounds
+			if(diff > 0.0f)
+			{
+				if(serf_max == serf_current)
+					break;
+				serf_max = serf_current;
+			}
+			else
+			{
+				if(serf_min == serf_current)
+					break;
+				serf_min = serf_current;
+			}
+
+			// update estimate
+			const float derivative = 0.5f*c*cos_theta_i - 0.5f*c*sin_theta_i * slope;
+			serf_current -= diff/derivative;
+		}
+
+		slope.x = serfinv(std::min(serf_max, std::max(serf_min, serf_current)));
+		slope.y = serfinv(2.0f*U_2-1.0f);
+		return slope;
+	}
+};
+
+/* Beckmann slope distribution sampled with the iterative solver only */
+struct SlopeBeckmannIterative : public SlopeBeckmann
+{
+	static Vector2f sampleP22_11(const float cos_theta_i, const float sin_theta_i, const float U, const float U_2)
+	{
+		return solveP22_11(cos_theta_i, sin_theta_i, U, U_2);
+	}
+};
+
+/* GGX slope distribution */
+struct SlopeGGX
+{
+	static const bool beckmann = false;
+
+	// distribution of slopes
+	static float P22(const float slope_x, const float slope_y, const float alpha_x, const float alpha_y)
+	{
+		const float tmp = 1.0f + slope_x*slope_x/(alpha_x*alpha_x) + slope_y*slope_y/(alpha_y*alpha_y);
+		return 1.0f / (M_PI * alpha_x * alpha_y) / (tmp * tmp);
+	}
+
+	// Smith's Lambda function
+	static float Lambda(const Vector3f& wi, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 0.0f;
+		if(wi.z < -0.9999f)
+			return -1.0f;
+
+		const float a = wi.z/projectedRoughnessSin(wi, alpha_u, alpha_v);
+		return 0.5f*(-1.0f + sign(a) * sqrtf(1 + 1/(a*a)));
+	}
+
+	// projected area towards incident direction
+	static float projectedArea(const Vector3f& wi, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 1.0f;
+		if( wi.z < -0.9999f)
+			return 0.0f;
+
+		const float alphai_sin = projectedRoughnessSin(wi, alpha_u, alpha_v);
+		return 0.5f * (wi.z + sqrtf(wi.z*wi.z + alphai_sin*alphai_sin));
+	}
+
+	// sample the distribution of visible slopes with alpha=1.0
+	static Vector2f sampleP22_11(const float cos_theta_i, const float sin_theta_i, const float U, const float U_2)
+	{
+		Vector2f slope;
+
+		if(sin_theta_i < 0.0001f && cos_theta_i > 0.0f)
+		{
+			const float r = sqrtf(U/(1.0f-U));
+			const float phi = 6.28318530718f * U_2;
+			slope.x = r * cosf(phi);
+			slope.y = r * sinf(phi);
+			return slope;
+		}
+
+		// constant
+		const float tan_theta_i = sin_theta_i/cos_theta_i;
+
+		// projected area
+		const float projectedarea = 0.5f * (cos_theta_i + 1.0f);
+		if(projectedarea < 0.0001f || projectedarea!=projectedarea)
+			return Vector2f(0,0);
+		// normalization coefficient
+		const float c = 1.0f / projectedarea;
+
+		const float A = 2.0f*U/cos_theta_i/c - 1.0f;
+		const float B = tan_theta_i;
+		const float tmp = !std::isinf(1.0f / (A*A-1.0f)) ? 1.0f / (A*A-1.0f) : (cos_theta_i > 1.0f ? 10000000.0f : -10000000.0f);
+
+		const float D = sqrtf(std::max(0.0f, B*B*tmp*tmp - (A*A-B*B)*tmp));
+		const float slope_x_1 = B*tmp - D;
+		const float slope_x_2 = B*tmp + D;
+		slope.x = (A < 0.0f || slope_x_2 > 1.0f/tan_theta_i) ? slope_x_1 : slope_x_2;
+
+		float U2;
+		float S;
+		if(U_2 > 0.5f)
+		{
+			S = 1.0f;
+			U2 = 2.0f*(U_2-0.5f);
+		}
+		else
+		{
+			S = -1.0f;
+			U2 = 2.0f*(0.5f-U_2);
+		}
+		const float z = (U2*(U2*(U2*0.27385f-0.73369f)+0.46341f)) / (U2*(U2*(U2*0.093073f+0.309420f)-1.000000f)+0.597999f);
+		slope.y = S * z * sqrtf(1.0f+slope.x*slope.x);
+		return slope;
+	}
+};
+
+
+/************* COMPILE-TIME MICROSURFACE FUNCTIONS *************/
+
+/* Functions of Microsurface and MicrosurfaceSlope for given distributions */
+template<class Height, class Slope>
+struct MicrosurfaceFunctions
+{
+	// distribution of normals (NDF)
+	static float D(const Vector3f& wm, const float alpha_x, const float alpha_y)
+	{
+		if( wm.z <= 0.0f)
+			return 0.0f;
+
+		// slope of wm
+		const float slope_x = -wm.x/wm.z;
+		const float slope_y = -wm.y/wm.z;
+
+		return Slope::P22(slope_x, slope_y, alpha_x, alpha_y) / (wm.z*wm.z*wm.z*wm.z);
+	}
+
+	// distribution of visible normals (VNDF)
+	static float D_wi(const Vector3f& wi, const Vector3f& wm, const float alpha_x, const float alpha_y)
+	{
+		if( wm.z <= 0.0f)
+			return 0.0f;
+
+		// normalization coefficient
+		const float projectedarea = Slope::projectedArea(wi, alpha_x, alpha_y);
+		if(projectedarea == 0)
+			return 0;
+		const float c = 1.0f / projectedarea;
+
+		return c * std::max(0.0f, Dot(wi, wm)) * D(wm, alpha_x, alpha_y);
+	}
+
+	// sample the VNDF
+	static Vector3f sampleD_wi(const Vector3f& wi, const float U1, const float U2, const float alpha_x, const float alpha_y)
+	{
+		// stretch to match configuration with alpha=1.0
+		const Vector3f wi_11 = Normalize(Vector3f(alpha_x * wi.x, alpha_y * wi.y, wi.z));
+
+		// sample visible slope with alpha=1.0
+		const float sin_theta = sqrtf(wi_11.x*wi_11.x + wi_11.y*wi_11.y);
+		Vector2f slope_11 = Slope::sampleP22_11(wi_11.z, sin_theta, U1, U2);
+
+		// align with view direction
+		const float cos_phi = (sin_theta > 0.0f) ? wi_11.x/sin_theta : 1.0f;
+		const float sin_phi = (sin_theta > 0.0f) ? wi_11.y/sin_theta : 0.0f;
+		Vector2f slope(cos_phi*slope_11.x - sin_phi*slope_11.y, sin_phi*slope_11.x + cos_phi*slope_11.y);
+
+		// stretch back
+		slope.x *= alpha_x;
+		slope.y *= alpha_y;
+
+		// if numerical instability
+		if( (slope.x != slope.x) || !IsFiniteNumber(slope.x) )
+		{
+			if(wi.z > 0) return Vector3f(0.0f,0.0f,1.0f);
+			else return Normalize(Vector3f(wi.x, wi.y, 0.0f));
+		}
+
+		// compute normal
+		return Normalize(Vector3f(-slope.x, -slope.y, 1.0f));
+	}
+
+	// masking function
+	static float G_1(const Vector3f& wi, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 1.0f;
+		if(wi.z <= 0.0f)
+			return 0.0f;
+
+		return 1.0f / (1.0f + Slope::Lambda(wi, alpha_u, alpha_v));
+	}
+
+	// masking function at height h0
+	static float G_1(const Vector3f& wi, const float h0, const float alpha_u, const float alpha_v)
+	{
+		if(wi.z > 0.9999f)
+			return 1.0f;
+		if(wi.z <= 0.0f)
+			return 0.0f;
+
+		return powf(Height::C1(h0), Slope::Lambda(wi, alpha_u, alpha_v));
+	}
+
+	// sample height in outgoing direction
+	static float sampleHeight(const Vector3f& wr, const float hr, const float U, const float alpha_u, const float alpha_v)
+	{
+		ProfilePhase p(Prof::MicrosurfaceHeight);
+		if(wr.z > 0.9999f)
+			return std::numeric_limits<float>::max();
+		if(wr.z < -0.9999f)
+			return Height::invC1(U*Height::C1(hr));
+		if(fabsf(wr.z) < 0.0001f)
+			return hr;
+
+		// probability of intersection
+		const float G_1_ = G_1(wr, hr, alpha_u, alpha_v);
+
+		if (U > 1.0f - G_1_) // leave the microsurface
+			return std::numeric_limits<float>::max();
+
+		return Height::invC1(Height::C1(hr) / powf((1.0f-U),1.0f/Slope::Lambda(wr, alpha_u, alpha_v)));
+	}
+
+	// Microsurface::eval() of a reflective microsurface ms, whose final
+	// type makes its phase functions direct calls
+	template<class Specialized>
+	static float eval(const Specialized& ms, const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder)
+	{
+		if(wo.z < 0)
+			return 0;
+		// init
+		MicrosurfaceRandom random(rng);
+		Vector3f wr = -wi;
+		float hr = 1.0f + Height::invC1(0.999f);
+
+		float sum = 0;
+		float throughput = 1.0f;
+
+		// random walk
+		int current_scatteringOrder = 0;
+		while(scatteringOrder==0 || current_scatteringOrder <= scatteringOrder)
+		{
+			// next height
+			float U = rng.UniformFloat();
+			hr = sampleHeight(wr, hr, U, ms.alpha_u(), ms.alpha_v());
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() )
+				break;
+			else
+				current_scatteringOrder++;
+
+			// next event estimation
+			float phasefunction = ms.evalPhaseFunction(-wr, wo, rng);
+			float shadowing = G_1(wo, hr, ms.alpha_u(), ms.alpha_v());
+			float I = phasefunction * shadowing;
+
+			if ( IsFiniteNumber(I) && (scatteringOrder==0 || current_scatteringOrder==scatteringOrder) )
+				sum += throughput * I;
+
+			// next direction
+			wr = ms.samplePhaseFunction(-wr, random);
+
+			// if NaN (should not happen, just in case)
+			if( (hr != hr) || (wr.z != wr.z) )
+			{
+				microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::NaN);
+				return 0.0f;
+			}
+
+			// Russian roulette
+			if( !ms.m_roulette.survive(current_scatteringOrder, throughput, rng) )
+			{
+				microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Roulette);
+				return sum;
+			}
+		}
+
+		microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Left);
+		return sum;
+	}
+
+	// Microsurface::sample() of a reflective microsurface
+	template<class Specialized>
+	static Vector3f sample(const Specialized& ms, const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight)
+	{
+		weight = 1.0f;
+
+		// init
+		Vector3f wr = -wi;
+		float hr = 1.0f + Height::invC1(0.999f);
+
+		// random walk
+		scatteringOrder = 0;
+		while(true)
+		{
+			// next height
+			float U = random.UniformFloat();
+			hr = sampleHeight(wr, hr, U, ms.alpha_u(), ms.alpha_v());
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() )
+				break;
+			else
+				scatteringOrder++;
+
+			// next direction
+			wr = ms.samplePhaseFunction(-wr, random);
+
+			// if NaN (should not happen, just in case), or stopped by Russian roulette
+			if( (hr != hr) || (wr.z != wr.z) || !ms.m_roulette.survive(scatteringOrder, weight, random.rng) )
+			{
+				microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+				weight = 0.0f;
+				return Vector3f(0,0,1);
+			}
+		}
+
+		microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+		return wr;
+	}
+
+	// Microsurface::evalSpectrum() of a reflective microsurface
+	template<class Specialized>
+	static Spectrum evalSpectrum(const Specialized& ms, const Vector3f& wi, const Vector3f& wo, RNG& rng)
+	{
+		if(wo.z < 0)
+			return Spectrum(0.0f);
+		// init
+		MicrosurfaceRandom random(rng);
+		Vector3f wr = -wi;
+		float hr = 1.0f + Height::invC1(0.999f);
+
+		Spectrum sum(0.0f);
+		Spectrum throughput(1.0f);
+
+		// random walk
+		int scatteringOrder = 0;
+		while(true)
+		{
+			// next height
+			float U = rng.UniformFloat();
+			hr = sampleHeight(wr, hr, U, ms.alpha_u(), ms.alpha_v());
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() )
+				break;
+			else
+				scatteringOrder++;
+
+			// next event estimation, through the reflectance towards wo
+			float phasefunction = ms.evalPhaseFunction(-wr, wo, rng);
+			float shadowing = G_1(wo, hr, ms.alpha_u(), ms.alpha_v());
+			float I = phasefunction * shadowing;
+
+			if ( IsFiniteNumber(I) )
+				sum += throughput * ms.scatteringWeight(-wr, wo) * I;
+
+			// next direction, and the reflectance along it
+			const Vector3f wnext = ms.samplePhaseFunction(-wr, random);
+			throughput *= ms.scatteringWeight(-wr, wnext);
+			wr = wnext;
+
+			// if NaN (should not happen, just in case)
+			if( (hr != hr) || (wr.z != wr.z) )
+			{
+				microsurfaceWalkStats(scatteringOrder, WalkOutcome::NaN);
+				return Spectrum(0.0f);
+			}
+
+			// Russian roulette
+			if( !ms.m_roulette.survive(scatteringOrder, throughput, rng) )
+			{
+				microsurfaceWalkStats(scatteringOrder, WalkOutcome::Roulette);
+				return sum;
+			}
+		}
+
+		microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+		return sum;
+	}
+
+	// Microsurface::sampleSpectrum() of a reflective microsurface
+	template<class Specialized>
+	static Vector3f sampleSpectrum(const Specialized& ms, const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight)
+	{
+		weight = Spectrum(1.0f);
+
+		// init
+		Vector3f wr = -wi;
+		float hr = 1.0f + Height::invC1(0.999f);
+
+		// random walk
+		scatteringOrder = 0;
+		while(true)
+		{
+			// next height
+			float U = random.UniformFloat();
+			hr = sampleHeight(wr, hr, U, ms.alpha_u(), ms.alpha_v());
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() )
+				break;
+			else
+				scatteringOrder++;
+
+			// next direction, and the reflectance along it
+			const Vector3f wnext = ms.samplePhaseFunction(-wr, random);
+			weight *= ms.scatteringWeight(-wr, wnext);
+			wr = wnext;
+
+			// if NaN (should not happen, just in case), or stopped by Russian roulette
+			if( (hr != hr) || (wr.z != wr.z) || !ms.m_roulette.survive(scatteringOrder, weight, random.rng) )
+			{
+				microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+				weight = Spectrum(0.0f);
+				return Vector3f(0,0,1);
+			}
+		}
+
+		microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+		return wr;
+	}
+};
+
+
+/************* SPECIALIZED MICROSURFACES *************/
+
+/* Microsurface<Height, Slope, Material>, with Height in {HeightUniform,
+   HeightGaussian}, Slope in {SlopeBeckmann, SlopeGGX} and Material one of
+   MicrosurfaceConductor, MicrosurfaceDielectric, MicrosurfaceDiffuse */
+template<class Height, class Slope, class Material>
+class MicrosurfaceSpecialized;
+
+/* Microsurface made of conductor material */
+template<class Height, class Slope>
+class MicrosurfaceSpecialized<Height, Slope, MicrosurfaceConductor> final : public MicrosurfaceConductor
+{
+	typedef MicrosurfaceFunctions<Height, Slope> F;
+
+public:
+	MicrosurfaceSpecialized(const float alpha_x, const float alpha_y, const Spectrum& eta = Spectrum(0.0f), const Spectrum& k = Spectrum(0.0f), const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: MicrosurfaceConductor(Height::uniform, Slope::beckmann, alpha_x, alpha_y, eta, k, roulette)
+	{}
+
+	using MicrosurfaceConductor::eval;
+	using MicrosurfaceConductor::sample;
+	using MicrosurfaceConductor::sampleSpectrum;
+	using MicrosurfaceConductor::evalPhaseFunction;
+	using MicrosurfaceConductor::samplePhaseFunction;
+
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder=0) const
+	{
+		return F::eval(*this, wi, wo, rng, scatteringOrder);
+	}
+
+	virtual Vector3f sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const
+	{
+		return F::sample(*this, wi, random, scatteringOrder, weight);
+	}
+
+	virtual Spectrum evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		return F::evalSpectrum(*this, wi, wo, rng);
+	}
+
+	virtual Vector3f sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const
+	{
+		return F::sampleSpectrum(*this, wi, random, scatteringOrder, weight);
+	}
+
+	// evaluate local phase function
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		// half vector
+		const Vector3f wh = Normalize(wi+wo);
+		if(wh.z < 0.0f)
+			return 0.0f;
+
+		return 0.25f * F::D_wi(wi, wh, m_alphau, m_alphav) / Dot(wi, wh);
+	}
+
+	// sample local phase function
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
+	{
+		ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+		const float U1 = random.UniformFloat();
+		const float U2 = random.UniformFloat();
+
+		Vector3f wm = F::sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+		// reflect
+		return -wi + 2.0f * wm * Dot(wi, wm);
+	}
+
+	// evaluate BSDF limited to single scattering
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		ProfilePhase p(Prof::MicrosurfaceSingleScattering);
+		// half-vector
+		const Vector3f wh = Normalize(wi+wo);
+		const float D = F::D(wh, m_alphau, m_alphav);
+
+		// masking-shadowing
+		const float G2 = 1.0f / (1.0f + Slope::Lambda(wi, m_alphau, m_alphav) + Slope::Lambda(wo, m_alphau, m_alphav));
+
+		// BRDF * cos
+		return D * G2 / (4.0f * wi.z);
+	}
+};
+
+/* Microsurface made of dielectric material */
+template<class Height, class Slope>
+class MicrosurfaceSpecialized<Height, Slope, MicrosurfaceDielectric> final : public MicrosurfaceDielectric
+{
+	typedef MicrosurfaceFunctions<Height, Slope> F;
+
+public:
+	MicrosurfaceSpecialized(const float alpha_x, const float alpha_y, const float eta = 1.5f, const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: MicrosurfaceDielectric(Height::uniform, Slope::beckmann, alpha_x, alpha_y, eta, roulette)
+	{}
+
+	using MicrosurfaceDielectric::eval;
+	using MicrosurfaceDielectric::sample;
+	using MicrosurfaceDielectric::evalPhaseFunction;
+	using MicrosurfaceDielectric::samplePhaseFunction;
+
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder=0) const
+	{
+		// init
+		MicrosurfaceRandom random(rng);
+		Vector3f wr = -wi;
+		bool outside = wi.z > 0;
+		float hr = 1.0f + Height::invC1(0.999f);
+		hr = outside ? hr : -hr;
+
+		float sum = 0.0f;
+		float throughput = 1.0f;
+
+		// random walk
+		int current_scatteringOrder = 0;
+		while(scatteringOrder==0 || current_scatteringOrder <= scatteringOrder)
+		{
+			// next height
+			float U = rng.UniformFloat();
+			hr = (outside) ? F::sampleHeight(wr, hr, U, m_alphau, m_alphav) : -F::sampleHeight(-wr, -hr, U, m_alphau, m_alphav);
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() || hr == -std::numeric_limits<float>::max())
+				break;
+			else
+				current_scatteringOrder++;
+
+			// next event estimation
+			float phasefunction = evalPhaseFunction(-wr, wo, outside, (wo.z>0) );
+			float shadowing = (wo.z>0) ? F::G_1(wo, hr, m_alphau, m_alphav) : F::G_1(-wo, -hr, m_alphau, m_alphav);
+			float I = phasefunction * shadowing;
+
+			if ( IsFiniteNumber(I) && (scatteringOrder==0 || current_scatteringOrder==scatteringOrder) )
+				sum += throughput * I;
+
+			// next direction
+			wr = samplePhaseFunction(-wr, random, outside, outside);
+
+			// if NaN (should not happen, just in case)
+			if( (hr != hr) || (wr.z != wr.z) )
+			{
+				microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::NaN);
+				return 0.0f;
+			}
+
+			// Russian roulette
+			if( !m_roulette.survive(current_scatteringOrder, throughput, rng) )
+			{
+				microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Roulette);
+				return sum;
+			}
+		}
+
+		microsurfaceWalkStats(current_scatteringOrder, WalkOutcome::Left);
+		return sum;
+	}
+
+	virtual Vector3f sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const
+	{
+		weight = 1.0f;
+
+		// init
+		Vector3f wr = -wi;
+		bool outside = wi.z > 0;
+		float hr = 1.0f + Height::invC1(0.999f);
+		hr = outside ? hr : -hr;
+
+		// random walk
+		scatteringOrder = 0;
+		while(true)
+		{
+			// next height
+			float U = random.UniformFloat();
+			hr = (outside) ? F::sampleHeight(wr, hr, U, m_alphau, m_alphav) : -F::sampleHeight(-wr, -hr, U, m_alphau, m_alphav);
+
+			// leave the microsurface?
+			if( hr == std::numeric_limits<float>::max() || hr == -std::numeric_limits<float>::max())
+				break;
+			else
+				scatteringOrder++;
+
+			// next direction
+			wr = samplePhaseFunction(-wr, random, outside, outside);
+
+			// if NaN (should not happen, just in case), or stopped by Russian roulette
+			if( (hr != hr) || (wr.z != wr.z) || !m_roulette.survive(scatteringOrder, weight, random.rng) )
+			{
+				microsurfaceWalkStats(scatteringOrder, (hr != hr) || (wr.z != wr.z) ? WalkOutcome::NaN : WalkOutcome::Roulette);
+				weight = 0.0f;
+				return Vector3f(0,0,1);
+			}
+		}
+
+		microsurfaceWalkStats(scatteringOrder, WalkOutcome::Left);
+		return wr;
+	}
+
+	// evaluate local phase function
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		return evalPhaseFunction(wi, wo, true, true) + evalPhaseFunction(wi, wo, true, false);
+	}
+
+	float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, const bool wi_outside, const bool wo_outside) const
+	{
+		const float eta = wi_outside ? m_eta : 1.0f / m_eta;
+
+		if( wi_outside == wo_outside ) // reflection
+		{
+			// half vector
+			const Vector3f wh = Normalize(wi+wo);
+			// value
+			return (wi_outside) ?
+				(0.25f * F::D_wi(wi, wh, m_alphau, m_alphav) / Dot(wi, wh) * fresnel(wi, wh, eta)) :
+				(0.25f * F::D_wi(-wi, -wh, m_alphau, m_alphav) / Dot(-wi, -wh) * fresnel(-wi, -wh, eta)) ;
+		}
+		else // transmission
+		{
+			Vector3f wh = -Normalize(wi+wo*eta);
+			wh *= (wi_outside) ? (sign(wh.z)) : (-sign(wh.z));
+
+			if(Dot(wh, wi) < 0)
+				return 0;
+
+			if(wi_outside)
+			{
+				const float denom = Dot(wi, wh)+eta*Dot(wo,wh);
+				return eta*eta * (1.0f-fresnel(wi, wh, eta)) *
+					F::D_wi(wi, wh, m_alphau, m_alphav) * std::max(0.0f, -Dot(wo, wh)) *
+					1.0f / (denom*denom);
+			}
+			else
+			{
+				const float denom = Dot(-wi, -wh)+eta*Dot(-wo,-wh);
+				return eta*eta * (1.0f-fresnel(-wi, -wh, eta)) *
+					F::D_wi(-wi, -wh, m_alphau, m_alphav) * std::max(0.0f, -Dot(-wo, -wh)) *
+					1.0f / (denom*denom);
+			}
+		}
+	}
+
+	// sample local phase function
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
+	{
+		bool wo_outside;
+		return samplePhaseFunction(wi, random, true, wo_outside);
+	}
+
+	Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random, const bool wi_outside, bool& wo_outside) const
+	{
+		ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+		const float U1 = random.UniformFloat();
+		const float U2 = random.UniformFloat();
+
+		const float eta = wi_outside ? m_eta : 1.0f / m_eta;
+
+		Vector3f wm = wi_outside ? (F::sampleD_wi(wi, U1, U2, m_alphau, m_alphav)) :
+							   (-F::sampleD_wi(-wi, U1, U2, m_alphau, m_alphav)) ;
+
+		const float F_ = fresnel(wi, wm, eta);
+
+		if( random.UniformFloat() < F_ )
+		{
+			return -wi + 2.0f * wm * Dot(wi, wm); // reflect
+		}
+		else
+		{
+			wo_outside = !wi_outside;
+			return Normalize(refraction(wi, wm, eta));
+		}
+	}
+
+	// evaluate BSDF limited to single scattering
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		ProfilePhase p(Prof::MicrosurfaceSingleScattering);
+		if(wi.z < 0 && wo.z < 0)
+			return 0.0f;
+		Vector3f twi = wi, two = wo;
+		if(wi.z < 0) {
+			twi = wo;
+			two = wi;
+		}
+
+		const bool wo_outside = two.z > 0;
+		const float eta = m_eta;
+
+		if(wo_outside) // reflection
+		{
+			// D
+			const Vector3f wh = Normalize(Vector3f(twi+two));
+			const float D = F::D(wh, m_alphau, m_alphav);
+
+			// masking shadowing
+			const float Lambda_i = Slope::Lambda(twi, m_alphau, m_alphav);
+			const float Lambda_o = Slope::Lambda(two, m_alphau, m_alphav);
+			const float G2 = 1.0f / (1.0f + Lambda_i + Lambda_o);
+
+			// BRDF
+			return fresnel(twi, wh, eta) * D * G2 / (4.0f * twi.z);
+		}
+		else // refraction
+		{
+			// D
+			Vector3f wh = -Normalize(twi+two*eta);
+			if(eta<1.0f)
+				wh = -wh;
+			const float D = F::D(wh, m_alphau, m_alphav);
+
+			// G2
+			const float Lambda_i = Slope::Lambda(twi, m_alphau, m_alphav);
+			const float Lambda_o = Slope::Lambda(-two, m_alphau, m_alphav);
+			const float G2 = (float) beta(1.0f+Lambda_i, 1.0f+Lambda_o);
+
+			// BSDF
+			const float denom = Dot(twi, wh)+eta*Dot(two,wh);
+			return std::max(0.0f, Dot(twi, wh)) * std::max(0.0f, -Dot(two, wh)) *
+				1.0f / twi.z * eta*eta * (1.0f-fresnel(twi, wh, eta)) *
+				G2 * D / (denom*denom);
+		}
+	}
+
+private:
+	// MicrosurfaceDielectric::Fresnel(), inlined
+	static float fresnel(const Vector3f& wi, const Vector3f& wm, const float eta)
+	{
+		const float cos_theta_i = Dot(wi, wm);
+		const float cos_theta_t2 = 1.0f - (1.0f-cos_theta_i*cos_theta_i) / (eta*eta);
+
+		// total internal reflection
+		if (cos_theta_t2 <= 0.0f) return 1.0f;
+
+		const float cos_theta_t = sqrtf(cos_theta_t2);
+
+		const float Rs = (cos_theta_i - eta * cos_theta_t) / (cos_theta_i + eta * cos_theta_t);
+		const float Rp = (eta * cos_theta_i - cos_theta_t) / (eta * cos_theta_i + cos_theta_t);
+
+		return 0.5f * (Rs * Rs + Rp * Rp);
+	}
+
+	// MicrosurfaceDielectric::refract(), inlined
+	static Vector3f refraction(const Vector3f &wi, const Vector3f &wm, const float eta)
+	{
+		const float cos_theta_i = Dot(wi, wm);
+		const float cos_theta_t2 = 1.0f - (1.0f-cos_theta_i*cos_theta_i) / (eta*eta);
+		const float cos_theta_t = -sqrtf(std::max(0.0f,cos_theta_t2));
+
+		return wm * (Dot(wi, wm) / eta + cos_theta_t) - wi / eta;
+	}
+};
+
+/* Microsurface made of diffuse material */
+template<class Height, class Slope>
+class MicrosurfaceSpecialized<Height, Slope, MicrosurfaceDiffuse> final : public MicrosurfaceDiffuse
+{
+	typedef MicrosurfaceFunctions<Height, Slope> F;
+
+public:
+	MicrosurfaceSpecialized(const float alpha_x, const float alpha_y, const Spectrum& albedo = Spectrum(1.0f), const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: MicrosurfaceDiffuse(Height::uniform, Slope::beckmann, alpha_x, alpha_y, albedo, roulette)
+	{}
+
+	using MicrosurfaceDiffuse::eval;
+	using MicrosurfaceDiffuse::sample;
+	using MicrosurfaceDiffuse::sampleSpectrum;
+	using MicrosurfaceDiffuse::evalPhaseFunction;
+	using MicrosurfaceDiffuse::samplePhaseFunction;
+
+	virtual float eval(const Vector3f& wi, const Vector3f& wo, RNG& rng, const int scatteringOrder=0) const
+	{
+		return F::eval(*this, wi, wo, rng, scatteringOrder);
+	}
+
+	virtual Vector3f sample(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, float& weight) const
+	{
+		return F::sample(*this, wi, random, scatteringOrder, weight);
+	}
+
+	virtual Spectrum evalSpectrum(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		return F::evalSpectrum(*this, wi, wo, rng);
+	}
+
+	virtual Vector3f sampleSpectrum(const Vector3f& wi, MicrosurfaceRandom& random, int& scatteringOrder, Spectrum& weight) const
+	{
+		return F::sampleSpectrum(*this, wi, random, scatteringOrder, weight);
+	}
+
+	// evaluate local phase function
+	virtual float evalPhaseFunction(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		const float U1 = rng.UniformFloat();
+		const float U2 = rng.UniformFloat();
+		Vector3f wm = F::sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+		return 1.0f/M_PI * std::max(0.0f, Dot(wo, wm));
+	}
+
+	// sample local phase function
+	virtual Vector3f samplePhaseFunction(const Vector3f& wi, MicrosurfaceRandom& random) const
+	{
+		ProfilePhase p(Prof::MicrosurfacePhaseSampling);
+		const float U1 = random.UniformFloat();
+		const float U2 = random.UniformFloat();
+		const float U3 = random.UniformFloat();
+		const float U4 = random.UniformFloat();
+
+		Vector3f wm = F::sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+		// sample diffuse reflection
+		Vector3f w1, w2;
+		if(wm.z < -0.9999999f)
+		{
+			w1 = Vector3f(0.0f, -1.0f, 0.0f);
+			w2 = Vector3f(-1.0f, 0.0f, 0.0f);
+		}
+		else
+		{
+			const float a = 1.0f /(1.0f + wm.z);
+			const float b = -wm.x*wm.y*a;
+			w1 = Vector3f(1.0f - wm.x*wm.x*a, b, -wm.x);
+			w2 = Vector3f(b, 1.0f - wm.y*wm.y*a, -wm.y);
+		}
+
+		float r1 = 2.0f*U3 - 1.0f;
+		float r2 = 2.0f*U4 - 1.0f;
+
+		// concentric map
+		float phi, r;
+		if (r1 == 0 && r2 == 0) {
+			r = phi = 0;
+		} else if (r1*r1 > r2*r2) {
+			r = r1;
+			phi = (M_PI/4.0f) * (r2/r1);
+		} else {
+			r = r2;
+			phi = (M_PI/2.0f) - (r1/r2) * (M_PI/4.0f);
+		}
+		float x = r*cosf(phi);
+		float y = r*sinf(phi);
+		float z = sqrtf(std::max(0.0f, 1.0f - x*x - y*y));
+		return x*w1 + y*w2 + z*wm;
+	}
+
+	// evaluate BSDF limited to single scattering
+	virtual float evalSingleScattering(const Vector3f& wi, const Vector3f& wo, RNG& rng) const
+	{
+		ProfilePhase p(Prof::MicrosurfaceSingleScattering);
+		// sample visible microfacet
+		const float U1 = rng.UniformFloat();
+		const float U2 = rng.UniformFloat();
+		const Vector3f wm = F::sampleD_wi(wi, U1, U2, m_alphau, m_alphav);
+
+		// shadowing given masking
+		const float Lambda_i = Slope::Lambda(wi, m_alphau, m_alphav);
+		const float Lambda_o = Slope::Lambda(wo, m_alphau, m_alphav);
+		float G2_given_G1 = (1.0f + Lambda_i) / (1.0f + Lambda_i + Lambda_o);
+
+		// evaluate diffuse and shadowing given masking
+		return 1.0f / (float)M_PI * std::max(0.0f, Dot(wm, wo)) * G2_given_G1;
+	}
+};
+
+
+/************* SELECTION *************/
+
+enum MicrosurfaceMaterial { MICROSURFACE_CONDUCTOR, MICROSURFACE_DIELECTRIC, MICROSURFACE_DIFFUSE };
+
+// optical constants of the microsurface materials: dielectrics use eta,
+// conductors conductor_eta and conductor_k, diffuse microsurfaces albedo
+struct MicrosurfaceOptics
+{
+	MicrosurfaceOptics(const float eta = 1.5f)
+		: eta(eta), conductor_eta(0.0f), conductor_k(0.0f), albedo(1.0f)
+	{}
+
+	float eta;
+	Spectrum conductor_eta, conductor_k;
+	Spectrum albedo;
+};
+
+// allocates a microsurface in arena, whose walks stop by the roulette the
+// allocator was chosen with
+class MicrosurfaceAllocator
+{
+public:
+	typedef Microsurface* (*Function)(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics, const MicrosurfaceRoulette& roulette);
+
+	MicrosurfaceAllocator(const Function function = nullptr, const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette())
+		: m_function(function), m_roulette(roulette)
+	{}
+
+	Microsurface* operator()(MemoryArena& arena, const float alpha_x, const float alpha_y, const MicrosurfaceOptics& optics) const
+	{
+		return m_function(arena, alpha_x, alpha_y, optics, m_roulette);
+	}
+	explicit operator bool() const { return m_function != nullptr; }
+
+private:
+	Function m_function;
+	MicrosurfaceRoulette m_roulette;
+};
+
+// allocator of the specialized microsurface for this combination, or of the
+// reference classes if specialized is false; Beckmann microsurfaces sample
+// their visible slopes with the table unless beckmann_table is false, and
+// the walks of all of them stop by roulette
+MicrosurfaceAllocator microsurfaceAllocator(const MicrosurfaceMaterial material, const bool height_uniform, const bool slope_beckmann, const bool specialized = true, const bool beckmann_table = true, const MicrosurfaceRoulette& roulette = MicrosurfaceRoulette());
+
+#endif
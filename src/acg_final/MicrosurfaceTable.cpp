@@ -0,0 +1,325 @@
+#include "MicrosurfaceTable.h"
+#include "parallel.h"
+#include "error.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+#ifndef M_PI
+#define M_PI			3.14159265358979323846f	/* pi */
+#endif
+
+static const char tableMagic[8] = {'M', 'M', 'S', 'T', 'A', 'B', 'L', '\x02'};
+
+// table nodes
+static float cosNode(const int i)
+{
+	return 2.0f * (i + 0.5f) / MicrosurfaceTable::nCos - 1.0f;
+}
+
+static float phiNode(const int i)
+{
+	return M_PI * i / (MicrosurfaceTable::nPhi - 1);
+}
+
+static float alphaNode(const int i)
+{
+	return MicrosurfaceTable::alphaMin() + (MicrosurfaceTable::alphaMax() - MicrosurfaceTable::alphaMin()) * i / (MicrosurfaceTable::nAlpha - 1);
+}
+
+// continuous node coordinate x in [0, n-1] -> lower node and weight
+static void interval(float x, const int n, int& i, float& t)
+{
+	x = std::max(0.0f, std::min((float)(n - 1), x));
+	i = std::min(n - 2, (int)x);
+	t = x - i;
+}
+
+MicrosurfaceTable::MicrosurfaceTable(const std::string& description, const Factory& factory, const int nWalks)
+	: m_description(description), m_walks(nWalks), m_data(nAlpha * nCos * nCos * nPhi, 0.0f)
+{
+	// one task per (alpha, theta_i) row
+	ParallelFor([&](int64_t row) {
+		const int a = (int)row / nCos;
+		const int i = (int)row % nCos;
+		std::unique_ptr<Microsurface> microsurface = factory(alphaNode(a));
+		RNG rng(row);
+
+		const float cos_i = cosNode(i);
+		const float sin_i = sqrtf(std::max(0.0f, 1.0f - cos_i*cos_i));
+		const Vector3f wi(sin_i, 0.0f, cos_i);
+		for(int o = 0; o < nCos; ++o)
+		{
+			const float cos_o = cosNode(o);
+			const float sin_o = sqrtf(std::max(0.0f, 1.0f - cos_o*cos_o));
+			for(int p = 0; p < nPhi; ++p)
+			{
+				const float phi = phiNode(p);
+				const Vector3f wo(sin_o * cosf(phi), sin_o * sinf(phi), cos_o);
+
+				double all = 0.0, single = 0.0;
+				for(int w = 0; w < nWalks; ++w)
+				{
+					all += microsurface->eval(wi, wo, rng, 0);
+					single += microsurface->evalSingleScattering(wi, wo, rng);
+				}
+				m_data[offset(a, i, o, p)] = (float)std::max(0.0, (all - single) / nWalks);
+			}
+		}
+	}, nAlpha * nCos);
+}
+
+std::unique_ptr<MicrosurfaceTable> MicrosurfaceTable::read(const std::string& filename, const std::string& description)
+{
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(!f)
+		return nullptr;
+
+	std::unique_ptr<MicrosurfaceTable> table(new MicrosurfaceTable);
+	char magic[8];
+	int header[5];
+	bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, tableMagic, 8) == 0 &&
+			  fread(header, sizeof(int), 5, f) == 5 &&
+			  header[0] == nCos && header[1] == nPhi && header[2] == nAlpha && header[4] >= 0;
+	if(ok)
+	{
+		table->m_walks = header[3];
+		table->m_description.resize(header[4]);
+		ok = (header[4] == 0 || fread(&table->m_description[0], 1, header[4], f) == (size_t)header[4]) &&
+			 table->m_description == description;
+	}
+	if(ok)
+	{
+		table->m_data.resize(nAlpha * nCos * nCos * nPhi);
+		ok = fread(&table->m_data[0], sizeof(float), table->m_data.size(), f) == table->m_data.size();
+	}
+	fclose(f);
+
+	if(!ok)
+	{
+		Warning("Ignoring microsurface table \"%s\": not built for \"%s\"", filename.c_str(), description.c_str());
+		return nullptr;
+	}
+	return table;
+}
+
+bool MicrosurfaceTable::write(const std::string& filename) const
+{
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(!f)
+	{
+		Error("Unable to write microsurface table \"%s\"", filename.c_str());
+		return false;
+	}
+	const int header[5] = {nCos, nPhi, nAlpha, m_walks, (int)m_description.size()};
+	bool ok = fwrite(tableMagic, 1, 8, f) == 8 &&
+			  fwrite(header, sizeof(int), 5, f) == 5 &&
+			  fwrite(m_description.data(), 1, m_description.size(), f) == m_description.size() &&
+			  fwrite(&m_data[0], sizeof(float), m_data.size(), f) == m_data.size();
+	if(fclose(f) != 0 || !ok)
+	{
+		Error("Error writing microsurface table \"%s\"", filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MicrosurfaceTable::supports(const float alpha_x, const float alpha_y) const
+{
+	// isotropic only: the lobe then depends on the azimuth difference alone
+	if(fabsf(alpha_x - alpha_y) > 1e-4f * alpha_x)
+		return false;
+	return alpha_x >= alphaMin() && alpha_x <= alphaMax();
+}
+
+float MicrosurfaceTable::evalMultipleScattering(const Vector3f& wi, const Vector3f& wo, const float alpha) const
+{
+	// azimuth difference
+	const float sin2 = (wi.x*wi.x + wi.y*wi.y) * (wo.x*wo.x + wo.y*wo.y);
+	const float cos_phi = (sin2 > 0.0f) ? std::max(-1.0f, std::min(1.0f, (wi.x*wo.x + wi.y*wo.y) / sqrtf(sin2))) : 1.0f;
+
+	int ia, ii, io, ip;
+	float ta, ti, to, tp;
+	interval((alpha - alphaMin()) / (alphaMax() - alphaMin()) * (nAlpha - 1), nAlpha, ia, ta);
+	interval(0.5f * (wi.z + 1.0f) * nCos - 0.5f, nCos, ii, ti);
+	interval(0.5f * (wo.z + 1.0f) * nCos - 0.5f, nCos, io, to);
+	interval(acosf(cos_phi) / M_PI * (nPhi - 1), nPhi, ip, tp);
+
+	float value = 0.0f;
+	for(int a = 0; a < 2; ++a)
+	for(int i = 0; i < 2; ++i)
+	for(int o = 0; o < 2; ++o)
+	for(int p = 0; p < 2; ++p)
+	{
+		const float w = (a ? ta : 1.0f - ta) * (i ? ti : 1.0f - ti) * (o ? to : 1.0f - to) * (p ? tp : 1.0f - tp);
+		value += w * m_data[offset(ia + a, ii + i, io + o, ip + p)];
+	}
+	return value;
+}
+
+
+/************* ENERGY OF THE HIGHER SCATTERING ORDERS *************/
+
+static const char higherOrdersMagic[8] = {'M', 'M', 'S', 'H', 'I', 'G', 'H', '\x01'};
+
+MicrosurfaceHigherOrders::MicrosurfaceHigherOrders(const std::string& description, const MicrosurfaceTable::Factory& factory, const int nWalks)
+	: m_description(description), m_data(nAlpha * nCos * 2, 0.0f)
+{
+	// one task per roughness; a smooth microsurface only scatters once.
+	// The roughnesses are spaced quadratically: the share of the higher
+	// orders grows fastest at low roughness, where the threshold applies
+	ParallelFor([&](int64_t row) {
+		const int a = (int)row + 1;
+		const float s = (float)a / (nAlpha - 1);
+		const float alpha = alphaMax() * s * s;
+		std::unique_ptr<Microsurface> microsurface = factory(alpha);
+		RNG rng(a);
+		for(int i = 0; i < nCos; ++i)
+		{
+			float cos_i = 2.0f * (i + 0.5f) / nCos - 1.0f;
+			if(!microsurface->transmits())
+				cos_i = fabsf(cos_i);
+			const Vector3f wi(sqrtf(std::max(0.0f, 1.0f - cos_i*cos_i)), 0.0f, cos_i);
+
+			double higher[2] = {0.0, 0.0};
+			for(int w = 0; w < nWalks; ++w)
+			{
+				int scatteringOrder;
+				float weight;
+				const Vector3f wo = microsurface->sample(wi, rng, scatteringOrder, weight);
+				if(scatteringOrder > 1)
+					higher[(wo.z > 0) != (cos_i > 0)] += weight;
+			}
+			for(int t = 0; t < 2; ++t)
+				m_data[(a * nCos + i) * 2 + t] = (float)(higher[t] / nWalks);
+		}
+	}, nAlpha - 1);
+	computeAverages();
+}
+
+void MicrosurfaceHigherOrders::computeAverages()
+{
+	// midpoint rule over the nodes of each hemisphere
+	m_averages.assign(nAlpha * 2, 0.0f);
+	for(int a = 0; a < nAlpha; ++a)
+	for(int i = 0; i < nCos; ++i)
+	{
+		const float cos_i = 2.0f * (i + 0.5f) / nCos - 1.0f;
+		m_averages[a * 2 + (cos_i > 0)] += 2.0f * m_data[(a * nCos + i) * 2] * fabsf(cos_i) * 2.0f / nCos;
+	}
+}
+
+void MicrosurfaceHigherOrders::rescale(const std::function<float(const float cos_i, const float alpha)>& total)
+{
+	for(int a = 0; a < nAlpha; ++a)
+	for(int i = 0; i < nCos; ++i)
+	{
+		const float s = (float)a / (nAlpha - 1);
+		const float cos_i = 2.0f * (i + 0.5f) / nCos - 1.0f;
+		const float target = std::max(0.0f, total(cos_i, alphaMax() * s * s));
+		float* entry = &m_data[(a * nCos + i) * 2];
+		const float sum = entry[0] + entry[1];
+		// without walks that scattered twice, split the energy evenly
+		const float reflectedShare = sum > 0.0f ? entry[0] / sum : 0.5f;
+		entry[0] = target * reflectedShare;
+		entry[1] = target * (1.0f - reflectedShare);
+	}
+	computeAverages();
+}
+
+std::unique_ptr<MicrosurfaceHigherOrders> MicrosurfaceHigherOrders::read(const std::string& filename, const std::string& description)
+{
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(!f)
+		return nullptr;
+
+	std::unique_ptr<MicrosurfaceHigherOrders> table(new MicrosurfaceHigherOrders);
+	char magic[8];
+	int header[3];
+	bool ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, higherOrdersMagic, 8) == 0 &&
+			  fread(header, sizeof(int), 3, f) == 3 &&
+			  header[0] == nCos && header[1] == nAlpha && header[2] >= 0;
+	if(ok)
+	{
+		table->m_description.resize(header[2]);
+		ok = (header[2] == 0 || fread(&table->m_description[0], 1, header[2], f) == (size_t)header[2]) &&
+			 table->m_description == description;
+	}
+	if(ok)
+	{
+		table->m_data.resize(nAlpha * nCos * 2);
+		ok = fread(&table->m_data[0], sizeof(float), table->m_data.size(), f) == table->m_data.size();
+	}
+	fclose(f);
+
+	if(!ok)
+	{
+		Warning("Ignoring microsurface table \"%s\": not built for \"%s\"", filename.c_str(), description.c_str());
+		return nullptr;
+	}
+	table->computeAverages();
+	return table;
+}
+
+bool MicrosurfaceHigherOrders::write(const std::string& filename) const
+{
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(!f)
+	{
+		Error("Unable to write microsurface table \"%s\"", filename.c_str());
+		return false;
+	}
+	const int header[3] = {nCos, nAlpha, (int)m_description.size()};
+	bool ok = fwrite(higherOrdersMagic, 1, 8, f) == 8 &&
+			  fwrite(header, sizeof(int), 3, f) == 3 &&
+			  fwrite(m_description.data(), 1, m_description.size(), f) == m_description.size() &&
+			  fwrite(&m_data[0], sizeof(float), m_data.size(), f) == m_data.size();
+	if(fclose(f) != 0 || !ok)
+	{
+		Error("Error writing microsurface table \"%s\"", filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+float MicrosurfaceHigherOrders::lookup(const Vector3f& wi, const float alpha, const int t) const
+{
+	int ia, ii;
+	float ta, ti;
+	interval(sqrtf(alpha / alphaMax()) * (nAlpha - 1), nAlpha, ia, ta);
+	interval(0.5f * (wi.z + 1.0f) * nCos - 0.5f, nCos, ii, ti);
+
+	float value = 0.0f;
+	for(int a = 0; a < 2; ++a)
+	for(int i = 0; i < 2; ++i)
+		value += (a ? ta : 1.0f - ta) * (i ? ti : 1.0f - ti) * m_data[((ia + a) * nCos + ii + i) * 2 + t];
+	return value;
+}
+
+float MicrosurfaceHigherOrders::energy(const Vector3f& wi, const float alpha_x, const float alpha_y) const
+{
+	const float alpha = std::max(alpha_x, alpha_y);
+	return lookup(wi, alpha, 0) + lookup(wi, alpha, 1);
+}
+
+float MicrosurfaceHigherOrders::reflected(const Vector3f& wi, const float alpha) const
+{
+	return lookup(wi, alpha, 0);
+}
+
+float MicrosurfaceHigherOrders::transmitted(const Vector3f& wi, const float alpha) const
+{
+	return lookup(wi, alpha, 1);
+}
+
+float MicrosurfaceHigherOrders::averageReflected(const bool above, const float alpha) const
+{
+	int ia;
+	float ta;
+	interval(sqrtf(alpha / alphaMax()) * (nAlpha - 1), nAlpha, ia, ta);
+	return (1.0f - ta) * m_averages[ia * 2 + above] + ta * m_averages[(ia + 1) * 2 + above];
+}
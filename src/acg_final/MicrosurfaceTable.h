@@ -0,0 +1,121 @@
+#ifndef _MICROSURFACETABLE_
+#define _MICROSURFACETABLE_
+
+#include "MicrosurfaceScattering.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/************* TABULATED MICROSURFACE LOBES *************/
+
+/* Multiple-scattering lobe of an isotropic microsurface, precomputed once over
+   (theta_i, theta_o, phi_d, alpha) for one height/slope/material
+   combination, and answered by multilinear interpolation afterwards. */
+class MicrosurfaceTable
+{
+public:
+	// creates the microsurface to tabulate for an isotropic roughness alpha
+	typedef std::function<std::unique_ptr<Microsurface>(const float alpha)> Factory;
+
+	// resolution of the table
+	static const int nCos = 16;   // cos(theta_i) and cos(theta_o) in [-1, 1]
+	static const int nPhi = 9;    // phi_d in [0, pi]
+	static const int nAlpha = 8;  // alpha in [alphaMin(), alphaMax()]
+	static float alphaMin() { return 0.05f; }
+	static float alphaMax() { return 1.0f; }
+
+public:
+	// build the table in parallel, averaging nWalks random walks per entry;
+	// description identifies the microsurface in files written by write()
+	MicrosurfaceTable(const std::string& description, const Factory& factory, const int nWalks = 64);
+
+	// read a table written by write(); returns nullptr if the file is
+	// missing or was built for another microsurface
+	static std::unique_ptr<MicrosurfaceTable> read(const std::string& filename, const std::string& description);
+	bool write(const std::string& filename) const;
+
+	// can the table answer queries for this roughness?
+	bool supports(const float alpha_x, const float alpha_y) const;
+
+	// tabulated eval(wi, wo, 0) - evalSingleScattering(wi, wo): the
+	// contribution of all bounces but the first
+	float evalMultipleScattering(const Vector3f& wi, const Vector3f& wo, const float alpha) const;
+
+	const std::string& description() const { return m_description; }
+	int walks() const { return m_walks; }
+
+private:
+	MicrosurfaceTable() {}
+	int offset(const int alpha, const int cos_i, const int cos_o, const int phi) const
+	{
+		return ((alpha * nCos + cos_i) * nCos + cos_o) * nPhi + phi;
+	}
+
+	std::string m_description;
+	int m_walks;
+	// indexed by offset()
+	std::vector<float> m_data;
+};
+
+
+/************* ENERGY OF THE HIGHER SCATTERING ORDERS *************/
+
+/* Share of the energy scattered by a lossless microsurface that leaves after
+   two or more bounces, reflected or transmitted, precomputed over (theta_i,
+   alpha) from the lengths of sampled walks. Colour only removes energy from
+   the higher orders, so this bounds them for coloured microsurfaces as well.
+   It is also the energy that single-scattering microfacet models lose, which
+   energy-compensation lobes give back (Kulla and Conty 2017). */
+class MicrosurfaceHigherOrders
+{
+public:
+	// resolution of the table
+	static const int nCos = 32;    // cos(theta_i) in [-1, 1]
+	static const int nAlpha = 16;  // sqrt(alpha) in [0, sqrt(alphaMax())]
+	static float alphaMax() { return 2.0f; }
+
+public:
+	// build the table in parallel from nWalks sampled walks per entry;
+	// reflective microsurfaces are only sampled from above. description
+	// identifies the microsurface in files written by write()
+	MicrosurfaceHigherOrders(const std::string& description, const MicrosurfaceTable::Factory& factory, const int nWalks = 4096);
+
+	// read a table written by write(); returns nullptr if the file is
+	// missing or was built for another microsurface
+	static std::unique_ptr<MicrosurfaceHigherOrders> read(const std::string& filename, const std::string& description);
+	bool write(const std::string& filename) const;
+
+	// energy of the second and higher orders for walks starting in wi; the
+	// larger roughness stands for anisotropic microsurfaces
+	float energy(const Vector3f& wi, const float alpha_x, const float alpha_y) const;
+
+	// the same energy, leaving on the side of wi or on the other one
+	float reflected(const Vector3f& wi, const float alpha) const;
+	float transmitted(const Vector3f& wi, const float alpha) const;
+	// cosine-weighted average of reflected() over the hemisphere above
+	// (or below) the microsurface, 2 * int reflected(mu) mu dmu
+	float averageReflected(const bool above, const float alpha) const;
+
+	// scale the reflected and transmitted energies of every node so that
+	// they sum to total(cos_i, alpha), keeping their ratio; fits the table
+	// to single-scattering models that lose another share of the energy
+	void rescale(const std::function<float(const float cos_i, const float alpha)>& total);
+
+	const std::string& description() const { return m_description; }
+
+private:
+	MicrosurfaceHigherOrders() {}
+	// interpolated entry t (0: reflected, 1: transmitted)
+	float lookup(const Vector3f& wi, const float alpha, const int t) const;
+	void computeAverages();
+
+	std::string m_description;
+	// indexed by (alpha * nCos + cos_i) * 2 + t
+	std::vector<float> m_data;
+	// indexed by alpha * 2 + above
+	std::vector<float> m_averages;
+};
+
+#endif
@@ -82,6 +82,7 @@
 #include "materials/subsurface.h"
 #include "materials/translucent.h"
 #include "materials/multimicro.h"
+#include "materials/kullaconty.h"
 #include "materials/uber.h"
 #include "samplers/halton.h"
 #include "samplers/maxmin.h"
@@ -594,6 +595,14 @@ std::shared_ptr<Material> MakeMaterial(const std::string &name,
         material = CreateFourierMaterial(mp);
     else if (name == "multimicro")
         material = CreateMultiMicroMaterial(mp);
+    else if (name == "multimicroconductor")
+        material = CreateMultiMicroMaterial(mp, MICROSURFACE_CONDUCTOR);
+    else if (name == "multimicrodiffuse")
+        material = CreateMultiMicroMaterial(mp, MICROSURFACE_DIFFUSE);
+    else if (name == "kullaconty")
+        material = CreateKullaContyMaterial(mp);
+    else if (name == "kullacontyconductor")
+        material = CreateKullaContyMaterial(mp, MICROSURFACE_CONDUCTOR);
     else {
         Warning("Material \"%s\" unknown. Using \"matte\".", name.c_str());
         material = CreateMatteMaterial(mp);
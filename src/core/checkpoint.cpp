@@ -0,0 +1,257 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/checkpoint.cpp*
+#include "checkpoint.h"
+#include "film.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace pbrt {
+
+// Checkpoint files start with this header, followed by the image tiles,
+// the film's accumulators, one byte per step and the integrator data
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t renderHash;
+    int64_t nTiles, nAccumulators, nSteps, dataSize;
+    int32_t floatSize, pad;
+};
+
+static const char checkpointMagic[8] = "pbrtck2";
+
+// Reads the header and the tiles of a checkpoint of the render
+// _renderHash_ from _f_
+static bool ReadHeaderAndTiles(FILE *f, uint64_t renderHash,
+                               CheckpointHeader *header,
+                               std::vector<Bounds2i> *tiles) {
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        memcmp(header->magic, checkpointMagic, sizeof(header->magic)) != 0 ||
+        header->renderHash != renderHash ||
+        header->floatSize != (int32_t)sizeof(Float) || header->nTiles < 0 ||
+        header->nTiles > header->nSteps)
+        return false;
+    tiles->resize(header->nTiles);
+    return fread(tiles->data(), sizeof(Bounds2i), tiles->size(), f) ==
+           tiles->size();
+}
+
+// RenderCheckpoint Method Definitions
+RenderCheckpoint::RenderCheckpoint(Film *film, uint64_t renderHash,
+                                   std::vector<Bounds2i> tiles,
+                                   int64_t nSteps, void *data,
+                                   size_t dataSize, Float interval)
+    : film(film),
+      filename(film->filename + ".checkpoint"),
+      renderHash(renderHash),
+      tiles(std::move(tiles)),
+      stepDone(nSteps, 0),
+      data(data),
+      dataSize(dataSize),
+      interval(interval) {
+    if (interval > 0)
+        writerThread = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(writerMutex);
+            auto period = std::chrono::duration<double>(this->interval);
+            while (!writerCondition.wait_for(lock, period,
+                                             [this]() { return stopWriter; })) {
+                lock.unlock();
+                Write();
+                lock.lock();
+            }
+        });
+}
+
+RenderCheckpoint::~RenderCheckpoint() { StopWriter(); }
+
+bool RenderCheckpoint::ReadTiles(const Film *film, uint64_t renderHash,
+                                 std::vector<Bounds2i> *tiles) {
+    FILE *f = fopen((film->filename + ".checkpoint").c_str(), "rb");
+    if (!f) return false;
+    CheckpointHeader header;
+    std::vector<Bounds2i> fileTiles;
+    bool ok = ReadHeaderAndTiles(f, renderHash, &header, &fileTiles);
+    fclose(f);
+    // The tiles are those of the film's sample bounds
+    Bounds2i sampleBounds = film->GetSampleBounds();
+    for (const Bounds2i &tile : fileTiles)
+        ok &= tile.Area() > 0 && Intersect(tile, sampleBounds) == tile;
+    if (ok) *tiles = std::move(fileTiles);
+    return ok;
+}
+
+void RenderCheckpoint::StopWriter() {
+    if (!writerThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        stopWriter = true;
+    }
+    writerCondition.notify_all();
+    writerThread.join();
+}
+
+int64_t RenderCheckpoint::StepsDone() const {
+    int64_t n = 0;
+    for (uint8_t done : stepDone) n += done;
+    return n;
+}
+
+void RenderCheckpoint::BeginStep() {
+    for (;;) {
+        ++activeSteps;
+        if (!copyPending) return;
+        // A checkpoint is being copied; let it go ahead and wait for it
+        std::unique_lock<std::mutex> lock(gateMutex);
+        if (--activeSteps == 0) gateCondition.notify_all();
+        gateCondition.wait(lock, [this]() { return !copyPending; });
+    }
+}
+
+void RenderCheckpoint::EndStep(int64_t step) {
+    if (step >= 0) stepDone[step] = 1;
+    if (--activeSteps == 0 && copyPending) {
+        std::lock_guard<std::mutex> lock(gateMutex);
+        gateCondition.notify_all();
+    }
+}
+
+bool RenderCheckpoint::Write() {
+    std::lock_guard<std::mutex> writeLock(writeMutex);
+    auto start = std::chrono::steady_clock::now();
+
+    // Copy the checkpoint once no step is under way; steps that begin in
+    // the meantime wait until the copy is done
+    std::vector<Float> acc(Film::nAccumulators *
+                           (size_t)film->croppedPixelBounds.Area());
+    std::vector<uint8_t> steps;
+    std::vector<char> dataCopy(dataSize);
+    {
+        std::unique_lock<std::mutex> lock(gateMutex);
+        copyPending = true;
+        gateCondition.wait(lock, [this]() { return activeSteps == 0; });
+    }
+    film->GetAccumulators(acc.data());
+    steps = stepDone;
+    if (dataSize > 0) memcpy(dataCopy.data(), data, dataSize);
+    {
+        std::lock_guard<std::mutex> lock(gateMutex);
+        copyPending = false;
+    }
+    gateCondition.notify_all();
+    double copySeconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    // Write to a temporary file that replaces the previous checkpoint only
+    // once it is complete, so that there always is a usable one
+    CheckpointHeader header;
+    memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+    header.renderHash = renderHash;
+    header.nTiles = tiles.size();
+    header.nAccumulators = acc.size();
+    header.nSteps = steps.size();
+    header.dataSize = dataSize;
+    header.floatSize = sizeof(Float);
+    header.pad = 0;
+    std::string tmpFilename = filename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: unable to open checkpoint file for writing",
+                tmpFilename.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(tiles.data(), sizeof(Bounds2i), tiles.size(), f) ==
+                  tiles.size() &&
+              fwrite(acc.data(), sizeof(Float), acc.size(), f) == acc.size() &&
+              fwrite(steps.data(), 1, steps.size(), f) == steps.size() &&
+              fwrite(dataCopy.data(), 1, dataSize, f) == dataSize;
+    ok = fclose(f) == 0 && ok;
+#ifdef PBRT_IS_WINDOWS
+    if (ok) remove(filename.c_str());
+#endif
+    if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write checkpoint", filename.c_str());
+        remove(tmpFilename.c_str());
+        return false;
+    }
+    LOG(INFO) << "Wrote checkpoint " << filename << " with "
+              << std::count(steps.begin(), steps.end(), 1) << " of "
+              << steps.size() << " steps done; copying it took "
+              << copySeconds << "s, writing it "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start).count() -
+                     copySeconds
+              << "s";
+    return true;
+}
+
+bool RenderCheckpoint::Resume() {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        Warning("%s: no checkpoint to resume from; starting over",
+                filename.c_str());
+        return false;
+    }
+    CheckpointHeader header;
+    std::vector<Bounds2i> fileTiles;
+    std::vector<Float> acc(Film::nAccumulators *
+                           (size_t)film->croppedPixelBounds.Area());
+    std::vector<uint8_t> steps(stepDone.size());
+    std::vector<char> dataCopy(dataSize);
+    bool ok = ReadHeaderAndTiles(f, renderHash, &header, &fileTiles) &&
+              fileTiles == tiles &&
+              header.nAccumulators == (int64_t)acc.size() &&
+              header.nSteps == (int64_t)steps.size() &&
+              header.dataSize == (int64_t)dataSize &&
+              fread(acc.data(), sizeof(Float), acc.size(), f) == acc.size() &&
+              fread(steps.data(), 1, steps.size(), f) == steps.size() &&
+              fread(dataCopy.data(), 1, dataSize, f) == dataSize;
+    fclose(f);
+    if (!ok) {
+        Warning("%s: checkpoint is damaged or from a different render; "
+                "starting over", filename.c_str());
+        return false;
+    }
+    film->SetAccumulators(acc.data());
+    stepDone = steps;
+    if (dataSize > 0) memcpy(data, dataCopy.data(), dataSize);
+    LOG(INFO) << "Resuming from " << filename << " with " << StepsDone()
+              << " of " << stepDone.size() << " steps done";
+    return true;
+}
+
+void RenderCheckpoint::Finish() {
+    StopWriter();
+    remove(filename.c_str());
+}
+
+}  // namespace pbrt
@@ -0,0 +1,122 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_CHECKPOINT_H
+#define PBRT_CORE_CHECKPOINT_H
+
+// core/checkpoint.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pbrt {
+
+// 64-bit FNV-1a hash of _size_ bytes at _data_, continuing from _hash_
+inline uint64_t HashBytes(const void *data, size_t size,
+                          uint64_t hash = 0xcbf29ce484222325ULL) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// RenderCheckpoint Declarations
+
+// Saves the state of a render in progress to a file every _interval_
+// seconds, so that a render that was stopped can be resumed: the image
+// _tiles_ of the render, the film's pixel accumulators, which _steps_ of
+// the render (image tiles, mostly) have been merged into them, and
+// _dataSize_ bytes of integrator data at _data_ that go with both. Render
+// threads bracket each step's updates of the film and the data with
+// BeginStep() and EndStep(); a checkpoint is copied while no step is in
+// between, and written to disk from a thread of its own.
+class RenderCheckpoint {
+  public:
+    // RenderCheckpoint Public Methods
+    RenderCheckpoint(Film *film, uint64_t renderHash,
+                     std::vector<Bounds2i> tiles, int64_t nSteps, void *data,
+                     size_t dataSize, Float interval);
+    ~RenderCheckpoint();
+    // Reads the tiles of the checkpoint of the same render to _film_ (as
+    // told by _renderHash_) into _tiles_, if there is one. Tiles depend on
+    // the number of threads, so a render resumes with the ones it was
+    // started with.
+    static bool ReadTiles(const Film *film, uint64_t renderHash,
+                          std::vector<Bounds2i> *tiles);
+    // Restores the film, the steps done and the data from the checkpoint
+    // file, if there is one for the same render and tiles
+    bool Resume();
+    bool StepDone(int64_t step) const { return stepDone[step] != 0; }
+    int64_t StepsDone() const;
+    void BeginStep();
+    // Marks _step_ done, unless it is negative
+    void EndStep(int64_t step);
+    bool Write();
+    // Stops checkpointing and removes the file, once the image is written
+    void Finish();
+
+  private:
+    // RenderCheckpoint Private Data
+    Film *film;
+    const std::string filename;
+    const uint64_t renderHash;
+    const std::vector<Bounds2i> tiles;
+    std::vector<uint8_t> stepDone;
+    void *data;
+    const size_t dataSize;
+    const Float interval;
+    std::atomic<int> activeSteps{0};
+    std::atomic<bool> copyPending{false};
+    std::mutex gateMutex, writeMutex, writerMutex;
+    std::condition_variable gateCondition, writerCondition;
+    bool stopWriter = false;
+    std::thread writerThread;
+
+    // RenderCheckpoint Private Methods
+    void StopWriter();
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_CHECKPOINT_H
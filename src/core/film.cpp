@@ -40,6 +40,10 @@
 namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Film pixels", filmPixelMemory);
+STAT_PERCENT("Film/Tile pixels merged without locking", interiorPixelsMerged,
+             tilePixelsMerged);
+STAT_PER_THREAD("Film/Seconds per thread in MergeFilmTile()",
+                mergeFilmTileSeconds);
 
 // Film Method Definitions
 Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
@@ -64,6 +68,9 @@ Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
     // Allocate film image storage
     pixels = std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]);
     filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    int nStripes = (croppedPixelBounds.Diagonal().y + rowsPerStripe - 1) /
+                   rowsPerStripe;
+    stripeMutexes.reset(new std::mutex[std::max(nStripes, 1)]);
 
     // Precompute filter weight table
     int offset = 0;
@@ -100,9 +107,27 @@ std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
     Point2i p1 = (Point2i)Floor(floatBounds.pMax - halfPixel + filter->radius) +
                  Point2i(1, 1);
     Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
-    return std::unique_ptr<FilmTile>(new FilmTile(
-        tilePixelBounds, filter->radius, filterTable, filterTableWidth,
-        maxSampleLuminance));
+    std::unique_ptr<FilmTile> tile(new FilmTile(tilePixelBounds, filter->radius,
+                                                filterTable, filterTableWidth,
+                                                maxSampleLuminance));
+
+    // Bound the pixels whose filter support lies inside _sampleBounds_,
+    // which only samples of this tile contribute to, given that tiles
+    // rendered at the same time have disjoint sample bounds. It is shrunk
+    // by a pixel so that rounding in FilmTile::AddSample() can't matter.
+    Bounds2i interior;
+    interior.pMin =
+        (Point2i)Ceil(floatBounds.pMin - halfPixel + filter->radius) +
+        Vector2i(1, 1);
+    interior.pMax =
+        (Point2i)Ceil(floatBounds.pMax - halfPixel - filter->radius) -
+        Vector2i(1, 1);
+    interior = Intersect(interior, tilePixelBounds);
+    if (interior.pMin.x >= interior.pMax.x ||
+        interior.pMin.y >= interior.pMax.y)
+        interior.pMax = interior.pMin;
+    tile->interiorBounds = interior;
+    return tile;
 }
 
 void Film::Clear() {
@@ -114,11 +139,37 @@ void Film::Clear() {
     }
 }
 
+void Film::GetAccumulators(Float *acc) const {
+    int nPixels = croppedPixelBounds.Area();
+    for (int i = 0; i < nPixels; ++i) {
+        const Pixel &p = pixels[i];
+        for (int c = 0; c < 3; ++c) {
+            acc[c] = p.xyz[c];
+            acc[4 + c] = p.splatXYZ[c];
+        }
+        acc[3] = p.filterWeightSum;
+        acc += nAccumulators;
+    }
+}
+
+void Film::SetAccumulators(const Float *acc) {
+    int nPixels = croppedPixelBounds.Area();
+    for (int i = 0; i < nPixels; ++i) {
+        Pixel &p = pixels[i];
+        for (int c = 0; c < 3; ++c) {
+            p.xyz[c] = acc[c];
+            p.splatXYZ[c] = acc[4 + c];
+        }
+        p.filterWeightSum = acc[3];
+        acc += nAccumulators;
+    }
+}
+
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
     VLOG(1) << "Merging film tile " << tile->pixelBounds;
-    std::lock_guard<std::mutex> lock(mutex);
-    for (Point2i pixel : tile->GetPixelBounds()) {
+    auto start = std::chrono::steady_clock::now();
+    auto mergePixel = [&](const Point2i &pixel) {
         // Merge _pixel_ into _Film::pixels_
         const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
         Pixel &mergePixel = GetPixel(pixel);
@@ -126,7 +177,35 @@ void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
         tilePixel.contribSum.ToXYZ(xyz);
         for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
         mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+    };
+
+    // Merge the interior of the tile, which is no other tile's business
+    const Bounds2i &interior = tile->interiorBounds;
+    for (Point2i pixel : interior) mergePixel(pixel);
+
+    // Merge the border a stripe of rows at a time, under the stripe's lock
+    const Bounds2i &bounds = tile->pixelBounds;
+    for (int y = bounds.pMin.y; y < bounds.pMax.y;) {
+        int stripe = (y - croppedPixelBounds.pMin.y) / rowsPerStripe;
+        int stripeEnd =
+            std::min(croppedPixelBounds.pMin.y + (stripe + 1) * rowsPerStripe,
+                     bounds.pMax.y);
+        std::lock_guard<std::mutex> lock(stripeMutexes[stripe]);
+        for (; y < stripeEnd; ++y) {
+            bool interiorRow = y >= interior.pMin.y && y < interior.pMax.y;
+            for (int x = bounds.pMin.x; x < bounds.pMax.x; ++x) {
+                if (interiorRow && x == interior.pMin.x) {
+                    x = interior.pMax.x - 1;
+                    continue;
+                }
+                mergePixel(Point2i(x, y));
+            }
+        }
     }
+    interiorPixelsMerged += interior.Area();
+    tilePixelsMerged += bounds.Area();
+    mergeFilmTileSeconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
 }
 
 void Film::SetImage(const Spectrum *img) const {
@@ -166,6 +245,9 @@ void Film::AddSplat(const Point2f &p, Spectrum v) {
 }
 
 void Film::WriteImage(Float splatScale) {
+    // Films without a filename keep their image in memory only
+    if (filename.empty()) return;
+
     // Convert image to RGB and compute final pixel values
     LOG(INFO) <<
         "Converting image to RGB and computing final weighted pixel values";
@@ -70,6 +70,12 @@ class Film {
     void AddSplat(const Point2f &p, Spectrum v);
     void WriteImage(Float splatScale = 1);
     void Clear();
+    // The pixel accumulators as _nAccumulators_ values per pixel of
+    // _croppedPixelBounds_: the XYZ sums, the filter weight sum and the XYZ
+    // splats. Render checkpoints save and restore them with these.
+    static PBRT_CONSTEXPR int nAccumulators = 7;
+    void GetAccumulators(Float *acc) const;
+    void SetAccumulators(const Float *acc);
 
     // Film Public Data
     const Point2i fullResolution;
@@ -90,7 +96,10 @@ class Film {
     std::unique_ptr<Pixel[]> pixels;
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
-    std::mutex mutex;
+    // MergeFilmTile() merges the pixels that several tiles contribute to
+    // under the lock of the stripe of _rowsPerStripe_ rows they lie in
+    static PBRT_CONSTEXPR int rowsPerStripe = 4;
+    std::unique_ptr<std::mutex[]> stripeMutexes;
     const Float scale;
     const Float maxSampleLuminance;
 
@@ -174,10 +183,14 @@ class FilmTile {
         return pixels[offset];
     }
     Bounds2i GetPixelBounds() const { return pixelBounds; }
+    Bounds2i GetInteriorBounds() const { return interiorBounds; }
 
   private:
     // FilmTile Private Data
     const Bounds2i pixelBounds;
+    // Pixels that no other tile's samples contribute to, set by
+    // Film::GetFilmTile(); they are merged into the film without locking
+    Bounds2i interiorBounds;
     const Vector2f filterRadius, invFilterRadius;
     const Float *filterTable;
     const int filterTableSize;
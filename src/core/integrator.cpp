@@ -42,10 +42,14 @@
 #include "progressreporter.h"
 #include "camera.h"
 #include "stats.h"
+#include "checkpoint.h"
+#include "parser.h"
 
 namespace pbrt {
 
 STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_INT_DISTRIBUTION("Integrator/Samples per pixel (adaptive)",
+                      adaptiveSamplesPerPixel);
 
 // Integrator Method Definitions
 Integrator::~Integrator() {}
@@ -225,34 +229,294 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
 }
 
 // SamplerIntegrator Method Definitions
+bool ParseTileOrder(const std::string &name, TileOrder *order) {
+    if (name == "scanline")
+        *order = TileOrder::Scanline;
+    else if (name == "hilbert")
+        *order = TileOrder::Hilbert;
+    else if (name == "spiral")
+        *order = TileOrder::Spiral;
+    else
+        return false;
+    return true;
+}
+
+// Position of the _d_th point along the Hilbert curve that fills an _n_ by
+// _n_ grid, _n_ a power of two
+static Point2i HilbertCurvePoint(int n, int64_t d) {
+    int x = 0, y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (int)(d / 2), ry = 1 & (int)(d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+    return Point2i(x, y);
+}
+
+std::vector<Bounds2i> ComputeImageTiles(const Bounds2i &sampleBounds,
+                                        int tileSize, TileOrder order,
+                                        int nSplitTail) {
+    CHECK_GT(tileSize, 0);
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+    if (nTiles.x <= 0 || nTiles.y <= 0) return {};
+
+    // Order the tiles of the _nTiles_ grid
+    std::vector<Point2i> grid;
+    grid.reserve(nTiles.x * nTiles.y);
+    switch (order) {
+    case TileOrder::Scanline:
+        for (int y = 0; y < nTiles.y; ++y)
+            for (int x = 0; x < nTiles.x; ++x) grid.push_back(Point2i(x, y));
+        break;
+    case TileOrder::Hilbert: {
+        // Walk the curve over the enclosing power-of-two square and keep
+        // the points that fall inside the grid
+        int n = RoundUpPow2(std::max(nTiles.x, nTiles.y));
+        for (int64_t d = 0; d < (int64_t)n * n; ++d) {
+            Point2i p = HilbertCurvePoint(n, d);
+            if (p.x < nTiles.x && p.y < nTiles.y) grid.push_back(p);
+        }
+        break;
+    }
+    case TileOrder::Spiral: {
+        // Square rings around the center of the image, each ring ordered
+        // by angle
+        for (int y = 0; y < nTiles.y; ++y)
+            for (int x = 0; x < nTiles.x; ++x) grid.push_back(Point2i(x, y));
+        auto key = [&](const Point2i &p) {
+            Float dx = p.x - (nTiles.x - 1) * .5f;
+            Float dy = p.y - (nTiles.y - 1) * .5f;
+            return std::make_pair(std::max(std::abs(dx), std::abs(dy)),
+                                  std::atan2(dy, dx));
+        };
+        std::stable_sort(grid.begin(), grid.end(),
+                         [&](const Point2i &a, const Point2i &b) {
+                             return key(a) < key(b);
+                         });
+        break;
+    }
+    }
+
+    // Compute the bounds of each tile, splitting the last _nSplitTail_ ones
+    std::vector<Bounds2i> tiles;
+    tiles.reserve(grid.size() + 3 * std::max(nSplitTail, 0));
+    for (size_t i = 0; i < grid.size(); ++i) {
+        Point2i p0 = sampleBounds.pMin + Vector2i(grid[i] * tileSize);
+        Point2i p1 = Min(p0 + Vector2i(tileSize, tileSize), sampleBounds.pMax);
+        Bounds2i tile(p0, p1);
+        Vector2i extent = tile.Diagonal();
+        if ((int64_t)i + nSplitTail < (int64_t)grid.size() ||
+            extent.x < 2 || extent.y < 2) {
+            tiles.push_back(tile);
+            continue;
+        }
+        Point2i mid = p0 + extent / 2;
+        tiles.push_back(Bounds2i(p0, mid));
+        tiles.push_back(Bounds2i(Point2i(mid.x, p0.y), Point2i(p1.x, mid.y)));
+        tiles.push_back(Bounds2i(Point2i(p0.x, mid.y), Point2i(mid.x, p1.y)));
+        tiles.push_back(Bounds2i(mid, p1));
+    }
+    return tiles;
+}
+
+int ComputeTileSize(const Vector2i &extent, int64_t spp, int nThreads) {
+    // About 16 tiles per thread keeps the threads evenly loaded, but tiles
+    // of fewer than a thousand or so samples spend a noticeable share of
+    // their time cloning the sampler and allocating and merging film tiles
+    Float area = Float(extent.x) * Float(extent.y);
+    Float balanced = std::sqrt(area / (16 * std::max(nThreads, 1)));
+    Float minSize = std::ceil(std::sqrt(1024.f / std::max<int64_t>(spp, 1)));
+    return Clamp((int)balanced, std::max<int>(4, minSize), 32);
+}
+
+void AllocateAdaptiveSamples(std::vector<AdaptivePixel> &pixels,
+                             double totalSamples, int64_t maxSamples) {
+    // A pixel needs about $\lambda$ times its relative variance samples to
+    // reach a relative error of $1/\sqrt{\lambda}$; find the $\lambda$
+    // that spends _totalSamples_, given that pixels keep the samples they
+    // have and take no more than _maxSamples_
+    auto allocate = [&](double lambda, bool set) {
+        double sum = 0;
+        for (AdaptivePixel &p : pixels) {
+            if (p.nSamples == 0) continue;
+            double n = std::min(std::ceil(lambda * p.RelativeVariance()),
+                                (double)maxSamples);
+            n = std::max(n, (double)p.nSamples);
+            if (set) p.maxSamples = (int64_t)n;
+            sum += n;
+        }
+        return sum;
+    };
+    double lo = 0, hi = 1;
+    while (allocate(hi, false) < totalSamples && hi < 1e30) hi *= 2;
+    for (int i = 0; i < 64 && lo < hi; ++i) {
+        double mid = (lo + hi) / 2;
+        if (allocate(mid, false) < totalSamples)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    allocate(lo, true);
+}
+
 void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
     // Render image tiles in parallel
 
-    // Compute number of tiles, _nTiles_, to use for parallel rendering
+    // Compute the image tiles, in the order they are to be rendered
     Bounds2i sampleBounds = camera->film->GetSampleBounds();
     Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-                   (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-    {
-        ParallelFor2D([&](Point2i tile) {
-            // Render section of image corresponding to _tile_
+    int nThreads = MaxThreadIndex();
+    int tileSize = PbrtOptions.tileSize > 0
+                       ? PbrtOptions.tileSize
+                       : ComputeTileSize(sampleExtent,
+                                         sampler->samplesPerPixel, nThreads);
+    TileOrder order = TileOrder::Hilbert;
+    if (!ParseTileOrder(PbrtOptions.tileOrder, &order))
+        Warning("Tile order \"%s\" unknown. Using \"hilbert\".",
+                PbrtOptions.tileOrder.c_str());
+    int nSplitTail =
+        PbrtOptions.splitTailTiles && nThreads > 1 ? 2 * nThreads : 0;
+    std::vector<Bounds2i> tiles =
+        ComputeImageTiles(sampleBounds, tileSize, order, nSplitTail);
+
+    // With adaptive sampling, every pixel takes _nFirstSamples_ samples in
+    // a first pass. A second pass continues from there, in batches of as
+    // many samples, for pixels whose error is too large or that were given
+    // more of the sample budget; samplers return the same samples for each
+    // index however the pixel's samples are split up.
+    const int64_t spp = sampler->samplesPerPixel;
+    const bool adaptive =
+        PbrtOptions.adaptiveError > 0 || PbrtOptions.adaptiveSpp > 0;
+    const int64_t nFirstSamples =
+        adaptive ? std::min(spp, std::max<int64_t>(8, RoundUpPow2(spp) / 16))
+                 : spp;
+    const int nPasses = nFirstSamples < spp ? 2 : 1;
+    std::vector<AdaptivePixel> adaptivePixels(adaptive ? sampleBounds.Area()
+                                                       : 0);
+    auto adaptivePixel = [&](const Point2i &p) -> AdaptivePixel & {
+        Vector2i d = p - sampleBounds.pMin;
+        return adaptivePixels[d.y * sampleExtent.x + d.x];
+    };
+
+    // Checkpoint the film, the tiles merged into it and the adaptive
+    // sampling statistics that go with them. Each tile of each pass is a
+    // step of the render, and so is the sample allocation before the
+    // second pass. Tiles keep their statistics to themselves until they
+    // are merged, so that the checkpointed ones are those of the tiles
+    // that are done and those of the start of the pass for the others.
+    // A checkpoint is of the same render if it is of the same scene, as
+    // parsed, at the same resolution and crop window with the same
+    // sampling; the scene description covers the camera, the film and the
+    // sampler, and the rest covers the command line options. It comes with
+    // the tiles it was written for, which depend on the number of threads.
+    uint64_t renderHash = parsedSceneHash;
+    const int64_t renderParams[9] = {camera->film->fullResolution.x,
+                                     camera->film->fullResolution.y,
+                                     sampleBounds.pMin.x,
+                                     sampleBounds.pMin.y,
+                                     sampleBounds.pMax.x,
+                                     sampleBounds.pMax.y,
+                                     spp,
+                                     nFirstSamples,
+                                     nPasses};
+    renderHash = HashBytes(renderParams, sizeof(renderParams), renderHash);
+    const Float adaptiveParams[2] = {PbrtOptions.adaptiveError,
+                                     PbrtOptions.adaptiveSpp};
+    renderHash = HashBytes(adaptiveParams, sizeof(adaptiveParams), renderHash);
+    if (PbrtOptions.resume &&
+        RenderCheckpoint::ReadTiles(camera->film, renderHash, &tiles))
+        LOG(INFO) << "Using the " << tiles.size()
+                  << " tiles of the checkpoint";
+    else
+        LOG(INFO) << "Rendering " << tiles.size() << " tiles of "
+                  << tileSize << " pixels";
+    const int64_t nTiles = tiles.size();
+    const int64_t allocationStep = nPasses * nTiles;
+    RenderCheckpoint checkpoint(
+        camera->film, renderHash, tiles, allocationStep + (nPasses > 1),
+        adaptivePixels.data(), adaptivePixels.size() * sizeof(AdaptivePixel),
+        PbrtOptions.checkpointInterval);
+    ProgressReporter reporter(nPasses * nTiles, "Rendering");
+    if (PbrtOptions.resume && checkpoint.Resume()) {
+        int64_t nTilesDone = 0;
+        for (int64_t step = 0; step < allocationStep; ++step)
+            nTilesDone += checkpoint.StepDone(step);
+        reporter.Update(nTilesDone);
+    }
+
+    for (int pass = 0; pass < nPasses; ++pass) {
+        if (pass == 1 && !checkpoint.StepDone(allocationStep)) {
+            checkpoint.BeginStep();
+            // Decide how many samples each pixel may take in all
+            int64_t nPixels = 0;
+            for (AdaptivePixel &p : adaptivePixels)
+                if (p.nSamples > 0) {
+                    p.maxSamples = spp;
+                    ++nPixels;
+                }
+            if (PbrtOptions.adaptiveSpp > 0)
+                AllocateAdaptiveSamples(adaptivePixels,
+                                        PbrtOptions.adaptiveSpp * nPixels,
+                                        spp);
+            if (PbrtOptions.adaptiveError > 0)
+                for (AdaptivePixel &p : adaptivePixels)
+                    if (p.nSamples > 0 &&
+                        p.RelativeError() <= PbrtOptions.adaptiveError)
+                        p.maxSamples = p.nSamples;
+            checkpoint.EndStep(allocationStep);
+        }
+
+        // Hand out the tiles in order from a shared counter, so that the
+        // threads work on neighboring tiles and the split tiles at the end
+        // of the list are the last ones rendered
+        std::atomic<int64_t> nextTile{0};
+        auto renderTile = [&](int64_t t) {
+            // Render section of image corresponding to _tiles[t]_
+            const Bounds2i &tileBounds = tiles[t];
+            const int64_t step = pass * nTiles + t;
+            if (checkpoint.StepDone(step)) return;
+            auto pixelDone = [&](const Point2i &p) {
+                const AdaptivePixel &ap = adaptivePixel(p);
+                return ap.nSamples >= ap.maxSamples;
+            };
+            if (pass > 0) {
+                bool tileDone = true;
+                for (Point2i pixel : tileBounds)
+                    tileDone &= pixelDone(pixel);
+                if (tileDone) {
+                    reporter.Update();
+                    return;
+                }
+            }
 
             // Allocate _MemoryArena_ for tile
             MemoryArena arena;
 
+            // Copy the tile's adaptive sampling statistics
+            std::vector<AdaptivePixel> tilePixels;
+            if (adaptive)
+                for (Point2i pixel : tileBounds)
+                    tilePixels.push_back(adaptivePixel(pixel));
+            auto tilePixel = [&](const Point2i &p) -> AdaptivePixel & {
+                Vector2i d = p - tileBounds.pMin;
+                return tilePixels[d.y * (tileBounds.pMax.x -
+                                         tileBounds.pMin.x) + d.x];
+            };
+
             // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
-            std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-
-            // Compute sample bounds for tile
-            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-            Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+            std::unique_ptr<Sampler> tileSampler = sampler->Clone(t);
+
             LOG(INFO) << "Starting image tile " << tileBounds;
 
             // Get _FilmTile_ for tile
@@ -261,6 +525,7 @@ void SamplerIntegrator::Render(const Scene &scene) {
 
             // Loop over pixels in tile to render them
             for (Point2i pixel : tileBounds) {
+                if (pass > 0 && pixelDone(pixel)) continue;
                 {
                     ProfilePhase pp(Prof::StartPixel);
                     tileSampler->StartPixel(pixel);
@@ -273,7 +538,13 @@ void SamplerIntegrator::Render(const Scene &scene) {
                 if (!InsideExclusive(pixel, pixelBounds))
                     continue;
 
-                do {
+                // Find the samples of _pixel_ to take in this pass
+                AdaptivePixel *ap = adaptive ? &tilePixel(pixel) : nullptr;
+                int64_t firstSample = pass == 0 ? 0 : ap->nSamples;
+                int64_t endSample = pass == 0 ? nFirstSamples : ap->maxSamples;
+                if (firstSample > 0) tileSampler->SetSampleNumber(firstSample);
+
+                for (int64_t index = firstSample; index < endSample; ++index) {
                     // Initialize _CameraSample_ for current sample
                     CameraSample cameraSample =
                         tileSampler->GetCameraSample(pixel);
@@ -322,20 +593,43 @@ void SamplerIntegrator::Render(const Scene &scene) {
                     // Free _MemoryArena_ memory from computing image sample
                     // value
                     arena.Reset();
-                } while (tileSampler->StartNextSample());
+
+                    // Stop sampling the pixel once its error is small enough
+                    if (ap) {
+                        ap->AddSample(L.y() * rayWeight);
+                        if (pass > 0 && PbrtOptions.adaptiveError > 0 &&
+                            (index + 1) % nFirstSamples == 0 &&
+                            ap->RelativeError() <= PbrtOptions.adaptiveError)
+                            break;
+                    }
+                    if (index + 1 < endSample) tileSampler->StartNextSample();
+                }
             }
             LOG(INFO) << "Finished image tile " << tileBounds;
 
-            // Merge image tile into _Film_
+            // Merge image tile and its statistics into _Film_
+            checkpoint.BeginStep();
             camera->film->MergeFilmTile(std::move(filmTile));
+            if (adaptive)
+                for (Point2i pixel : tileBounds)
+                    adaptivePixel(pixel) = tilePixel(pixel);
+            checkpoint.EndStep(step);
             reporter.Update();
-        }, nTiles);
-        reporter.Done();
+        };
+        ParallelFor([&](int64_t) {
+            for (int64_t t = nextTile++; t < (int64_t)tiles.size();
+                 t = nextTile++)
+                renderTile(t);
+        }, nThreads);
     }
+    reporter.Done();
+    for (const AdaptivePixel &p : adaptivePixels)
+        if (p.nSamples > 0) ReportValue(adaptiveSamplesPerPixel, p.nSamples);
     LOG(INFO) << "Rendering finished";
 
     // Save final image after rendering
     camera->film->WriteImage();
+    checkpoint.Finish();
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(
@@ -73,6 +73,54 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
 std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
     const Scene &scene);
 
+// Order in which SamplerIntegrator::Render() hands out image tiles
+enum class TileOrder { Scanline, Hilbert, Spiral };
+bool ParseTileOrder(const std::string &name, TileOrder *order);
+
+// Splits _sampleBounds_ into square tiles _tileSize_ pixels on a side,
+// listed in _order_. The last _nSplitTail_ tiles of the list are each split
+// into quarters so that the end of the frame is handed out in finer pieces.
+std::vector<Bounds2i> ComputeImageTiles(const Bounds2i &sampleBounds,
+                                        int tileSize, TileOrder order,
+                                        int nSplitTail);
+
+// Tile size for rendering an image of _extent_ pixels at _spp_ samples per
+// pixel on _nThreads_ threads: small enough that each thread gets a few
+// tens of tiles, yet large enough to amortize the per-tile setup.
+int ComputeTileSize(const Vector2i &extent, int64_t spp, int nThreads);
+
+// Running statistics of the luminance of a pixel's samples, which adaptive
+// sampling in SamplerIntegrator::Render() decides how many more samples to
+// take from
+struct AdaptivePixel {
+    void AddSample(Float y) {
+        ++nSamples;
+        double delta = y - mean;
+        mean += delta / nSamples;
+        m2 += delta * (y - mean);
+    }
+    // Variance of a sample relative to the squared mean; dark pixels are
+    // measured against a floor so that their noise is not overrated
+    Float RelativeVariance() const {
+        if (nSamples < 2) return Infinity;
+        double m = std::max(mean, .01);
+        return m2 / (nSamples - 1) / (m * m);
+    }
+    // Relative standard error of the pixel's estimate
+    Float RelativeError() const {
+        return std::sqrt(RelativeVariance() / nSamples);
+    }
+
+    int64_t nSamples = 0, maxSamples = 0;
+    double mean = 0, m2 = 0;
+};
+
+// Sets the _maxSamples_ of the pixels that have taken samples so that,
+// taking up to _maxSamples_ each, they take _totalSamples_ in all and
+// their relative errors come out about the same.
+void AllocateAdaptiveSamples(std::vector<AdaptivePixel> &pixels,
+                             double totalSamples, int64_t maxSamples);
+
 // SamplerIntegrator Declarations
 class SamplerIntegrator : public Integrator {
   public:
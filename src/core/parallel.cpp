@@ -35,7 +35,7 @@
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
+#include <deque>
 #include <thread>
 #include <condition_variable>
 
@@ -44,55 +44,62 @@ namespace pbrt {
 // Parallel Local Definitions
 static std::vector<std::thread> threads;
 static bool shutdownThreads = false;
-class ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
 
 // Bookkeeping variables to help with the implementation of
-// MergeWorkerThreadStats().
-static std::atomic<bool> reportWorkerStats{false};
+// MergeWorkerThreadStats(). Each call starts a new generation, which every
+// worker reports its stats for once.
+static int reportGeneration = 0;
 // Number of workers that still need to report their stats.
 static std::atomic<int> reporterCount;
 // After kicking the workers to report their stats, the main thread waits
 // on this condition variable until they've all done so.
 static std::condition_variable reportDoneCondition;
-static std::mutex reportDoneMutex;
 
-class ParallelForLoop {
-  public:
+// A loop run by ParallelForRanges(); it lives on the stack of the thread
+// that started it until all of its iterations have run.
+struct ParallelForLoop {
     // ParallelForLoop Public Methods
-    ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex,
+    ParallelForLoop(ParallelForRange run, void *func, int64_t count,
                     int chunkSize, uint64_t profilerState)
-        : func1D(std::move(func1D)),
-          maxIndex(maxIndex),
+        : run(run),
+          func(func),
           chunkSize(chunkSize),
-          profilerState(profilerState) {}
-    ParallelForLoop(const std::function<void(Point2i)> &f, const Point2i &count,
-                    uint64_t profilerState)
-        : func2D(f),
-          maxIndex(count.x * count.y),
-          chunkSize(1),
-          profilerState(profilerState) {
-        nX = count.x;
-    }
+          profilerState(profilerState),
+          remaining(count) {}
 
-  public:
-    // ParallelForLoop Private Data
-    std::function<void(int64_t)> func1D;
-    std::function<void(Point2i)> func2D;
-    const int64_t maxIndex;
+    // ParallelForLoop Public Data
+    const ParallelForRange run;
+    void *const func;
     const int chunkSize;
-    uint64_t profilerState;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
-    int nX = -1;
-
-    // ParallelForLoop Private Methods
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
-    }
+    const uint64_t profilerState;
+    // Iterations that have not finished running; the thread that brings
+    // it to zero is the last one to touch the loop
+    std::atomic<int64_t> remaining;
+};
+
+// Iterations _[begin, end)_ of a loop that no thread has started yet
+struct LoopRange {
+    ParallelForLoop *loop;
+    int64_t begin, end;
+};
+
+// The ranges a thread has queued: it pushes and pops them at the back,
+// depth first, while other threads steal the oldest, and largest, ones
+// from the front. _size_ lets threads skip empty queues without locking.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<LoopRange> ranges;
+    std::atomic<int> size{0};
 };
+static std::unique_ptr<WorkQueue[]> workQueues;
+static int nWorkQueues = 0;
+
+// Idle threads sleep on _workCondition_ until a range is queued (or, for a
+// thread waiting on a loop, until the loop is done)
+static std::atomic<int64_t> queuedRanges{0};
+static std::atomic<int> sleepingThreads{0};
+static std::mutex workMutex;
+static std::condition_variable workCondition;
 
 void Barrier::Wait() {
     std::unique_lock<std::mutex> lock(mutex);
@@ -107,7 +114,74 @@ void Barrier::Wait() {
         cv.wait(lock, [this] { return count == 0; });
 }
 
-static std::condition_variable workListCondition;
+static void PushRange(const LoopRange &range) {
+    WorkQueue &queue = workQueues[ThreadIndex];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.ranges.push_back(range);
+        queue.size.store(queue.ranges.size(), std::memory_order_relaxed);
+    }
+    // Sleeping threads count themselves before they check for queued
+    // ranges, so one of the two sees the other's update
+    ++queuedRanges;
+    if (sleepingThreads > 0) {
+        std::lock_guard<std::mutex> lock(workMutex);
+        workCondition.notify_one();
+    }
+}
+
+// Takes the newest range of this thread's queue or else steals the oldest
+// one of another thread's
+static bool PopRange(LoopRange *range) {
+    for (int i = 0; i < nWorkQueues; ++i) {
+        int q = (ThreadIndex + i) % nWorkQueues;
+        WorkQueue &queue = workQueues[q];
+        if (queue.size.load(std::memory_order_relaxed) == 0) continue;
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.ranges.empty()) continue;
+        if (q == ThreadIndex) {
+            *range = queue.ranges.back();
+            queue.ranges.pop_back();
+        } else {
+            *range = queue.ranges.front();
+            queue.ranges.pop_front();
+        }
+        queue.size.store(queue.ranges.size(), std::memory_order_relaxed);
+        --queuedRanges;
+        return true;
+    }
+    return false;
+}
+
+static void RunRange(const LoopRange &range) {
+    ParallelForLoop &loop = *range.loop;
+    WorkQueue &queue = workQueues[ThreadIndex];
+    uint64_t oldState = ProfilerState;
+    ProfilerState = loop.profilerState;
+
+    // Run chunks of the range, leaving the upper half of what is left to
+    // other threads whenever this thread's queue has nothing to steal
+    int64_t begin = range.begin, end = range.end;
+    while (begin < end) {
+        int64_t nChunks = (end - begin + loop.chunkSize - 1) / loop.chunkSize;
+        if (nChunks > 1 && queue.size.load(std::memory_order_relaxed) == 0) {
+            int64_t middle = begin + nChunks / 2 * loop.chunkSize;
+            PushRange({&loop, middle, end});
+            end = middle;
+        }
+        int64_t chunkEnd = std::min(begin + loop.chunkSize, end);
+        loop.run(loop.func, begin, chunkEnd);
+        begin = chunkEnd;
+    }
+    ProfilerState = oldState;
+
+    // Wake up the thread waiting for the loop if this was its last range
+    int64_t ran = end - range.begin;
+    if (loop.remaining.fetch_sub(ran) == ran) {
+        std::lock_guard<std::mutex> lock(workMutex);
+        workCondition.notify_all();
+    }
+}
 
 static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Started execution in worker thread " << tIndex;
@@ -117,6 +191,10 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the worker thread before the profiling system actually stops running.
     ProfilerWorkerThreadInit();
 
+    // Stats are only merged once ParallelInit() has returned, so this has
+    // to happen before the barrier is cleared
+    int reportedGeneration = reportGeneration;
+
     // The main thread sets up a barrier so that it can be sure that all
     // workers have called ProfilerWorkerThreadInit() before it continues
     // (and actually starts the profiling system).
@@ -126,115 +204,74 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
-    while (!shutdownThreads) {
-        if (reportWorkerStats) {
+    while (true) {
+        // Run queued ranges for as long as there are any
+        LoopRange range;
+        if (PopRange(&range)) {
+            RunRange(range);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(workMutex);
+        if (shutdownThreads) break;
+        if (reportedGeneration != reportGeneration) {
+            reportedGeneration = reportGeneration;
             ReportThreadStats();
             if (--reporterCount == 0)
                 // Once all worker threads have merged their stats, wake up
                 // the main thread.
                 reportDoneCondition.notify_one();
-            // Now sleep again.
-            workListCondition.wait(lock);
-        } else if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
-        } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd =
-                std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                uint64_t oldState = ProfilerState;
-                ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                ProfilerState = oldState;
-            }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) workListCondition.notify_all();
         }
+        // Sleep until there are more ranges to run
+        ++sleepingThreads;
+        workCondition.wait(lock, [&] {
+            return queuedRanges > 0 || shutdownThreads ||
+                   reportedGeneration != reportGeneration;
+        });
+        --sleepingThreads;
     }
     LOG(INFO) << "Exiting worker thread " << tIndex;
 }
 
 // Parallel Definitions
-void ParallelFor(std::function<void(int64_t)> func, int64_t count,
-                 int chunkSize) {
+void ParallelForRanges(ParallelForRange run, void *func, int64_t count,
+                       int chunkSize) {
     CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
+    CHECK_GT(chunkSize, 0);
+    if (count <= 0) return;
 
     // Run iterations immediately if not using threads or if _count_ is small
-    if (threads.empty() || count < chunkSize) {
-        for (int64_t i = 0; i < count; ++i) func(i);
+    if (threads.empty() || count <= chunkSize) {
+        run(func, 0, count);
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
-    ParallelForLoop loop(std::move(func), count, chunkSize,
-                         CurrentProfilerState());
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
+    // Queue the loop as one range per thread, so that loops of a few long
+    // iterations keep all threads busy; the threads that pick the ranges up
+    // split them further. The first range is pushed last, so that this
+    // thread starts with it.
+    ParallelForLoop loop(run, func, count, chunkSize, CurrentProfilerState());
+    int64_t nChunks = (count + chunkSize - 1) / chunkSize;
+    int nRanges = (int)std::min<int64_t>(nChunks, nWorkQueues);
+    for (int i = nRanges - 1; i >= 0; --i) {
+        int64_t begin = nChunks * i / nRanges * chunkSize;
+        int64_t end = std::min(nChunks * (i + 1) / nRanges * chunkSize, count);
+        PushRange({&loop, begin, end});
+    }
 
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
+    // Help out with queued ranges, of this loop or of any other, until all
+    // iterations of this one have run
+    while (loop.remaining > 0) {
+        LoopRange range;
+        if (PopRange(&range)) {
+            RunRange(range);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(workMutex);
+        ++sleepingThreads;
+        workCondition.wait(
+            lock, [&] { return queuedRanges > 0 || loop.remaining == 0; });
+        --sleepingThreads;
     }
 }
 
@@ -244,59 +281,7 @@ int MaxThreadIndex() {
     return PbrtOptions.nThreads == 0 ? NumSystemCores() : PbrtOptions.nThreads;
 }
 
-void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
-    CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
-
-    if (threads.empty() || count.x * count.y <= 1) {
-        for (int y = 0; y < count.y; ++y)
-            for (int x = 0; x < count.x; ++x) func(Point2i(x, y));
-        return;
-    }
-
-    ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
-}
+bool ParallelRunning() { return !threads.empty(); }
 
 int NumSystemCores() {
     return std::max(1u, std::thread::hardware_concurrency());
@@ -313,6 +298,10 @@ void ParallelInit() {
     // started until after all worker threads have done that.
     std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(nThreads);
 
+    // One queue of ranges per thread, including the main thread
+    workQueues.reset(new WorkQueue[nThreads]);
+    nWorkQueues = nThreads;
+
     // Launch one fewer worker thread than the total number we want doing
     // work, since the main thread helps out, too.
     for (int i = 0; i < nThreads - 1; ++i)
@@ -325,31 +314,31 @@ void ParallelCleanup() {
     if (threads.empty()) return;
 
     {
-        std::lock_guard<std::mutex> lock(workListMutex);
+        std::lock_guard<std::mutex> lock(workMutex);
         shutdownThreads = true;
-        workListCondition.notify_all();
+        workCondition.notify_all();
     }
 
     for (std::thread &thread : threads) thread.join();
     threads.erase(threads.begin(), threads.end());
+    workQueues.reset();
+    nWorkQueues = 0;
     shutdownThreads = false;
 }
 
 void MergeWorkerThreadStats() {
-    std::unique_lock<std::mutex> lock(workListMutex);
-    std::unique_lock<std::mutex> doneLock(reportDoneMutex);
-    // Set up state so that the worker threads will know that we would like
-    // them to report their thread-specific stats when they wake up.
-    reportWorkerStats = true;
+    std::unique_lock<std::mutex> lock(workMutex);
+    // Start a new generation so that the worker threads will know that we
+    // would like them to report their thread-specific stats when they wake
+    // up.
+    ++reportGeneration;
     reporterCount = threads.size();
 
     // Wake up the worker threads.
-    workListCondition.notify_all();
+    workCondition.notify_all();
 
     // Wait for all of them to merge their stats.
     reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
-
-    reportWorkerStats = false;
 }
 
 }  // namespace pbrt
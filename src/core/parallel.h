@@ -45,6 +45,7 @@
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <type_traits>
 
 namespace pbrt {
 
@@ -98,15 +99,47 @@ class Barrier {
     int count;
 };
 
-void ParallelFor(std::function<void(int64_t)> func, int64_t count,
-                 int chunkSize = 1);
+// Runs iterations _[begin, end)_ of a loop whose body is _func_; the
+// ParallelFor() templates below instantiate one for each loop body, so that
+// the body is called directly rather than through a _std::function_.
+typedef void (*ParallelForRange)(void *func, int64_t begin, int64_t end);
+
+// Runs _count_ iterations in chunks of _chunkSize_ on the thread pool and
+// returns once all have run. Each thread keeps a deque of the ranges it has
+// yet to run; it splits its range whenever its deque is empty, so that idle
+// threads always find half of a busy thread's work to steal. Nested loops
+// are run by the threads that are waiting for them.
+void ParallelForRanges(ParallelForRange run, void *func, int64_t count,
+                       int chunkSize);
+
+template <typename Func>
+void ParallelFor(Func &&func, int64_t count, int chunkSize = 1) {
+    typedef typename std::remove_reference<Func>::type Body;
+    ParallelForRanges(
+        [](void *f, int64_t begin, int64_t end) {
+            Body &body = *(Body *)f;
+            for (int64_t i = begin; i < end; ++i) body(i);
+        },
+        (void *)&func, count, chunkSize);
+}
+
 extern PBRT_THREAD_LOCAL int ThreadIndex;
-void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count);
+
+template <typename Func>
+void ParallelFor2D(Func &&func, const Point2i &count) {
+    if (count.x <= 0 || count.y <= 0) return;
+    int nX = count.x;
+    ParallelFor([&](int64_t index) { func(Point2i(index % nX, index / nX)); },
+                (int64_t)count.x * (int64_t)count.y);
+}
 int MaxThreadIndex();
 int NumSystemCores();
 
 void ParallelInit();
 void ParallelCleanup();
+// Whether ParallelInit() has started worker threads for ParallelFor() to
+// run loops on
+bool ParallelRunning();
 void MergeWorkerThreadStats();
 
 }  // namespace pbrt
@@ -33,6 +33,7 @@
 // core/parser.cpp*
 #include "parser.h"
 #include "api.h"
+#include "checkpoint.h"
 #include "fileutil.h"
 #include "memory.h"
 #include "paramset.h"
@@ -60,6 +61,7 @@
 namespace pbrt {
 
 Loc *parserLoc;
+uint64_t parsedSceneHash = HashBytes(nullptr, 0);
 
 static std::string toString(string_view s) {
     return std::string(s.data(), s.size());
@@ -834,9 +836,15 @@ static void parse(std::unique_ptr<Tokenizer> t) {
             if (PbrtOptions.cat || PbrtOptions.toPly)
                 printf("%*s%s\n", catIndentCount, "", toString(tok).c_str());
             return nextToken(flags);
-        } else
-            // Regular token; success.
+        } else {
+            // Regular token; success. Hash it along with its length, so
+            // that differently split tokens hash differently.
+            size_t size = tok.size();
+            parsedSceneHash = HashBytes(&size, sizeof(size), parsedSceneHash);
+            parsedSceneHash =
+                HashBytes(tok.data(), tok.size(), parsedSceneHash);
             return tok;
+        }
     };
 
     auto ungetToken = [&](string_view s) {
@@ -60,6 +60,11 @@ struct Loc {
 // If not nullptr, stores the current file location of the parser.
 extern Loc *parserLoc;
 
+// Hash of the tokens of the scene descriptions parsed so far, including
+// the files they include but not their comments; it tells checkpoints of
+// renders of other scenes apart.
+extern uint64_t parsedSceneHash;
+
 // Reimplement enough of absl/std::string_view as needed for the below
 // (Bringing on the abseil dependency at this point just for this seems
 // excessive.)
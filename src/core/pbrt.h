@@ -174,6 +174,24 @@ struct Options {
     int nThreads = 0;
     bool quickRender = false;
     bool quiet = false;
+    // Tiles of SamplerIntegrator::Render(): edge length in pixels (0 picks
+    // one from the resolution, sample count and threads), order, and
+    // whether the last tiles of the frame are split further
+    int tileSize = 0;
+    std::string tileOrder = "hilbert";
+    bool splitTailTiles = true;
+    // Adaptive sampling in SamplerIntegrator::Render(): the relative error
+    // at which a pixel stops taking samples, and the average number of
+    // samples per pixel to spend (0 disables either)
+    Float adaptiveError = 0;
+    Float adaptiveSpp = 0;
+    // Seconds between checkpoints of SamplerIntegrator::Render() (0 writes
+    // none), and whether to resume from the last one
+    Float checkpointInterval = 0;
+    bool resume = false;
+    // Directory of the files that BVHAccel saves its trees to, to read them
+    // back instead of building them again (empty disables them)
+    std::string accelCacheDir;
     bool cat = false, toPly = false;
     std::string imageFile;
     // x0, x1, y0, y1
@@ -43,6 +43,10 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+
+Bounds3f Primitive::ClippedWorldBound(const Bounds3f &box) const {
+    return pbrt::Intersect(WorldBound(), box);
+}
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -109,6 +113,10 @@ GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape> &shape,
 
 Bounds3f GeometricPrimitive::WorldBound() const { return shape->WorldBound(); }
 
+Bounds3f GeometricPrimitive::ClippedWorldBound(const Bounds3f &box) const {
+    return shape->ClippedWorldBound(box);
+}
+
 bool GeometricPrimitive::IntersectP(const Ray &r) const {
     return shape->IntersectP(r);
 }
@@ -105,6 +105,13 @@ Spectrum ScaledBxDF::Sample_f(const Vector3f &wo, Vector3f *wi,
     return scale * f;
 }
 
+Spectrum ScaledBxDF::Sample_f(const Vector3f &wo, Vector3f *wi,
+                              const Point2f &sample, Sampler &sampler,
+                              Float *pdf, BxDFType *sampledType) const {
+    Spectrum f = bxdf->Sample_f(wo, wi, sample, sampler, pdf, sampledType);
+    return scale * f;
+}
+
 Float ScaledBxDF::Pdf(const Vector3f &wo, const Vector3f &wi) const {
     return bxdf->Pdf(wo, wi);
 }
@@ -114,27 +121,235 @@ std::string ScaledBxDF::ToString() const {
            std::string(" scale: ") + scale.ToString() + std::string(" ]");
 }
 
+// _w_ mirrored into the upper hemisphere, where the walks of reflective
+// microsurfaces start and end
+static Vector3f Upper(const Vector3f &w) {
+    return Vector3f(w.x, w.y, std::abs(w.z));
+}
+
 Spectrum MultiMicroBSDF::f(const Vector3f &wo, const Vector3f &wi) const {
-    float temp_f = m_microsurface->eval(wi, wo, 2);
-    Spectrum temp(temp_f);
-    return temp;
+    // The walk starts from _wo_ and returns BSDF * |cos| of its exit
+    // direction _wi_
+    Float cosThetaI = AbsCosTheta(wi);
+    if (cosThetaI == 0) return Spectrum(0.f);
+    // Reflective microsurfaces are two-sided
+    bool transmits = m_microsurface->transmits();
+    if (!transmits && !SameHemisphere(wo, wi)) return Spectrum(0.f);
+    Vector3f o = transmits ? wo : Upper(wo), i = transmits ? wi : Upper(wi);
+
+    // Single scattering is known analytically, up to the colour of the
+    // scattering event; it suffices where the higher orders are negligible
+    if (higherOrders &&
+        higherOrders->energy(o, m_microsurface->alpha_u(),
+                             m_microsurface->alpha_v()) < singleThreshold)
+        return m_microsurface->scatteringWeight(o, i) * SingleScattering(o, i) /
+               cosThetaI;
+
+    if (!transmits) {
+        // The walks of reflective microsurfaces carry the spectral
+        // reflectance of every scattering event
+        Spectrum value(0.f);
+        for (int w = 0; w < nWalks; ++w)
+            value += m_microsurface->evalSpectrum(o, i, rng);
+        return value / (nWalks * cosThetaI);
+    }
+    Float value;
+    if (table)
+        value = SingleScattering(wo, wi) +
+                table->evalMultipleScattering(wo, wi,
+                                              m_microsurface->alpha_u());
+    else
+        value = m_microsurface->eval(wo, wi, nWalks, rng);
+    return Spectrum(value / cosThetaI);
 }
 
 Spectrum MultiMicroBSDF::Sample_f(const Vector3f &wo, Vector3f *wi,
                               const Point2f &sample, Float *pdf,
                               BxDFType *sampledType) const {
-    *wi = m_microsurface->sample(wo);
+    return SampleWalk(wo, wi, sample, nullptr, pdf, sampledType);
+}
+
+Spectrum MultiMicroBSDF::Sample_f(const Vector3f &wo, Vector3f *wi,
+                                  const Point2f &sample, Sampler &sampler,
+                                  Float *pdf, BxDFType *sampledType) const {
+    return SampleWalk(wo, wi, sample, &sampler, pdf, sampledType);
+}
+
+Spectrum MultiMicroBSDF::SampleWalk(const Vector3f &wo, Vector3f *wi,
+                                    const Point2f &sample, Sampler *sampler,
+                                    Float *pdf, BxDFType *sampledType) const {
+    // Prescribe the random numbers of the first bounces, in the order the
+    // walk draws them: per bounce a height, then the phase function, whose
+    // first two dimensions sample the visible normal. _sample_ gives the
+    // first visible normal; with a sampler, it draws the rest of the first
+    // _nSampledBounces_ bounces, in pairs where the dimensions belong
+    // together, and the height at which the walk may then leave. All other
+    // random numbers come from _rng_
+    const int nPhase = m_microsurface->phaseFunctionDimensions();
+    float U[nSampledBounces * 5 + 1];
+    CHECK_LE(nSampledBounces * (1 + nPhase) + 1,
+             (int)(sizeof(U) / sizeof(U[0])));
+    int n = 0;
+    U[n++] = sampler ? sampler->Get1D() : rng.UniformFloat();
+    U[n++] = sample[0];
+    U[n++] = sample[1];
+    if (sampler) {
+        for (int bounce = 0; bounce < nSampledBounces; ++bounce) {
+            if (bounce > 0) {
+                U[n++] = sampler->Get1D();
+                Point2f u = sampler->Get2D();
+                U[n++] = u[0];
+                U[n++] = u[1];
+            }
+            for (int k = 2; k < nPhase; k += 2) {
+                if (k + 1 < nPhase) {
+                    Point2f u = sampler->Get2D();
+                    U[n++] = u[0];
+                    U[n++] = u[1];
+                } else
+                    U[n++] = sampler->Get1D();
+            }
+        }
+        U[n++] = sampler->Get1D();
+    }
+    MicrosurfaceRandom random(rng, U, n);
+
+    // A single walk gives both the direction and its throughput; _f_ is
+    // returned such that f * |cos| / pdf equals that throughput, so the
+    // (estimated) pdf only affects MIS weights
+    int scatteringOrder;
+    Spectrum weight;
+    if (m_microsurface->transmits()) {
+        float grey;
+        *wi = m_microsurface->sample(wo, random, scatteringOrder, grey);
+        weight = Spectrum(grey);
+    } else {
+        *wi = m_microsurface->sampleSpectrum(Upper(wo), random,
+                                             scatteringOrder, weight);
+        if (wo.z < 0) wi->z = -wi->z;
+    }
+    *pdf = 0;
+    if (weight.IsBlack() || wi->z == 0) return Spectrum(0.f);
     *pdf = Pdf(wo, *wi);
-    Spectrum temp = f(wo, *wi);
-    return temp;
+    if (sampledType)
+        *sampledType = SameHemisphere(wo, *wi)
+                           ? BxDFType(BSDF_REFLECTION | BSDF_GLOSSY)
+                           : BxDFType(BSDF_TRANSMISSION | BSDF_GLOSSY);
+    return weight * *pdf / AbsCosTheta(*wi);
 }
 
 Float MultiMicroBSDF::Pdf(const Vector3f &wo, const Vector3f &wi) const {
-    return 0.9f * m_microsurface->evalSingleScattering(wi, wo) + 0.1f * BxDF::Pdf(wo, wi);
+    // Density of the walk started from _wo_: single scattering is known
+    // analytically; the higher orders come from the table if there is one
+    // (exact for the lossless dielectric) or are otherwise approximated
+    // by a clamped cosine lobe carrying the energy masked after the first
+    // bounce, over the sphere or the hemisphere of reflective microsurfaces
+    Float pdf;
+    bool transmits = m_microsurface->transmits();
+    if (!transmits) {
+        if (!SameHemisphere(wo, wi)) return 0;
+        Vector3f o = Upper(wo);
+        pdf = SingleScattering(o, Upper(wi)) +
+              (1 - m_microsurface->G_1(o)) * AbsCosTheta(wi) * InvPi;
+    } else {
+        // The table clamps its noisy estimates to 0 where the walks rarely
+        // leave, which the lobe stands in for
+        Float multiple =
+            table ? table->evalMultipleScattering(wo, wi,
+                                                  m_microsurface->alpha_u())
+                  : 0;
+        if (multiple == 0)
+            multiple = (1 - m_microsurface->G_1(wo.z < 0 ? -wo : wo)) *
+                       AbsCosTheta(wi) * Inv2Pi;
+        pdf = SingleScattering(wo, wi) + multiple;
+    }
+    // The estimate vanishes where its stochastic single scattering misses
+    // and nothing is left for the higher orders (a diffuse microsurface
+    // seen straight on), though walks do leave there; dropping them would
+    // lose their energy, so they keep the density of the cosine lobe, for
+    // Sample_f() and MIS alike
+    if (pdf == 0) pdf = AbsCosTheta(wi) * (transmits ? Inv2Pi : InvPi);
+    return pdf;
+}
+
+Float MultiMicroBSDF::SingleScattering(const Vector3f &wo,
+                                       const Vector3f &wi) const {
+    Float value = m_microsurface->evalSingleScattering(wo, wi, rng);
+    return (value > 0 && std::isfinite(value)) ? value : 0;
 }
 
 std::string MultiMicroBSDF::ToString() const {
-    return StringPrintf("MicrosurfaceDielectric");
+    return StringPrintf("[ MultiMicroBSDF alpha_u: %f alpha_v: %f "
+                        "transmits: %s nWalks: %d singleThreshold: %f ]",
+                        m_microsurface->alpha_u(), m_microsurface->alpha_v(),
+                        m_microsurface->transmits() ? "true" : "false",
+                        nWalks, singleThreshold);
+}
+
+Spectrum KullaContyBxDF::f(const Vector3f &wo, const Vector3f &wi) const {
+    if (wo.z == 0 || wi.z == 0) return Spectrum(0.f);
+    if (SameHemisphere(wo, wi)) {
+        Float Eavg = higherOrders->averageReflected(wo.z > 0, alpha);
+        if (Eavg <= 0) return Spectrum(0.f);
+        return Fms * (higherOrders->reflected(wo, alpha) *
+                      higherOrders->reflected(wi, alpha) / (Pi * Eavg));
+    }
+    if (!transmits) return Spectrum(0.f);
+    Float eta = CosTheta(wo) > 0 ? (etaB / etaA) : (etaA / etaB);
+    Float factor = (mode == TransportMode::Radiance) ? (1 / eta) : 1;
+    return Spectrum(higherOrders->transmitted(wo, alpha) * InvPi * factor *
+                    factor);
+}
+
+Float KullaContyBxDF::ReflectionProbability(const Vector3f &wo) const {
+    if (!transmits) return 1;
+    Float R = higherOrders->reflected(wo, alpha);
+    Float T = higherOrders->transmitted(wo, alpha);
+    return R + T > 0 ? R / (R + T) : .5f;
+}
+
+Spectrum KullaContyBxDF::Sample_f(const Vector3f &wo, Vector3f *wi,
+                                  const Point2f &sample, Float *pdf,
+                                  BxDFType *sampledType) const {
+    // Choose reflection or transmission, then a cosine-weighted direction
+    // on that side
+    Float pr = ReflectionProbability(wo);
+    Point2f u = sample;
+    bool reflect = u[0] < pr;
+    u[0] = reflect ? std::min(u[0] / pr, OneMinusEpsilon)
+                   : std::min((u[0] - pr) / (1 - pr), OneMinusEpsilon);
+    *wi = CosineSampleHemisphere(u);
+    if ((wo.z < 0) == reflect) wi->z *= -1;
+    *pdf = Pdf(wo, *wi);
+    if (sampledType)
+        *sampledType = reflect ? BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE)
+                               : BxDFType(BSDF_TRANSMISSION | BSDF_DIFFUSE);
+    return f(wo, *wi);
+}
+
+Float KullaContyBxDF::Pdf(const Vector3f &wo, const Vector3f &wi) const {
+    Float pr = ReflectionProbability(wo);
+    return (SameHemisphere(wo, wi) ? pr : 1 - pr) * AbsCosTheta(wi) * InvPi;
+}
+
+std::string KullaContyBxDF::ToString() const {
+    return StringPrintf("[ KullaContyBxDF alpha: %f transmits: %s ",
+                        alpha, transmits ? "true" : "false") +
+           std::string("Fms: ") + Fms.ToString() +
+           StringPrintf(" etaA: %f etaB: %f ]", etaA, etaB);
+}
+
+Spectrum KullaContyBxDF::AverageFresnel(const Fresnel &fresnel) {
+    // Kulla and Conty's average of Schlick's approximation; exact enough
+    // for the colour of the compensation and a single Fresnel evaluation
+    return (fresnel.Evaluate(1.f) * 20.f + Spectrum(1.f)) / 21.f;
+}
+
+Spectrum KullaContyBxDF::MultipleScatteringFresnel(const Spectrum &Favg,
+                                                   Float Eavg) {
+    // Each further bounce reflects Favg of the energy, and 1 - Eavg of it
+    // bounces once more
+    return Favg * Favg * Eavg / (Spectrum(1.f) - Favg * (1 - Eavg));
 }
 
 Fresnel::~Fresnel() {}
@@ -277,6 +492,11 @@ Spectrum MicrofacetTransmission::f(const Vector3f &wo,
     Vector3f wh = Normalize(wo + wi * eta);
     if (wh.z < 0) wh = -wh;
 
+    // Refraction only happens through microfacets that face _wo_ on its
+    // side and _wi_ on the other, the only ones _Sample_f()_ picks
+    if (Dot(wo, wh) * cosThetaO <= 0 || Dot(wi, wh) * cosThetaI <= 0)
+        return Spectrum(0);
+
     Spectrum F = fresnel.Evaluate(Dot(wo, wh));
 
     Float sqrtDenom = Dot(wo, wh) + eta * Dot(wi, wh);
@@ -462,6 +682,9 @@ Float MicrofacetTransmission::Pdf(const Vector3f &wo,
     // Compute $\wh$ from $\wo$ and $\wi$ for microfacet transmission
     Float eta = CosTheta(wo) > 0 ? (etaB / etaA) : (etaA / etaB);
     Vector3f wh = Normalize(wo + wi * eta);
+    if (wh.z < 0) wh = -wh;
+    if (Dot(wo, wh) * CosTheta(wo) <= 0 || Dot(wi, wh) * CosTheta(wi) <= 0)
+        return 0;
 
     // Compute change of variables _dwh\_dwi_ for microfacet transmission
     Float sqrtDenom = Dot(wo, wh) + eta * Dot(wi, wh);
@@ -726,6 +949,19 @@ Spectrum BSDF::rho(const Vector3f &wo, int nSamples, const Point2f *samples,
 Spectrum BSDF::Sample_f(const Vector3f &woWorld, Vector3f *wiWorld,
                         const Point2f &u, Float *pdf, BxDFType type,
                         BxDFType *sampledType) const {
+    return Sample_f(woWorld, wiWorld, u, nullptr, pdf, type, sampledType);
+}
+
+Spectrum BSDF::Sample_f(const Vector3f &woWorld, Vector3f *wiWorld,
+                        Sampler &sampler, Float *pdf, BxDFType type,
+                        BxDFType *sampledType) const {
+    Point2f u = sampler.Get2D();
+    return Sample_f(woWorld, wiWorld, u, &sampler, pdf, type, sampledType);
+}
+
+Spectrum BSDF::Sample_f(const Vector3f &woWorld, Vector3f *wiWorld,
+                        const Point2f &u, Sampler *sampler, Float *pdf,
+                        BxDFType type, BxDFType *sampledType) const {
     ProfilePhase pp(Prof::BSDFSampling);
     // Choose which _BxDF_ to sample
     int matchingComps = NumComponents(type);
@@ -758,7 +994,9 @@ Spectrum BSDF::Sample_f(const Vector3f &woWorld, Vector3f *wiWorld,
     if (wo.z == 0) return 0.;
     *pdf = 0;
     if (sampledType) *sampledType = bxdf->type;
-    Spectrum f = bxdf->Sample_f(wo, &wi, uRemapped, pdf, sampledType);
+    Spectrum f = sampler ? bxdf->Sample_f(wo, &wi, uRemapped, *sampler, pdf,
+                                          sampledType)
+                         : bxdf->Sample_f(wo, &wi, uRemapped, pdf, sampledType);
     VLOG(2) << "For wo = " << wo << ", sampled f = " << f << ", pdf = "
             << *pdf << ", ratio = " << ((*pdf > 0) ? (f / *pdf) : Spectrum(0.))
             << ", wi = " << wi;
@@ -775,15 +1013,24 @@ Spectrum BSDF::Sample_f(const Vector3f &woWorld, Vector3f *wiWorld,
                 *pdf += bxdfs[i]->Pdf(wo, wi);
     if (matchingComps > 1) *pdf /= matchingComps;
 
-    // Compute value of BSDF for sampled direction
+    // Compute value of BSDF for sampled direction; a single matching _BxDF_
+    // keeps the value it sampled, which for stochastic BxDFs like
+    // _MultiMicroBSDF_ is the throughput of the sampled walk and must not
+    // be replaced by an independent estimate
     if (!(bxdf->type & BSDF_SPECULAR)) {
         bool reflect = Dot(*wiWorld, ng) * Dot(woWorld, ng) > 0;
-        f = 0.;
-        for (int i = 0; i < nBxDFs; ++i)
-            if (bxdfs[i]->MatchesFlags(type) &&
-                ((reflect && (bxdfs[i]->type & BSDF_REFLECTION)) ||
-                 (!reflect && (bxdfs[i]->type & BSDF_TRANSMISSION))))
-                f += bxdfs[i]->f(wo, wi);
+        if (matchingComps == 1) {
+            if (!(bxdf->type &
+                  (reflect ? BSDF_REFLECTION : BSDF_TRANSMISSION)))
+                f = 0.;
+        } else {
+            f = 0.;
+            for (int i = 0; i < nBxDFs; ++i)
+                if (bxdfs[i]->MatchesFlags(type) &&
+                    ((reflect && (bxdfs[i]->type & BSDF_REFLECTION)) ||
+                     (!reflect && (bxdfs[i]->type & BSDF_TRANSMISSION))))
+                    f += bxdfs[i]->f(wo, wi);
+        }
     }
     VLOG(2) << "Overall f = " << f << ", pdf = " << *pdf << ", ratio = "
             << ((*pdf > 0) ? (f / *pdf) : Spectrum(0.));
@@ -44,7 +44,9 @@
 #include "microfacet.h"
 #include "shape.h"
 #include "spectrum.h"
+#include "rng.h"
 #include "acg_final/MicrosurfaceScattering.h"
+#include "acg_final/MicrosurfaceTable.h"
 #include <memory>
 
 namespace pbrt {
@@ -183,6 +185,11 @@ class BSDF {
     Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &u,
                       Float *pdf, BxDFType type = BSDF_ALL,
                       BxDFType *sampledType = nullptr) const;
+    // Draws _u_ from _sampler_, and lets the sampled _BxDF_ draw the
+    // additional dimensions it can use
+    Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, Sampler &sampler,
+                      Float *pdf, BxDFType type = BSDF_ALL,
+                      BxDFType *sampledType = nullptr) const;
     Float Pdf(const Vector3f &wo, const Vector3f &wi,
               BxDFType flags = BSDF_ALL) const;
     std::string ToString() const;
@@ -193,6 +200,9 @@ class BSDF {
   private:
     // BSDF Private Methods
     ~BSDF() {}
+    Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &u,
+                      Sampler *sampler, Float *pdf, BxDFType type,
+                      BxDFType *sampledType) const;
 
     // BSDF Private Data
     const Normal3f ns, ng;
@@ -219,6 +229,14 @@ class BxDF {
     virtual Spectrum Sample_f(const Vector3f &wo, Vector3f *wi,
                               const Point2f &sample, Float *pdf,
                               BxDFType *sampledType = nullptr) const;
+    // BxDFs whose sampling consumes more random numbers than _sample_
+    // provides may draw them from _sampler_, so that they are stratified
+    // as well; by default, the sampler is not used
+    virtual Spectrum Sample_f(const Vector3f &wo, Vector3f *wi,
+                              const Point2f &sample, Sampler &sampler,
+                              Float *pdf, BxDFType *sampledType) const {
+        return Sample_f(wo, wi, sample, pdf, sampledType);
+    }
     virtual Spectrum rho(const Vector3f &wo, int nSamples,
                          const Point2f *samples) const;
     virtual Spectrum rho(int nSamples, const Point2f *samples1,
@@ -251,6 +269,9 @@ class ScaledBxDF : public BxDF {
     Spectrum f(const Vector3f &wo, const Vector3f &wi) const;
     Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &sample,
                       Float *pdf, BxDFType *sampledType) const;
+    Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &sample,
+                      Sampler &sampler, Float *pdf,
+                      BxDFType *sampledType) const;
     Float Pdf(const Vector3f &wo, const Vector3f &wi) const;
     std::string ToString() const;
 
@@ -261,21 +282,62 @@ class ScaledBxDF : public BxDF {
 
 class MultiMicroBSDF : public BxDF {
 public:
-    MultiMicroBSDF(const std::shared_ptr<Microsurface>& in, float alphau, float alphav) : BxDF(BxDFType(BSDF_TRANSMISSION | BSDF_GLOSSY)), m_microsurface(in) {
-        //if(m_microsurface == nullptr)_microsurface = new MicrosurfaceDielectric(false, false, alphax, alphay, 1.5);
-        in->refresh_alpha(alphau, alphav);
-    }
+    // The microsurface carries the roughness of this shading point and is
+    // allocated in the same MemoryArena as the BxDF. If a table is given,
+    // f() and Pdf() interpolate it instead of running random walks
+    // whenever it covers the roughness. Otherwise f() averages _nWalks_
+    // random walks, which run in SIMD lanes when there are several.
+    // Reflective microsurfaces (conductors and diffuse ones) run spectral
+    // walks instead, one per estimate, which carry their colour. Where
+    // _higherOrders_ estimates that bounces after the first carry less
+    // than _singleThreshold_ of the energy, f() only evaluates single
+    // scattering.
+    MultiMicroBSDF(const Microsurface *microsurface, uint64_t seed,
+                   const MicrosurfaceTable *table = nullptr, int nWalks = 1,
+                   const MicrosurfaceHigherOrders *higherOrders = nullptr,
+                   Float singleThreshold = 0)
+        : BxDF(BxDFType(BSDF_REFLECTION | BSDF_GLOSSY |
+                        (microsurface->transmits() ? BSDF_TRANSMISSION : 0))),
+          m_microsurface(microsurface),
+          table(table && table->supports(microsurface->alpha_u(),
+                                         microsurface->alpha_v())
+                    ? table
+                    : nullptr),
+          nWalks(nWalks),
+          higherOrders(singleThreshold > 0 ? higherOrders : nullptr),
+          singleThreshold(singleThreshold),
+          rng(seed) {}
     Spectrum f(const Vector3f &wo, const Vector3f &wi) const;
     Spectrum Sample_f(const Vector3f &wo, Vector3f *wi,
                               const Point2f &sample, Float *pdf,
                               BxDFType *sampledType = nullptr) const;
+    // The first bounces of the walk draw their random numbers from
+    // _sampler_; _sample_ gives the first visible normal
+    Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &sample,
+                      Sampler &sampler, Float *pdf,
+                      BxDFType *sampledType) const;
     Float Pdf(const Vector3f &wo, const Vector3f &wi) const;
-    ~MultiMicroBSDF() {
-
-    }
     std::string ToString() const;
 private:
-    const std::shared_ptr<Microsurface>& m_microsurface;
+    // Sample_f(), with or without a sampler
+    Spectrum SampleWalk(const Vector3f &wo, Vector3f *wi,
+                        const Point2f &sample, Sampler *sampler, Float *pdf,
+                        BxDFType *sampledType) const;
+    // evalSingleScattering(), clamped to valid values
+    Float SingleScattering(const Vector3f &wo, const Vector3f &wi) const;
+
+    // Bounces of the walk that draw from the sampler; the walk escaping
+    // after them does as well
+    static PBRT_CONSTEXPR int nSampledBounces = 2;
+
+    const Microsurface *m_microsurface;
+    const MicrosurfaceTable *table;
+    const int nWalks;
+    const MicrosurfaceHigherOrders *higherOrders;
+    const Float singleThreshold;
+    // Random walks draw from this BxDF's own stream, so that no generator
+    // state is shared between threads and renders are reproducible
+    mutable RNG rng;
 };
 
 class Fresnel {
@@ -321,6 +383,54 @@ class FresnelNoOp : public Fresnel {
     std::string ToString() const { return "[ FresnelNoOp ]"; }
 };
 
+// Energy that single-scattering microfacet lobes lose to the bounces they
+// ignore, given back as a diffuse-like lobe (Kulla and Conty 2017). Its
+// albedo for light leaving in _wo_ is the share of the higher orders that
+// _higherOrders_ tabulates from random walks for roughness _alpha_.
+// Reflection is reciprocal, E(wo) E(wi) / (pi E_avg), and coloured by
+// _Fms_, the average Fresnel reflectance of the multiple bounces.
+// Transmission, for dielectrics, is E_T(wo) / pi, scaled like
+// _MicrofacetTransmission_ for radiance.
+class KullaContyBxDF : public BxDF {
+  public:
+    KullaContyBxDF(const MicrosurfaceHigherOrders *higherOrders, Float alpha,
+                   const Spectrum &Fms, bool transmits = false,
+                   Float etaA = 1, Float etaB = 1,
+                   TransportMode mode = TransportMode::Radiance)
+        : BxDF(BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE |
+                        (transmits ? BSDF_TRANSMISSION : 0))),
+          higherOrders(higherOrders),
+          alpha(alpha),
+          Fms(Fms),
+          transmits(transmits),
+          etaA(etaA),
+          etaB(etaB),
+          mode(mode) {}
+    Spectrum f(const Vector3f &wo, const Vector3f &wi) const;
+    Spectrum Sample_f(const Vector3f &wo, Vector3f *wi, const Point2f &sample,
+                      Float *pdf, BxDFType *sampledType) const;
+    Float Pdf(const Vector3f &wo, const Vector3f &wi) const;
+    std::string ToString() const;
+
+    // Average Fresnel reflectance 2 int F(mu) mu dmu, estimated from normal
+    // incidence, and the colour of the compensation for a single-scattering
+    // lobe whose average albedo is _Eavg_
+    static Spectrum AverageFresnel(const Fresnel &fresnel);
+    static Spectrum MultipleScatteringFresnel(const Spectrum &Favg,
+                                              Float Eavg);
+
+  private:
+    // Probability of sampling reflection rather than transmission
+    Float ReflectionProbability(const Vector3f &wo) const;
+
+    const MicrosurfaceHigherOrders *higherOrders;
+    const Float alpha;
+    const Spectrum Fms;
+    const bool transmits;
+    const Float etaA, etaB;
+    const TransportMode mode;
+};
+
 class SpecularReflection : public BxDF {
   public:
     // SpecularReflection Public Methods
@@ -105,14 +105,30 @@ PixelSampler::PixelSampler(int64_t samplesPerPixel, int nSampledDimensions)
     }
 }
 
+void PixelSampler::StartPixel(const Point2i &p) {
+    Sampler::StartPixel(p);
+    StartSampleStream();
+}
+
 bool PixelSampler::StartNextSample() {
     current1DDimension = current2DDimension = 0;
-    return Sampler::StartNextSample();
+    bool more = Sampler::StartNextSample();
+    StartSampleStream();
+    return more;
 }
 
 bool PixelSampler::SetSampleNumber(int64_t sampleNum) {
     current1DDimension = current2DDimension = 0;
-    return Sampler::SetSampleNumber(sampleNum);
+    bool valid = Sampler::SetSampleNumber(sampleNum);
+    StartSampleStream();
+    return valid;
+}
+
+void PixelSampler::StartSampleStream() {
+    // Dimensions past the precomputed ones come from _rng_, so move it to
+    // the values of the current sample
+    rng.SetSequence(PixelSequence(currentPixel));
+    rng.Advance(SampleStreamOffset(currentPixelSampleIndex));
 }
 
 Float PixelSampler::Get1D() {
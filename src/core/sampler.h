@@ -46,6 +46,30 @@
 
 namespace pbrt {
 
+// Random number sequence for the samples of pixel _p_. Samplers that draw
+// their samples with an _RNG_ restart it on this sequence for each pixel,
+// so that a pixel's samples do not depend on the pixels sampled before it,
+// and rendered images do not depend on how they were split into tiles.
+// Values that are drawn per sample start at SampleStreamOffset() of the
+// sequence, so that the _i_th sample is the same however it was reached.
+inline uint64_t PixelSequence(const Point2i &p) {
+    uint64_t v = ((uint64_t)(uint32_t)p.x << 32) | (uint32_t)p.y;
+    // Finalizer of MurmurHash3, so that neighboring pixels get unrelated
+    // sequences
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+}
+
+inline int64_t SampleStreamOffset(int64_t sampleIndex) {
+    // Leaves 2^32 values per sample, and as many ahead of the first sample
+    // for the values drawn once per pixel
+    return (sampleIndex + 1) << 32;
+}
+
 // Sampler Declarations
 class Sampler {
   public:
@@ -90,6 +114,7 @@ class PixelSampler : public Sampler {
   public:
     // PixelSampler Public Methods
     PixelSampler(int64_t samplesPerPixel, int nSampledDimensions);
+    void StartPixel(const Point2i &p);
     bool StartNextSample();
     bool SetSampleNumber(int64_t);
     Float Get1D();
@@ -101,6 +126,10 @@ class PixelSampler : public Sampler {
     std::vector<std::vector<Point2f>> samples2D;
     int current1DDimension = 0, current2DDimension = 0;
     RNG rng;
+
+  private:
+    // PixelSampler Private Methods
+    void StartSampleStream();
 };
 
 class GlobalSampler : public Sampler {
@@ -53,6 +53,10 @@ Shape::Shape(const Transform *ObjectToWorld, const Transform *WorldToObject,
 
 Bounds3f Shape::WorldBound() const { return (*ObjectToWorld)(ObjectBound()); }
 
+Bounds3f Shape::ClippedWorldBound(const Bounds3f &box) const {
+    return pbrt::Intersect(WorldBound(), box);
+}
+
 Interaction Shape::Sample(const Interaction &ref, const Point2f &u,
                           Float *pdf) const {
     Interaction intr = Sample(u, pdf);
@@ -56,6 +56,10 @@ class Shape {
     virtual ~Shape();
     virtual Bounds3f ObjectBound() const = 0;
     virtual Bounds3f WorldBound() const;
+    // Bounds of the part of the shape inside _box_, in world space; shapes
+    // that can be clipped return tighter bounds than the overlap of _box_
+    // and WorldBound()
+    virtual Bounds3f ClippedWorldBound(const Bounds3f &box) const;
     virtual bool Intersect(const Ray &ray, Float *tHit,
                            SurfaceInteraction *isect,
                            bool testAlphaTexture = true) const = 0;
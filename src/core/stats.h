@@ -160,6 +160,10 @@ enum class Prof {
     BSSRDFSampling,
     PhaseFuncEvaluation,
     PhaseFuncSampling,
+    MicrosurfaceHeight,
+    MicrosurfacePhaseSampling,
+    MicrosurfaceSingleScattering,
+    MicrosurfaceBatchedWalks,
     AccelIntersect,
     AccelIntersectP,
     LightSample,
@@ -215,6 +219,10 @@ static const char *ProfNames[] = {
     "BSSRDF::Sample_f()",
     "PhaseFunction::p()",
     "PhaseFunction::Sample_p()",
+    "Microsurface::sampleHeight()",
+    "Microsurface::samplePhaseFunction()",
+    "Microsurface::evalSingleScattering()",
+    "Microsurface::eval() batched walks",
     "Accelerator::Intersect()",
     "Accelerator::IntersectP()",
     "Light::Sample_*()",
@@ -341,6 +349,18 @@ void CleanupProfiler();
         var##max = std::max(var##max, decltype(var##min)(value)); \
     } while (0)
 
+// A per-thread total, such as the time a thread spends in some phase,
+// reported as its average, minimum and maximum over the threads that added
+// to it
+#define STAT_PER_THREAD(title, var)                                 \
+    static PBRT_THREAD_LOCAL double var;                            \
+    static void STATS_FUNC##var(StatsAccumulator &accum) {          \
+        if (var != 0)                                               \
+            accum.ReportFloatDistribution(title, var, 1, var, var); \
+        var = 0;                                                    \
+    }                                                               \
+    static StatRegisterer STATS_REG##var(STATS_FUNC##var)
+
 #define STAT_PERCENT(title, numVar, denomVar)                 \
     static PBRT_THREAD_LOCAL int64_t numVar, denomVar;        \
     static void STATS_FUNC##numVar(StatsAccumulator &accum) { \
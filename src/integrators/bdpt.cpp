@@ -191,7 +191,7 @@ int RandomWalk(const Scene &scene, RayDifferential ray, Sampler &sampler,
             // Sample BSDF at current vertex and compute reverse probability
             Vector3f wi, wo = isect.wo;
             BxDFType type;
-            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdfFwd,
+            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler, &pdfFwd,
                                               BSDF_ALL, &type);
             VLOG(2) << "Random walk sampled dir " << wi << " f: " << f <<
                 ", pdfFwd: " << pdfFwd;
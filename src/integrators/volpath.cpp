@@ -131,7 +131,7 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
             Vector3f wo = -ray.d, wi;
             Float pdf;
             BxDFType flags;
-            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
+            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler, &pdf,
                                               BSDF_ALL, &flags);
             if (f.IsBlack() || pdf == 0.f) break;
             beta *= f * AbsDot(wi, isect.shading.n) / pdf;
@@ -36,6 +36,7 @@
 #include "api.h"
 #include "parser.h"
 #include "parallel.h"
+#include "integrator.h"
 #include <glog/logging.h>
 
 using namespace pbrt;
@@ -46,6 +47,14 @@ static void usage(const char *msg = nullptr) {
 
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
+  --accelcache <dir>   Save the BVHs that are built to files in <dir>, and
+                       read them from there when the geometry is the same.
+  --adaptive <err>     Stop sampling pixels once the relative error of their
+                       estimate falls below <err>.
+  --adaptivespp <num>  Spend an average of <num> samples per pixel, giving
+                       more to noisier pixels.
+  --checkpoint <sec>   Save the render in progress to <outfile>.checkpoint
+                       every <sec> seconds.
   --cropwindow <x0,x1,y0,y1> Specify an image crop window.
   --help               Print this help text.
   --nthreads <num>     Use specified number of threads for rendering.
@@ -53,6 +62,12 @@ Rendering options:
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --resume             Continue the render saved by --checkpoint.
+  --tileorder <order>  Order in which image tiles are rendered: "hilbert"
+                       (default), "spiral" or "scanline".
+  --tilesize <num>     Edge length of image tiles, in pixels. Default: chosen
+                       from the resolution, sample count and thread count.
+  --nosplittiles       Do not split the last image tiles of the frame.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -117,6 +132,53 @@ int main(int argc, char *argv[]) {
             options.quickRender = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
             options.quiet = true;
+        } else if (!strcmp(argv[i], "--accelcache") ||
+                   !strcmp(argv[i], "-accelcache")) {
+            if (i + 1 == argc)
+                usage("missing value after --accelcache argument");
+            options.accelCacheDir = argv[++i];
+        } else if (!strcmp(argv[i], "--adaptive") ||
+                   !strcmp(argv[i], "-adaptive")) {
+            if (i + 1 == argc)
+                usage("missing value after --adaptive argument");
+            options.adaptiveError = atof(argv[++i]);
+            if (options.adaptiveError <= 0)
+                usage("--adaptive must be positive");
+        } else if (!strcmp(argv[i], "--adaptivespp") ||
+                   !strcmp(argv[i], "-adaptivespp")) {
+            if (i + 1 == argc)
+                usage("missing value after --adaptivespp argument");
+            options.adaptiveSpp = atof(argv[++i]);
+            if (options.adaptiveSpp <= 0)
+                usage("--adaptivespp must be positive");
+        } else if (!strcmp(argv[i], "--checkpoint") ||
+                   !strcmp(argv[i], "-checkpoint")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpoint argument");
+            options.checkpointInterval = atof(argv[++i]);
+            if (options.checkpointInterval <= 0)
+                usage("--checkpoint must be positive");
+        } else if (!strcmp(argv[i], "--resume") ||
+                   !strcmp(argv[i], "-resume")) {
+            options.resume = true;
+        } else if (!strcmp(argv[i], "--tileorder") ||
+                   !strcmp(argv[i], "-tileorder")) {
+            if (i + 1 == argc)
+                usage("missing value after --tileorder argument");
+            options.tileOrder = argv[++i];
+            TileOrder order;
+            if (!ParseTileOrder(options.tileOrder, &order))
+                usage("unknown --tileorder; expected \"hilbert\", "
+                      "\"spiral\" or \"scanline\"");
+        } else if (!strcmp(argv[i], "--tilesize") ||
+                   !strcmp(argv[i], "-tilesize")) {
+            if (i + 1 == argc)
+                usage("missing value after --tilesize argument");
+            options.tileSize = atoi(argv[++i]);
+            if (options.tileSize <= 0) usage("--tilesize must be positive");
+        } else if (!strcmp(argv[i], "--nosplittiles") ||
+                   !strcmp(argv[i], "-nosplittiles")) {
+            options.splitTailTiles = false;
         } else if (!strcmp(argv[i], "--cat") || !strcmp(argv[i], "-cat")) {
             options.cat = true;
         } else if (!strcmp(argv[i], "--toply") || !strcmp(argv[i], "-toply")) {
@@ -0,0 +1,167 @@
+#include "materials/kullaconty.h"
+#include "materials/metal.h"
+#include "materials/multimicro.h"
+#include "interaction.h"
+#include "reflection.h"
+#include "texture.h"
+#include "paramset.h"
+#include "rng.h"
+#include <map>
+
+namespace pbrt {
+
+// Cosine-weighted albedo of the single-scattering lobes of a dielectric, for
+// light arriving from _wo_
+static Float DielectricSingleScatteringAlbedo(const Vector3f &wo, Float alpha,
+                                              bool beck, Float eta) {
+    const int nSamples = 1024;
+    BeckmannDistribution beckmann(alpha, alpha);
+    TrowbridgeReitzDistribution ggx(alpha, alpha);
+    MicrofacetDistribution *distrib =
+        beck ? (MicrofacetDistribution *)&beckmann : &ggx;
+    FresnelDielectric fresnel(1.f, eta);
+    MicrofacetReflection reflection(Spectrum(1.f), distrib, &fresnel);
+    MicrofacetTransmission transmission(Spectrum(1.f), distrib, 1.f, eta,
+                                        TransportMode::Importance);
+    // Sample both lobes in turn; the estimator weights by their average pdf
+    RNG rng;
+    Float albedo = 0;
+    for (int i = 0; i < nSamples; ++i) {
+        Point2f u((i / 2 + rng.UniformFloat()) / (nSamples / 2),
+                  rng.UniformFloat());
+        Vector3f wi;
+        Float pdf = 0;
+        if (i % 2 == 0)
+            reflection.Sample_f(wo, &wi, u, &pdf, nullptr);
+        else
+            transmission.Sample_f(wo, &wi, u, &pdf, nullptr);
+        // Like _BSDF::Sample_f()_, drop what the sampled lobe rejects (a
+        // refraction leaving upwards), which the other lobe covers
+        if (pdf == 0) continue;
+        pdf = (reflection.Pdf(wo, wi) + transmission.Pdf(wo, wi)) / 2;
+        if (pdf == 0 || wi.z == 0) continue;
+        // The microfacet lobes leave the side to _BSDF::f()_
+        Spectrum f = SameHemisphere(wo, wi) ? reflection.f(wo, wi)
+                                            : transmission.f(wo, wi);
+        albedo += f[0] * AbsCosTheta(wi) / pdf;
+    }
+    return albedo / nSamples;
+}
+
+const MicrosurfaceHigherOrders *KullaContyCompensation(
+    MicrosurfaceMaterial material, bool beck, Float eta,
+    const std::string &filename, int nWalks) {
+    const MicrosurfaceHigherOrders *walks = MicrosurfaceHigherOrderTable(
+        material, false, beck, eta, filename, nWalks);
+    if (material != MICROSURFACE_DIELECTRIC) return walks;
+
+    // pbrt's transmission lobe masks with 1 / (1 + Lambda_i + Lambda_o)
+    // rather than the height-correlated Beta(1 + Lambda_i, 1 + Lambda_o)
+    // of the walks, and overestimates single transmission at high
+    // roughness. The compensation only adds the energy it actually misses;
+    // the walks still decide how that splits between the two sides
+    static std::map<std::string, std::unique_ptr<MicrosurfaceHigherOrders>>
+        compensations;
+    std::unique_ptr<MicrosurfaceHigherOrders> &compensation =
+        compensations[walks->description()];
+    if (!compensation) {
+        compensation.reset(new MicrosurfaceHigherOrders(*walks));
+        compensation->rescale([&](float cosTheta, float alpha) -> float {
+            if (alpha < 1e-3f) return 0;
+            Vector3f wo(std::sqrt(std::max(0.f, 1 - cosTheta * cosTheta)),
+                        0, cosTheta);
+            return 1 - DielectricSingleScatteringAlbedo(wo, alpha, beck, eta);
+        });
+    }
+    return compensation.get();
+}
+
+// KullaContyMaterial Method Definitions
+void KullaContyMaterial::ComputeScatteringFunctions(
+    SurfaceInteraction *si, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    if (bumpMap) Bump(bumpMap, si);
+    bool dielectric = material == MICROSURFACE_DIELECTRIC;
+    si->bsdf = ARENA_ALLOC(arena, BSDF)(*si, dielectric ? eta : 1);
+    Float roughu = roughnessX->Evaluate(*si);
+    Float roughv = roughnessY->Evaluate(*si);
+    MicrofacetDistribution *distrib;
+    if (beck)
+        distrib = ARENA_ALLOC(arena, BeckmannDistribution)(roughu, roughv);
+    else
+        distrib =
+            ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(roughu, roughv);
+    // The tables are isotropic
+    Float alpha = std::sqrt(roughu * roughv);
+
+    if (dielectric) {
+        // Both single-scattering lobes are lossless, so the higher orders
+        // leave uncoloured
+        Fresnel *fresnel = ARENA_ALLOC(arena, FresnelDielectric)(1.f, eta);
+        si->bsdf->Add(
+            ARENA_ALLOC(arena, MicrofacetReflection)(1., distrib, fresnel));
+        si->bsdf->Add(ARENA_ALLOC(arena, MicrofacetTransmission)(
+            1., distrib, 1.f, eta, mode));
+        si->bsdf->Add(ARENA_ALLOC(arena, KullaContyBxDF)(
+            higherOrders, alpha, Spectrum(1.f), true, 1.f, eta, mode));
+        return;
+    }
+
+    // Black optical constants stand for a perfect reflector
+    Spectrum etaC = conductorEta->Evaluate(*si), kC = k->Evaluate(*si);
+    Fresnel *fresnel;
+    if (etaC.IsBlack() && kC.IsBlack())
+        fresnel = ARENA_ALLOC(arena, FresnelNoOp)();
+    else
+        fresnel = ARENA_ALLOC(arena, FresnelConductor)(1.f, etaC, kC);
+    si->bsdf->Add(
+        ARENA_ALLOC(arena, MicrofacetReflection)(1., distrib, fresnel));
+    Float Eavg = 1 - higherOrders->averageReflected(true, alpha);
+    Spectrum Fms = KullaContyBxDF::MultipleScatteringFresnel(
+        KullaContyBxDF::AverageFresnel(*fresnel), Eavg);
+    si->bsdf->Add(ARENA_ALLOC(arena, KullaContyBxDF)(higherOrders, alpha, Fms));
+}
+
+KullaContyMaterial *CreateKullaContyMaterial(const TextureParams &mp,
+                                             MicrosurfaceMaterial material) {
+    if (material == MICROSURFACE_DIFFUSE) {
+        Warning("Kulla-Conty materials are conductors or dielectrics; "
+                "using a conductor.");
+        material = MICROSURFACE_CONDUCTOR;
+    }
+    std::shared_ptr<Texture<Float>> roughnessX =
+        mp.GetFloatTexture("roughnessX", .1f);
+    std::shared_ptr<Texture<Float>> roughnessY =
+        mp.GetFloatTexture("roughnessY", .1f);
+    std::shared_ptr<Texture<Float>> bumpMap =
+        mp.GetFloatTextureOrNull("bumpmap");
+    bool beck = mp.FindBool("beckmann", false);
+
+    Float eta = 1.5f;
+    std::shared_ptr<Texture<Spectrum>> conductorEta, k;
+    if (material == MICROSURFACE_DIELECTRIC)
+        eta = mp.FindFloat("eta", 1.5f);
+    else {
+        static Spectrum copperN =
+            Spectrum::FromSampled(CopperWavelengths, CopperN, CopperSamples);
+        static Spectrum copperK =
+            Spectrum::FromSampled(CopperWavelengths, CopperK, CopperSamples);
+        conductorEta = mp.GetSpectrumTexture("eta", copperN);
+        k = mp.GetSpectrumTexture("k", copperK);
+    }
+
+    // The energy of the higher orders comes from walks on the lossless
+    // microsurface; "albedofile" keeps it across runs
+    int nWalks = mp.FindInt("albedowalks", 4096);
+    if (nWalks < 1) {
+        Warning("\"albedowalks\" must be at least 1; using 4096.");
+        nWalks = 4096;
+    }
+    const MicrosurfaceHigherOrders *higherOrders = KullaContyCompensation(
+        material, beck, eta, mp.FindFilename("albedofile", ""), nWalks);
+    return new KullaContyMaterial(roughnessX, roughnessY, bumpMap, beck,
+                                  higherOrders, material, eta, conductorEta,
+                                  k);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,69 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_MATERIALS_KULLACONTY_H
+#define PBRT_MATERIALS_KULLACONTY_H
+
+#include "pbrt.h"
+#include "material.h"
+#include "acg_final/MicrosurfaceSpecialized.h"
+#include "acg_final/MicrosurfaceTable.h"
+#include <memory>
+
+namespace pbrt {
+
+// KullaContyMaterial Declarations
+// A single-scattering microfacet conductor or dielectric with the energy of
+// the missing bounces added back by a _KullaContyBxDF_; a cheap stand-in for
+// the multimicro materials, whose walks tabulate that energy
+class KullaContyMaterial : public Material {
+  public:
+    KullaContyMaterial(const std::shared_ptr<Texture<Float>> &roughnessX,
+                       const std::shared_ptr<Texture<Float>> &roughnessY,
+                       const std::shared_ptr<Texture<Float>> &bumpMap,
+                       bool beck, const MicrosurfaceHigherOrders *higherOrders,
+                       MicrosurfaceMaterial material, Float eta,
+                       const std::shared_ptr<Texture<Spectrum>> &conductorEta,
+                       const std::shared_ptr<Texture<Spectrum>> &k)
+        : roughnessX(roughnessX),
+          roughnessY(roughnessY),
+          bumpMap(bumpMap),
+          beck(beck),
+          higherOrders(higherOrders),
+          material(material),
+          eta(eta),
+          conductorEta(conductorEta),
+          k(k) {}
+    void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
+                                    TransportMode mode,
+                                    bool allowMultipleLobes) const;
+
+  private:
+    std::shared_ptr<Texture<Float>> roughnessX, roughnessY, bumpMap;
+    bool beck;
+    // Energy the single-scattering lobes lose, from _KullaContyCompensation()_
+    const MicrosurfaceHigherOrders *higherOrders;
+    // The dielectric's index of refraction or the conductor's complex one
+    MicrosurfaceMaterial material;
+    Float eta;
+    std::shared_ptr<Texture<Spectrum>> conductorEta, k;
+};
+
+// Energy the compensation lobe gives back: the higher orders of the walks on
+// a conductor, and for a dielectric what its single-scattering lobes lose,
+// split between the sides like the higher orders of the walks
+const MicrosurfaceHigherOrders *KullaContyCompensation(
+    MicrosurfaceMaterial material, bool beck, Float eta,
+    const std::string &filename = "", int nWalks = 4096);
+
+// "kullaconty" is a dielectric and "kullacontyconductor" a conductor; both
+// take the parameters of the matching multimicro materials
+KullaContyMaterial *CreateKullaContyMaterial(
+    const TextureParams &mp,
+    MicrosurfaceMaterial material = MICROSURFACE_DIELECTRIC);
+
+}  // namespace pbrt
+
+#endif
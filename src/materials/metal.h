@@ -70,6 +70,10 @@ class MetalMaterial : public Material {
 
 MetalMaterial *CreateMetalMaterial(const TextureParams &mp);
 
+// Measured index of refraction and absorption of copper, the default metal
+extern const int CopperSamples;
+extern const Float CopperWavelengths[], CopperN[], CopperK[];
+
 }  // namespace pbrt
 
 #endif  // PBRT_MATERIALS_METAL_H
@@ -1,5 +1,6 @@
 
 #include "materials/multimicro.h"
+#include "materials/metal.h"
 #include "interaction.h"
 #include "reflection.h"
 #include "texture.h"
@@ -8,19 +9,89 @@
 
 namespace pbrt {
 
+std::map<std::string, std::unique_ptr<MicrosurfaceTable>>
+    MultiMicroMaterial::loadedTables;
+
+// Name of a microsurface in the table caches and files
+static std::string Description(MicrosurfaceMaterial material, bool uni,
+                               bool beck, Float eta) {
+    const char *names[3] = {"conductor", "dielectric", "diffuse"};
+    return StringPrintf("%s %s %s eta %f", names[material],
+                        uni ? "uniform" : "gaussian", beck ? "beckmann" : "ggx",
+                        eta);
+}
+
+// The lossless reference microsurface of an isotropic roughness, for the
+// tables
+static MicrosurfaceTable::Factory ReferenceFactory(
+    MicrosurfaceMaterial material, bool uni, bool beck, Float eta) {
+    return [=](float alpha) {
+        Microsurface *ms;
+        if (material == MICROSURFACE_CONDUCTOR)
+            ms = new MicrosurfaceConductor(uni, beck, alpha, alpha);
+        else if (material == MICROSURFACE_DIELECTRIC)
+            ms = new MicrosurfaceDielectric(uni, beck, alpha, alpha, eta);
+        else
+            ms = new MicrosurfaceDiffuse(uni, beck, alpha, alpha);
+        return std::unique_ptr<Microsurface>(ms);
+    };
+}
+
+const MicrosurfaceHigherOrders *MicrosurfaceHigherOrderTable(
+    MicrosurfaceMaterial material, bool uni, bool beck, Float eta,
+    const std::string &filename, int nWalks) {
+    static std::map<std::string, std::unique_ptr<MicrosurfaceHigherOrders>>
+        tables;
+    std::string description = Description(material, uni, beck, eta);
+    std::unique_ptr<MicrosurfaceHigherOrders> &loaded = tables[description];
+    if (!loaded && !filename.empty())
+        loaded = MicrosurfaceHigherOrders::read(filename, description);
+    if (!loaded) {
+        LOG(INFO) << "Tabulating higher scattering orders for "
+                  << description;
+        loaded.reset(new MicrosurfaceHigherOrders(
+            description, ReferenceFactory(material, uni, beck, eta), nWalks));
+        if (!filename.empty()) loaded->write(filename);
+    }
+    return loaded.get();
+}
+
+// Seed for the random walks of a single shading point; it only depends on
+// the hit itself, so renders are reproducible for any number of threads.
+static uint64_t ShadingPointSeed(const SurfaceInteraction &si) {
+    const Float v[6] = {si.p.x, si.p.y, si.p.z, si.wo.x, si.wo.y, si.wo.z};
+    uint64_t h = 0;
+    for (Float f : v) {
+        // splitmix64 finalizer
+        h += (uint64_t)FloatToBits(f) + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
 void MultiMicroMaterial::ComputeScatteringFunctions(SurfaceInteraction *si,
                                                     MemoryArena &arena,
                                                     TransportMode mode,
                                                     bool allowMultipleLobes) const {
     if(bumpMap) Bump(bumpMap, si);
-    float eta = 1.5f;
-    si->bsdf = ARENA_ALLOC(arena, BSDF)(*si, eta);
+    si->bsdf = ARENA_ALLOC(arena, BSDF)(
+        *si, material == MICROSURFACE_DIELECTRIC ? eta : 1);
     Float roughu = roughnessX->Evaluate(*si);
     Float roughv = roughnessY->Evaluate(*si);
-    si->bsdf->Add(ARENA_ALLOC(arena, MultiMicroBSDF)(m_microsurface, roughu, roughv));
+    MicrosurfaceOptics optics(eta);
+    if (conductorEta) optics.conductor_eta = conductorEta->Evaluate(*si);
+    if (k) optics.conductor_k = k->Evaluate(*si);
+    if (albedo) optics.albedo = albedo->Evaluate(*si).Clamp(0, 1);
+    Microsurface *microsurface = allocator(arena, roughu, roughv, optics);
+    si->bsdf->Add(ARENA_ALLOC(arena, MultiMicroBSDF)(
+        microsurface, ShadingPointSeed(*si), table, nWalks, higherOrders,
+        singleThreshold));
 }
 
-MultiMicroMaterial *CreateMultiMicroMaterial(const TextureParams &mp) {
+MultiMicroMaterial *CreateMultiMicroMaterial(const TextureParams &mp,
+                                             MicrosurfaceMaterial material) {
     std::shared_ptr<Texture<Float>> roughnessX =
         mp.GetFloatTexture("roughnessX", .1f);
     std::shared_ptr<Texture<Float>> roughnessY =
@@ -29,7 +100,84 @@ MultiMicroMaterial *CreateMultiMicroMaterial(const TextureParams &mp) {
         mp.GetFloatTextureOrNull("bumpmap");
     bool uni = mp.FindBool("uniform", false);
     bool beck = mp.FindBool("beckmann", false);
-    return new MultiMicroMaterial(roughnessX, roughnessY, bumpMap, uni, beck);
+
+    // Index of refraction of the dielectric, or the spectral optical
+    // constants of the reflective microsurfaces
+    Float eta = 1.5f;
+    std::shared_ptr<Texture<Spectrum>> conductorEta, k, albedo;
+    if (material == MICROSURFACE_DIELECTRIC)
+        eta = mp.FindFloat("eta", 1.5f);
+    else if (material == MICROSURFACE_CONDUCTOR) {
+        static Spectrum copperN =
+            Spectrum::FromSampled(CopperWavelengths, CopperN, CopperSamples);
+        static Spectrum copperK =
+            Spectrum::FromSampled(CopperWavelengths, CopperK, CopperSamples);
+        conductorEta = mp.GetSpectrumTexture("eta", copperN);
+        k = mp.GetSpectrumTexture("k", copperK);
+    } else if (material == MICROSURFACE_DIFFUSE)
+        albedo = mp.GetSpectrumTexture("albedo", Spectrum(0.5f));
+
+    // Precompute the random-walk lobes, or read them from "tablefile" if
+    // it was written for the same microsurface before
+    const MicrosurfaceTable *table = nullptr;
+    bool tabulate = mp.FindBool("tabulate", false);
+    if (tabulate && material != MICROSURFACE_DIELECTRIC) {
+        Warning("\"tabulate\" is only supported by dielectric multimicro "
+                "materials; ignoring it.");
+        tabulate = false;
+    }
+    if (tabulate) {
+        std::string description = Description(material, uni, beck, eta);
+        std::string filename = mp.FindFilename("tablefile", "");
+        std::unique_ptr<MicrosurfaceTable> &loaded =
+            MultiMicroMaterial::loadedTables[description];
+        if (!loaded && !filename.empty())
+            loaded = MicrosurfaceTable::read(filename, description);
+        if (!loaded) {
+            int nWalks = mp.FindInt("tablewalks", 64);
+            LOG(INFO) << "Tabulating multimicro lobes for " << description;
+            loaded.reset(new MicrosurfaceTable(
+                description, ReferenceFactory(material, uni, beck, eta),
+                nWalks));
+            if (!filename.empty()) loaded->write(filename);
+        }
+        table = loaded.get();
+    }
+    int nWalks = mp.FindInt("walks", 1);
+    if (nWalks < 1) {
+        Warning("\"walks\" must be at least 1; using 1.");
+        nWalks = 1;
+    }
+
+    // Walks stop by Russian roulette from their "rrorder"-th bounce on,
+    // continuing with at most "rrcontinue" probability; f() skips the walks
+    // where the bounces after the first are estimated to carry less than
+    // "singlethreshold" of the energy, so that it leaves out up to that
+    // much of what sampled walks return. Both are off by default. The
+    // energy of the higher orders is read from "higherorderfile" if it was
+    // written for the same microsurface before
+    MicrosurfaceRoulette roulette(mp.FindInt("rrorder", 0),
+                                  mp.FindFloat("rrcontinue", .9f));
+    if (roulette.continuation <= 0 || roulette.continuation > 1) {
+        Warning("\"rrcontinue\" must be in (0, 1]; using 1.");
+        roulette.continuation = 1;
+    }
+    Float singleThreshold = mp.FindFloat("singlethreshold", 0);
+    const MicrosurfaceHigherOrders *higherOrders = nullptr;
+    if (singleThreshold > 0)
+        higherOrders = MicrosurfaceHigherOrderTable(
+            material, uni, beck, eta, mp.FindFilename("higherorderfile", ""));
+
+    // "specialized" false keeps the reference microsurfaces, whose height
+    // and slope distributions are virtual; "beckmanntable" false samples
+    // Beckmann slopes with the iterative solver instead of the table
+    MicrosurfaceAllocator allocator = microsurfaceAllocator(
+        material, uni, beck, mp.FindBool("specialized", true),
+        mp.FindBool("beckmanntable", true), roulette);
+    return new MultiMicroMaterial(roughnessX, roughnessY, bumpMap, uni, beck,
+                                  table, nWalks, allocator, material, eta,
+                                  conductorEta, k, albedo, higherOrders,
+                                  singleThreshold);
 }
 
 }  // namespace pbrt
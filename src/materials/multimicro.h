@@ -9,6 +9,9 @@
 #include "pbrt.h"
 #include "material.h"
 #include "acg_final/MicrosurfaceScattering.h"
+#include "acg_final/MicrosurfaceSpecialized.h"
+#include "acg_final/MicrosurfaceTable.h"
+#include <map>
 #include <memory>
 
 namespace pbrt {
@@ -20,26 +23,78 @@ class MultiMicroMaterial : public Material {
     MultiMicroMaterial(const std::shared_ptr<Texture<Float>> &roughnessX,
                     const std::shared_ptr<Texture<Float>> &roughnessY,
                     const std::shared_ptr<Texture<Float>> &bumpMap,
-                    bool uni, bool beck) :
+                    bool uni, bool beck,
+                    const MicrosurfaceTable *table = nullptr,
+                    int nWalks = 1,
+                    MicrosurfaceAllocator allocator = nullptr,
+                    MicrosurfaceMaterial material = MICROSURFACE_DIELECTRIC,
+                    Float eta = 1.5f,
+                    const std::shared_ptr<Texture<Spectrum>> &conductorEta = nullptr,
+                    const std::shared_ptr<Texture<Spectrum>> &k = nullptr,
+                    const std::shared_ptr<Texture<Spectrum>> &albedo = nullptr,
+                    const MicrosurfaceHigherOrders *higherOrders = nullptr,
+                    Float singleThreshold = 0) :
           roughnessX(roughnessX),
           roughnessY(roughnessY),
           bumpMap(bumpMap),
           uni(uni),
-          beck(beck) {
-            std::shared_ptr<Microsurface> temp(new MicrosurfaceDielectric(uni, beck));
-            m_microsurface = temp;
-          }
+          beck(beck),
+          table(table),
+          nWalks(nWalks),
+          allocator(allocator ? allocator
+                              : microsurfaceAllocator(material, uni, beck)),
+          material(material),
+          eta(eta),
+          conductorEta(conductorEta),
+          k(k),
+          albedo(albedo),
+          higherOrders(higherOrders),
+          singleThreshold(singleThreshold) {}
     void ComputeScatteringFunctions(SurfaceInteraction *si, MemoryArena &arena,
                                     TransportMode mode,
                                     bool allowMultipleLobes) const;
 
   private:
     std::shared_ptr<Texture<Float>> roughnessX, roughnessY, bumpMap;
-    std::shared_ptr<Microsurface> m_microsurface;
     bool uni, beck;
+    // Optional tabulated lobes, shared by all materials with the same
+    // height/slope distributions
+    const MicrosurfaceTable *table;
+    static std::map<std::string, std::unique_ptr<MicrosurfaceTable>>
+        loadedTables;
+    // Random walks averaged per BSDF evaluation
+    int nWalks;
+    // Allocates the microsurface of a hit, with the roulette its walks stop
+    // by; chosen once, so the walks of the specialized microsurfaces make no
+    // virtual calls
+    MicrosurfaceAllocator allocator;
+    // Optical constants: the dielectric's index of refraction, the
+    // conductor's complex one and the albedo of diffuse microfacets; the
+    // spectral ones are accumulated along a single walk
+    MicrosurfaceMaterial material;
+    Float eta;
+    std::shared_ptr<Texture<Spectrum>> conductorEta, k, albedo;
+    // Shortcut to single scattering where the higher orders carry less
+    // than _singleThreshold_ of the energy
+    const MicrosurfaceHigherOrders *higherOrders;
+    Float singleThreshold;
+    friend MultiMicroMaterial *CreateMultiMicroMaterial(
+        const TextureParams &mp, MicrosurfaceMaterial material);
 };
 
-MultiMicroMaterial *CreateMultiMicroMaterial(const TextureParams &mp);
+// Energy of the higher scattering orders of a lossless microsurface, shared
+// by all materials built on the same one; it is read from _filename_ if that
+// was written for the same microsurface, and tabulated from _nWalks_ walks
+// per entry (and written there) otherwise
+const MicrosurfaceHigherOrders *MicrosurfaceHigherOrderTable(
+    MicrosurfaceMaterial material, bool uni, bool beck, Float eta,
+    const std::string &filename = "", int nWalks = 4096);
+
+// "multimicro" is a dielectric; "multimicroconductor" and
+// "multimicrodiffuse" select the other microsurface materials
+MultiMicroMaterial *CreateMultiMicroMaterial(
+    const TextureParams &mp,
+    MicrosurfaceMaterial material = MICROSURFACE_DIELECTRIC);
 
 }  // namespace pbrt
 
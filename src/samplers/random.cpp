@@ -61,6 +61,7 @@ std::unique_ptr<Sampler> RandomSampler::Clone(int seed) {
 
 void RandomSampler::StartPixel(const Point2i &p) {
     ProfilePhase _(Prof::StartPixel);
+    rng.SetSequence(PixelSequence(p));
     for (size_t i = 0; i < sampleArray1D.size(); ++i)
         for (size_t j = 0; j < sampleArray1D[i].size(); ++j)
             sampleArray1D[i][j] = rng.UniformFloat();
@@ -69,6 +70,26 @@ void RandomSampler::StartPixel(const Point2i &p) {
         for (size_t j = 0; j < sampleArray2D[i].size(); ++j)
             sampleArray2D[i][j] = {rng.UniformFloat(), rng.UniformFloat()};
     Sampler::StartPixel(p);
+    StartSampleStream();
+}
+
+bool RandomSampler::StartNextSample() {
+    bool more = Sampler::StartNextSample();
+    StartSampleStream();
+    return more;
+}
+
+bool RandomSampler::SetSampleNumber(int64_t sampleNum) {
+    bool valid = Sampler::SetSampleNumber(sampleNum);
+    StartSampleStream();
+    return valid;
+}
+
+void RandomSampler::StartSampleStream() {
+    // Draw the current sample's values from its own part of the pixel's
+    // sequence, after the values of the sample arrays
+    rng.SetSequence(PixelSequence(currentPixel));
+    rng.Advance(SampleStreamOffset(currentPixelSampleIndex));
 }
 
 Sampler *CreateRandomSampler(const ParamSet &params) {
@@ -185,6 +185,54 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
+Bounds3f Triangle::ClippedWorldBound(const Bounds3f &box) const {
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh->p[v[0]];
+    const Point3f &p1 = mesh->p[v[1]];
+    const Point3f &p2 = mesh->p[v[2]];
+
+    // Bound the error of the vertices that clipping computes; vertices
+    // within it of a plane are taken to be on its inside, so that the
+    // polygon only ever grows
+    Vector3f pAbs = Max(Max(Abs(Vector3f(p0)), Abs(Vector3f(p1))),
+                        Abs(Vector3f(p2)));
+    Vector3f pError = gamma(7) * pAbs;
+
+    // Clip the triangle against the two planes of each of _box_'s slabs;
+    // each plane adds at most one vertex to the polygon
+    Point3f poly[9] = {p0, p1, p2}, clipped[9];
+    int n = 3;
+    for (int axis = 0; axis < 3; ++axis)
+        for (int side = 0; side < 2; ++side) {
+            Float plane = box[side][axis];
+            auto inside = [&](const Point3f &p) {
+                return side == 0 ? p[axis] >= plane - pError[axis]
+                                 : p[axis] <= plane + pError[axis];
+            };
+            int nClipped = 0;
+            for (int i = 0; i < n; ++i) {
+                const Point3f &p = poly[i], &q = poly[(i + 1) % n];
+                if (inside(p)) clipped[nClipped++] = p;
+                if (inside(p) != inside(q)) {
+                    Point3f pc =
+                        Lerp((plane - p[axis]) / (q[axis] - p[axis]), p, q);
+                    pc[axis] = plane;
+                    clipped[nClipped++] = pc;
+                }
+            }
+            n = nClipped;
+            if (n == 0) return Bounds3f();
+            std::copy(clipped, clipped + n, poly);
+        }
+
+    // Bound the clipped polygon, allowing for the error of its vertices
+    // but not beyond the triangle or the box
+    Bounds3f b;
+    for (int i = 0; i < n; ++i) b = Union(b, poly[i]);
+    b = Bounds3f(b.pMin - pError, b.pMax + pError);
+    return pbrt::Intersect(pbrt::Intersect(b, box), WorldBound());
+}
+
 bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                          bool testAlphaTexture) const {
     ProfilePhase p(Prof::TriIntersect);
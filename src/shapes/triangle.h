@@ -81,6 +81,7 @@ class Triangle : public Shape {
     }
     Bounds3f ObjectBound() const;
     Bounds3f WorldBound() const;
+    Bounds3f ClippedWorldBound(const Bounds3f &box) const;
     bool Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    bool testAlphaTexture = true) const;
     bool IntersectP(const Ray &ray, bool testAlphaTexture = true) const;
@@ -0,0 +1,66 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "integrator.h"
+#include "rng.h"
+
+using namespace pbrt;
+
+TEST(AdaptiveSampling, PixelStatistics) {
+    AdaptivePixel p;
+    for (Float y : {1.f, 3.f, 1.f, 3.f}) p.AddSample(y);
+    EXPECT_EQ(4, p.nSamples);
+    EXPECT_FLOAT_EQ(2, p.mean);
+    // Sample variance 4/3, relative to a mean of 2
+    EXPECT_FLOAT_EQ(1.f / 3.f, p.RelativeVariance());
+    EXPECT_FLOAT_EQ(std::sqrt(1.f / 12.f), p.RelativeError());
+
+    AdaptivePixel flat;
+    for (int i = 0; i < 8; ++i) flat.AddSample(.5f);
+    EXPECT_EQ(0, flat.RelativeError());
+}
+
+TEST(AdaptiveSampling, Allocation) {
+    // Pixels with relative variances spread over a few orders of magnitude,
+    // a flat one among them, after a first pass of 8 samples each
+    const int nPixels = 1000, nFirst = 8, maxSamples = 1024;
+    std::vector<AdaptivePixel> pixels(nPixels);
+    RNG rng;
+    for (int i = 0; i < nPixels; ++i) {
+        Float sigma = i == 0 ? 0 : std::pow(10.f, 2 * rng.UniformFloat() - 1);
+        for (int s = 0; s < nFirst; ++s)
+            pixels[i].AddSample(1 + sigma * (s % 2 ? 1 : -1) / 2);
+    }
+    // A pixel outside of the pixel bounds, which took no samples
+    pixels.push_back(AdaptivePixel());
+
+    for (double spp : {16., 64., 256.}) {
+        AllocateAdaptiveSamples(pixels, spp * nPixels, maxSamples);
+        double total = 0;
+        for (const AdaptivePixel &p : pixels) {
+            if (p.nSamples == 0) {
+                EXPECT_EQ(0, p.maxSamples);
+                continue;
+            }
+            EXPECT_GE(p.maxSamples, p.nSamples);
+            EXPECT_LE(p.maxSamples, maxSamples);
+            total += p.maxSamples;
+        }
+        // The budget is spent, up to rounding
+        EXPECT_NEAR(spp * nPixels, total, nPixels);
+        // The flat pixel gets no more samples
+        EXPECT_EQ(nFirst, pixels[0].maxSamples);
+        // Noisier pixels get at least as many samples
+        for (int i = 1; i < nPixels; ++i)
+            for (int j = 1; j < 10; ++j)
+                if (pixels[i].RelativeVariance() >
+                    pixels[j].RelativeVariance()) {
+                    EXPECT_GE(pixels[i].maxSamples, pixels[j].maxSamples);
+                }
+    }
+
+    // Budgets beyond what the pixels may take give each the maximum
+    AllocateAdaptiveSamples(pixels, 2. * maxSamples * nPixels, maxSamples);
+    for (int i = 1; i < nPixels; ++i)
+        EXPECT_EQ(maxSamples, pixels[i].maxSamples);
+}
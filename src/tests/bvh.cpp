@@ -0,0 +1,301 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "rng.h"
+#include "shapes/triangle.h"
+
+using namespace pbrt;
+
+static std::vector<std::shared_ptr<Primitive>> MeshPrimitives(
+    const std::vector<Point3f> &p) {
+    static Transform identity;
+    std::vector<int> indices(p.size());
+    for (size_t i = 0; i < p.size(); ++i) indices[i] = i;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const std::shared_ptr<Shape> &tri : CreateTriangleMesh(
+             &identity, &identity, false, p.size() / 3, indices.data(),
+             p.size(), p.data(), nullptr, nullptr, nullptr, nullptr, nullptr))
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+// Small random triangles in the unit cube at _origin_, with their z
+// coordinates scaled by _zScale_; 100K of them are enough for the SAH build
+// to bin the top levels in parallel
+static std::vector<std::shared_ptr<Primitive>> RandomTriangles(
+    int nTris, Point3f origin = Point3f(0, 0, 0), Float zScale = 1) {
+    RNG rng;
+    std::vector<Point3f> p;
+    for (int t = 0; t < nTris; ++t) {
+        Point3f c(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        for (int v = 0; v < 3; ++v) {
+            Point3f pv = c + 0.01f * Vector3f(rng.UniformFloat() - .5f,
+                                              rng.UniformFloat() - .5f,
+                                              rng.UniformFloat() - .5f);
+            pv.z *= zScale;
+            p.push_back(origin + Vector3f(pv));
+        }
+    }
+    return MeshPrimitives(p);
+}
+
+// Long, thin triangles in the unit cube, which the bounds of object splits
+// cannot separate well; half of them lie in planes of constant z
+static std::vector<std::shared_ptr<Primitive>> SliverTriangles(int nTris) {
+    RNG rng;
+    std::vector<Point3f> p;
+    for (int t = 0; t < nTris; ++t) {
+        Point3f p0(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        Point3f p1 = p0 + 0.3f * Vector3f(rng.UniformFloat() - .5f,
+                                          rng.UniformFloat() - .5f,
+                                          rng.UniformFloat() - .5f);
+        Point3f p2 = p0 + 0.01f * Vector3f(rng.UniformFloat(),
+                                           rng.UniformFloat(),
+                                           rng.UniformFloat());
+        if (t & 1) p1.z = p2.z = p0.z;
+        p.insert(p.end(), {p0, p1, p2});
+    }
+    return MeshPrimitives(p);
+}
+
+// Triangles of growing size around the point (.5, .5, .5), in parallel
+// planes, whose bounds all have that point as their centroid; the builds
+// cannot split them and put them all in one leaf
+static std::vector<std::shared_ptr<Primitive>> NestedTriangles(int nTris) {
+    const Point3f c(.5f, .5f, .5f);
+    const Vector3f d[3] = {Vector3f(-1, -1, -1), Vector3f(1, 0, 1),
+                           Vector3f(0, 1, 0)};
+    std::vector<Point3f> p;
+    for (int t = 0; t < nTris; ++t)
+        for (int v = 0; v < 3; ++v) p.push_back(c + (t + 1) * 1e-3f * d[v]);
+    return MeshPrimitives(p);
+}
+
+TEST(BVH, ParallelBuildMatchesSerial) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(100000);
+    int nThreads = PbrtOptions.nThreads;
+
+    // Build with a single thread and with several, which run the subtrees
+    // and the binning of large nodes in parallel
+    PbrtOptions.nThreads = 1;
+    ParallelInit();
+    BVHAccel serial(prims, 4);
+    ParallelCleanup();
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    BVHAccel parallel(prims, 4);
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+
+    // The trees are the same
+    EXPECT_GT(serial.SAHCost(), 1);
+    EXPECT_EQ(serial.SAHCost(), parallel.SAHCost());
+    RNG rng(7);
+    for (int i = 0; i < 10000; ++i) {
+        Point3f o(rng.UniformFloat(), rng.UniformFloat(), -1);
+        Point3f target(rng.UniformFloat(), rng.UniformFloat(), 2);
+        Ray r0(o, target - o), r1 = r0;
+        SurfaceInteraction i0, i1;
+        bool hit0 = serial.Intersect(r0, &i0);
+        ASSERT_EQ(hit0, parallel.Intersect(r1, &i1));
+        if (hit0) {
+            EXPECT_EQ(r0.tMax, r1.tMax);
+            EXPECT_EQ(i0.primitive, i1.primitive);
+        }
+    }
+}
+
+// Checks that _bvh_ finds the same intersections as _reference_ for rays
+// from all directions towards _bounds_, starting inside and outside of it,
+// some of them short
+static void ExpectSameHits(const BVHAccel &reference, const BVHAccel &bvh,
+                           const Bounds3f &bounds, int seed) {
+    RNG rng(seed);
+    Bounds3f origins = Expand(bounds, MaxComponent(bounds.Diagonal()));
+    for (int i = 0; i < 20000; ++i) {
+        Point3f o = origins.Lerp(Point3f(
+            rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat()));
+        Point3f target = bounds.Lerp(Point3f(
+            rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat()));
+        Float tMax = (i % 4 == 0) ? rng.UniformFloat() : Infinity;
+        Ray r0(o, target - o, tMax), r1 = r0;
+        ASSERT_EQ(reference.IntersectP(r0), bvh.IntersectP(r1));
+        SurfaceInteraction i0, i1;
+        bool hit0 = reference.Intersect(r0, &i0);
+        ASSERT_EQ(hit0, bvh.Intersect(r1, &i1));
+        if (hit0) {
+            EXPECT_EQ(r0.tMax, r1.tMax);
+            EXPECT_EQ(i0.primitive, i1.primitive);
+        }
+    }
+}
+
+TEST(BVH, WideMatchesBinary) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(20000);
+    BVHAccel binary(prims, 4);
+    for (int width : {4, 8}) {
+        BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        // Collapsing the tree leaves the leaves as they are and drops
+        // interior nodes
+        EXPECT_LT(wide.SAHCost(), binary.SAHCost());
+        EXPECT_EQ(binary.WorldBound(), wide.WorldBound());
+        ExpectSameHits(binary, wide, binary.WorldBound(), width);
+    }
+}
+
+TEST(BVH, WideLargeLeaves) {
+    // Leaves of more primitives than fit in a byte
+    for (int nTris : {256, 300}) {
+        std::vector<std::shared_ptr<Primitive>> prims = NestedTriangles(nTris);
+        BVHAccel binary(prims, 4);
+        for (int width : {4, 8}) {
+            BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SAH, width);
+            ExpectSameHits(binary, wide, binary.WorldBound(), width);
+            BVHAccel sbvh(prims, 4, BVHAccel::SplitMethod::SBVH, width);
+            ExpectSameHits(binary, sbvh, binary.WorldBound(), width + 1);
+        }
+    }
+}
+
+TEST(BVH, QuantizedMatchesFloat) {
+    // Random triangles, and ones in the plane z = 1000 far from the origin,
+    // whose bounds are flat and whose coordinates are coarse floats
+    std::vector<std::shared_ptr<Primitive>> meshes[2] = {
+        RandomTriangles(20000),
+        RandomTriangles(20000, Point3f(1000, 1000, 1000), 0)};
+    for (const std::vector<std::shared_ptr<Primitive>> &prims : meshes) {
+        BVHAccel reference(prims, 4);
+        for (int bits : {16, 8}) {
+            BVHAccel quantized(prims, 4, BVHAccel::SplitMethod::SAH, 2, bits);
+            // The bounds are rounded outwards and the nodes are smaller
+            EXPECT_GE(quantized.SAHCost(), reference.SAHCost());
+            EXPECT_LT(quantized.NodeBytes(), reference.NodeBytes());
+            EXPECT_EQ(reference.WorldBound(), quantized.WorldBound());
+            ExpectSameHits(reference, quantized, reference.WorldBound(), bits);
+        }
+    }
+
+    // A single leaf
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(3);
+    BVHAccel reference(prims, 4);
+    BVHAccel quantized(prims, 4, BVHAccel::SplitMethod::SAH, 2, 8);
+    ExpectSameHits(reference, quantized, reference.WorldBound(), 1);
+
+    // Leaves of more primitives than fit in a byte
+    for (int nTris : {256, 300}) {
+        std::vector<std::shared_ptr<Primitive>> prims = NestedTriangles(nTris);
+        BVHAccel reference(prims, 4);
+        for (int bits : {16, 8}) {
+            BVHAccel quantized(prims, 4, BVHAccel::SplitMethod::SAH, 2, bits);
+            ExpectSameHits(reference, quantized, reference.WorldBound(), bits);
+        }
+    }
+}
+
+TEST(BVH, SpatialSplitsMatchSAH) {
+    std::vector<std::shared_ptr<Primitive>> prims = SliverTriangles(5000);
+    BVHAccel sah(prims, 4);
+    BVHAccel noBudget(prims, 4, BVHAccel::SplitMethod::SBVH, 2, 0, 0);
+    BVHAccel sbvh(prims, 4, BVHAccel::SplitMethod::SBVH);
+    EXPECT_EQ(sah.WorldBound(), sbvh.WorldBound());
+    // Spatial splits separate the slivers better than object splits alone,
+    // which is all the build can do without references to spare
+    EXPECT_LT(sbvh.SAHCost(), 0.95f * sah.SAHCost());
+    EXPECT_LT(sbvh.SAHCost(), noBudget.SAHCost());
+    ExpectSameHits(sah, noBudget, sah.WorldBound(), 1);
+    ExpectSameHits(sah, sbvh, sah.WorldBound(), 2);
+
+    // The primitives that spatial splits duplicate are found through both
+    // wide and quantized nodes
+    BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SBVH, 4);
+    BVHAccel quantized(prims, 4, BVHAccel::SplitMethod::SBVH, 2, 8);
+    ExpectSameHits(sah, wide, sah.WorldBound(), 3);
+    ExpectSameHits(sah, quantized, sah.WorldBound(), 4);
+}
+
+TEST(BVH, Cache) {
+    std::string accelCacheDir = PbrtOptions.accelCacheDir;
+    PbrtOptions.accelCacheDir = ".";
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(20000);
+    const BVHAccel::SplitMethod sah = BVHAccel::SplitMethod::SAH;
+    struct {
+        int width, quantizeBits;
+    } layouts[] = {{2, 0}, {4, 0}, {8, 0}, {2, 8}};
+    std::vector<std::string> filenames;
+    for (const auto &layout : layouts) {
+        // Start without a cache file left from an earlier run
+        filenames.push_back(
+            BVHAccel(prims, 4, sah, layout.width, layout.quantizeBits)
+                .CacheFilename());
+        remove(filenames.back().c_str());
+        BVHAccel built(prims, 4, sah, layout.width, layout.quantizeBits);
+        BVHAccel cached(prims, 4, sah, layout.width, layout.quantizeBits);
+        EXPECT_FALSE(built.FromCache());
+        ASSERT_TRUE(cached.FromCache());
+        EXPECT_EQ(filenames.back(), cached.CacheFilename());
+        EXPECT_EQ(built.SAHCost(), cached.SAHCost());
+        EXPECT_EQ(built.NodeBytes(), cached.NodeBytes());
+        EXPECT_EQ(built.WorldBound(), cached.WorldBound());
+        ExpectSameHits(built, cached, built.WorldBound(), layout.width);
+    }
+
+    // Other parameters, other primitives or primitives in another order
+    // make other trees
+    BVHAccel built(prims, 4);
+    std::vector<std::shared_ptr<Primitive>> moved =
+        RandomTriangles(20000, Point3f(0, 0, 0.5f));
+    std::vector<std::shared_ptr<Primitive>> reversed(prims.rbegin(),
+                                                     prims.rend());
+    for (const std::string &other :
+         {BVHAccel(prims, 2).CacheFilename(),
+          BVHAccel(prims, 4, BVHAccel::SplitMethod::Middle).CacheFilename(),
+          BVHAccel(moved, 4).CacheFilename(),
+          BVHAccel(reversed, 4).CacheFilename()}) {
+        EXPECT_NE(built.CacheFilename(), other);
+        filenames.push_back(other);
+    }
+
+    // A damaged file is replaced by the tree built again; it is written as
+    // a new file, since _built_ may have mapped the one there is
+    remove(built.CacheFilename().c_str());
+    FILE *f = fopen(built.CacheFilename().c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite("pbrtbvh", 1, 8, f);
+    fclose(f);
+    EXPECT_FALSE(BVHAccel(prims, 4).FromCache());
+    BVHAccel cached(prims, 4);
+    EXPECT_TRUE(cached.FromCache());
+    ExpectSameHits(built, cached, built.WorldBound(), 5);
+
+    // So is one whose nodes refer to nodes past the end
+    std::vector<char> file;
+    f = fopen(filenames[0].c_str(), "rb");
+    ASSERT_TRUE(f != nullptr);
+    for (int c; (c = fgetc(f)) != EOF;) file.push_back(c);
+    fclose(f);
+    int64_t nodesOffset;
+    // The offset of the nodes follows the magic, key and three counts
+    memcpy(&nodesOffset, &file[40], sizeof(nodesOffset));
+    int32_t secondChildOffset = 1 << 30;
+    memcpy(&file[nodesOffset + sizeof(Bounds3f)], &secondChildOffset,
+           sizeof(secondChildOffset));
+    remove(filenames[0].c_str());
+    f = fopen(filenames[0].c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite(file.data(), 1, file.size(), f);
+    fclose(f);
+    EXPECT_FALSE(BVHAccel(prims, 4, sah, 2, 0).FromCache());
+    EXPECT_TRUE(BVHAccel(prims, 4, sah, 2, 0).FromCache());
+
+    // SBVH trees are not cached
+    EXPECT_TRUE(BVHAccel(prims, 4, BVHAccel::SplitMethod::SBVH)
+                    .CacheFilename()
+                    .empty());
+
+    for (const std::string &filename : filenames) remove(filename.c_str());
+    PbrtOptions.accelCacheDir = accelCacheDir;
+}
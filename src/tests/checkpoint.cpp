@@ -0,0 +1,191 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "api.h"
+#include "checkpoint.h"
+#include "film.h"
+#include "filters/box.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "parser.h"
+#include <atomic>
+#include <thread>
+
+using namespace pbrt;
+
+// A 40x30 film with a box filter that only covers the pixel a sample is
+// taken in, so that each tile adds exactly to its own pixels
+static std::unique_ptr<Film> MakeFilm(const std::string &filename) {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5f, 0.5f)));
+    return std::unique_ptr<Film>(
+        new Film(Point2i(40, 30), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                 std::move(filter), 35., filename, 1.));
+}
+
+// Adds _nSamples_ samples of value _t + 1_ at the center of each pixel of
+// tile _t_
+static const int nSamples = 64;
+static void MergeTile(Film *film, const std::vector<Bounds2i> &tiles,
+                      int64_t t) {
+    std::unique_ptr<FilmTile> tile = film->GetFilmTile(tiles[t]);
+    for (Point2i p : tiles[t])
+        for (int s = 0; s < nSamples; ++s)
+            tile->AddSample(Point2f(p.x + 0.5f, p.y + 0.5f),
+                            Spectrum(t + 1.f));
+    film->MergeFilmTile(std::move(tile));
+}
+
+TEST(Checkpoint, WriteAndResume) {
+    std::unique_ptr<Film> film = MakeFilm("checkpoint-a.exr");
+    std::vector<Bounds2i> tiles =
+        ComputeImageTiles(film->GetSampleBounds(), 8, TileOrder::Hilbert, 0);
+    std::vector<int> data(tiles.size(), 0);
+    std::vector<Float> expected(Film::nAccumulators *
+                                film->croppedPixelBounds.Area());
+    {
+        RenderCheckpoint checkpoint(film.get(), 17, tiles, tiles.size(),
+                                    data.data(), data.size() * sizeof(int),
+                                    0);
+        for (size_t t = 0; t < tiles.size(); t += 2) {
+            checkpoint.BeginStep();
+            MergeTile(film.get(), tiles, t);
+            data[t] = t + 100;
+            checkpoint.EndStep(t);
+        }
+        film->GetAccumulators(expected.data());
+        EXPECT_TRUE(checkpoint.Write());
+    }
+
+    // A different render does not take the checkpoint
+    std::unique_ptr<Film> other = MakeFilm("checkpoint-a.exr");
+    std::vector<int> otherData(tiles.size(), -1);
+    {
+        RenderCheckpoint checkpoint(other.get(), 18, tiles, tiles.size(),
+                                    otherData.data(),
+                                    otherData.size() * sizeof(int), 0);
+        EXPECT_FALSE(checkpoint.Resume());
+        EXPECT_EQ(0, checkpoint.StepsDone());
+        EXPECT_EQ(-1, otherData[0]);
+    }
+
+    // Other tiles do not take it either, but a render with other tiles
+    // can read the checkpoint's and resume with them
+    std::vector<Bounds2i> otherTiles = ComputeImageTiles(
+        other->GetSampleBounds(), 4, TileOrder::Hilbert, 0);
+    {
+        RenderCheckpoint checkpoint(other.get(), 17, otherTiles,
+                                    tiles.size(), otherData.data(),
+                                    otherData.size() * sizeof(int), 0);
+        EXPECT_FALSE(checkpoint.Resume());
+    }
+    EXPECT_FALSE(RenderCheckpoint::ReadTiles(other.get(), 18, &otherTiles));
+    ASSERT_TRUE(RenderCheckpoint::ReadTiles(other.get(), 17, &otherTiles));
+    EXPECT_TRUE(otherTiles == tiles);
+
+    // The same one gets the film, the steps done and the data back
+    RenderCheckpoint checkpoint(other.get(), 17, otherTiles, tiles.size(),
+                                otherData.data(),
+                                otherData.size() * sizeof(int), 0);
+    ASSERT_TRUE(checkpoint.Resume());
+    EXPECT_EQ((int64_t)(tiles.size() + 1) / 2, checkpoint.StepsDone());
+    std::vector<Float> acc(expected.size());
+    other->GetAccumulators(acc.data());
+    EXPECT_TRUE(acc == expected);
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        EXPECT_EQ(t % 2 == 0, checkpoint.StepDone(t));
+        EXPECT_EQ(data[t], otherData[t]);
+    }
+
+    // Once the render is done, the checkpoint goes away
+    checkpoint.Finish();
+    EXPECT_EQ(nullptr, fopen("checkpoint-a.exr.checkpoint", "rb"));
+    EXPECT_FALSE(RenderCheckpoint::ReadTiles(other.get(), 17, &otherTiles));
+}
+
+TEST(Checkpoint, SceneHash) {
+    Options options;
+    options.nThreads = 1;
+    pbrtInit(options);
+    uint64_t hash = parsedSceneHash;
+    pbrtParseString("LookAt 0 0 0  0 0 1  0 1 0");
+    uint64_t lookAt = parsedSceneHash;
+    EXPECT_NE(hash, lookAt);
+    // Comments do not change the scene
+    pbrtParseString("# LookAt 0 0 0  0 0 1  0 1 0");
+    EXPECT_EQ(lookAt, parsedSceneHash);
+    pbrtParseString("Camera \"perspective\" \"float fov\" [45]");
+    uint64_t fov45 = parsedSceneHash;
+    EXPECT_NE(lookAt, fov45);
+    pbrtCleanup();
+
+    // Neither do spaces, but other parameters do
+    pbrtInit(options);
+    parsedSceneHash = hash;
+    pbrtParseString("LookAt 0 0 0 0 0 1 0 1 0\n"
+                    "Camera \"perspective\" \"float fov\" [ 45 ]");
+    EXPECT_EQ(fov45, parsedSceneHash);
+    parsedSceneHash = hash;
+    pbrtParseString("LookAt 0 0 0 0 0 1 0 1 0\n"
+                    "Camera \"perspective\" \"float fov\" [40]");
+    EXPECT_NE(fov45, parsedSceneHash);
+    pbrtCleanup();
+}
+
+TEST(Checkpoint, ConsistentWhileMerging) {
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+
+    std::unique_ptr<Film> film = MakeFilm("checkpoint-b.exr");
+    std::vector<Bounds2i> tiles =
+        ComputeImageTiles(film->GetSampleBounds(), 2, TileOrder::Hilbert, 0);
+    std::vector<int> data(tiles.size(), 0);
+    RenderCheckpoint checkpoint(film.get(), 5, tiles, tiles.size(),
+                                data.data(), data.size() * sizeof(int),
+                                0.001f);
+
+    // Read the checkpoints back while tiles are being merged: a tile is
+    // either done, in the film and in the data, or none of these
+    std::atomic<bool> merging{true};
+    int nChecked = 0, nInconsistent = 0;
+    std::thread checker([&]() {
+        std::unique_ptr<Film> copy = MakeFilm("checkpoint-b.exr");
+        std::vector<int> copyData(tiles.size());
+        std::vector<Float> acc(Film::nAccumulators *
+                               copy->croppedPixelBounds.Area());
+        do {
+            if (!checkpoint.Write()) break;
+            RenderCheckpoint resumed(copy.get(), 5, tiles, tiles.size(),
+                                     copyData.data(),
+                                     copyData.size() * sizeof(int), 0);
+            if (!resumed.Resume()) break;
+            copy->GetAccumulators(acc.data());
+            for (size_t t = 0; t < tiles.size(); ++t) {
+                bool done = resumed.StepDone(t);
+                for (Point2i p : tiles[t]) {
+                    Vector2i d = p - copy->croppedPixelBounds.pMin;
+                    Float weight =
+                        acc[Film::nAccumulators * (d.y * 40 + d.x) + 3];
+                    nInconsistent += weight != (done ? nSamples : 0);
+                }
+                nInconsistent += copyData[t] != (done ? int(t) + 1 : 0);
+            }
+            ++nChecked;
+        } while (merging);
+    });
+    ParallelFor([&](int64_t t) {
+        checkpoint.BeginStep();
+        MergeTile(film.get(), tiles, t);
+        data[t] = t + 1;
+        checkpoint.EndStep(t);
+    }, tiles.size());
+    merging = false;
+    checker.join();
+    EXPECT_GT(nChecked, 0);
+    EXPECT_EQ(0, nInconsistent);
+    EXPECT_EQ((int64_t)tiles.size(), checkpoint.StepsDone());
+    checkpoint.Finish();
+
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+}
@@ -0,0 +1,110 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "film.h"
+#include "filters/gaussian.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "rng.h"
+
+using namespace pbrt;
+
+// Renders random samples into the tiles of a film, merges the tiles either
+// serially or in parallel, and returns the film's pixel accumulators
+static std::vector<Float> RenderTiles(Float filterRadius, int tileSize,
+                                      bool parallel) {
+    std::unique_ptr<Filter> filter(new GaussianFilter(
+        Vector2f(filterRadius, filterRadius), 2.f));
+    Film film(Point2i(61, 37), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+              std::move(filter), 35., "unused.exr", 1.);
+    std::vector<Bounds2i> tiles = ComputeImageTiles(
+        film.GetSampleBounds(), tileSize, TileOrder::Hilbert, 4);
+    std::vector<std::unique_ptr<FilmTile>> filmTiles(tiles.size());
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        filmTiles[t] = film.GetFilmTile(tiles[t]);
+        RNG rng(t);
+        for (Point2i p : tiles[t])
+            for (int s = 0; s < 4; ++s) {
+                Point2f pFilm(p.x + rng.UniformFloat(),
+                              p.y + rng.UniformFloat());
+                filmTiles[t]->AddSample(pFilm, Spectrum(rng.UniformFloat()));
+            }
+    }
+    if (parallel)
+        ParallelFor([&](int64_t t) {
+            film.MergeFilmTile(std::move(filmTiles[t]));
+        }, tiles.size());
+    else
+        for (std::unique_ptr<FilmTile> &tile : filmTiles)
+            film.MergeFilmTile(std::move(tile));
+
+    std::vector<Float> acc(Film::nAccumulators *
+                           film.croppedPixelBounds.Area());
+    film.GetAccumulators(acc.data());
+    return acc;
+}
+
+TEST(Film, ParallelMerge) {
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+
+    for (Float radius : {0.5f, 1.3f, 2.f})
+        for (int tileSize : {3, 8, 16}) {
+            std::vector<Float> serial = RenderTiles(radius, tileSize, false);
+            std::vector<Float> parallel = RenderTiles(radius, tileSize, true);
+            EXPECT_EQ(serial.size(), parallel.size());
+            // Pixels that several tiles contribute to may sum them in a
+            // different order
+            for (size_t i = 0; i < std::min(serial.size(), parallel.size());
+                 ++i)
+                EXPECT_NEAR(serial[i], parallel[i],
+                            1e-5f * std::max((Float)1, std::abs(serial[i])))
+                    << "radius " << radius << ", tile size " << tileSize
+                    << ", pixel " << i / Film::nAccumulators
+                    << ", accumulator " << i % Film::nAccumulators;
+        }
+
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+}
+
+TEST(Film, TileInteriors) {
+    // No tile may touch the pixels in the interior of another one, which
+    // Film::MergeFilmTile() merges without locking
+    for (Float radius : {0.5f, 1.f, 1.3f, 2.f, 3.7f}) {
+        std::unique_ptr<Filter> filter(
+            new GaussianFilter(Vector2f(radius, radius), 2.f));
+        Film film(Point2i(61, 37), Bounds2f(Point2f(.1, 0), Point2f(1, .8)),
+                  std::move(filter), 35., "unused.exr", 1.);
+        for (int tileSize : {1, 3, 8, 16}) {
+            std::vector<Bounds2i> tiles = ComputeImageTiles(
+                film.GetSampleBounds(), tileSize, TileOrder::Scanline, 0);
+            std::vector<std::unique_ptr<FilmTile>> filmTiles;
+            int64_t interiorArea = 0;
+            for (const Bounds2i &tile : tiles) {
+                filmTiles.push_back(film.GetFilmTile(tile));
+                interiorArea += filmTiles.back()->GetInteriorBounds().Area();
+            }
+            if (tileSize == 16) {
+                EXPECT_GT(interiorArea, 0);
+            }
+            for (size_t i = 0; i < filmTiles.size(); ++i) {
+                Bounds2i interior = filmTiles[i]->GetInteriorBounds();
+                if (interior.Area() == 0) continue;
+                EXPECT_TRUE(Inside(interior.pMin,
+                                   filmTiles[i]->GetPixelBounds()));
+                for (size_t j = 0; j < filmTiles.size(); ++j) {
+                    if (i == j) continue;
+                    Bounds2i overlap =
+                        Intersect(interior, filmTiles[j]->GetPixelBounds());
+                    EXPECT_TRUE(overlap.pMin.x >= overlap.pMax.x ||
+                                overlap.pMin.y >= overlap.pMax.y)
+                        << "radius " << radius << ", tile " << tiles[i]
+                        << " interior " << interior << " vs. tile "
+                        << tiles[j];
+                }
+            }
+        }
+    }
+}
@@ -3,6 +3,7 @@
 #include "pbrt.h"
 #include "parallel.h"
 #include <atomic>
+#include <vector>
 
 using namespace pbrt;
 
@@ -37,3 +38,30 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    // Use several threads even on machines with a single core, so that
+    // ranges really are stolen
+    int nThreads = PbrtOptions.nThreads;
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+
+    const int nOuter = 64, nInner = 1000;
+    std::vector<std::atomic<int>> counts(nOuter * nInner);
+    for (std::atomic<int> &c : counts) c = 0;
+    ParallelFor([&](int64_t o) {
+        ParallelFor([&](int64_t i) { ++counts[o * nInner + i]; }, nInner, 1);
+    }, nOuter, 1);
+    int64_t nOnce = 0;
+    for (const std::atomic<int> &c : counts) nOnce += c == 1;
+    EXPECT_EQ(nOuter * nInner, nOnce);
+
+    // Stats can be merged between loops
+    MergeWorkerThreadStats();
+    std::atomic<int64_t> sum{0};
+    ParallelFor([&](int64_t i) { sum += i; }, 100000, 7);
+    EXPECT_EQ(int64_t(100000) * 99999 / 2, sum);
+
+    ParallelCleanup();
+    PbrtOptions.nThreads = nThreads;
+}
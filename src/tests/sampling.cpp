@@ -6,8 +6,12 @@
 #include "rng.h"
 #include "sampling.h"
 #include "lowdiscrepancy.h"
+#include "camera.h"
+#include "samplers/halton.h"
 #include "samplers/maxmin.h"
+#include "samplers/random.h"
 #include "samplers/sobol.h"
+#include "samplers/stratified.h"
 #include "samplers/zerotwosequence.h"
 
 using namespace pbrt;
@@ -301,3 +305,63 @@ TEST(Distribution1D, Continuous) {
     EXPECT_FLOAT_EQ(0., dist.SampleContinuous(0., &pdf));
     EXPECT_FLOAT_EQ(1., dist.SampleContinuous(1., &pdf));
 }
+
+// The values of a pixel sample: its camera sample and more dimensions than
+// the samplers precompute
+static std::vector<Float> PixelSampleValues(Sampler &sampler,
+                                            const Point2i &pixel) {
+    CameraSample cs = sampler.GetCameraSample(pixel);
+    std::vector<Float> v = {cs.pFilm.x, cs.pFilm.y, cs.pLens.x, cs.pLens.y,
+                            cs.time};
+    for (int i = 0; i < 8; ++i) {
+        v.push_back(sampler.Get1D());
+        Point2f u = sampler.Get2D();
+        v.push_back(u.x);
+        v.push_back(u.y);
+    }
+    return v;
+}
+
+TEST(Sampler, ConsistentSampleNumbers) {
+    // Adaptive sampling takes the samples of a pixel in several runs, with
+    // other pixels in between; each sample index has to give the same
+    // values as when the pixel is sampled in one go
+    const int spp = 16;
+    Bounds2i sampleBounds(Point2i(0, 0), Point2i(20, 20));
+    std::vector<std::unique_ptr<Sampler>> samplers;
+    samplers.push_back(std::unique_ptr<Sampler>(new RandomSampler(spp)));
+    samplers.push_back(
+        std::unique_ptr<Sampler>(new StratifiedSampler(4, 4, true, 2)));
+    samplers.push_back(
+        std::unique_ptr<Sampler>(new ZeroTwoSequenceSampler(spp, 2)));
+    samplers.push_back(std::unique_ptr<Sampler>(new MaxMinDistSampler(spp, 2)));
+    samplers.push_back(
+        std::unique_ptr<Sampler>(new HaltonSampler(spp, sampleBounds)));
+    samplers.push_back(
+        std::unique_ptr<Sampler>(new SobolSampler(spp, sampleBounds)));
+
+    Point2i pixel(7, 3), other(12, 15);
+    for (const std::unique_ptr<Sampler> &sampler : samplers) {
+        std::unique_ptr<Sampler> s = sampler->Clone(0);
+        std::vector<std::vector<Float>> reference;
+        s->StartPixel(pixel);
+        do {
+            reference.push_back(PixelSampleValues(*s, pixel));
+        } while (s->StartNextSample());
+        ASSERT_EQ(spp, reference.size());
+
+        // Another clone, with another seed, that has sampled another pixel
+        s = sampler->Clone(17);
+        s->StartPixel(other);
+        PixelSampleValues(*s, other);
+        for (int first : {4, 8, 13}) {
+            s->StartPixel(pixel);
+            s->SetSampleNumber(first);
+            for (int i = first; i < spp; ++i) {
+                EXPECT_EQ(reference[i], PixelSampleValues(*s, pixel))
+                    << "sample " << i << " from " << first;
+                s->StartNextSample();
+            }
+        }
+    }
+}
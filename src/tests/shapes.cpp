@@ -268,6 +268,45 @@ TEST(Triangle, Sampling) {
     }
 }
 
+TEST(Triangle, ClippedBounds) {
+    for (int i = 0; i < 1000; ++i) {
+        RNG rng(i);
+        // Every other triangle lies in a plane perpendicular to an axis
+        int flatAxis = (i & 1) ? (i / 2) % 3 : -1, call = 0;
+        Float flat = pUnif(rng);
+        std::shared_ptr<Triangle> tri = GetRandomTriangle([&]() {
+            return (call++ % 3 == flatAxis) ? flat : pUnif(rng);
+        });
+        if (!tri) continue;
+        Bounds3f box(Point3f(pUnif(rng), pUnif(rng), pUnif(rng)),
+                     Point3f(pUnif(rng), pUnif(rng), pUnif(rng)));
+        if (flatAxis != -1) {
+            box.pMin[flatAxis] = std::min(box.pMin[flatAxis], flat);
+            box.pMax[flatAxis] = std::max(box.pMax[flatAxis], flat);
+        }
+        Bounds3f clipped = tri->ClippedWorldBound(box);
+
+        // The clipped bounds are within the box and the triangle's bounds,
+        // and contain the points of the triangle in the box
+        Bounds3f overlap = Intersect(box, tri->WorldBound());
+        for (int a = 0; a < 3; ++a)
+            if (clipped.pMin[a] <= clipped.pMax[a]) {
+                EXPECT_GE(clipped.pMin[a], overlap.pMin[a]);
+                EXPECT_LE(clipped.pMax[a], overlap.pMax[a]);
+            }
+        for (int j = 0; j < 1000; ++j) {
+            Float pdf;
+            Point3f p = tri->Sample(Point2f(rng.UniformFloat(),
+                                            rng.UniformFloat()),
+                                    &pdf).p;
+            // Sampled points may be off the triangle by rounding
+            if (Inside(p, overlap)) {
+                EXPECT_TRUE(Inside(p, clipped)) << i;
+            }
+        }
+    }
+}
+
 // Checks the closed-form solid angle computation for triangles against a
 // Monte Carlo estimate of it.
 TEST(Triangle, SolidAngle) {
@@ -0,0 +1,70 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "integrator.h"
+
+using namespace pbrt;
+
+// Checks that _tiles_ cover each pixel of _bounds_ exactly once
+static void CheckCoverage(const Bounds2i &bounds,
+                          const std::vector<Bounds2i> &tiles) {
+    Vector2i extent = bounds.Diagonal();
+    std::vector<int> covered(extent.x * extent.y, 0);
+    for (const Bounds2i &tile : tiles) {
+        EXPECT_GT(tile.Area(), 0);
+        for (Point2i p : tile) {
+            ASSERT_TRUE(InsideExclusive(p, bounds)) << p << " in " << tile;
+            Vector2i d = p - bounds.pMin;
+            ++covered[d.y * extent.x + d.x];
+        }
+    }
+    for (int c : covered) EXPECT_EQ(1, c);
+}
+
+TEST(ImageTiles, Coverage) {
+    Bounds2i bounds(Point2i(3, -5), Point2i(3 + 320, -5 + 180));
+    for (TileOrder order :
+         {TileOrder::Scanline, TileOrder::Hilbert, TileOrder::Spiral})
+        for (int tileSize : {1, 7, 16, 1000})
+            for (int nSplitTail : {0, 5, 100000}) {
+                std::vector<Bounds2i> tiles =
+                    ComputeImageTiles(bounds, tileSize, order, nSplitTail);
+                CheckCoverage(bounds, tiles);
+            }
+}
+
+TEST(ImageTiles, HilbertIsContinuous) {
+    // On a power-of-two grid, consecutive tiles along the Hilbert curve
+    // share an edge
+    Bounds2i bounds(Point2i(0, 0), Point2i(128, 128));
+    std::vector<Bounds2i> tiles =
+        ComputeImageTiles(bounds, 8, TileOrder::Hilbert, 0);
+    ASSERT_EQ(16 * 16, tiles.size());
+    for (size_t i = 1; i < tiles.size(); ++i) {
+        Vector2i d = tiles[i].pMin - tiles[i - 1].pMin;
+        EXPECT_EQ(8, std::abs(d.x) + std::abs(d.y)) << "tile " << i;
+    }
+}
+
+TEST(ImageTiles, SplitTail) {
+    Bounds2i bounds(Point2i(0, 0), Point2i(64, 48));
+    std::vector<Bounds2i> tiles =
+        ComputeImageTiles(bounds, 16, TileOrder::Scanline, 3);
+    ASSERT_EQ(12 - 3 + 3 * 4, tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i)
+        EXPECT_EQ(i < 9 ? 16 : 8, tiles[i].Diagonal().x) << "tile " << i;
+}
+
+TEST(ImageTiles, TileSize) {
+    // Small images get smaller tiles as threads are added
+    Vector2i tuna(320, 180);
+    EXPECT_GT(ComputeTileSize(tuna, 64, 1), ComputeTileSize(tuna, 64, 16));
+    // Very few samples per pixel make for larger tiles
+    EXPECT_GE(ComputeTileSize(tuna, 1, 16), 32);
+    for (int nThreads : {1, 2, 8, 64, 256})
+        for (int64_t spp : {1, 16, 1024}) {
+            int size = ComputeTileSize(Vector2i(7680, 4320), spp, nThreads);
+            EXPECT_GE(size, 4);
+            EXPECT_LE(size, 32);
+        }
+}
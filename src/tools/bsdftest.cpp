@@ -2,6 +2,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
 
 #include "pbrt.h"
 #include "reflection.h"
@@ -9,44 +13,141 @@
 #include "memory.h"
 #include "api.h"
 #include "paramset.h"
+#include "parallel.h"
+#include "rng.h"
 #include "shapes/disk.h"
+#include "materials/kullaconty.h"
+#include "acg_final/MicrosurfaceSpecialized.h"
 
 using namespace pbrt;
 
-static MemoryArena arena;
-static RNG rng;
-
 // extract the red channel from a Spectrum class
 double spectrumRedValue(const Spectrum& s) { return s[0]; }
 
-typedef void (*CreateBSDFFunc)(BSDF* bsdf);
-
-void createLambertian(BSDF* bsdf);
-void createOrenNayar0(BSDF* bsdf);
-void createOrenNayar20(BSDF* bsdf);
-void createMicrofacet(BSDF* bsdf, bool beckmann, bool samplevisible,
-                      float roughx, float roughy);
-void createMicrofacet30and0(BSDF* bsdf);
-void createFresnelBlend(BSDF* bsdf, bool beckmann, bool samplevisible,
-                        float roughx, float roughy);
+// Models are created once per chunk of estimates, with the arena and the
+// random number generator of that chunk, so that stateful BxDFs like
+// MultiMicroBSDF are never shared between threads
+typedef void (*CreateBSDFFunc)(BSDF* bsdf, MemoryArena& arena, RNG& rng);
+
+void createLambertian(BSDF* bsdf, MemoryArena& arena, RNG& rng);
+void createLambertianTransmission(BSDF* bsdf, MemoryArena& arena, RNG& rng);
+void createOrenNayar0(BSDF* bsdf, MemoryArena& arena, RNG& rng);
+void createOrenNayar20(BSDF* bsdf, MemoryArena& arena, RNG& rng);
+void createMicrofacet(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                      bool samplevisible, float roughx, float roughy);
+void createMicrofacet30and0(BSDF* bsdf, MemoryArena& arena, bool beckmann);
+void createFresnelBlend(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                        bool samplevisible, float roughx, float roughy);
+void createRoughDielectric(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                           float roughx, float roughy);
+void createKullaConty(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                      float alpha);
+void createMultiMicro(BSDF* bsdf, MemoryArena& arena, RNG& rng,
+                      MicrosurfaceMaterial material, bool uniform,
+                      bool beckmann, float alpha);
+
+// The random walks of multimicro sample directions with a density their
+// Pdf() only approximates, so their 1/pdf histograms are not expected to
+// average 2pi and their pdfs are not checked against Pdf(); the chi-square
+// test of the sampled directions against f() still applies
+struct BSDFModel {
+    const char* description;
+    CreateBSDFFunc create;
+    bool exactPdf;
+};
 
 typedef void (*GenSampleFunc)(BSDF* bsdf, const Vector3f& wo, Vector3f* wi,
-                              Float* pdf, Spectrum* f);
+                              Float* pdf, Spectrum* f, RNG& rng,
+                              bool verifyPdf);
 
 void Gen_Sample_f(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
-                  Spectrum* f);
+                  Spectrum* f, RNG& rng, bool verifyPdf);
 void Gen_CosHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
-                       Spectrum* f);
+                       Spectrum* f, RNG& rng, bool verifyPdf);
 void Gen_UniformHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi,
-                           Float* pdf, Spectrum* f);
+                           Float* pdf, Spectrum* f, RNG& rng, bool verifyPdf);
+
+// all but specular lobes, on both sides of the surface
+static const BxDFType inflags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+
+static void usage(const char* msg = nullptr) {
+    if (msg) fprintf(stderr, "bsdftest: %s\n\n", msg);
+    fprintf(stderr,
+            "usage: bsdftest [--samples <n>] [--nthreads <n>] "
+            "[--model <substring>]\n"
+            "  --samples <n>      Monte carlo estimates per model "
+            "(default 10000000).\n"
+            "  --nthreads <n>     Threads to run the estimates on "
+            "(default: all cores).\n"
+            "  --model <text>     Only test the models whose description "
+            "contains <text>.\n");
+    exit(msg ? 1 : 0);
+}
+
+// Average time of a call of _func_, run serially after a short warm-up
+template <typename Func>
+static double NanosecondsPerCall(int n, Func func) {
+    volatile double sink = 0;
+    for (int i = 0; i < std::min(n, 100); ++i) sink = sink + func();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) sink = sink + func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+// Estimates that fell into a bin of the chi-square test
+struct ChiSquareBin {
+    double sum = 0, sum2 = 0;
+    int64_t hits = 0;
+    void Add(double value) {
+        sum += value;
+        sum2 += value * value;
+        ++hits;
+    }
+    void Merge(const ChiSquareBin& b) {
+        sum += b.sum;
+        sum2 += b.sum2;
+        hits += b.hits;
+    }
+    // the bin's share of an estimate from _n_ samples, and its variance
+    double Mean(int64_t n) const { return sum / n; }
+    double MeanVariance(int64_t n) const {
+        double mean = Mean(n);
+        return (sum2 / n - mean * mean) / n;
+    }
+};
+
+// Probability that a chi-square variable with _dof_ degrees of freedom
+// exceeds _chi2_, from the Wilson-Hilferty normal approximation
+static double ChiSquarePValue(double chi2, int dof) {
+    if (dof <= 0) return 1;
+    double k = dof;
+    double z = (std::pow(chi2 / k, 1. / 3.) - (1 - 2 / (9 * k))) /
+               std::sqrt(2 / (9 * k));
+    return 0.5 * std::erfc(z / std::sqrt(2.));
+}
 
 int main(int argc, char* argv[]) {
     Options opt;
-    pbrtInit(opt);
-
     // number of monte carlo estimates
     // const int estimates = 1;
-    const int estimates = 10000000;
+    int estimates = 10000000;
+    std::string modelFilter;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--samples") && i + 1 < argc)
+            estimates = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--nthreads") && i + 1 < argc)
+            opt.nThreads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--model") && i + 1 < argc)
+            modelFilter = argv[++i];
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else
+            usage(StringPrintf("unknown argument \"%s\"", argv[i]).c_str());
+    }
+    if (estimates < 1) usage("--samples must be positive");
+    if (opt.nThreads < 0) usage("--nthreads must not be negative");
+    pbrtInit(opt);
 
     // radiance of uniform environment map
     const double environmentRadiance = 1.0;
@@ -55,79 +156,123 @@ int main(int argc, char* argv[]) {
             "outgoing radiance from a surface viewed\n"
             "straight on with uniform lighting\n\n"
             "    uniform incoming radiance = %.3f\n"
-            "    monte carlo samples = %d\n\n\n",
-            environmentRadiance, estimates);
-
-    CreateBSDFFunc BSDFFuncArray[] = {
-        createLambertian,
-        createOrenNayar0,
-        createOrenNayar20,
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, true, 0.5, 0.5); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, true, 0.5, 0.5); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, true, 0.2, 0.1); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, true, 0.2, 0.1); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, true, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, true, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, true, 0.33, 0.033); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, true, 0.33, 0.033); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, false, 0.5, 0.5); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, false, 0.5, 0.5); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, false, 0.2, 0.1); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, false, 0.2, 0.1); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, false, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, false, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, true, false, 0.33, 0.033); },
-        [](BSDF* bsdf) -> void
-        { createMicrofacet(bsdf, false, false, 0.33, 0.033); },
-        [](BSDF* bsdf) -> void
-        { createFresnelBlend(bsdf, true, true, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createFresnelBlend(bsdf, false, true, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createFresnelBlend(bsdf, true, false, 0.15, 0.25); },
-        [](BSDF* bsdf) -> void
-        { createFresnelBlend(bsdf, false, false, 0.15, 0.25); },
-    };
-
-    const char* BSDFFuncDescripArray[] = {
-        "Lambertian",
-        "Oren Nayar (sigma 0)",
-        "Oren Nayar (sigma 20)",
-        "Beckmann (roughness 0.5, sample visible mf area)",
-        "Trowbridge-Reitz (roughness 0.5, sample visible mf area)",
-        "Beckmann (roughness 0.2/0.1, sample visible mf area)",
-        "Trowbridge-Reitz (roughness 0.2/0.1, sample visible mf area)",
-        "Beckmann (roughness 0.15/0.25, sample visible mf area)",
-        "Trowbridge-Reitz (roughness 0.15/0.25, sample visible mf area)",
-        "Beckmann (roughness 0.33/0.033, sample visible mf area)",
-        "Trowbridge-Reitz (roughness 0.33/0.033, sample visible mf area)",
-        "Beckmann (roughness 0.5, traditional sample wh)",
-        "Trowbridge-Reitz (roughness 0.5, traditional sample wh)",
-        "Beckmann (roughness 0.2/0.1, traditional sample wh)",
-        "Trowbridge-Reitz (roughness 0.2/0.1, traditional sample wh)",
-        "Beckmann (roughness 0.15/0.25, traditional sample wh)",
-        "Trowbridge-Reitz (roughness 0.15/0.25, traditional sample wh)",
-        "Beckmann (roughness 0.33/0.033, traditional sample wh)",
-        "Trowbridge-Reitz (roughness 0.33/0.033, traditional sample wh)",
-        "Fresnel Blend Beckmann (roughness 0.15/0.25, sample visible mf area)",
-        "Fresnel Blend Trowbridge-Reitz (roughness 0.15/0.25, sample visible mf area)",
-        "Fresnel Blend Beckmann (roughness 0.15/0.25, traditional sample wh)",
-        "Fresnel Blend Trowbridge-Reitz (roughness 0.15/0.25, traditional sample wh)",
+            "    monte carlo samples = %d\n"
+            "    threads = %d\n\n\n",
+            environmentRadiance, estimates, MaxThreadIndex());
+
+    BSDFModel models[] = {
+        {"Lambertian", createLambertian, true},
+        {"Lambertian transmission", createLambertianTransmission, true},
+        {"Oren Nayar (sigma 0)", createOrenNayar0, true},
+        {"Oren Nayar (sigma 20)", createOrenNayar20, true},
+        {"Beckmann (roughness 0.5, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, true, 0.5, 0.5); }, true},
+        {"Trowbridge-Reitz (roughness 0.5, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, true, 0.5, 0.5); }, true},
+        {"Beckmann (roughness 0.2/0.1, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, true, 0.2, 0.1); }, true},
+        {"Trowbridge-Reitz (roughness 0.2/0.1, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, true, 0.2, 0.1); }, true},
+        {"Beckmann (roughness 0.15/0.25, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, true, 0.15, 0.25); }, true},
+        {"Trowbridge-Reitz (roughness 0.15/0.25, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, true, 0.15, 0.25); }, true},
+        {"Beckmann (roughness 0.33/0.033, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, true, 0.33, 0.033); }, true},
+        {"Trowbridge-Reitz (roughness 0.33/0.033, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, true, 0.33, 0.033); }, true},
+        {"Beckmann (roughness 0.5, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, false, 0.5, 0.5); }, true},
+        {"Trowbridge-Reitz (roughness 0.5, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, false, 0.5, 0.5); }, true},
+        {"Beckmann (roughness 0.2/0.1, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, false, 0.2, 0.1); }, true},
+        {"Trowbridge-Reitz (roughness 0.2/0.1, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, false, 0.2, 0.1); }, true},
+        {"Beckmann (roughness 0.15/0.25, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, false, 0.15, 0.25); }, true},
+        {"Trowbridge-Reitz (roughness 0.15/0.25, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, false, 0.15, 0.25); }, true},
+        {"Beckmann (roughness 0.33/0.033, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, true, false, 0.33, 0.033); }, true},
+        {"Trowbridge-Reitz (roughness 0.33/0.033, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createMicrofacet(bsdf, arena, false, false, 0.33, 0.033); }, true},
+        {"Fresnel Blend Beckmann (roughness 0.15/0.25, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createFresnelBlend(bsdf, arena, true, true, 0.15, 0.25); }, true},
+        {"Fresnel Blend Trowbridge-Reitz (roughness 0.15/0.25, sample visible mf area)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createFresnelBlend(bsdf, arena, false, true, 0.15, 0.25); }, true},
+        {"Fresnel Blend Beckmann (roughness 0.15/0.25, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createFresnelBlend(bsdf, arena, true, false, 0.15, 0.25); }, true},
+        {"Fresnel Blend Trowbridge-Reitz (roughness 0.15/0.25, traditional sample wh)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createFresnelBlend(bsdf, arena, false, false, 0.15, 0.25); }, true},
+        {"Rough dielectric Beckmann (roughness 0.5, eta 1.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createRoughDielectric(bsdf, arena, true, 0.5, 0.5); }, true},
+        {"Rough dielectric Trowbridge-Reitz (roughness 0.5, eta 1.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createRoughDielectric(bsdf, arena, false, 0.5, 0.5); }, true},
+        {"Kulla-Conty conductor Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createKullaConty(bsdf, arena, true, 0.5); }, true},
+        {"Kulla-Conty conductor Trowbridge-Reitz (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG&) -> void
+         { createKullaConty(bsdf, arena, false, 0.5); }, true},
+        {"Multimicro conductor, uniform heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_CONDUCTOR, true, true, 0.5); }, false},
+        {"Multimicro conductor, uniform heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_CONDUCTOR, true, false, 0.5); }, false},
+        {"Multimicro conductor, Gaussian heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_CONDUCTOR, false, true, 0.5); }, false},
+        {"Multimicro conductor, Gaussian heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_CONDUCTOR, false, false, 0.5); }, false},
+        {"Multimicro dielectric, uniform heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIELECTRIC, true, true, 0.5); }, false},
+        {"Multimicro dielectric, uniform heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIELECTRIC, true, false, 0.5); }, false},
+        {"Multimicro dielectric, Gaussian heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIELECTRIC, false, true, 0.5); }, false},
+        {"Multimicro dielectric, Gaussian heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIELECTRIC, false, false, 0.5); }, false},
+        {"Multimicro diffuse, uniform heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIFFUSE, true, true, 0.5); }, false},
+        {"Multimicro diffuse, uniform heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIFFUSE, true, false, 0.5); }, false},
+        {"Multimicro diffuse, Gaussian heights, Beckmann (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIFFUSE, false, true, 0.5); }, false},
+        {"Multimicro diffuse, Gaussian heights, GGX (alpha 0.5)",
+         [](BSDF* bsdf, MemoryArena& arena, RNG& rng) -> void
+         { createMultiMicro(bsdf, arena, rng, MICROSURFACE_DIFFUSE, false, false, 0.5); }, false},
     };
 
     GenSampleFunc SampleFuncArray[] = {
@@ -142,61 +287,103 @@ int main(int argc, char* argv[]) {
         // CO        "Uniform Hemisphere",
     };
 
-    int numModels = sizeof(BSDFFuncArray) / sizeof(BSDFFuncArray[0]);
-    int numModelsDescrip =
-        sizeof(BSDFFuncDescripArray) / sizeof(BSDFFuncDescripArray[0]);
+    int numModels = sizeof(models) / sizeof(models[0]);
     int numGenerators = sizeof(SampleFuncArray) / sizeof(SampleFuncArray[0]);
     int numGeneratorsDescrip =
         sizeof(SampleFuncDescripArray) / sizeof(SampleFuncDescripArray[0]);
 
-    if (numModels != numModelsDescrip) {
-        fprintf(stderr,
-                "BSDFFuncArray and BSDFFuncDescripArray out of sync!\n");
-        exit(1);
-    }
-
     if (numGenerators != numGeneratorsDescrip) {
         fprintf(stderr,
                 "SampleFuncArray and SampleFuncDescripArray out of sync!\n");
         exit(1);
     }
 
+    // create BSDF which requires creating a Shape, casting a Ray
+    // that hits the shape to get a SurfaceInteraction object.
+    SurfaceInteraction isect;
+    {
+        Transform t = RotateX(-90);
+        bool reverseOrientation = false;
+        ParamSet p;
+
+        std::shared_ptr<Shape> disk(
+            new Disk(new Transform(t), new Transform(Inverse(t)),
+                     reverseOrientation, 0., 1., 0, 360.));
+        Point3f origin(
+            0.1, 1, 0);  // offset slightly so we don't hit center of disk
+        Vector3f direction(0, -1, 0);
+        Float tHit;
+        Ray r(origin, direction);
+        disk->Intersect(r, &tHit, &isect);
+    }
+
+    // The estimates run in chunks across all threads; each chunk draws
+    // from its own sequence of the generator, so the results only depend
+    // on the number of estimates
+    const int64_t chunkSize = 16384;
+    const int64_t numChunks = (estimates + chunkSize - 1) / chunkSize;
+
+    // The chi-square test compares the sampled directions, weighted by
+    // f |cos| / pdf, with the integral of f |cos| over each bin of the
+    // sphere, estimated from as many uniformly distributed directions
+    const int numHistoBins = 10;
+    const int numChiThetaBins = 2 * numHistoBins;
+    auto chiBin = [&](const Vector3f& wiL) {
+        float wiPhi = (std::atan2(Clamp(wiL.y, -1.f, 1.f),
+                                  Clamp(wiL.x, -1.f, 1.f)) + Pi) / (2.0 * Pi);
+        int binPhi = Clamp((int)(wiPhi * numHistoBins), 0, numHistoBins - 1);
+        int binTheta = Clamp((int)((wiL.z + 1) * 0.5f * numChiThetaBins), 0,
+                             numChiThetaBins - 1);
+        return binTheta * numHistoBins + binPhi;
+    };
+    // whether the chi-square test failed for any model, which the exit
+    // status tells
+    bool failed = false;
+
     // for each bsdf model
     for (int model = 0; model < numModels; model++) {
-        BSDF* bsdf;
-
-        // create BSDF which requires creating a Shape, casting a Ray
-        // that hits the shape to get a SurfaceInteraction object.
-        {
-            Transform t = RotateX(-90);
-            bool reverseOrientation = false;
-            ParamSet p;
-
-            std::shared_ptr<Shape> disk(
-                new Disk(new Transform(t), new Transform(Inverse(t)),
-                         reverseOrientation, 0., 1., 0, 360.));
-            Point3f origin(
-                0.1, 1, 0);  // offset slightly so we don't hit center of disk
-            Vector3f direction(0, -1, 0);
-            Float tHit;
-            Ray r(origin, direction);
-            SurfaceInteraction isect;
-            disk->Intersect(r, &tHit, &isect);
-            bsdf = ARENA_ALLOC(arena, BSDF)(isect);
-            (BSDFFuncArray[model])(bsdf);
-        }
+        const BSDFModel& bsdfModel = models[model];
+        if (!modelFilter.empty() &&
+            !strstr(bsdfModel.description, modelFilter.c_str()))
+            continue;
 
         // facing directly at normal
         Vector3f woL = Normalize(Vector3f(0, 0, 1));
-        Vector3f wo = bsdf->LocalToWorld(woL);
-        // was bsdf->dgShading.nn
-        const Normal3f n = Normal3f(bsdf->LocalToWorld(Vector3f(0, 0, 1)));
+
+        // Serial throughput of the BSDF, on a single thread; this also
+        // builds any tables the model shares between chunks before the
+        // chunks run
+        double sampleNs, evalNs, pdfNs;
+        {
+            MemoryArena arena;
+            RNG rng;
+            BSDF* bsdf = ARENA_ALLOC(arena, BSDF)(isect);
+            bsdfModel.create(bsdf, arena, rng);
+            Vector3f wo = bsdf->LocalToWorld(woL);
+            const int n = std::min(estimates, 200000);
+            sampleNs = NanosecondsPerCall(n, [&]() {
+                Vector3f wi;
+                Float pdf;
+                Point2f u(rng.UniformFloat(), rng.UniformFloat());
+                return spectrumRedValue(
+                    bsdf->Sample_f(wo, &wi, u, &pdf, inflags));
+            });
+            evalNs = NanosecondsPerCall(n, [&]() {
+                Point2f u(rng.UniformFloat(), rng.UniformFloat());
+                Vector3f wi = bsdf->LocalToWorld(UniformSampleSphere(u));
+                return spectrumRedValue(bsdf->f(wo, wi, inflags));
+            });
+            pdfNs = NanosecondsPerCall(n, [&]() {
+                Point2f u(rng.UniformFloat(), rng.UniformFloat());
+                Vector3f wi = bsdf->LocalToWorld(UniformSampleSphere(u));
+                return (double)bsdf->Pdf(wo, wi, inflags);
+            });
+        }
 
         // for each method of generating samples over the hemisphere
         for (int gen = 0; gen < numGenerators; gen++) {
             double redSum = 0.0;
 
-            const int numHistoBins = 10;
             double histogram[numHistoBins][numHistoBins];
             for (int i = 0; i < numHistoBins; i++) {
                 for (int j = 0; j < numHistoBins; j++) {
@@ -206,69 +393,161 @@ int main(int argc, char* argv[]) {
             int badSamples = 0;
             int outsideSamples = 0;
 
-            int warningTarget = 1;
-            for (int sample = 0; sample < estimates; sample++) {
-                Vector3f wi;
-                Float pdf;
-                Spectrum f;
-
-                // sample hemisphere around bsdf, wo is fixed
-                (SampleFuncArray[gen])(bsdf, wo, &wi, &pdf, &f);
-
-                double redF = spectrumRedValue(f);
-
-                // add hemisphere sample to histogram
-                Vector3f wiL = bsdf->WorldToLocal(wi);
-                float x = Clamp(wiL.x, -1.f, 1.f);
-                float y = Clamp(wiL.y, -1.f, 1.f);
-                float wiPhi = (atan2(y, x) + Pi) / (2.0 * Pi);
-                float wiCosTheta = wiL.z;
-                bool validSample = (wiCosTheta > 1e-7);
-                if (wiPhi < -0.0001 || wiPhi > 1.0001 || wiCosTheta > 1.0001) {
-                    // wiCosTheta can be less than 0
-                    fprintf(stderr, "bad wi! %.3f %.3f %.3f, (%.3f %.3f)\n",
-                            wiL[0], wiL[1], wiL[2], wiPhi, wiCosTheta);
-                } else if (validSample) {
-                    int histoPhi = (int)(wiPhi * numHistoBins);
-                    if (histoPhi == numHistoBins)
-                      --histoPhi;
-                    int histoCosTheta = (int)(wiCosTheta * numHistoBins);
-                    if (histoCosTheta == numHistoBins)
-                      --histoCosTheta;
-                    assert(histoPhi >= 0 && histoPhi < numHistoBins);
-                    assert(histoCosTheta >= 0 && histoCosTheta < numHistoBins);
-                    histogram[histoCosTheta][histoPhi] += 1.0 / pdf;
-                }
+            // per chi-square bin, the sampled weights and the uniform
+            // estimates of f |cos|
+            const int numChiBins = numChiThetaBins * numHistoBins;
+            std::vector<ChiSquareBin> sampled(numChiBins),
+                reference(numChiBins);
 
-                if (!validSample) {
-                    outsideSamples++;
-                } else if (pdf == 0.f || std::isnan(pdf) || redF < 0 ||
-                           std::isnan(redF)) {
-                    if (badSamples == warningTarget) {
+            std::mutex mergeMutex;
+            int warningTarget = 1;
+            auto start = std::chrono::steady_clock::now();
+            ParallelFor([&](int64_t chunk) {
+                MemoryArena arena;
+                RNG rng;
+                rng.SetSequence(chunk);
+                BSDF* bsdf = ARENA_ALLOC(arena, BSDF)(isect);
+                bsdfModel.create(bsdf, arena, rng);
+                Vector3f wo = bsdf->LocalToWorld(woL);
+                // was bsdf->dgShading.nn
+                const Normal3f n =
+                    Normal3f(bsdf->LocalToWorld(Vector3f(0, 0, 1)));
+
+                double chunkRedSum = 0.0;
+                double chunkHistogram[numHistoBins][numHistoBins] = {};
+                int chunkBad = 0, chunkOutside = 0;
+                std::vector<ChiSquareBin> chunkSampled(numChiBins),
+                    chunkReference(numChiBins);
+
+                int64_t first = chunk * chunkSize;
+                int64_t last = std::min<int64_t>(first + chunkSize, estimates);
+                for (int64_t sample = first; sample < last; sample++) {
+                    Vector3f wi;
+                    Float pdf;
+                    Spectrum f;
+
+                    // sample sphere around bsdf, wo is fixed
+                    (SampleFuncArray[gen])(bsdf, wo, &wi, &pdf, &f, rng,
+                                           bsdfModel.exactPdf);
+
+                    double redF = spectrumRedValue(f);
+
+                    // add hemisphere sample to histogram
+                    Vector3f wiL = bsdf->WorldToLocal(wi);
+                    float x = Clamp(wiL.x, -1.f, 1.f);
+                    float y = Clamp(wiL.y, -1.f, 1.f);
+                    float wiPhi = (atan2(y, x) + Pi) / (2.0 * Pi);
+                    float wiCosTheta = wiL.z;
+                    bool validSample = (wiCosTheta > 1e-7);
+                    bool transmitted = (wiCosTheta < -1e-7);
+                    bool badValue = pdf == 0.f || std::isnan(pdf) ||
+                                    redF < 0 || std::isnan(redF);
+                    if (wiPhi < -0.0001 || wiPhi > 1.0001 ||
+                        wiCosTheta > 1.0001) {
+                        // wiCosTheta can be less than 0
                         fprintf(stderr,
-                                "warning %d, bad sample %d! "
-                                "pdf: %.3f, redF: %.3f\n",
-                                warningTarget, sample, pdf, redF);
-                        warningTarget *= 10;
+                                "bad wi! %.3f %.3f %.3f, (%.3f %.3f)\n",
+                                wiL[0], wiL[1], wiL[2], wiPhi, wiCosTheta);
+                    } else if (validSample && !badValue) {
+                        int histoPhi = (int)(wiPhi * numHistoBins);
+                        if (histoPhi == numHistoBins)
+                          --histoPhi;
+                        int histoCosTheta = (int)(wiCosTheta * numHistoBins);
+                        if (histoCosTheta == numHistoBins)
+                          --histoCosTheta;
+                        assert(histoPhi >= 0 && histoPhi < numHistoBins);
+                        assert(histoCosTheta >= 0 &&
+                               histoCosTheta < numHistoBins);
+                        chunkHistogram[histoCosTheta][histoPhi] += 1.0 / pdf;
+                    }
+
+                    if (!validSample && !transmitted) {
+                        chunkOutside++;
+                    } else if (badValue) {
+                        std::lock_guard<std::mutex> lock(mergeMutex);
+                        if (badSamples + chunkBad == warningTarget) {
+                            fprintf(stderr,
+                                    "warning %d, bad sample %lld! "
+                                    "pdf: %.3f, redF: %.3f\n",
+                                    warningTarget, (long long)sample, pdf,
+                                    redF);
+                            warningTarget *= 10;
+                        }
+                        chunkBad++;
+                    } else {
+                        if (!validSample) chunkOutside++;
+                        // outgoing radiance estimate =
+                        //   bsdf * incomingRadiance * cos(wi) / pdf
+                        double weight = redF * AbsDot(wi, n) / pdf;
+                        chunkRedSum += weight * environmentRadiance;
+                        chunkSampled[chiBin(wiL)].Add(weight);
                     }
-                    badSamples++;
-                } else {
-                    // outgoing radiance estimate =
-                    //   bsdf * incomingRadiance * cos(wi) / pdf
-                    redSum += redF * environmentRadiance * AbsDot(wi, n) / pdf;
+
+                    // reference estimate of f |cos| in a uniform direction
+                    Point2f u(rng.UniformFloat(), rng.UniformFloat());
+                    Vector3f refL = UniformSampleSphere(u);
+                    Vector3f ref = bsdf->LocalToWorld(refL);
+                    double value = spectrumRedValue(bsdf->f(wo, ref, inflags)) *
+                                   AbsDot(ref, n) / UniformSpherePdf();
+                    if (value > 0 && std::isfinite(value))
+                        chunkReference[chiBin(refL)].Add(value);
                 }
-            }
+
+                std::lock_guard<std::mutex> lock(mergeMutex);
+                redSum += chunkRedSum;
+                for (int i = 0; i < numHistoBins; i++)
+                    for (int j = 0; j < numHistoBins; j++)
+                        histogram[i][j] += chunkHistogram[i][j];
+                badSamples += chunkBad;
+                outsideSamples += chunkOutside;
+                for (int bin = 0; bin < numChiBins; bin++) {
+                    sampled[bin].Merge(chunkSampled[bin]);
+                    reference[bin].Merge(chunkReference[bin]);
+                }
+            }, numChunks);
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
             int goodSamples = estimates - badSamples;
 
+            // chi-square statistic over the bins both estimates reach
+            // often enough for their variances to mean something; the
+            // energy in the other bins is compared as a whole
+            const int minHits = 32;
+            double chi2 = 0, sparseSampled = 0, sparseReference = 0;
+            int dof = 0;
+            for (int bin = 0; bin < numChiBins; bin++) {
+                double a = sampled[bin].Mean(estimates);
+                double b = reference[bin].Mean(estimates);
+                if (sampled[bin].hits < minHits ||
+                    reference[bin].hits < minHits) {
+                    sparseSampled += a;
+                    sparseReference += b;
+                    continue;
+                }
+                double variance = sampled[bin].MeanVariance(estimates) +
+                                  reference[bin].MeanVariance(estimates);
+                if (variance <= 0) continue;
+                chi2 += (a - b) * (a - b) / variance;
+                dof++;
+            }
+            double pValue = ChiSquarePValue(chi2, dof);
+            // strict, as the heavy tails of some estimators inflate the
+            // statistic a little whatever the number of estimates, while
+            // a mismatch grows with it
+            const double significance = 1e-5;
+            if (pValue < significance) failed = true;
+
             // print results
             fprintf(stderr,
                     "*** BRDF: '%s', Samples: '%s'\n\n"
                     "wi histogram showing the relative weight in each bin\n"
-                    "  all entries should be close to 2pi = %.5f:\n"
+                    "  all entries should be close to 2pi = %.5f%s:\n"
                     "  (%d bad samples, %d outside samples)\n\n"
                     "                          phi bins\n",
-                    BSDFFuncDescripArray[model], SampleFuncDescripArray[gen],
-                    Pi * 2.0, badSamples, outsideSamples);
+                    bsdfModel.description, SampleFuncDescripArray[gen],
+                    Pi * 2.0,
+                    bsdfModel.exactPdf ? "" : " (approximate pdf)",
+                    badSamples, outsideSamples);
             double totalSum = 0.0;
             for (int i = 0; i < numHistoBins; i++) {
                 fprintf(stderr, "  cos(theta) bin %02d:", i);
@@ -281,20 +560,27 @@ int main(int argc, char* argv[]) {
             }
             fprintf(stderr,
                     "\n  final average :  %.5f (error %.5f)\n\n"
-                    "  radiance = %.5f\n\n",
+                    "  radiance = %.5f\n\n"
+                    "  chi-square of sampled directions against f(): "
+                    "%.2f, %d dof, p = %.4f%s\n"
+                    "  (sparse bins: %.5f sampled, %.5f expected)\n\n"
+                    "  Sample_f %.1f ns, f %.1f ns, Pdf %.1f ns per call; "
+                    "%.2f M estimates/s on %d threads\n\n",
                     totalSum / goodSamples, totalSum / goodSamples - Pi * 2.0,
-                    redSum / goodSamples);
+                    redSum / goodSamples, chi2, dof, pValue,
+                    pValue < significance ? " FAILED" : "", sparseSampled,
+                    sparseReference, sampleNs, evalNs, pdfNs,
+                    estimates / seconds * 1e-6, MaxThreadIndex());
         }
     }
 
     pbrtCleanup();
-    return 0;
+    return failed ? 1 : 0;
 }
 
 void Gen_Sample_f(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
-                  Spectrum* f) {
-    // only glossy or diffuse reflections (no specular reflections)
-    BxDFType inflags = BxDFType(BSDF_REFLECTION | BSDF_DIFFUSE | BSDF_GLOSSY);
+                  Spectrum* f, RNG& rng, bool verifyPdf) {
+    // only glossy or diffuse scattering (no specular reflections)
     BxDFType outflags;
     Point2f sample {rng.UniformFloat(), rng.UniformFloat()};
     *f = bsdf->Sample_f(wo, wi, sample, pdf, inflags, &outflags);
@@ -304,7 +590,7 @@ void Gen_Sample_f(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
     float wiCosTheta = wiL.z;
     bool validSample = (wiCosTheta > 1e-7);
 
-    if (validSample) {
+    if (validSample && verifyPdf) {
         float verifyPdf = bsdf->Pdf(wo, *wi, inflags);
         float relErr = std::abs(verifyPdf - *pdf) / *pdf;
         if (relErr > 1e-3) {
@@ -323,7 +609,7 @@ void Gen_Sample_f(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
 }
 
 void Gen_CosHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
-                       Spectrum* f) {
+                       Spectrum* f, RNG& rng, bool verifyPdf) {
     float u1 = rng.UniformFloat();
     float u2 = rng.UniformFloat();
     Vector3f wiL = CosineSampleHemisphere(Point2f(u1, u2));
@@ -335,7 +621,7 @@ void Gen_CosHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi, Float* pdf,
 }
 
 void Gen_UniformHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi,
-                           Float* pdf, Spectrum* f) {
+                           Float* pdf, Spectrum* f, RNG& rng, bool verifyPdf) {
     float u1 = rng.UniformFloat();
     float u2 = rng.UniformFloat();
     Vector3f wiL = UniformSampleHemisphere(Point2f(u1, u2));
@@ -345,13 +631,18 @@ void Gen_UniformHemisphere(BSDF* bsdf, const Vector3f& wo, Vector3f* wi,
     *f = bsdf->f(wo, *wi);
 }
 
-void createLambertian(BSDF* bsdf) {
+void createLambertian(BSDF* bsdf, MemoryArena& arena, RNG& rng) {
     Spectrum Kd(1);
     bsdf->Add(ARENA_ALLOC(arena, LambertianReflection)(Kd));
 }
 
-void createMicrofacet(BSDF* bsdf, bool beckmann, bool samplevisible,
-                      float roughx, float roughy) {
+void createLambertianTransmission(BSDF* bsdf, MemoryArena& arena, RNG& rng) {
+    Spectrum Kt(1);
+    bsdf->Add(ARENA_ALLOC(arena, LambertianTransmission)(Kt));
+}
+
+void createMicrofacet(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                      bool samplevisible, float roughx, float roughy) {
     Spectrum Ks(1);
     MicrofacetDistribution *distrib;
     if (beckmann) {
@@ -371,8 +662,8 @@ void createMicrofacet(BSDF* bsdf, bool beckmann, bool samplevisible,
     bsdf->Add(bxdf);
 }
 
-void createFresnelBlend(BSDF* bsdf, bool beckmann, bool samplevisible,
-                        float roughx, float roughy)
+void createFresnelBlend(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                        bool samplevisible, float roughx, float roughy)
 {
     Spectrum d(0.5);
     Spectrum s(0.5);
@@ -393,7 +684,7 @@ void createFresnelBlend(BSDF* bsdf, bool beckmann, bool samplevisible,
     bsdf->Add(bxdf);
 }
 
-void createMicrofacet30and0(BSDF* bsdf, bool beckmann) {
+void createMicrofacet30and0(BSDF* bsdf, MemoryArena& arena, bool beckmann) {
     Spectrum Ks(0.5);
     MicrofacetDistribution *distrib1, *distrib2;
     if (beckmann) {
@@ -424,16 +715,67 @@ void createMicrofacet30and0(BSDF* bsdf, bool beckmann) {
     bsdf->Add(bxdf2);
 }
 
-void createOrenNayar0(BSDF* bsdf) {
+void createOrenNayar0(BSDF* bsdf, MemoryArena& arena, RNG& rng) {
     Spectrum Kd(1);
     float sigma = 0.0;
     BxDF* bxdf = ARENA_ALLOC(arena, OrenNayar)(Kd, sigma);
     bsdf->Add(bxdf);
 }
 
-void createOrenNayar20(BSDF* bsdf) {
+void createOrenNayar20(BSDF* bsdf, MemoryArena& arena, RNG& rng) {
     Spectrum Kd(1);
     float sigma = 20.0;
     BxDF* bxdf = ARENA_ALLOC(arena, OrenNayar)(Kd, sigma);
     bsdf->Add(bxdf);
 }
+
+// pbrt's rough glass: a reflection and a transmission lobe sharing the
+// distribution, seen from outside
+void createRoughDielectric(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                           float roughx, float roughy) {
+    const Float eta = 1.5;
+    MicrofacetDistribution *distrib;
+    if (beckmann)
+      distrib = ARENA_ALLOC(arena, BeckmannDistribution)(
+          BeckmannDistribution::RoughnessToAlpha(roughx),
+          BeckmannDistribution::RoughnessToAlpha(roughy));
+    else
+      distrib = ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(
+          TrowbridgeReitzDistribution::RoughnessToAlpha(roughx),
+          TrowbridgeReitzDistribution::RoughnessToAlpha(roughy));
+    Fresnel* fresnel = ARENA_ALLOC(arena, FresnelDielectric)(1.f, eta);
+    bsdf->Add(ARENA_ALLOC(arena, MicrofacetReflection)(1., distrib, fresnel));
+    bsdf->Add(ARENA_ALLOC(arena, MicrofacetTransmission)(1., distrib, 1.f, eta,
+                                                         TransportMode::Radiance));
+}
+
+// A perfect conductor with its energy compensation lobe; the tables are
+// built on first use, which happens before the chunks run
+void createKullaConty(BSDF* bsdf, MemoryArena& arena, bool beckmann,
+                      float alpha) {
+    const MicrosurfaceHigherOrders *higherOrders =
+        KullaContyCompensation(MICROSURFACE_CONDUCTOR, beckmann, 1.5, "", 1024);
+    MicrofacetDistribution *distrib;
+    if (beckmann)
+      distrib = ARENA_ALLOC(arena, BeckmannDistribution)(alpha, alpha);
+    else
+      distrib = ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(alpha, alpha);
+    Fresnel* fresnel = ARENA_ALLOC(arena, FresnelNoOp)();
+    bsdf->Add(ARENA_ALLOC(arena, MicrofacetReflection)(1., distrib, fresnel));
+    Float Eavg = 1 - higherOrders->averageReflected(true, alpha);
+    Spectrum Fms = KullaContyBxDF::MultipleScatteringFresnel(
+        KullaContyBxDF::AverageFresnel(*fresnel), Eavg);
+    bsdf->Add(ARENA_ALLOC(arena, KullaContyBxDF)(higherOrders, alpha, Fms));
+}
+
+// A lossless microsurface of each material: a perfect conductor, glass and
+// a white diffuse surface, walked once per estimate
+void createMultiMicro(BSDF* bsdf, MemoryArena& arena, RNG& rng,
+                      MicrosurfaceMaterial material, bool uniform,
+                      bool beckmann, float alpha) {
+    MicrosurfaceOptics optics(1.5f);
+    Microsurface* microsurface = microsurfaceAllocator(
+        material, uniform, beckmann)(arena, alpha, alpha, optics);
+    uint64_t seed = ((uint64_t)rng.UniformUInt32() << 32) | rng.UniformUInt32();
+    bsdf->Add(ARENA_ALLOC(arena, MultiMicroBSDF)(microsurface, seed));
+}
@@ -0,0 +1,208 @@
+// Build time and quality of BVHAccel on triangle meshes in PLY files, such
+// as the ones under scenes/: the fastest of several builds with one thread
+// and with the whole pool, for each split method, and the SAH cost of the
+// trees they build. Then the node memory per primitive and the rays per
+// second that Intersect() and IntersectP() trace for each node layout: the
+// binary tree with full precision and quantized bounds, and the 4- and
+// 8-wide trees, built with object splits and with spatial splits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "pbrt.h"
+#include "api.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "primitive.h"
+#include "rng.h"
+#include "transform.h"
+#include "accelerators/bvh.h"
+#include "shapes/plymesh.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "bvhbench: %s\n\n", msg);
+    fprintf(stderr,
+            "usage: bvhbench [--nthreads <n>] [--repeat <n>] [--copies <n>] "
+            "[--rays <n>] <mesh.ply...>\n"
+            "  --nthreads <n>  Threads of the parallel builds (default: all "
+            "cores).\n"
+            "  --repeat <n>    Builds of each kind; the fastest is reported "
+            "(default 3).\n"
+            "  --copies <n>    Build over <n> copies of the meshes side by "
+            "side (default 1).\n"
+            "  --rays <n>      Rays traced through each node layout (default "
+            "1000000).\n");
+    exit(msg ? 1 : 0);
+}
+
+int main(int argc, char *argv[]) {
+    int nThreads = 0, repeat = 3, nCopies = 1, nRays = 1000000;
+    std::vector<std::string> filenames;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--nthreads") && i + 1 < argc)
+            nThreads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--copies") && i + 1 < argc)
+            nCopies = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rays") && i + 1 < argc)
+            nRays = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else if (argv[i][0] == '-')
+            usage(StringPrintf("unknown argument \"%s\"", argv[i]).c_str());
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty()) usage("no meshes given");
+    if (nThreads < 0 || repeat < 1 || nCopies < 1 || nRays < 1)
+        usage("--nthreads must not be negative, --repeat, --copies and "
+              "--rays positive");
+
+    Options opt;
+    opt.quiet = true;
+    opt.nThreads = nThreads;
+    pbrtInit(opt);
+    nThreads = MaxThreadIndex();
+
+    // Load the meshes, with the copies next to each other along x
+    std::vector<std::unique_ptr<Transform>> transforms;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    Bounds3f meshBounds;
+    for (int copy = 0; copy < nCopies; ++copy) {
+        Vector3f offset;
+        if (copy > 0) offset.x = copy * 1.1f * meshBounds.Diagonal().x;
+        transforms.emplace_back(new Transform(Translate(offset)));
+        transforms.emplace_back(new Transform(Inverse(*transforms.back())));
+        const Transform *o2w = transforms[2 * copy].get();
+        const Transform *w2o = transforms[2 * copy + 1].get();
+        for (const std::string &filename : filenames) {
+            ParamSet params;
+            std::unique_ptr<std::string[]> name(new std::string[1]);
+            name[0] = filename;
+            params.AddString("filename", std::move(name), 1);
+            for (const std::shared_ptr<Shape> &shape :
+                 CreatePLYMesh(o2w, w2o, false, params)) {
+                if (copy == 0)
+                    meshBounds = Union(meshBounds, shape->WorldBound());
+                prims.push_back(std::make_shared<GeometricPrimitive>(
+                    shape, nullptr, nullptr, MediumInterface()));
+            }
+        }
+    }
+    if (prims.empty()) usage("the meshes have no triangles");
+    printf("%d triangles, %d threads, fastest of %d builds\n\n",
+           (int)prims.size(), nThreads, repeat);
+    printf("%-8s %8s %12s %12s %8s %10s\n", "split", "threads", "build ms",
+           "SAH cost", "speedup", "vs serial");
+
+    const char *methodNames[] = {"sah", "hlbvh", "middle", "equal", "sbvh"};
+    const BVHAccel::SplitMethod methods[] = {
+        BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH,
+        BVHAccel::SplitMethod::Middle, BVHAccel::SplitMethod::EqualCounts,
+        BVHAccel::SplitMethod::SBVH};
+    for (int m = 0; m < 5; ++m) {
+        double serialSeconds = 0;
+        Float serialCost = 0;
+        for (int threads : {1, nThreads}) {
+            // Restart the thread pool with _threads_ threads
+            pbrtCleanup();
+            opt.nThreads = threads;
+            pbrtInit(opt);
+
+            double best = 1e30;
+            Float cost = 0;
+            for (int r = 0; r < repeat; ++r) {
+                std::vector<std::shared_ptr<Primitive>> buildPrims = prims;
+                auto start = std::chrono::steady_clock::now();
+                BVHAccel bvh(std::move(buildPrims), 4, methods[m]);
+                auto end = std::chrono::steady_clock::now();
+                best = std::min(
+                    best, std::chrono::duration<double>(end - start).count());
+                cost = bvh.SAHCost();
+            }
+            if (threads == 1) {
+                serialSeconds = best;
+                serialCost = cost;
+            }
+            printf("%-8s %8d %12.1f %12.3f %7.2fx %+9.3f%%\n", methodNames[m],
+                   threads, best * 1e3, cost, serialSeconds / best,
+                   100 * (cost - serialCost) / serialCost);
+            if (nThreads == 1) break;
+        }
+    }
+
+    // Trace rays between random points of the bounds, a bit enlarged so
+    // that some rays miss, through trees of each layout
+    std::vector<Ray> rays;
+    Bounds3f bounds;
+    for (const std::shared_ptr<Primitive> &prim : prims)
+        bounds = Union(bounds, prim->WorldBound());
+    bounds = Expand(bounds, 0.1f * MaxComponent(bounds.Diagonal()));
+    RNG rng;
+    auto randomPoint = [&]() {
+        return bounds.Lerp(Point3f(rng.UniformFloat(), rng.UniformFloat(),
+                                   rng.UniformFloat()));
+    };
+    for (int i = 0; i < nRays; ++i) {
+        Point3f o = randomPoint();
+        rays.push_back(Ray(o, randomPoint() - o));
+    }
+    printf("\n%d rays between random points, fastest of %d runs\n\n",
+           nRays, repeat);
+    printf("%-8s %12s %10s %14s %14s %8s\n", "layout", "SAH cost",
+           "B/prim", "Intersect/s", "IntersectP/s", "hits");
+    const BVHAccel::SplitMethod sah = BVHAccel::SplitMethod::SAH,
+                                sbvh = BVHAccel::SplitMethod::SBVH;
+    struct {
+        const char *name;
+        BVHAccel::SplitMethod splitMethod;
+        int width, quantizeBits;
+    } layouts[] = {{"binary", sah, 2, 0},      {"quant16", sah, 2, 16},
+                   {"quant8", sah, 2, 8},      {"wide4", sah, 4, 0},
+                   {"wide8", sah, 8, 0},       {"sbvh", sbvh, 2, 0},
+                   {"sbvh-w4", sbvh, 4, 0}};
+    for (const auto &layout : layouts) {
+        BVHAccel bvh(prims, 4, layout.splitMethod, layout.width,
+                     layout.quantizeBits);
+        double best[2] = {1e30, 1e30};
+        std::atomic<int> nHits{0};
+        for (int r = 0; r < repeat; ++r) {
+            for (int p = 0; p < 2; ++p) {
+                nHits = 0;
+                auto start = std::chrono::steady_clock::now();
+                ParallelFor([&](int64_t chunk) {
+                    int64_t end = std::min<int64_t>(nRays, (chunk + 1) * 4096);
+                    int chunkHits = 0;
+                    for (int64_t i = chunk * 4096; i < end; ++i) {
+                        if (p == 1)
+                            chunkHits += bvh.IntersectP(rays[i]);
+                        else {
+                            Ray ray = rays[i];
+                            SurfaceInteraction isect;
+                            chunkHits += bvh.Intersect(ray, &isect);
+                        }
+                    }
+                    nHits += chunkHits;
+                }, (nRays + 4095) / 4096);
+                auto end = std::chrono::steady_clock::now();
+                best[p] = std::min(
+                    best[p], std::chrono::duration<double>(end - start).count());
+            }
+        }
+        printf("%-8s %12.3f %10.2f %14.0f %14.0f %8d\n", layout.name,
+               bvh.SAHCost(), double(bvh.NodeBytes()) / prims.size(),
+               nRays / best[0], nRays / best[1], (int)nHits);
+    }
+
+    pbrtCleanup();
+    return 0;
+}
@@ -0,0 +1,593 @@
+// Benchmark and validation of the microsurface random walks of acg_final:
+// timings, walk lengths, energy conservation and reciprocity for every
+// height/slope/material combination.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "api.h"
+#include "cameras/perspective.h"
+#include "film.h"
+#include "filters/box.h"
+#include "integrators/path.h"
+#include "lights/point.h"
+#include "materials/multimicro.h"
+#include "memory.h"
+#include "parallel.h"
+#include "rng.h"
+#include "sampling.h"
+#include "samplers/random.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+#include "acg_final/MicrosurfaceSpecialized.h"
+#include "acg_final/MicrosurfaceTable.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "microsurfacetest: %s\n\n", msg);
+    fprintf(stderr,
+            "usage: microsurfacetest [--reference] [--walks <n>] [--pairs <n>]\n"
+            "                        [--throughput]\n"
+            "  --reference     Test the reference microsurface classes instead "
+            "of\n"
+            "                  the specialized ones.\n"
+            "  --throughput    Compare the throughput of the walk "
+            "implementations\n"
+            "                  instead.\n"
+            "  --walks <n>     Walks per estimate (default 100000).\n"
+            "  --pairs <n>     Direction pairs for the reciprocity check "
+            "(default 16).\n");
+    exit(msg ? 1 : 0);
+}
+
+// Mean and standard error of a Monte Carlo estimate
+struct Estimate {
+    double sum = 0, sum2 = 0;
+    int64_t n = 0;
+    void Add(double v) {
+        sum += v;
+        sum2 += v * v;
+        ++n;
+    }
+    double Mean() const { return n ? sum / n : 0; }
+    double StdError() const {
+        if (n < 2) return 0;
+        double mean = Mean();
+        return std::sqrt(std::max(0., sum2 / n - mean * mean) / (n - 1));
+    }
+};
+
+template <typename Func>
+static double NanosecondsPerCall(int n, Func func) {
+    volatile float sink = 0;
+    // warm up, which also builds tables on first use
+    for (int i = 0; i < std::min(n, 1000); ++i) sink = sink + func(i);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) sink = sink + func(i);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+// Direction with the given elevation above (or below) the surface
+static Vector3f Direction(Float cosTheta, Float phi) {
+    Float sinTheta = std::sqrt(std::max((Float)0, 1 - cosTheta * cosTheta));
+    return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi),
+                    cosTheta);
+}
+
+// Direction close to the mirror reflection of w, or to its refraction into
+// a dielectric of index eta, within about alpha; rough microsurfaces scatter
+// most of their energy there. Grazing directions are avoided: walks ending
+// there are rare and heavy-tailed, so their standard error is unreliable.
+static Vector3f NearSpecular(const Vector3f &w, Float alpha, Float eta,
+                             bool transmit, RNG &rng) {
+    Float scale = transmit ? 1 / eta : 1;
+    Float x = -w.x * scale + alpha * (2 * rng.UniformFloat() - 1);
+    Float y = -w.y * scale + alpha * (2 * rng.UniformFloat() - 1);
+    Float z = std::sqrt(std::max((Float).09, 1 - x * x - y * y));
+    return Normalize(Vector3f(x, y, transmit ? -z : z));
+}
+
+// Throughput of the batched walks against the scalar ones
+static void BatchedWalkThroughput() {
+    const int nWalks = 64, nEvals = 2000;
+    for (int beckmann = 1; beckmann >= 0; --beckmann) {
+        MicrosurfaceDielectric ms(false, beckmann, 0.5f, 0.5f);
+        RNG dirs, rng;
+        std::vector<Vector3f> w;
+        for (int i = 0; i < 2 * nEvals; ++i)
+            w.push_back(UniformSampleSphere(
+                {dirs.UniformFloat(), dirs.UniformFloat()}));
+
+        double scalarNs = NanosecondsPerCall(nEvals, [&](int i) {
+            float sum = 0;
+            for (int j = 0; j < nWalks; ++j)
+                sum += ms.eval(w[2 * i], w[2 * i + 1], rng);
+            return sum / nWalks;
+        });
+        double batchedNs = NanosecondsPerCall(nEvals, [&](int i) {
+            return ms.eval(w[2 * i], w[2 * i + 1], nWalks, rng);
+        });
+        printf("dielectric, %s slopes: scalar %.0f walks/s, %d lanes %.0f "
+               "walks/s (%.2fx)\n",
+               beckmann ? "beckmann" : "ggx", nWalks * 1e9 / scalarNs,
+               simd::lanes, nWalks * 1e9 / batchedNs, scalarNs / batchedNs);
+    }
+}
+
+// Throughput of the specialized walks against the reference ones
+static void SpecializedThroughput() {
+    const MicrosurfaceMaterial materials[3] = {
+        MICROSURFACE_CONDUCTOR, MICROSURFACE_DIELECTRIC, MICROSURFACE_DIFFUSE};
+    const char *materialNames[3] = {"conductor", "dielectric", "diffuse"};
+    const int nEvals = 20000;
+    MemoryArena arena;
+    RNG dirs;
+    std::vector<Vector3f> w;
+    for (int i = 0; i < 2 * nEvals; ++i)
+        w.push_back(UniformSampleHemisphere(
+            {dirs.UniformFloat(), dirs.UniformFloat()}));
+
+    for (int m = 0; m < 3; ++m) {
+        double ns[2];
+        for (int specialized = 0; specialized < 2; ++specialized) {
+            const Microsurface *ms = microsurfaceAllocator(
+                materials[m], false, false, specialized)(arena, 0.5f, 0.5f,
+                                                         1.5f);
+            RNG rng;
+            ns[specialized] = NanosecondsPerCall(nEvals, [&](int i) {
+                return ms->eval(w[2 * i], w[2 * i + 1], rng);
+            });
+        }
+        printf("%s walks: reference %.0f walks/s, specialized %.0f walks/s "
+               "(%.2fx)\n",
+               materialNames[m], 1e9 / ns[0], 1e9 / ns[1], ns[0] / ns[1]);
+    }
+}
+
+// Time per call of the trig-free kernels of the specialized microsurfaces
+// against the ones of the reference classes
+static void FastMathThroughput() {
+    const int n = 1 << 16;
+    RNG rng;
+    std::vector<Vector3f> w;
+    std::vector<float> u;
+    for (int i = 0; i < n; ++i) {
+        w.push_back(UniformSampleHemisphere(
+            {rng.UniformFloat(), rng.UniformFloat()}));
+        u.push_back(rng.UniformFloat());
+    }
+    const MicrosurfaceSlope *beckmann = MicrosurfaceSlope::get(true);
+    const MicrosurfaceSlope *ggx = MicrosurfaceSlope::get(false);
+    MicrosurfaceConductor reference(false, true, 0.5f, 0.5f);
+    typedef MicrosurfaceFunctions<HeightGaussian, SlopeBeckmann> Beckmann;
+    typedef MicrosurfaceFunctions<HeightGaussian, SlopeGGX> GGX;
+
+    struct Timing {
+        const char *name;
+        double reference, fast;
+    } timings[] = {
+        {"erf",
+         NanosecondsPerCall(n, [&](int i) { return (float)serf(4 * u[i] - 2); }),
+         NanosecondsPerCall(n, [&](int i) { return fastErf(4 * u[i] - 2); })},
+        {"Beckmann Lambda",
+         NanosecondsPerCall(
+             n, [&](int i) { return beckmann->Lambda(w[i], 0.5f, 0.5f); }),
+         NanosecondsPerCall(
+             n, [&](int i) { return SlopeBeckmann::Lambda(w[i], 0.5f, 0.5f); })},
+        {"GGX Lambda",
+         NanosecondsPerCall(
+             n, [&](int i) { return ggx->Lambda(w[i], 0.5f, 0.5f); }),
+         NanosecondsPerCall(
+             n, [&](int i) { return SlopeGGX::Lambda(w[i], 0.5f, 0.5f); })},
+        {"Beckmann projectedArea",
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return beckmann->projectedArea(w[i], 0.5f, 0.5f);
+                            }),
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return SlopeBeckmann::projectedArea(w[i], 0.5f,
+                                                                    0.5f);
+                            })},
+        {"GGX projectedArea",
+         NanosecondsPerCall(
+             n, [&](int i) { return ggx->projectedArea(w[i], 0.5f, 0.5f); }),
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return SlopeGGX::projectedArea(w[i], 0.5f, 0.5f);
+                            })},
+        {"Beckmann sampleD_wi",
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return beckmann
+                                    ->sampleD_wi(w[i], u[i], u[n - 1 - i], 0.5f,
+                                                 0.5f)
+                                    .z;
+                            }),
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return Beckmann::sampleD_wi(w[i], u[i],
+                                                            u[n - 1 - i], 0.5f,
+                                                            0.5f)
+                                    .z;
+                            })},
+        {"GGX sampleD_wi",
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return ggx
+                                    ->sampleD_wi(w[i], u[i], u[n - 1 - i], 0.5f,
+                                                 0.5f)
+                                    .z;
+                            }),
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return GGX::sampleD_wi(w[i], u[i], u[n - 1 - i],
+                                                       0.5f, 0.5f)
+                                    .z;
+                            })},
+        {"Gaussian G_1(h)",
+         NanosecondsPerCall(
+             n, [&](int i) { return reference.G_1(w[i], 2 * u[i] - 1); }),
+         NanosecondsPerCall(n,
+                            [&](int i) {
+                                return Beckmann::G_1(w[i], 2 * u[i] - 1, 0.5f,
+                                                     0.5f);
+                            })},
+    };
+    for (const Timing &t : timings)
+        printf("%-24s reference %6.1f ns, fast %6.1f ns (%.2fx)\n", t.name,
+               t.reference, t.fast, t.reference / t.fast);
+}
+
+// Time per evaluation of the tabulated multiple-scattering lobe of the
+// dielectric against the walks it replaces, and its relative RMS error
+static void TableThroughput() {
+    const int nPoints = 200, nRefWalks = 4096;
+    MicrosurfaceTable table("dielectric", [](float alpha) {
+        return std::unique_ptr<Microsurface>(
+            new MicrosurfaceDielectric(false, false, alpha, alpha));
+    });
+    RNG rng;
+    double sumErr2 = 0, sumRef2 = 0, walkNs = 0, tableNs = 0;
+    for (int i = 0; i < nPoints; ++i) {
+        Float alpha = Lerp(rng.UniformFloat(), MicrosurfaceTable::alphaMin(),
+                           MicrosurfaceTable::alphaMax());
+        MicrosurfaceDielectric ms(false, false, alpha, alpha);
+        Vector3f wi =
+            UniformSampleHemisphere({rng.UniformFloat(), rng.UniformFloat()});
+        Vector3f wo =
+            UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+
+        auto multiple = [&](int) {
+            return ms.eval(wi, wo, rng) - ms.evalSingleScattering(wi, wo, rng);
+        };
+        double ref = 0;
+        for (int w = 0; w < nRefWalks; ++w) ref += multiple(w);
+        ref /= nRefWalks;
+        float tab = table.evalMultipleScattering(wi, wo, alpha);
+        walkNs += NanosecondsPerCall(nRefWalks, multiple);
+        tableNs += NanosecondsPerCall(nRefWalks, [&](int) {
+            return table.evalMultipleScattering(wi, wo, alpha);
+        });
+        sumErr2 += (tab - ref) * (tab - ref);
+        sumRef2 += ref * ref;
+    }
+    printf("dielectric table: walks %.0f ns, table %.1f ns (%.1fx), relative "
+           "RMS error %.3f against %d walks\n",
+           walkNs / nPoints, tableNs / nPoints, walkNs / tableNs,
+           std::sqrt(sumErr2 / sumRef2), nRefWalks);
+}
+
+// Visible Beckmann slope along x with alpha=1.0, by bisection on its CDF
+static double BeckmannSlopeX(double cosTheta, double u) {
+    double sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+    double slope_i = cosTheta / sinTheta;
+    double projectedArea =
+        0.5 * (std::erf(slope_i) + 1) * cosTheta +
+        0.5 * INV_SQRT_M_PI * sinTheta * std::exp(-slope_i * slope_i);
+    double lo = -12, hi = slope_i;
+    for (int i = 0; i < 64; ++i) {
+        double slope = 0.5 * (lo + hi);
+        double cdf =
+            (0.5 * INV_SQRT_M_PI * sinTheta * std::exp(-slope * slope) +
+             cosTheta * (0.5 + 0.5 * std::erf(slope))) /
+            projectedArea;
+        (cdf < u ? lo : hi) = slope;
+    }
+    return 0.5 * (lo + hi);
+}
+
+// Time per sample of the Beckmann visible slopes with the table and with
+// the solver, their error in erf(slope), and the estimates of a Beckmann
+// walk with either
+static void BeckmannTableThroughput() {
+    const int n = 1 << 16;
+    RNG rng;
+    std::vector<Float> u(2 * n), c(n);
+    for (int i = 0; i < n; ++i) {
+        u[2 * i] = rng.UniformFloat();
+        u[2 * i + 1] = rng.UniformFloat();
+        c[i] = Lerp(rng.UniformFloat(), BeckmannVisibleSlopeTable::cosMin(),
+                    1.f);
+    }
+    auto table = [&](int i) {
+        return SlopeBeckmann::sampleP22_11(c[i], std::sqrt(1 - c[i] * c[i]),
+                                           u[2 * i], u[2 * i + 1])
+            .x;
+    };
+    auto solver = [&](int i) {
+        return SlopeBeckmann::solveP22_11(c[i], std::sqrt(1 - c[i] * c[i]),
+                                          u[2 * i], u[2 * i + 1])
+            .x;
+    };
+    double tableNs = NanosecondsPerCall(n, table);
+    double solverNs = NanosecondsPerCall(n, solver);
+
+    double maxError[2] = {0, 0}, sumError2[2] = {0, 0};
+    for (int i = 0; i < n; ++i) {
+        double reference = std::erf(BeckmannSlopeX(c[i], u[2 * i]));
+        Float slopes[2] = {table(i), solver(i)};
+        for (int s = 0; s < 2; ++s) {
+            double error = std::abs(std::erf((double)slopes[s]) - reference);
+            maxError[s] = std::max(maxError[s], error);
+            sumError2[s] += error * error;
+        }
+    }
+
+    MemoryArena arena;
+    const Microsurface *microsurfaces[2] = {
+        microsurfaceAllocator(MICROSURFACE_DIELECTRIC, false, true, true,
+                              true)(arena, 0.5f, 0.5f, 1.5f),
+        microsurfaceAllocator(MICROSURFACE_DIELECTRIC, false, true, true,
+                              false)(arena, 0.5f, 0.5f, 1.5f)};
+    const Vector3f wi = Normalize(Vector3f(0.6f, 0.2f, 0.5f));
+    const Vector3f wo = Normalize(Vector3f(-0.3f, 0.4f, 0.7f));
+    Estimate estimates[2];
+    for (int m = 0; m < 2; ++m) {
+        RNG walkRng(m);
+        for (int i = 0; i < 200000; ++i)
+            estimates[m].Add(microsurfaces[m]->eval(wi, wo, walkRng));
+    }
+
+    printf("beckmann slopes: table %.1f ns, solver %.1f ns (%.2fx)\n"
+           "  erf(slope) error: table max %.2g rms %.2g, solver max %.2g "
+           "rms %.2g\n"
+           "  walk estimate: table %.5f +- %.5f, solver %.5f +- %.5f\n",
+           tableNs, solverNs, solverNs / tableNs, maxError[0],
+           std::sqrt(sumError2[0] / n), maxError[1],
+           std::sqrt(sumError2[1] / n), estimates[0].Mean(),
+           estimates[0].StdError(), estimates[1].Mean(),
+           estimates[1].StdError());
+}
+
+// Samples per second of a small multimicro scene, a rough dielectric sphere
+// seen from inside, rendered with an increasing number of threads; leaves
+// pbrt initialized with _opt_
+static void RenderThroughput(const Options &opt) {
+    Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 1, -1, 1, 360);
+    std::shared_ptr<Texture<Float>> roughness =
+        std::make_shared<ConstantTexture<Float>>(0.5);
+    std::shared_ptr<Material> material = std::make_shared<MultiMicroMaterial>(
+        roughness, roughness, nullptr, false, false);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, nullptr, MediumInterface()));
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(
+        std::make_shared<PointLight>(Transform(), nullptr, Spectrum(Pi)));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    const Point2i resolution(32, 32);
+    const int spp = 16;
+    AnimatedTransform identity(&id, 0, &id, 1);
+    int maxThreads = std::max(2, NumSystemCores());
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        pbrtCleanup();
+        Options options = opt;
+        options.quiet = true;
+        options.nThreads = nThreads;
+        pbrtInit(options);
+
+        // Without a filename, the film writes no image
+        std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+        Film *film =
+            new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                     std::move(filter), 1., "", 1.);
+        std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+            identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0.,
+            10., 45, film, nullptr);
+        PathIntegrator integrator(5, camera,
+                                  std::make_shared<RandomSampler>(spp),
+                                  film->croppedPixelBounds);
+        auto start = std::chrono::steady_clock::now();
+        integrator.Render(scene);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        printf("multimicro scene, %2d thread(s): %.0f samples/s\n", nThreads,
+               resolution.x * resolution.y * spp / seconds);
+    }
+    pbrtCleanup();
+    pbrtInit(opt);
+}
+
+int main(int argc, char *argv[]) {
+    bool reference = false, throughput = false;
+    int nWalks = 100000, nPairs = 16;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--reference"))
+            reference = true;
+        else if (!strcmp(argv[i], "--walks") && i + 1 < argc)
+            nWalks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--pairs") && i + 1 < argc)
+            nPairs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--throughput"))
+            throughput = true;
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else
+            usage(StringPrintf("unknown argument \"%s\"", argv[i]).c_str());
+    }
+    if (nWalks < 2 || nPairs < 1) usage("--walks and --pairs must be positive");
+
+    Options opt;
+    pbrtInit(opt);
+    if (throughput) {
+        BatchedWalkThroughput();
+        SpecializedThroughput();
+        FastMathThroughput();
+        TableThroughput();
+        BeckmannTableThroughput();
+        RenderThroughput(opt);
+        pbrtCleanup();
+        return 0;
+    }
+
+    const MicrosurfaceMaterial materials[3] = {
+        MICROSURFACE_CONDUCTOR, MICROSURFACE_DIELECTRIC, MICROSURFACE_DIFFUSE};
+    const char *materialNames[3] = {"conductor", "dielectric", "diffuse"};
+    const Float alphas[] = {0.1f, 0.3f, 0.6f, 1.0f};
+    const Float eta = 1.5f;
+    const int maxOrder = 3, nOrderBins = 10;
+    // incident direction, 60 degrees from the normal
+    const Vector3f wi = Direction(0.5f, 0.3f);
+
+    printf("%s microsurfaces, %d walks per estimate\n\n",
+           reference ? "reference" : "specialized", nWalks);
+    int failures = 0;
+    MemoryArena arena;
+    for (int m = 0; m < 3; ++m)
+        for (int uniform = 1; uniform >= 0; --uniform)
+            for (int beckmann = 1; beckmann >= 0; --beckmann)
+                for (Float alpha : alphas) {
+                    MicrosurfaceAllocator allocator = microsurfaceAllocator(
+                        materials[m], uniform, beckmann, !reference);
+                    const Microsurface *ms =
+                        allocator(arena, alpha, alpha, eta);
+                    const bool dielectric =
+                        materials[m] == MICROSURFACE_DIELECTRIC;
+                    RNG rng;
+                    printf("%s, %s heights, %s slopes, alpha %.2f\n",
+                           materialNames[m], uniform ? "uniform" : "gaussian",
+                           beckmann ? "beckmann" : "ggx", alpha);
+
+                    // Directions, uniform over the sphere for dielectrics
+                    // and over the upper hemisphere otherwise
+                    std::vector<Vector3f> wo(nWalks);
+                    for (Vector3f &w : wo) {
+                        Point2f u(rng.UniformFloat(), rng.UniformFloat());
+                        w = dielectric ? UniformSampleSphere(u)
+                                       : UniformSampleHemisphere(u);
+                    }
+                    const Float invPdf =
+                        dielectric ? 1 / UniformSpherePdf()
+                                   : 1 / UniformHemispherePdf();
+
+                    // Timings
+                    double evalNs = NanosecondsPerCall(nWalks, [&](int i) {
+                        return ms->eval(wi, wo[i], rng);
+                    });
+                    double sampleNs = NanosecondsPerCall(nWalks, [&](int i) {
+                        return ms->sample(wi, rng).z;
+                    });
+                    double singleNs = NanosecondsPerCall(nWalks, [&](int i) {
+                        return ms->evalSingleScattering(wi, wo[i], rng);
+                    });
+                    printf("  ns/call: eval %.0f, sample %.0f, "
+                           "evalSingleScattering %.0f\n",
+                           evalNs, sampleNs, singleNs);
+
+                    // Walk lengths and energy of sampled walks
+                    int64_t orders[nOrderBins + 1] = {0};
+                    Estimate sampledEnergy;
+                    for (int i = 0; i < nWalks; ++i) {
+                        int order;
+                        float weight;
+                        ms->sample(wi, rng, order, weight);
+                        ++orders[std::min(order, nOrderBins)];
+                        sampledEnergy.Add(weight);
+                    }
+                    double meanOrder = 0;
+                    printf("  walk lengths:");
+                    for (int k = 0; k <= nOrderBins; ++k) {
+                        meanOrder += (double)k * orders[k] / nWalks;
+                        printf(" %s%d %.4f", k == nOrderBins ? ">=" : "", k,
+                               (double)orders[k] / nWalks);
+                    }
+                    printf(" (mean %.3f)\n", meanOrder);
+
+                    // Energy of the evaluated BSDF, in total and per
+                    // scattering order; the walks neither absorb nor lose
+                    // energy, so the total should be one
+                    Estimate energy, orderEnergy[maxOrder + 1];
+                    for (int i = 0; i < nWalks; ++i) {
+                        energy.Add(ms->eval(wi, wo[i], rng) * invPdf);
+                        for (int k = 1; k <= maxOrder; ++k)
+                            orderEnergy[k].Add(ms->eval(wi, wo[i], rng, k) *
+                                               invPdf);
+                    }
+                    bool energyOk =
+                        std::abs(energy.Mean() - 1) <
+                            4 * energy.StdError() + 0.02 &&
+                        std::abs(sampledEnergy.Mean() - 1) < 1e-3;
+                    printf("  energy: eval %.4f +- %.4f, sample %.4f, "
+                           "orders",
+                           energy.Mean(), energy.StdError(),
+                           sampledEnergy.Mean());
+                    for (int k = 1; k <= maxOrder; ++k)
+                        printf(" %d: %.4f", k, orderEnergy[k].Mean());
+                    printf("%s\n", energyOk ? "" : "  FAILED");
+
+                    // Reciprocity of the BSDF, eval() / |cos wo|; through
+                    // the dielectric, f(wi, wo) / eta_o^2 is reciprocal.
+                    // Pairs are drawn close to the specular configuration,
+                    // transmitting every other one through dielectrics.
+                    double maxZ = 0;
+                    for (int p = 0; p < nPairs; ++p) {
+                        Vector3f a = Direction(Lerp(rng.UniformFloat(), .3f, 1.f),
+                                               2 * Pi * rng.UniformFloat());
+                        Vector3f b = NearSpecular(a, alpha, eta,
+                                                  dielectric && p % 2, rng);
+                        Float scaleAB = 1 / std::abs(b.z), scaleBA = 1 / std::abs(a.z);
+                        if (b.z < 0) scaleAB /= eta * eta;
+                        Estimate ab, ba;
+                        for (int i = 0; i < nWalks / nPairs; ++i) {
+                            ab.Add(ms->eval(a, b, rng) * scaleAB);
+                            ba.Add(ms->eval(b, a, rng) * scaleBA);
+                        }
+                        // walks that barely vary have a tiny standard error:
+                        // allow for rounding as well, and for rare long walks
+                        // where the BSDF is negligible
+                        double sigma = std::sqrt(ab.StdError() * ab.StdError() +
+                                                 ba.StdError() * ba.StdError()) +
+                                       1e-3 * std::max(ab.Mean(), ba.Mean()) +
+                                       1e-5;
+                        if (sigma > 0)
+                            maxZ = std::max(
+                                maxZ, std::abs(ab.Mean() - ba.Mean()) / sigma);
+                    }
+                    // with a few pairs, |z| > 5 is unlikely by chance
+                    bool reciprocityOk = maxZ < 5;
+                    printf("  reciprocity: max |z| %.2f over %d pairs%s\n\n",
+                           maxZ, nPairs, reciprocityOk ? "" : "  FAILED");
+
+                    if (!energyOk || !reciprocityOk) ++failures;
+                    arena.Reset();
+                }
+
+    printf("%d of %d configurations failed\n", failures,
+           3 * 2 * 2 * (int)(sizeof(alphas) / sizeof(alphas[0])));
+    pbrtCleanup();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+// Throughput of the thread pool behind ParallelFor() on the loop shapes pbrt
+// runs: fine-grained loops of chunk size 1, loops nested in other loops (as
+// when the BSSRDF tables or the HLBVH treelets are built inside a parallel
+// region) and the tile loop of the sampler integrator, whose tiles take
+// very different times.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "pbrt.h"
+#include "api.h"
+#include "parallel.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "parallelbench: %s\n\n", msg);
+    fprintf(stderr,
+            "usage: parallelbench [--nthreads <n>] [--repeat <n>]\n"
+            "  --nthreads <n>  Threads of the pool (default: all cores).\n"
+            "  --repeat <n>    Runs of each benchmark; the fastest is "
+            "reported (default 5).\n");
+    exit(msg ? 1 : 0);
+}
+
+// Some arithmetic that the compiler cannot drop, about _n_ dependent
+// multiply-adds long
+static uint64_t Work(uint64_t seed, int n) {
+    uint64_t h = seed + 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < n; ++i)
+        h = h * 6364136223846793005ULL + 1442695040888963407ULL;
+    return h;
+}
+
+// Fastest of _repeat_ runs of _func_, in seconds
+template <typename Func>
+static double Fastest(int repeat, Func func) {
+    double best = 1e30;
+    for (int r = 0; r < repeat; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best,
+                        std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    opt.quiet = true;
+    int repeat = 5;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--nthreads") && i + 1 < argc)
+            opt.nThreads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            usage();
+        else
+            usage(StringPrintf("unknown argument \"%s\"", argv[i]).c_str());
+    }
+    if (opt.nThreads < 0 || repeat < 1)
+        usage("--nthreads must not be negative and --repeat positive");
+    pbrtInit(opt);
+    printf("%d threads, fastest of %d runs\n\n", MaxThreadIndex(), repeat);
+    printf("%-34s %12s %12s\n", "benchmark", "total ms", "ns per item");
+
+    std::atomic<uint64_t> sink{0};
+    auto report = [&](const char *name, double seconds, int64_t items) {
+        printf("%-34s %12.2f %12.1f\n", name, seconds * 1e3,
+               seconds * 1e9 / items);
+    };
+
+    // Fine-grained loops: one tiny iteration per chunk, so the cost of
+    // handing out chunks dominates
+    const int64_t nFine = 1 << 20;
+    for (int cost : {0, 64, 1024}) {
+        double s = Fastest(repeat, [&]() {
+            ParallelFor([&](int64_t i) {
+                if (Work(i, cost) == 0) ++sink;
+            }, nFine, 1);
+        });
+        report(StringPrintf("chunk size 1, %d madds per item", cost).c_str(),
+               s, nFine);
+    }
+    {
+        double s = Fastest(repeat, [&]() {
+            ParallelFor([&](int64_t i) {
+                if (Work(i, 64) == 0) ++sink;
+            }, nFine, 64);
+        });
+        report("chunk size 64, 64 madds per item", s, nFine);
+    }
+
+    // Nested loops: each outer iteration runs a fine-grained inner loop
+    {
+        const int nOuter = 256, nInner = 4096;
+        double s = Fastest(repeat, [&]() {
+            ParallelFor([&](int64_t o) {
+                ParallelFor([&](int64_t i) {
+                    if (Work(o * nInner + i, 64) == 0) ++sink;
+                }, nInner, 1);
+            }, nOuter, 1);
+        });
+        report("nested 256 x 4096, chunk size 1", s, (int64_t)nOuter * nInner);
+    }
+
+    // The tile loop of SamplerIntegrator::Render() for a 1920x1080 image
+    // in 16x16 tiles, where a band of tiles (the visible geometry) costs
+    // twenty times more than the background
+    {
+        const Point2i nTiles((1920 + 15) / 16, (1080 + 15) / 16);
+        double s = Fastest(repeat, [&]() {
+            ParallelFor2D([&](Point2i tile) {
+                bool busy = tile.y > nTiles.y / 3 &&
+                            tile.y < 2 * nTiles.y / 3 && tile.x > nTiles.x / 4;
+                int cost = busy ? 20 * 2048 : 2048;
+                uint64_t h = 0;
+                for (int p = 0; p < 16; ++p)
+                    h ^= Work(((uint64_t)tile.y << 32) + tile.x * 16 + p, cost);
+                if (h == 0) ++sink;
+            }, nTiles);
+        });
+        report("tiles 120 x 68, uneven", s, (int64_t)nTiles.x * nTiles.y);
+    }
+
+    pbrtCleanup();
+    return sink == 12345 ? 1 : 0;
+}